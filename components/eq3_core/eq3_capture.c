@@ -0,0 +1,80 @@
+/*
+ * Capture file format for valve BLE traffic
+ *
+ * The hub keeps the records in a RAM ring and exports them in this format, host tools read it
+ * back. See eq3_capture.h for the layout.
+ */
+
+#include <string.h>
+
+#include "eq3_capture.h"
+
+int eq3_capture_put_header(uint8_t *buf, int len, int count){
+    if(len < EQ3_CAPTURE_HEADER_LEN || count < 0 || count > 0xffff)
+        return -1;
+    memcpy(buf, EQ3_CAPTURE_MAGIC, 4);
+    buf[4] = EQ3_CAPTURE_VERSION;
+    buf[5] = 0;
+    buf[6] = count & 0xff;
+    buf[7] = count >> 8;
+    return EQ3_CAPTURE_HEADER_LEN;
+}
+
+int eq3_capture_put_record(uint8_t *buf, int len, const struct eq3_capture_record *rec){
+    int reclen = EQ3_CAPTURE_RECORD_LEN + rec->len;
+    if(rec->len > EQ3_CAPTURE_DATA_MAX || len < reclen)
+        return -1;
+    buf[0] = rec->time_ms & 0xff;
+    buf[1] = (rec->time_ms >> 8) & 0xff;
+    buf[2] = (rec->time_ms >> 16) & 0xff;
+    buf[3] = rec->time_ms >> 24;
+    buf[4] = rec->type;
+    buf[5] = rec->len;
+    memcpy(&buf[6], rec->bda, 6);
+    buf[12] = rec->handle & 0xff;
+    buf[13] = rec->handle >> 8;
+    memcpy(&buf[EQ3_CAPTURE_RECORD_LEN], rec->data, rec->len);
+    return reclen;
+}
+
+int eq3_capture_get_header(const uint8_t *buf, int len){
+    if(len < EQ3_CAPTURE_HEADER_LEN || memcmp(buf, EQ3_CAPTURE_MAGIC, 4) != 0 || buf[4] != EQ3_CAPTURE_VERSION)
+        return -1;
+    return buf[6] | (buf[7] << 8);
+}
+
+int eq3_capture_get_record(const uint8_t *buf, int len, struct eq3_capture_record *rec){
+    if(len < EQ3_CAPTURE_RECORD_LEN || buf[5] > EQ3_CAPTURE_DATA_MAX || len < EQ3_CAPTURE_RECORD_LEN + buf[5])
+        return -1;
+    if(buf[4] < EQ3_CAP_OPEN || buf[4] > EQ3_CAP_COMMAND)
+        return -1;
+    rec->time_ms = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+    rec->type = buf[4];
+    rec->len = buf[5];
+    memcpy(rec->bda, &buf[6], 6);
+    rec->handle = buf[12] | (buf[13] << 8);
+    memset(rec->data, 0, sizeof(rec->data));
+    memcpy(rec->data, &buf[EQ3_CAPTURE_RECORD_LEN], rec->len);
+    return EQ3_CAPTURE_RECORD_LEN + rec->len;
+}
+
+const char *eq3_capture_type_name(uint8_t type){
+    switch(type){
+    case EQ3_CAP_OPEN:
+        return "open";
+    case EQ3_CAP_OPENED:
+        return "opened";
+    case EQ3_CAP_OPEN_FAILED:
+        return "failed";
+    case EQ3_CAP_WRITE:
+        return "write";
+    case EQ3_CAP_NOTIFY:
+        return "notify";
+    case EQ3_CAP_DISCONNECT:
+        return "disconn";
+    case EQ3_CAP_COMMAND:
+        return "command";
+    default:
+        return "?";
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ * Minimal CBOR encoder used for the binary MQTT topic tree.
+ *
+ * Only the types needed for TRV status and device lists are supported.
+ */
+
+#include <string.h>
+#include "eq3_cbor.h"
+
+#define CBOR_UINT    0x00
+#define CBOR_NEGINT  0x20
+#define CBOR_BYTES   0x40
+#define CBOR_TEXT    0x60
+#define CBOR_ARRAY   0x80
+#define CBOR_MAP     0xa0
+#define CBOR_FALSE   0xf4
+#define CBOR_TRUE    0xf5
+#define CBOR_HALF    0xf9
+
+void cbor_init(struct cbor_writer *cw, uint8_t *buf, int len){
+    cw->buf = buf;
+    cw->len = len;
+    cw->idx = 0;
+    cw->overflow = false;
+}
+
+static void cbor_put_byte(struct cbor_writer *cw, uint8_t byte){
+    if(cw->idx < cw->len)
+        cw->buf[cw->idx++] = byte;
+    else
+        cw->overflow = true;
+}
+
+/* Major type with the shortest argument encoding */
+static void cbor_put_head(struct cbor_writer *cw, uint8_t major, uint32_t val){
+    if(val < 24){
+        cbor_put_byte(cw, major | val);
+    }else if(val <= 0xff){
+        cbor_put_byte(cw, major | 24);
+        cbor_put_byte(cw, val);
+    }else if(val <= 0xffff){
+        cbor_put_byte(cw, major | 25);
+        cbor_put_byte(cw, val >> 8);
+        cbor_put_byte(cw, val);
+    }else{
+        cbor_put_byte(cw, major | 26);
+        cbor_put_byte(cw, val >> 24);
+        cbor_put_byte(cw, val >> 16);
+        cbor_put_byte(cw, val >> 8);
+        cbor_put_byte(cw, val);
+    }
+}
+
+void cbor_put_map(struct cbor_writer *cw, uint32_t pairs){
+    cbor_put_head(cw, CBOR_MAP, pairs);
+}
+
+void cbor_put_array(struct cbor_writer *cw, uint32_t items){
+    cbor_put_head(cw, CBOR_ARRAY, items);
+}
+
+void cbor_put_uint(struct cbor_writer *cw, uint32_t val){
+    cbor_put_head(cw, CBOR_UINT, val);
+}
+
+void cbor_put_int(struct cbor_writer *cw, int32_t val){
+    if(val < 0)
+        cbor_put_head(cw, CBOR_NEGINT, (uint32_t)(-1 - val));
+    else
+        cbor_put_head(cw, CBOR_UINT, (uint32_t)val);
+}
+
+void cbor_put_text(struct cbor_writer *cw, const char *text){
+    uint32_t len = strlen(text);
+    cbor_put_head(cw, CBOR_TEXT, len);
+    while(len-- > 0)
+        cbor_put_byte(cw, *text++);
+}
+
+void cbor_put_bytes(struct cbor_writer *cw, const uint8_t *bytes, uint32_t len){
+    cbor_put_head(cw, CBOR_BYTES, len);
+    while(len-- > 0)
+        cbor_put_byte(cw, *bytes++);
+}
+
+void cbor_put_bool(struct cbor_writer *cw, bool val){
+    cbor_put_byte(cw, val ? CBOR_TRUE : CBOR_FALSE);
+}
+
+/* Half precision float - exact for the 0.5 degree steps used by the TRVs.
+ * Values outside the normal half precision range are not handled */
+void cbor_put_half(struct cbor_writer *cw, float val){
+    union { float f; uint32_t u; } conv = { .f = val };
+    uint16_t half = (conv.u >> 16) & 0x8000;
+    int32_t exp = ((conv.u >> 23) & 0xff) - 127 + 15;
+    if(val != 0 && exp > 0 && exp < 31)
+        half |= (exp << 10) | ((conv.u >> 13) & 0x3ff);
+    cbor_put_byte(cw, CBOR_HALF);
+    cbor_put_byte(cw, half >> 8);
+    cbor_put_byte(cw, half);
+}
+
+int cbor_len(struct cbor_writer *cw){
+    return cw->overflow ? -1 : cw->idx;
+}
@@ -0,0 +1,346 @@
+/*
+ * EQ-3 command parsing and encoding
+ *
+ * Commands arrive as text ("<address> <command> [param]") from mqtt, the web interface or the uart
+ * and are encoded into the bytes written to the valve's command characteristic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+
+#define CMD_TAG "EQ3_CMD"
+
+/* The argument after a command word - the terminating 0 if there isn't one */
+static char *command_arg(char *cmdptr, int wordlen){
+    cmdptr += wordlen;
+    while(*cmdptr == ' ')
+        cmdptr++;
+    return cmdptr;
+}
+
+/* Parse a command - returns 0 and fills in cmd (apart from retries and next) or -1 if it is invalid */
+int eq3_parse_command(char *cmdstr, struct eq3cmd *cmd){
+    char *cmdptr = cmdstr;
+    eq3_bt_cmd command;
+    unsigned char cmdparms[MAX_CMD_BYTES];
+    bool start = false;
+
+    memset(cmdparms, 0, sizeof(cmdparms));
+
+    // Skip the bleaddr
+    while(*cmdptr != 0 && !isxdigit((unsigned char)*cmdptr))
+        cmdptr++;
+    while(*cmdptr != 0 && (isxdigit((unsigned char)*cmdptr) || *cmdptr == ':'))
+        cmdptr++;
+    // Skip any spaces
+    while(*cmdptr == ' ')
+        cmdptr++;
+    if(start == false && strncmp((const char *)cmdptr, "settime", 7) == 0){
+        char *arg = command_arg(cmdptr, 7);
+        start = true;
+
+        /* yymmddhhMMss in hex following the command sets the time. If there is nothing the
+         * valve time will be set according to the ntp time if is is synchronised */
+        if(*arg != 0){
+            char hexdigit[3];
+            int dig;
+            for(dig = 0; dig < SET_TIME_BYTES * 2 && isxdigit((unsigned char)arg[dig]); dig++)
+                ;
+            if(dig < SET_TIME_BYTES * 2 || (arg[dig] != 0 && !isspace((unsigned char)arg[dig]))){
+                EQ3_LOGI(CMD_TAG, "Invalid time argument %s", arg);
+                return -1;
+            }
+            hexdigit[2] = 0;
+            for(dig=0; dig < SET_TIME_BYTES; dig++){
+                hexdigit[0] = arg[dig * 2];
+                hexdigit[1] = arg[dig * 2 + 1];
+                cmdparms[dig] = (unsigned char)strtol(hexdigit, NULL, 16);
+            }
+        }else{
+            struct tm timeinfo = { 0 };
+            if(eq3_hal_localtime(&timeinfo) == true){
+                cmdparms[0] = timeinfo.tm_year - 100;
+                cmdparms[1] = timeinfo.tm_mon + 1;
+                cmdparms[2] = timeinfo.tm_mday;
+                cmdparms[3] = timeinfo.tm_hour;
+                cmdparms[4] = timeinfo.tm_min;
+                cmdparms[5] = timeinfo.tm_sec;
+            }else{
+                EQ3_LOGI(CMD_TAG, "Cannot set valve time via ntp as ntp is not enabled");
+                return -1;
+            }
+        }
+        command = EQ3_SETTIME;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "boost", 5) == 0){
+        start = true;
+        command = EQ3_BOOST;
+        /* 'boost off' (e.g. from a Home Assistant switch) ends the boost */
+        if(strncasecmp((const char *)cmdptr + 5, " off", 4) == 0)
+            command = EQ3_UNBOOST;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "unboost", 7) == 0){
+        start = true;
+        command = EQ3_UNBOOST;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "auto", 4) == 0){
+        start = true;
+        command = EQ3_AUTO;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "manual", 6) == 0){
+        start = true;
+        command = EQ3_MANUAL;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "lock", 4) == 0){
+        start = true;
+        command = EQ3_LOCK;
+        /* 'lock off' unlocks */
+        if(strncasecmp((const char *)cmdptr + 4, " off", 4) == 0)
+            command = EQ3_UNLOCK;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "unlock", 6) == 0){
+        start = true;
+        command = EQ3_UNLOCK;
+    }
+    if(start == false && strncmp((const char *)cmdptr, "offset", 6) == 0){
+        char *endmsg;
+        float offset = strtof(command_arg(cmdptr, 6), &endmsg);
+        /* Also catches nan */
+        if(!(offset >= -3.5 && offset <= 3.5)){
+            // Error
+            return -1;
+        }
+        offset += 3.5;
+        offset *= 2;
+        cmdparms[0] = (unsigned char)offset;
+        start = true;
+        command = EQ3_OFFSET;
+        EQ3_LOGI(CMD_TAG, "set offset val 0x%x\n", cmdparms[0]);
+    }
+    if(start == false && strncmp((const char *)cmdptr, "settemp", 7) == 0){
+        char *endmsg;
+        float temp = strtof(command_arg(cmdptr, 7), &endmsg);
+        /* Range check before the conversion - nan or a huge value doesn't fit an int */
+        if(temp >= 5 && temp < 30){
+            int inttemp = (int)temp;
+            start = true;
+            command = EQ3_SETTEMP;
+            cmdparms[0] = (unsigned char)(inttemp << 1);
+            if(temp - (float)inttemp >= 0.5)
+                cmdparms[0] |= 0x01;
+        }else{
+            EQ3_LOGI(CMD_TAG, "Invalid temperature %0.1f requested", temp);
+            return -1;
+        }
+    }
+    if (start == false && strncmp ((const char*)cmdptr, "mode", 4) == 0) {
+        start = true;
+        cmdptr = command_arg(cmdptr, 4);
+        EQ3_LOGI (CMD_TAG, "Command mode: \"%s\"", cmdptr);
+        if (strncmp ((const char*)cmdptr, "auto", 4) == 0) {
+            command = EQ3_AUTO;
+        }else if (strncmp ((const char*)cmdptr, "off", 3) == 0) {
+            command = EQ3_SETTEMP;
+            cmdparms[0] = 0x09; /* (30 << 1) */
+        } else if (strncmp ((const char*)cmdptr, "heat", 4) == 0) {
+            command = EQ3_MANUAL;
+        } else {
+            start = false;
+        }
+    }
+    if (start == false && strncmp ((const char*)cmdptr, "off", 3) == 0) {
+        /* 'Off' is achieved by setting the required temperature to 4.5 */
+        start = true;
+        command = EQ3_SETTEMP;
+        cmdparms[0] = 0x09; /* (4 << 1) | 0x01 */
+    }
+    if(start == false && strncmp((const char *)cmdptr, "on", 2) == 0){
+        /* 'On' is achieved by setting the required temperature to 30 */
+        start = true;
+        command = EQ3_SETTEMP;
+        cmdparms[0] = 0x3c; /* (30 << 1) */
+    }
+
+    if(start == false){
+        EQ3_LOGI(CMD_TAG, "Invalid command %s", cmdptr);
+        return -1;
+    }
+
+    cmd->cmd = command;
+    memcpy(cmd->cmdparms, cmdparms, MAX_CMD_BYTES);
+
+    while(*cmdstr != 0 && !isxdigit((unsigned char)*cmdstr))
+        cmdstr++;
+    int adidx = sizeof(cmd->bleda);
+    while(adidx > 0){
+        cmd->bleda[sizeof(cmd->bleda) - adidx] = strtol(cmdstr, &cmdstr, 16);
+        while(*cmdstr != 0 && !isxdigit((unsigned char)*cmdstr))
+            cmdstr++;
+        adidx--;
+    }
+    EQ3_LOGI(CMD_TAG, "Requested address: %02x:%02x:%02x:%02x:%02x:%02x", cmd->bleda[0], cmd->bleda[1], cmd->bleda[2],
+             cmd->bleda[3], cmd->bleda[4], cmd->bleda[5]);
+    return 0;
+}
+
+/* Encode the characteristic value for a command - returns its length, 0 if the command isn't supported */
+int eq3_encode_command(struct eq3cmd *cmd, uint8_t *frame){
+    int parm;
+    switch(cmd->cmd){
+    case EQ3_SETTIME:
+        frame[0] = PROP_INFO_QUERY;
+        for(parm=0; parm < SET_TIME_BYTES; parm++)
+            frame[1 + parm] = cmd->cmdparms[parm];
+        return 1 + SET_TIME_BYTES;
+    case EQ3_BOOST:
+        frame[0] = PROP_BOOST;
+        frame[1] = 0x01;
+        return 2;
+    case EQ3_UNBOOST:
+        frame[0] = PROP_BOOST;
+        frame[1] = 0x00;
+        return 2;
+    case EQ3_AUTO:
+        frame[0] = PROP_MODE_WRITE;
+        frame[1] = 0x00;
+        return 2;
+    case EQ3_MANUAL:
+        frame[0] = PROP_MODE_WRITE;
+        frame[1] = 0x40;
+        return 2;
+    case EQ3_SETTEMP:
+        frame[0] = PROP_TEMPERATURE_WRITE;
+        frame[1] = cmd->cmdparms[0];
+        return 2;
+    case EQ3_OFFSET:
+        frame[0] = PROP_OFFSET;
+        frame[1] = cmd->cmdparms[0];
+        return 2;
+    case EQ3_LOCK:
+        frame[0] = PROP_LOCK;
+        frame[1] = 1;
+        return 2;
+    case EQ3_UNLOCK:
+        frame[0] = PROP_LOCK;
+        frame[1] = 0;
+        return 2;
+    default:
+        EQ3_LOGI(CMD_TAG, "Can't handle that command yet");
+        return 0;
+    }
+}
+
+/* Build the command for a <mqttid>radin/trv/<address>/<command> topic with an optional parameter
+ * as the payload - returns 0 with "<address> <command> [param]" in cmd or -1 if it is malformed */
+int eq3_topic_command(const char *topic, const char *payload, int payload_len, char *cmd, int len){
+    const char *topicptr;
+    int cmdidx = 0;
+    bool cmderror = false;
+
+    memset (cmd, 0, len);
+    /* A topic ending in /trv has no address to look at */
+    if ((topicptr = strstr (topic, "/trv/")) == NULL)
+        return -1;
+    topicptr += 5;
+
+    while (*topicptr != '/' && *topicptr != 0 && !cmderror) {
+        if ((isxdigit ((unsigned char)*topicptr) || *topicptr == ':') && cmdidx < len - 1) {
+            cmd[cmdidx] = *topicptr;
+            cmdidx++;
+            topicptr++;
+        } else {
+            cmderror = true;
+        }
+    }
+
+    if (cmdidx != 17) {
+        cmderror = true;
+        EQ3_LOGI (CMD_TAG, "Wrong address length: %d", cmdidx);
+    }
+
+    if (*topicptr == '/') {
+        topicptr++;
+    } else {
+        cmderror = true;
+    }
+
+    if (!cmderror && cmdidx < len - 1) {
+        cmd[cmdidx] = ' ';
+        cmdidx++;
+    } else {
+        cmderror = true;
+    }
+
+    while (*topicptr != '\0' && !cmderror && cmdidx < len - 1) {
+        cmd[cmdidx] = *topicptr;
+        cmdidx++;
+        topicptr++;
+    }
+
+    if (payload_len > 0) {
+        if (!cmderror && cmdidx < len - 1) {
+            cmd[cmdidx] = ' ';
+            cmdidx++;
+        } else {
+            cmderror = true;
+        }
+    }
+
+    EQ3_LOGI (CMD_TAG, "Added command \"%s\" idx %d", cmd, cmdidx);
+
+    if (!cmderror && cmdidx < len - 1 - payload_len) {
+        memcpy (&cmd[cmdidx], payload, payload_len);
+        cmdidx += payload_len;
+        cmd[cmdidx] = 0;
+        return 0;
+    }
+    return -1;
+}
+
+/* FNV-1a over the topic and payload */
+static uint32_t delivery_hash(const char *topic, int topic_len, const char *payload, int payload_len){
+    uint32_t hash = 2166136261u;
+    int idx;
+    for(idx = 0; idx < topic_len; idx++){
+        hash ^= (uint8_t)topic[idx];
+        hash *= 16777619u;
+    }
+    for(idx = 0; idx < payload_len; idx++){
+        hash ^= (uint8_t)payload[idx];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* True if a QoS1 delivery is the broker sending a message again that was already handled. A
+ * resend has the dup flag and the packet id of the original - the topic and payload are checked
+ * too as the broker reuses packet ids once they have been acknowledged. QoS0 deliveries (msg_id 0)
+ * are never repeated */
+bool eq3_dedup_repeat(struct eq3_dedup *dedup, int msg_id, bool dup, const char *topic, int topic_len,
+                      const char *payload, int payload_len){
+    uint32_t hash;
+    int idx;
+
+    if(msg_id == 0)
+        return false;
+    hash = delivery_hash(topic, topic_len, payload, payload_len);
+    if(dup == true){
+        for(idx = 0; idx < EQ3_DEDUP_ENTRIES; idx++){
+            if(dedup->recent[idx].msg_id == msg_id && dedup->recent[idx].hash == hash){
+                dedup->dropped++;
+                EQ3_LOGW(CMD_TAG, "Dropping repeated delivery of message %d", msg_id);
+                return true;
+            }
+        }
+    }
+    dedup->recent[dedup->next].msg_id = msg_id;
+    dedup->recent[dedup->next].hash = hash;
+    dedup->next = (dedup->next + 1) % EQ3_DEDUP_ENTRIES;
+    return false;
+}
@@ -0,0 +1,50 @@
+/*
+ * Radio arbitration between valve sessions and discovery scans
+ *
+ * Only the state machine lives here - the hub (main/eq3_gap.c) and the simulated fleet stop and
+ * start the actual scans. See eq3_radio.h.
+ */
+
+#include <string.h>
+
+#include "eq3_radio.h"
+
+void eq3_radio_init(struct eq3_radio_scan *scan, int duration_ms, int max_preempt){
+    memset(scan, 0, sizeof(*scan));
+    scan->duration_ms = duration_ms;
+    scan->max_preempt = max_preempt;
+}
+
+int eq3_radio_scan_start(struct eq3_radio_scan *scan, int64_t now){
+    scan->requested = false;
+    scan->running = true;
+    if(scan->remaining_ms <= 0)
+        scan->remaining_ms = scan->duration_ms;
+    scan->started = now;
+    return scan->remaining_ms;
+}
+
+void eq3_radio_scan_done(struct eq3_radio_scan *scan){
+    scan->running = false;
+    scan->remaining_ms = 0;
+    scan->deferrals = 0;
+}
+
+enum eq3_radio_action eq3_radio_preempt(struct eq3_radio_scan *scan, int64_t now){
+    if(scan->running == false && scan->requested == false)
+        return EQ3_RADIO_GO;
+    if(scan->deferrals >= scan->max_preempt){
+        if(scan->running == true)
+            return EQ3_RADIO_HOLD;
+        return EQ3_RADIO_START_SCAN;
+    }
+    scan->deferrals++;
+    if(scan->running == false)
+        return EQ3_RADIO_GO;
+    scan->remaining_ms = (int)(((int64_t)scan->remaining_ms * 1000 - (now - scan->started)) / 1000);
+    if(scan->remaining_ms < 1)
+        scan->remaining_ms = 1;
+    scan->running = false;
+    scan->requested = true;
+    return EQ3_RADIO_STOP_SCAN;
+}
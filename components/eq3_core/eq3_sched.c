@@ -0,0 +1,358 @@
+/*
+ * EQ-3 command queue and valve session scheduler
+ *
+ * Commands are queued per valve and sent one session at a time: probe (if the valve hasn't been
+ * heard recently), open, write, wait for the status notification, then close after a short delay.
+ * Everything is driven from a one second timer and the session events of the BLE backend.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+
+#define SCHED_TAG "EQ3_SCHED"
+
+/* Define REQUEUE_RETRY to push a retry attempt for a command to the back of the queue. This means that if a list of trv commands is present an out-of-service
+ * trv cannot hold-off the other valves for its entire retry cycle */
+#define REQUEUE_RETRY
+
+struct _action {
+    uint16_t cmd_len;
+    uint8_t cmd_val[EQ3_FRAME_MAX];
+    uint8_t cmd_bleda[6];       /* BLE Device Address */
+
+    bool connection_open;
+    bool ble_operation_in_progress;
+    int ble_operation_time;
+    int ble_operation_timeout;  /* Picked from the link quality of the valve */
+    bool outstanding_timer;
+    bool probing;               /* Scanning for the valve before connecting */
+};
+
+/* Current TRV command being sent to EQ-3 */
+static struct _action current_action = {
+    .cmd_len = 0,
+    .cmd_val[0] = 0,
+    .connection_open = false,
+    .ble_operation_in_progress = false,
+    .ble_operation_time = 0,
+    .ble_operation_timeout = BLE_OPERATION_TIMEOUT,
+    .outstanding_timer = false,
+    .probing = false,
+};
+
+/* Delayed close of the connection once a command has finished */
+static struct {
+    bool running;
+    int countdown;
+} disconnect = { .running = false, .countdown = 0 };
+
+static struct eq3cmd *cmdqueue = NULL;
+
+/* Start a 1 second timer */
+static void runtimer(void){
+    if(current_action.outstanding_timer == false){
+        current_action.outstanding_timer = true;
+        eq3_hal_timer_start(1000);
+    }
+}
+
+void eq3_sched_wake(void){
+    runtimer();
+}
+
+static void schedule_disconnect(void){
+    if(disconnect.running != true){
+        disconnect.countdown = EQ3_DISCONNECT_DELAY;
+        disconnect.running = true;
+    }else{
+        EQ3_LOGI(SCHED_TAG, "disconnect already scheduled");
+    }
+    runtimer();
+}
+
+/* Enqueue a command into the list */
+static void enqueue_command(struct eq3cmd *newcmd){
+    struct eq3cmd *qwalk = cmdqueue;
+    struct eq3cmd *lastCommandForDevice = NULL;
+
+    if(cmdqueue == NULL){
+        cmdqueue = newcmd;
+        EQ3_LOGI(SCHED_TAG, "Add queue head");
+    }else{
+        if(memcmp(qwalk->bleda, newcmd->bleda, sizeof(newcmd->bleda)) == 0)
+            lastCommandForDevice = qwalk;
+
+        while(qwalk->next != NULL){
+            qwalk = qwalk->next;
+            if(memcmp(qwalk->bleda, newcmd->bleda, sizeof(newcmd->bleda)) == 0)
+                lastCommandForDevice = qwalk;
+        }
+
+        //don't add the same command again if it already is the last command for a specific device
+        if(lastCommandForDevice != NULL
+                && lastCommandForDevice->cmd == newcmd->cmd
+                && memcmp(lastCommandForDevice->cmdparms, newcmd->cmdparms, MAX_CMD_BYTES) == 0)
+        {
+            EQ3_LOGI(SCHED_TAG, "Command still pending");
+            free(newcmd);
+            return;
+        }
+
+        qwalk->next = newcmd;
+        EQ3_LOGI(SCHED_TAG, "Add queue end");
+     }
+}
+
+/* Handle an EQ-3 command from uart or mqtt */
+int handle_request(char *cmdstr){
+    struct eq3cmd *newcmd;
+    uint8_t frame[EQ3_FRAME_MAX];
+    int quality, len;
+
+    EQ3_LOGI(SCHED_TAG, "Handle command %s", cmdstr);
+    if((newcmd = malloc(sizeof(struct eq3cmd))) == NULL){
+        EQ3_LOGE(SCHED_TAG, "No memory for command");
+        return -1;
+    }
+    if(eq3_parse_command(cmdstr, newcmd) != 0){
+        free(newcmd);
+        return -1;
+    }
+    eq3_hal_log_event(cmdstr);
+
+    /* A poor link gets one more attempt - its failures are more likely to be transient */
+    newcmd->retries = MAX_CMD_RETRIES;
+    quality = eq3_hal_link_quality(newcmd->bleda);
+    if(quality != EQ3_LINK_QUALITY_UNKNOWN && quality < EQ3_LINK_QUALITY_POOR)
+        newcmd->retries++;
+    newcmd->next = NULL;
+    if((len = eq3_encode_command(newcmd, frame)) > 0)
+        eq3_hal_command_queued(newcmd->bleda, frame, len, quality);
+
+    enqueue_command(newcmd);
+
+    if(current_action.ble_operation_in_progress == false){
+        /* Only schedule the command if ble is currently idle */
+        runtimer();
+    }
+    return 0;
+}
+
+/* Get the next command off the queue and encode the characteristic parameters */
+static int setup_command(void){
+    if(cmdqueue != NULL){
+        int len = eq3_encode_command(cmdqueue, current_action.cmd_val);
+        if(len > 0)
+            current_action.cmd_len = len;
+        memcpy(current_action.cmd_bleda, cmdqueue->bleda, sizeof(current_action.cmd_bleda));
+    }
+    return 0;
+}
+
+static int command_complete(bool success){
+    bool deletehead = false;
+    int rc = EQ3_CMD_RETRY;
+
+    if(success == true){
+        deletehead = true;
+        rc = EQ3_CMD_DONE;
+    }else if(cmdqueue == NULL){
+        rc = EQ3_CMD_DONE;
+    }else{
+        /* Command failed - retry if there are any retries left */
+
+        /* Normal operation - retry the same command until all attempts are exhausted
+         * OR
+         * define REQUEUE_RETRY to push the command to the end of the list to retry once all other currently queued commands are complete. */
+        if(--cmdqueue->retries <= 0){
+            deletehead = true;
+            EQ3_LOGE(SCHED_TAG, "Command failed - retries exhausted");
+            rc = EQ3_CMD_FAILED;
+        }else{
+#ifdef REQUEUE_RETRY
+            EQ3_LOGE(SCHED_TAG, "Command failed - requeue for retry");
+            /* If there are no other queued commands just retry this one */
+            if(cmdqueue->next != NULL){
+                struct eq3cmd *mvcmd = cmdqueue;
+                while(mvcmd->next != NULL)
+                    mvcmd = mvcmd->next;
+                /* Attach head to tail */
+                mvcmd->next = cmdqueue;
+                cmdqueue = cmdqueue->next;
+                /* Detach head from new tail */
+                mvcmd->next->next = NULL;
+            }
+#else
+            EQ3_LOGE(SCHED_TAG, "Command failed - retry");
+#endif
+        }
+    }
+    if(deletehead && cmdqueue != NULL){
+        /* Delete this command from the queue */
+        struct eq3cmd *delcmd = cmdqueue;
+        cmdqueue = cmdqueue->next;
+        free(delcmd);
+    }
+    return rc;
+}
+
+/* The current command failed - report it once there are no retries left and close the connection */
+void eq3_sched_error(const uint8_t *bleda, const char *error){
+    /* Only send the response if there are no retries available */
+    if(command_complete(false) == EQ3_CMD_FAILED){
+        char statrep[120];
+        char mac_addr[20];
+        sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", bleda[0], bleda[1], bleda[2], bleda[3], bleda[4], bleda[5]);
+        snprintf (statrep, sizeof(statrep), "{\"trv\":\"%s\",\"error\":\"%s\"}", mac_addr, error);
+        eq3_hal_report(mac_addr, statrep);
+        eq3_hal_log_event(statrep);
+    }
+    /* A connection that never opened won't disconnect - don't leave the session to time out and fail a second time */
+    if(current_action.connection_open == false)
+        current_action.ble_operation_in_progress = false;
+    schedule_disconnect();
+}
+
+/* The valve has acknowledged the command with its status */
+void eq3_sched_done(void){
+    command_complete(true);
+    schedule_disconnect();
+}
+
+void eq3_sched_opened(void){
+    current_action.connection_open = true;
+}
+
+/* Wait before we connect to the next EQ-3 to send a queued command */
+void eq3_sched_closed(void){
+    current_action.connection_open = false;
+    runtimer();
+}
+
+/* The link has gone - a drop we didn't ask for fails the command */
+void eq3_sched_disconnected(bool dropped){
+    current_action.ble_operation_in_progress = false;
+    if(dropped == true)
+        eq3_sched_error(current_action.cmd_bleda, "Device unavailable");
+}
+
+/* Run the next EQ-3 command from the list */
+static int run_command(void){
+    if(cmdqueue != NULL){
+        /* Commands take priority over a discovery scan - unless it has been interrupted too often, then it finishes first */
+        if(eq3_hal_ble_preempt() == false){
+            runtimer();
+            return 0;
+        }
+        EQ3_LOGI(SCHED_TAG, "Sending next command");
+        setup_command();
+        current_action.ble_operation_in_progress = true;
+        current_action.ble_operation_time = 0;
+        /* A valve with a good link that hasn't answered in 20s isn't going to - retry sooner */
+        current_action.ble_operation_timeout = eq3_hal_link_quality(current_action.cmd_bleda) >= EQ3_LINK_QUALITY_GOOD ?
+                                               BLE_OPERATION_TIMEOUT_GOOD_LINK : BLE_OPERATION_TIMEOUT;
+        /* A valve which hasn't been heard recently may be out of range - look for it rather than waiting for the open to time out */
+        if(eq3_hal_ble_probe(current_action.cmd_bleda) == true){
+            current_action.probing = true;
+            runtimer();
+            return 0;
+        }
+        eq3_hal_ble_open(current_action.cmd_bleda);
+    }
+    return 0;
+}
+
+/* Called each second while probing - connect once the valve has been heard, fail the command if it wasn't */
+static void check_probe(void){
+    switch(eq3_hal_ble_probe_state()){
+        case EQ3_PROBE_RUNNING:
+            return;
+        case EQ3_PROBE_NOT_FOUND:
+            EQ3_LOGE(SCHED_TAG, "Probe - valve not in range");
+            current_action.probing = false;
+            current_action.ble_operation_in_progress = false;
+            /* No point in retrying straight away */
+            if(cmdqueue != NULL)
+                cmdqueue->retries = 1;
+            eq3_sched_error(current_action.cmd_bleda, "TRV not in range");
+            return;
+        case EQ3_PROBE_FOUND:
+        case EQ3_PROBE_IDLE:
+        default:
+            /* Heard it (or a discovery scan took over) - carry on */
+            current_action.probing = false;
+            eq3_hal_ble_open(current_action.cmd_bleda);
+            return;
+    }
+}
+
+/* Timer expired */
+void eq3_sched_tick(void){
+    EQ3_LOGI(SCHED_TAG, "Tick (disconnect=%d, countdown=%d, ble_operation_in_progress=%d)", disconnect.running, disconnect.countdown,
+             current_action.ble_operation_in_progress);
+    current_action.outstanding_timer = false;
+
+    if(disconnect.running == true){
+        if(--disconnect.countdown <= 0){
+            disconnect.running = false;
+            if(current_action.connection_open == true){
+                EQ3_LOGI(SCHED_TAG, "Close virtual server connection");
+                eq3_hal_ble_close();
+            }
+        }
+        runtimer();
+    }else if(current_action.ble_operation_in_progress == false){
+        run_command();
+        /* Nothing being sent (or a scan is finishing first) - scanning can use the radio */
+        if(current_action.ble_operation_in_progress == false)
+            eq3_hal_ble_idle();
+    }else{
+        if(current_action.probing == true)
+            check_probe();
+        if(current_action.ble_operation_in_progress == false){
+            /* The probe failed the command - move on to the next one */
+            runtimer();
+        }else if(++current_action.ble_operation_time >= current_action.ble_operation_timeout){
+            EQ3_LOGE(SCHED_TAG, "BLE operation timed out");
+            if(current_action.connection_open == false && current_action.probing == false)
+                eq3_hal_ble_open_timeout(current_action.cmd_bleda);
+            current_action.ble_operation_in_progress = false;
+            current_action.ble_operation_time = 0;
+            current_action.probing = false;
+            eq3_sched_error(current_action.cmd_bleda, "BLE system failure");
+        }else{
+            /* Restart the timer */
+            runtimer();
+        }
+    }
+}
+
+/* A valve session (or a probe for one) is underway */
+bool eq3_sched_busy(void){
+    return current_action.ble_operation_in_progress;
+}
+
+/* Nothing running and nothing queued - the radio is free for a scan */
+bool eq3_sched_idle(void){
+    return current_action.ble_operation_in_progress == false && current_action.connection_open == false && cmdqueue == NULL;
+}
+
+/* Connected (or connecting) to a valve rather than probing for it */
+bool eq3_sched_in_session(void){
+    return current_action.ble_operation_in_progress == true && current_action.probing == false;
+}
+
+const uint8_t *eq3_sched_bda(void){
+    return current_action.cmd_bleda;
+}
+
+/* Characteristic value for the current command */
+const uint8_t *eq3_sched_frame(int *len){
+    *len = current_action.cmd_len;
+    return current_action.cmd_val;
+}
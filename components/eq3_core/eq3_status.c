@@ -0,0 +1,174 @@
+/*
+ * EQ-3 status notification decoding and encoding
+ *
+ * The json encoding is what has always been published on <mqttid>radout/status/<address>.
+ * The cbor encoding is published on the optional binary topic tree. The device list published
+ * at the end of a scan is encoded here too.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "eq3_hal.h"
+#include "eq3_status.h"
+#include "eq3_cbor.h"
+
+#define STATUS_TAG "EQ3_STATUS"
+
+/* Decode the parameters from a PROP_INFO_RETURN notification */
+void eq3_decode_status(uint8_t *value, int len, struct eq3_status *status){
+    memset(status, 0, sizeof(struct eq3_status));
+    if(len > 5){
+        status->temp = value[5];
+        status->fields |= EQ3_STATUS_TEMP;
+    }
+    if(len > 14){
+        status->offset = value[14];
+        status->fields |= EQ3_STATUS_OFFSET;
+    }
+    if(len > 3){
+        status->valve = value[3];
+        status->fields |= EQ3_STATUS_VALVE;
+    }
+    if(len > 2){
+        status->mode = value[2];
+        status->fields |= EQ3_STATUS_MODE;
+    }
+    EQ3_LOGI(STATUS_TAG, "eq3 settemp %d.%d C, offset %d, valve %d%% open, mode 0x%02x", status->temp >> 1, status->temp & 0x01 ? 5 : 0,
+             status->offset, status->valve, status->mode);
+}
+
+/* Bounded append to the json buffer */
+static int json_append(char *buf, int len, int idx, const char *fmt, ...){
+    va_list args;
+    int added;
+    if(idx >= len)
+        return idx;
+    va_start(args, fmt);
+    added = vsnprintf(&buf[idx], len - idx, fmt, args);
+    va_end(args);
+    return idx + added;
+}
+
+/* Encode a status as json, returns the length or -1 if the buffer is too small */
+int eq3_status_to_json(struct eq3_status *status, char *mac_addr, char *buf, int len){
+    int idx = 0;
+
+    idx = json_append(buf, len, idx, "{\"trv\":\"%s\"", mac_addr);
+    if(status->fields & EQ3_STATUS_TEMP)
+        idx = json_append(buf, len, idx, ",\"temp\":\"%d.%d\"", status->temp >> 1, status->temp & 0x01 ? 5 : 0);
+    if(status->fields & EQ3_STATUS_OFFSET){
+        // The offset temperature is encoded in steps of 0.5°C between -3.5°C and 3.5°C
+        int offsetval = (int)status->offset - 7;
+        int magnitude = offsetval < 0 ? -offsetval : offsetval;
+        idx = json_append(buf, len, idx, ",\"offsetTemp\":\"%s%d.%d\"", offsetval < 0 ? "-" : "", magnitude >> 1, magnitude & 0x01 ? 5 : 0);
+    }
+    if(status->fields & EQ3_STATUS_VALVE)
+        idx = json_append(buf, len, idx, ",\"valve\":\"%d\"", status->valve);
+    if(status->fields & EQ3_STATUS_MODE){
+        uint8_t mode = status->mode;
+        idx = json_append(buf, len, idx, ",\"mode\":\"%s\"", mode & MANUAL ? "manual" : mode & AWAY ? "holiday" : "auto");
+        /* Below 5 degrees is 'off' */
+        idx = json_append(buf, len, idx, ",\"mode_ha\":\"%s\"", status->temp < 10 ? "off" : mode & MANUAL ? "heat" : "auto");
+        idx = json_append(buf, len, idx, ",\"boost\":\"%s\"", mode & BOOST ? "active" : "inactive");
+        idx = json_append(buf, len, idx, ",\"window\":\"%s\"", mode & WINDOW ? "open" : "closed");
+        idx = json_append(buf, len, idx, ",\"state\":\"%s\"", mode & LOCKED ? "locked" : "unlocked");
+        idx = json_append(buf, len, idx, ",\"battery\":\"%s\"", mode & LOW_BATTERY ? "LOW" : "GOOD");
+    }
+    idx = json_append(buf, len, idx, "}");
+    return idx < len ? idx : -1;
+}
+
+/* Encode a status as a cbor map, returns the length or -1 if the buffer is too small */
+/* {"trv":h'001A2211E720',"temp":22.0,"offsetTemp":0.0,"valve":64,"mode":"auto","mode_ha":"auto",
+ *  "boost":false,"window":false,"locked":false,"battery_low":false} */
+int eq3_status_to_cbor(struct eq3_status *status, uint8_t *bda, uint8_t *buf, int len){
+    struct cbor_writer cw;
+    uint32_t pairs = 1;
+    uint8_t mode = status->mode;
+
+    if(status->fields & EQ3_STATUS_TEMP)
+        pairs++;
+    if(status->fields & EQ3_STATUS_OFFSET)
+        pairs++;
+    if(status->fields & EQ3_STATUS_VALVE)
+        pairs++;
+    if(status->fields & EQ3_STATUS_MODE)
+        pairs += 6;
+
+    cbor_init(&cw, buf, len);
+    cbor_put_map(&cw, pairs);
+    cbor_put_text(&cw, "trv");
+    cbor_put_bytes(&cw, bda, 6);
+    if(status->fields & EQ3_STATUS_TEMP){
+        cbor_put_text(&cw, "temp");
+        cbor_put_half(&cw, (float)status->temp / 2);
+    }
+    if(status->fields & EQ3_STATUS_OFFSET){
+        cbor_put_text(&cw, "offsetTemp");
+        cbor_put_half(&cw, ((float)status->offset - 7) / 2);
+    }
+    if(status->fields & EQ3_STATUS_VALVE){
+        cbor_put_text(&cw, "valve");
+        cbor_put_uint(&cw, status->valve);
+    }
+    if(status->fields & EQ3_STATUS_MODE){
+        cbor_put_text(&cw, "mode");
+        cbor_put_text(&cw, mode & MANUAL ? "manual" : mode & AWAY ? "holiday" : "auto");
+        cbor_put_text(&cw, "mode_ha");
+        cbor_put_text(&cw, status->temp < 10 ? "off" : mode & MANUAL ? "heat" : "auto");
+        cbor_put_text(&cw, "boost");
+        cbor_put_bool(&cw, (mode & BOOST) != 0);
+        cbor_put_text(&cw, "window");
+        cbor_put_bool(&cw, (mode & WINDOW) != 0);
+        cbor_put_text(&cw, "locked");
+        cbor_put_bool(&cw, (mode & LOCKED) != 0);
+        cbor_put_text(&cw, "battery_low");
+        cbor_put_bool(&cw, (mode & LOW_BATTERY) != 0);
+    }
+    return cbor_len(&cw);
+}
+
+/* Encode one device - {"rssi":-123,"bleaddr":"00:00:00:00:00:00"} - returns the length written */
+int eq3_devlist_entry_to_json(struct eq3_devlist_entry *dev, char *buf, int len){
+    int added = snprintf(buf, len, "{\"rssi\":%d,\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\"}",
+                 dev->rssi, dev->bda[0], dev->bda[1], dev->bda[2], dev->bda[3], dev->bda[4], dev->bda[5]);
+    return added < len ? added : len - 1;
+}
+
+/* Encode the device list as json, returns the length or -1 if the buffer is too small */
+/* {"devices":[{"rssi":-123,"bleaddr":"00:00:00:00:00:00"},....]} */
+int eq3_devlist_to_json(struct eq3_devlist_entry *devs, int num, char *buf, int len){
+    int idx, devnum;
+
+    idx = json_append(buf, len, 0, "{\"devices\":[");
+    for(devnum = 0; devnum < num && idx < len; devnum++){
+        if(devnum > 0)
+            idx = json_append(buf, len, idx, ",");
+        if(idx < len)
+            idx += eq3_devlist_entry_to_json(&devs[devnum], &buf[idx], len - idx);
+    }
+    idx = json_append(buf, len, idx, "]}");
+    return idx < len ? idx : -1;
+}
+
+/* Encode the device list as cbor, returns the length or -1 if the buffer is too small */
+/* {"devices":[{"rssi":-77,"bleaddr":h'001A2211E720'},....]} */
+int eq3_devlist_to_cbor(struct eq3_devlist_entry *devs, int num, uint8_t *buf, int len){
+    struct cbor_writer cw;
+    int devnum;
+
+    cbor_init(&cw, buf, len);
+    cbor_put_map(&cw, 1);
+    cbor_put_text(&cw, "devices");
+    cbor_put_array(&cw, num);
+    for(devnum = 0; devnum < num; devnum++){
+        cbor_put_map(&cw, 2);
+        cbor_put_text(&cw, "rssi");
+        cbor_put_int(&cw, devs[devnum].rssi);
+        cbor_put_text(&cw, "bleaddr");
+        cbor_put_bytes(&cw, devs[devnum].bda, 6);
+    }
+    return cbor_len(&cw);
+}
@@ -0,0 +1,33 @@
+/*
+ * Fuzz target for the command text parser
+ *
+ * The input is a command as it comes from the uart, /set or /sendCommand ("<address> <command>
+ * [param]"). Anything eq3_parse_command() accepts must encode into a characteristic value that
+ * fits the frame.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    struct eq3cmd cmd;
+    uint8_t frame[EQ3_FRAME_MAX];
+    char *cmdstr;
+
+    eq3_hal_log_level = 0;
+    /* Exactly the input and its terminator so any read past the end is caught */
+    if((cmdstr = malloc(size + 1)) == NULL)
+        return 0;
+    memcpy(cmdstr, data, size);
+    cmdstr[size] = 0;
+    memset(&cmd, 0, sizeof(cmd));
+    if(eq3_parse_command(cmdstr, &cmd) == 0){
+        if(eq3_encode_command(&cmd, frame) > EQ3_FRAME_MAX)
+            abort();
+    }
+    free(cmdstr);
+    return 0;
+}
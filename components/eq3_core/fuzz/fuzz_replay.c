@@ -0,0 +1,74 @@
+/*
+ * Driver for the fuzz targets without libFuzzer
+ *
+ *   eq3_fuzz_topic corpus/topic crash-1234
+ *
+ * runs each file (or every file in each directory) through the target once - a corpus check in CI
+ * or the replay of a crash. With no arguments it runs stdin once, which is what afl-fuzz expects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define FUZZ_MAX_INPUT 65536
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int run_stream(FILE *in){
+    uint8_t *data = malloc(FUZZ_MAX_INPUT);
+    size_t size;
+    if(data == NULL)
+        return -1;
+    size = fread(data, 1, FUZZ_MAX_INPUT, in);
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+static int run_file(const char *path){
+    FILE *in = fopen(path, "rb");
+    int rc;
+    if(in == NULL){
+        perror(path);
+        return -1;
+    }
+    rc = run_stream(in);
+    fclose(in);
+    return rc;
+}
+
+int main(int argc, char *argv[]){
+    int arg, runs = 0, rc = 0;
+
+    if(argc < 2)
+        return run_stream(stdin) == 0 ? 0 : 1;
+    for(arg = 1; arg < argc; arg++){
+        struct stat st;
+        if(stat(argv[arg], &st) == 0 && S_ISDIR(st.st_mode)){
+            DIR *dir = opendir(argv[arg]);
+            struct dirent *entry;
+            char path[512];
+            if(dir == NULL)
+                continue;
+            while((entry = readdir(dir)) != NULL){
+                if(entry->d_name[0] == '.')
+                    continue;
+                snprintf(path, sizeof(path), "%s/%s", argv[arg], entry->d_name);
+                if(run_file(path) != 0)
+                    rc = 1;
+                runs++;
+            }
+            closedir(dir);
+        }else{
+            if(run_file(argv[arg]) != 0)
+                rc = 1;
+            runs++;
+        }
+    }
+    fprintf(stderr, "%d inputs run\n", runs);
+    return rc;
+}
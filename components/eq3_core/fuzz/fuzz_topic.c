@@ -0,0 +1,76 @@
+/*
+ * Fuzz target for mqtt commands - topic parsing through handle_request() and the scheduler
+ *
+ * The input is the topic, a newline and the payload. The payload isn't terminated, as it isn't in
+ * an mqtt message. Valid commands go through the queue and a session with a valve that answers
+ * straight away, so the queue is empty again when the next input runs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+#include "eq3_hal_linux.h"
+
+/* Sessions complete from inside the open and close calls */
+static void fuzz_open(const uint8_t *bda){
+    int len;
+    eq3_sched_opened();
+    eq3_sched_frame(&len);
+    if(len < 0 || len > EQ3_FRAME_MAX)
+        abort();
+    eq3_sched_done();
+}
+
+static void fuzz_close(void){
+    eq3_sched_disconnected(false);
+    eq3_sched_closed();
+}
+
+static void fuzz_report(const char *mac_addr, const char *json){
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    static const struct eq3_linux_ble fuzz_ble = {
+        .open = fuzz_open,
+        .close = fuzz_close,
+    };
+    const uint8_t *split = memchr(data, '\n', size);
+    char cmd[EQ3_TOPIC_CMD_MAX];
+    char *topic, *payload;
+    size_t topic_len, payload_len;
+
+    eq3_hal_log_level = 0;
+    eq3_linux_set_virtual_time(true);
+    eq3_linux_set_ble(&fuzz_ble);
+    eq3_linux_set_report(fuzz_report);
+
+    topic_len = split != NULL ? (size_t)(split - data) : size;
+    payload_len = split != NULL ? size - topic_len - 1 : 0;
+    topic = malloc(topic_len + 1);
+    payload = malloc(payload_len > 0 ? payload_len : 1);
+    if(topic == NULL || payload == NULL){
+        free(topic);
+        free(payload);
+        return 0;
+    }
+    memcpy(topic, data, topic_len);
+    topic[topic_len] = 0;
+    if(payload_len > 0)
+        memcpy(payload, split + 1, payload_len);
+
+    if(eq3_topic_command(topic, payload, (int)payload_len, cmd, sizeof(cmd)) == 0 && handle_request(cmd) == 0){
+        /* Run the session and the disconnect delay through to an idle scheduler */
+        while(eq3_linux_timer_due() >= 0){
+            eq3_linux_wait(eq3_linux_timer_due());
+            eq3_linux_run_timer();
+        }
+        if(eq3_sched_idle() == false)
+            abort();
+    }
+    free(topic);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef EQ3_CAPTURE_H
+#define EQ3_CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "eq3_cmd.h"
+
+/*
+ * Capture of valve BLE traffic
+ *
+ * Header: "EQ3C", version, 0, record count (16 bit). Each record is the time in ms (32 bit), the
+ * type, the data length, the address, the attribute handle (16 bit) and the data. Multi-byte
+ * values are little endian.
+ */
+#define EQ3_CAPTURE_MAGIC "EQ3C"
+#define EQ3_CAPTURE_VERSION 1
+#define EQ3_CAPTURE_HEADER_LEN 8
+#define EQ3_CAPTURE_RECORD_LEN 14          /* Without the data */
+#define EQ3_CAPTURE_DATA_MAX EQ3_FRAME_MAX
+
+enum eq3_capture_type {
+    EQ3_CAP_OPEN = 1,           /* Hub asked for a connection */
+    EQ3_CAP_OPENED,
+    EQ3_CAP_OPEN_FAILED,
+    EQ3_CAP_WRITE,              /* Command characteristic write */
+    EQ3_CAP_NOTIFY,             /* Notification from the valve */
+    EQ3_CAP_DISCONNECT,         /* data[0] is 1 if the link dropped */
+    EQ3_CAP_COMMAND,            /* Command queued - data[0] is the link quality (0xff unknown), then the encoded command */
+};
+
+struct eq3_capture_record {
+    uint32_t time_ms;
+    uint8_t type;
+    uint8_t len;
+    uint8_t bda[6];
+    uint16_t handle;
+    uint8_t data[EQ3_CAPTURE_DATA_MAX];
+};
+
+/* Both return the bytes written or -1 if buf is too small */
+int eq3_capture_put_header(uint8_t *buf, int len, int count);
+int eq3_capture_put_record(uint8_t *buf, int len, const struct eq3_capture_record *rec);
+
+/* Record count from the header or -1 if it isn't a capture */
+int eq3_capture_get_header(const uint8_t *buf, int len);
+/* Bytes used by the record or -1 if it is truncated or malformed */
+int eq3_capture_get_record(const uint8_t *buf, int len, struct eq3_capture_record *rec);
+
+const char *eq3_capture_type_name(uint8_t type);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef EQ3_CBOR_H
+#define EQ3_CBOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Minimal CBOR (RFC 7049) writer into a caller supplied buffer */
+struct cbor_writer {
+    uint8_t *buf;
+    int len;
+    int idx;
+    bool overflow;
+};
+
+void cbor_init(struct cbor_writer *cw, uint8_t *buf, int len);
+void cbor_put_map(struct cbor_writer *cw, uint32_t pairs);
+void cbor_put_array(struct cbor_writer *cw, uint32_t items);
+void cbor_put_uint(struct cbor_writer *cw, uint32_t val);
+void cbor_put_int(struct cbor_writer *cw, int32_t val);
+void cbor_put_text(struct cbor_writer *cw, const char *text);
+void cbor_put_bytes(struct cbor_writer *cw, const uint8_t *bytes, uint32_t len);
+void cbor_put_bool(struct cbor_writer *cw, bool val);
+void cbor_put_half(struct cbor_writer *cw, float val);
+
+/* Encoded length or -1 if the buffer was too small */
+int cbor_len(struct cbor_writer *cw);
+
+#endif
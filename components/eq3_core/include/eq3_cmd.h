@@ -0,0 +1,73 @@
+#ifndef EQ3_CMD_H
+#define EQ3_CMD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Request ids for TRV */
+#define PROP_ID_QUERY            0x00
+#define PROP_ID_RETURN           0x01
+#define PROP_INFO_RETURN         0x02
+#define PROP_INFO_QUERY          0x03
+#define PROP_COMFORT_ECO_CONFIG  0x11
+#define PROP_OFFSET              0x13
+#define PROP_WINDOW_OPEN_CONFIG  0x14
+#define PROP_SCHEDULE_QUERY      0x20
+#define PROP_SCHEDULE_RETURN     0x21
+#define PROP_MODE_WRITE          0x40
+#define PROP_TEMPERATURE_WRITE   0x41
+#define PROP_COMFORT             0x43
+#define PROP_ECO                 0x44
+#define PROP_BOOST               0x45
+#define PROP_LOCK                0x80
+
+#define MAX_CMD_BYTES 6
+#define SET_TIME_BYTES 6
+#define MAX_CMD_RETRIES 3
+
+/* Largest characteristic write */
+#define EQ3_FRAME_MAX 20
+
+/* Largest command built from an mqtt topic and payload */
+#define EQ3_TOPIC_CMD_MAX 80
+
+typedef enum {
+    EQ3_BOOST = 0,
+    EQ3_UNBOOST,
+    EQ3_AUTO,
+    EQ3_MANUAL,
+    EQ3_ECO,
+    EQ3_SETTEMP,
+    EQ3_OFFSET,
+    EQ3_SETTIME,
+    EQ3_LOCK,
+    EQ3_UNLOCK,
+}eq3_bt_cmd;
+
+struct eq3cmd{
+    uint8_t bleda[6];
+    eq3_bt_cmd cmd;
+    unsigned char cmdparms[MAX_CMD_BYTES];
+    int retries;
+    struct eq3cmd *next;
+};
+
+/* Recent QoS1 deliveries - the copies a broker sends again after a reconnect are dropped */
+#define EQ3_DEDUP_ENTRIES 16
+
+struct eq3_dedup {
+    struct {
+        int msg_id;
+        uint32_t hash;      /* Of the topic and payload */
+    } recent[EQ3_DEDUP_ENTRIES];
+    int next;
+    int dropped;
+};
+
+int eq3_parse_command(char *cmdstr, struct eq3cmd *cmd);
+int eq3_encode_command(struct eq3cmd *cmd, uint8_t *frame);
+int eq3_topic_command(const char *topic, const char *payload, int payload_len, char *cmd, int len);
+bool eq3_dedup_repeat(struct eq3_dedup *dedup, int msg_id, bool dup, const char *topic, int topic_len,
+                      const char *payload, int payload_len);
+
+#endif
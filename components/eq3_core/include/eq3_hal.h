@@ -0,0 +1,63 @@
+#ifndef EQ3_HAL_H
+#define EQ3_HAL_H
+
+/*
+ * Hardware abstraction for the eq3_core component
+ *
+ * The core (command parsing, queue, session scheduler and status encoding) only talks to the
+ * outside world through these functions. main/eq3_hal_esp.c and the GATT client in main/eq3_main.c
+ * implement them on ESP-IDF, port/linux/eq3_hal_linux.c on a Linux host.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#define EQ3_LOGE(tag, fmt, ...) ESP_LOGE(tag, fmt, ##__VA_ARGS__)
+#define EQ3_LOGW(tag, fmt, ...) ESP_LOGW(tag, fmt, ##__VA_ARGS__)
+#define EQ3_LOGI(tag, fmt, ...) ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#else
+#include <stdio.h>
+extern int eq3_hal_log_level;          /* 0 silent, 1 errors and warnings, 2 everything */
+#define EQ3_LOG(level, lc, tag, fmt, ...) do { if(eq3_hal_log_level >= level) fprintf(stderr, lc " %s: " fmt "\n", tag, ##__VA_ARGS__); } while(0)
+#define EQ3_LOGE(tag, fmt, ...) EQ3_LOG(1, "E", tag, fmt, ##__VA_ARGS__)
+#define EQ3_LOGW(tag, fmt, ...) EQ3_LOG(1, "W", tag, fmt, ##__VA_ARGS__)
+#define EQ3_LOGI(tag, fmt, ...) EQ3_LOG(2, "I", tag, fmt, ##__VA_ARGS__)
+#endif
+
+/* State of a probe for one valve before connecting to it */
+enum eq3_probe_state { EQ3_PROBE_IDLE = 0, EQ3_PROBE_RUNNING, EQ3_PROBE_FOUND, EQ3_PROBE_NOT_FOUND };
+
+/* Link quality score 0-100 - good links get shorter timeouts, poor ones an extra retry */
+#define EQ3_LINK_QUALITY_UNKNOWN -1
+#define EQ3_LINK_QUALITY_GOOD 70
+#define EQ3_LINK_QUALITY_POOR 30
+
+/* Clock - uS since boot */
+int64_t eq3_hal_time_us(void);
+/* Wall clock for setting the valve time - false if it isn't synchronised */
+bool eq3_hal_localtime(struct tm *timeinfo);
+
+/* One shot scheduler timer - eq3_sched_tick() is called when it expires */
+void eq3_hal_timer_start(unsigned int delay_ms);
+
+/* BLE - the results come back through eq3_sched_opened(), eq3_sched_done(), eq3_sched_error() and friends */
+void eq3_hal_ble_open(const uint8_t *bda);
+void eq3_hal_ble_close(void);
+bool eq3_hal_ble_preempt(void);                 /* A session is about to start - stop discovery scans, false if a scan has to finish first */
+bool eq3_hal_ble_probe(const uint8_t *bda);     /* Look for a valve not heard recently - false if no probe was started */
+enum eq3_probe_state eq3_hal_ble_probe_state(void);
+void eq3_hal_ble_idle(void);                    /* Nothing queued - scans may use the radio */
+void eq3_hal_ble_open_timeout(const uint8_t *bda);
+int eq3_hal_link_quality(const uint8_t *bda);
+
+/* Command results - an error report for a valve and the event log */
+void eq3_hal_report(const char *mac_addr, const char *json);
+void eq3_hal_log_event(const char *event);
+
+/* A command was queued - its encoded value and the link quality that picked its retries, for the BLE capture */
+void eq3_hal_command_queued(const uint8_t *bda, const uint8_t *frame, int len, int quality);
+
+#endif
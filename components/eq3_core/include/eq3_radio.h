@@ -0,0 +1,43 @@
+#ifndef EQ3_RADIO_H
+#define EQ3_RADIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Radio arbitration between valve sessions and discovery scans
+ *
+ * Sessions come first - a running scan is stopped and carries on later with the time it had left,
+ * but only max_preempt sessions may go ahead of one scan. After that the scan gets the radio
+ * between two sessions and keeps it until it has finished. The hub and the simulated fleet both
+ * drive the radio from the action eq3_radio_preempt() returns. Times are in uS from any clock.
+ */
+struct eq3_radio_scan {
+    volatile bool requested;    /* Waiting for the radio - may be set from any task */
+    bool running;
+    int duration_ms;            /* Of a whole scan */
+    int remaining_ms;           /* Left of a pre-empted scan, 0 when none is part done */
+    int deferrals;              /* Sessions that went ahead of the current scan */
+    int max_preempt;
+    int64_t started;            /* Since when the scan has been running */
+};
+
+enum eq3_radio_action {
+    EQ3_RADIO_GO = 0,           /* The session can have the radio */
+    EQ3_RADIO_STOP_SCAN,        /* Stop the running scan, then the session goes ahead */
+    EQ3_RADIO_START_SCAN,       /* Start the waiting scan - the session waits for it */
+    EQ3_RADIO_HOLD,             /* The running scan finishes first - the session waits */
+};
+
+void eq3_radio_init(struct eq3_radio_scan *scan, int duration_ms, int max_preempt);
+
+/* The scan gets the radio - returns how long to scan for in mS */
+int eq3_radio_scan_start(struct eq3_radio_scan *scan, int64_t now);
+
+/* The scan ran to the end */
+void eq3_radio_scan_done(struct eq3_radio_scan *scan);
+
+/* A valve session wants the radio */
+enum eq3_radio_action eq3_radio_preempt(struct eq3_radio_scan *scan, int64_t now);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef EQ3_SCHED_H
+#define EQ3_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Command complete success/fail acknowledgement */
+#define EQ3_CMD_DONE    0
+#define EQ3_CMD_RETRY   1
+#define EQ3_CMD_FAILED  2
+
+/* 40s timeout on BLE state machine actions - halved for valves with a good link */
+#define BLE_OPERATION_TIMEOUT 40
+#define BLE_OPERATION_TIMEOUT_GOOD_LINK 20
+
+/* Seconds between the end of a command and closing the connection so background GATTC work can finish */
+#define EQ3_DISCONNECT_DELAY 2
+
+/* Command sources */
+int handle_request(char *cmdstr);
+
+/* Timer - once a second while there is anything to do */
+void eq3_sched_tick(void);
+void eq3_sched_wake(void);
+
+/* Session events from the BLE backend */
+void eq3_sched_opened(void);
+void eq3_sched_closed(void);
+void eq3_sched_done(void);
+void eq3_sched_error(const uint8_t *bda, const char *error);
+void eq3_sched_disconnected(bool dropped);
+
+/* State */
+bool eq3_sched_busy(void);
+bool eq3_sched_idle(void);
+bool eq3_sched_in_session(void);
+const uint8_t *eq3_sched_bda(void);
+const uint8_t *eq3_sched_frame(int *len);
+
+#endif
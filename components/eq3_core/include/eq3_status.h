@@ -0,0 +1,56 @@
+#ifndef EQ3_STATUS_H
+#define EQ3_STATUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Status bits */
+#define AUTO                     0x00
+#define MANUAL                   0x01
+#define AWAY                     0x02
+#define BOOST                    0x04
+#define DST                      0x08
+#define WINDOW                   0x10
+#define LOCKED                   0x20
+#define UNKNOWN                  0x40
+#define LOW_BATTERY              0x80
+
+/* Fields present in a decoded status */
+#define EQ3_STATUS_TEMP          0x01
+#define EQ3_STATUS_OFFSET        0x02
+#define EQ3_STATUS_VALVE         0x04
+#define EQ3_STATUS_MODE          0x08
+
+/* Decoded PROP_INFO_RETURN notification */
+struct eq3_status {
+    uint8_t fields;       /* EQ3_STATUS_xxx bits of the values below which are valid */
+    uint8_t temp;         /* Target temperature in 0.5 degree steps */
+    uint8_t offset;       /* Offset temperature in 0.5 degree steps biased by 7 (-3.5 degrees) */
+    uint8_t valve;        /* Valve open percentage */
+    uint8_t mode;         /* Status bits */
+};
+
+/* Largest status json and cbor documents */
+#define EQ3_STATUS_JSON_MAX      240
+#define EQ3_STATUS_CBOR_MAX      128
+
+/* A valve in the device list published at the end of a scan */
+struct eq3_devlist_entry {
+    uint8_t bda[6];
+    int rssi;
+};
+
+/* Longest json entry for one device and the whole devlist documents for num devices */
+#define EQ3_DEVLIST_ENTRY_MAX    (sizeof("{\"rssi\":-128,\"bleaddr\":\"00:00:00:00:00:00\"},") - 1)
+#define EQ3_DEVLIST_JSON_MAX(num) (sizeof("{\"devices\":[]}") + EQ3_DEVLIST_ENTRY_MAX * (num))
+/* 2 byte rssi, 6 byte address, map header and the two keys for each device */
+#define EQ3_DEVLIST_CBOR_MAX(num) (16 + 26 * (num))
+
+void eq3_decode_status(uint8_t *value, int len, struct eq3_status *status);
+int eq3_status_to_json(struct eq3_status *status, char *mac_addr, char *buf, int len);
+int eq3_status_to_cbor(struct eq3_status *status, uint8_t *bda, uint8_t *buf, int len);
+int eq3_devlist_entry_to_json(struct eq3_devlist_entry *dev, char *buf, int len);
+int eq3_devlist_to_json(struct eq3_devlist_entry *devs, int num, char *buf, int len);
+int eq3_devlist_to_cbor(struct eq3_devlist_entry *devs, int num, uint8_t *buf, int len);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * eq3_core HAL for a Linux host
+ *
+ * The host program supplies the BLE side (a simulator or a recording) and polls the scheduler
+ * timer from its own loop. There is no probing and command results are printed unless the host
+ * program takes them.
+ *
+ * With virtual time the clock only moves when the host program waits, and then jumps straight to
+ * the end of the wait - a day of timeouts and retries runs in milliseconds and every run with the
+ * same inputs gives the same trace.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "eq3_hal.h"
+#include "eq3_sched.h"
+#include "eq3_hal_linux.h"
+
+int eq3_hal_log_level = 1;
+
+static struct eq3_linux_ble ble_ops;
+static void (*report_cb)(const char *mac_addr, const char *json) = NULL;
+static void (*queued_cb)(const uint8_t *bda, const uint8_t *frame, int len, int quality) = NULL;
+static int64_t timer_due = -1;
+static int speed = 1;                   /* Clock runs this many times faster than real time */
+static bool virtual_time = false;
+static int64_t virtual_now = 0;
+static FILE *trace_file = NULL;
+
+/* Wall clock of the valves at virtual time 0 - 2021-01-01 00:00:00 UTC */
+#define VIRTUAL_EPOCH 1609459200
+
+void eq3_linux_set_ble(const struct eq3_linux_ble *ble){
+    memcpy(&ble_ops, ble, sizeof(ble_ops));
+}
+
+/* Lets the host program wrap the backend's functions to watch the sessions */
+void eq3_linux_get_ble(struct eq3_linux_ble *ble){
+    memcpy(ble, &ble_ops, sizeof(ble_ops));
+}
+
+void eq3_linux_set_report(void (*report)(const char *mac_addr, const char *json)){
+    report_cb = report;
+}
+
+void eq3_linux_set_command_queued(void (*queued)(const uint8_t *bda, const uint8_t *frame, int len, int quality)){
+    queued_cb = queued;
+}
+
+void eq3_linux_set_speed(int factor){
+    if(factor > 0)
+        speed = factor;
+}
+
+void eq3_linux_set_virtual_time(bool enable){
+    virtual_time = enable;
+    virtual_now = 0;
+}
+
+bool eq3_linux_virtual_time(void){
+    return virtual_time;
+}
+
+void eq3_linux_set_trace(FILE *trace){
+    trace_file = trace;
+}
+
+/* One line per event - time in seconds, event, detail */
+void eq3_linux_trace(const char *event, const char *fmt, ...){
+    va_list args;
+    int64_t now;
+    if(trace_file == NULL)
+        return;
+    now = eq3_hal_time_us();
+    fprintf(trace_file, "%lld.%06lld %-8s ", (long long)(now / 1000000), (long long)(now % 1000000), event);
+    va_start(args, fmt);
+    vfprintf(trace_file, fmt, args);
+    va_end(args);
+    fputc('\n', trace_file);
+}
+
+static void trace_bda(const char *event, const uint8_t *bda){
+    eq3_linux_trace(event, "%02X:%02X:%02X:%02X:%02X:%02X", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+int64_t eq3_hal_time_us(void){
+    static int64_t start = -1;
+    struct timespec ts;
+    int64_t now;
+
+    if(virtual_time == true)
+        return virtual_now;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if(start < 0)
+        start = now;
+    return (now - start) * speed;
+}
+
+/* Sleep until the (scaled) clock reaches until_us - with virtual time just move the clock on */
+void eq3_linux_wait(int64_t until_us){
+    int64_t delay = until_us - eq3_hal_time_us();
+    struct timespec ts;
+    if(delay <= 0)
+        return;
+    if(virtual_time == true){
+        virtual_now = until_us;
+        return;
+    }
+    delay /= speed;
+    ts.tv_sec = delay / 1000000;
+    ts.tv_nsec = (delay % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+bool eq3_hal_localtime(struct tm *timeinfo){
+    time_t now = virtual_time == true ? VIRTUAL_EPOCH + (time_t)(virtual_now / 1000000) : time(NULL);
+    if(virtual_time == true)
+        gmtime_r(&now, timeinfo);
+    else
+        localtime_r(&now, timeinfo);
+    return true;
+}
+
+void eq3_hal_timer_start(unsigned int delay_ms){
+    eq3_linux_trace("timer", "%u", delay_ms);
+    timer_due = eq3_hal_time_us() + (int64_t)delay_ms * 1000;
+}
+
+int64_t eq3_linux_timer_due(void){
+    return timer_due;
+}
+
+bool eq3_linux_run_timer(void){
+    if(timer_due < 0 || eq3_hal_time_us() < timer_due)
+        return false;
+    timer_due = -1;
+    eq3_linux_trace("tick", "");
+    eq3_sched_tick();
+    return true;
+}
+
+void eq3_hal_ble_open(const uint8_t *bda){
+    trace_bda("open", bda);
+    if(ble_ops.open != NULL)
+        ble_ops.open(bda);
+}
+
+void eq3_hal_ble_close(void){
+    eq3_linux_trace("close", "");
+    if(ble_ops.close != NULL)
+        ble_ops.close();
+}
+
+bool eq3_hal_ble_preempt(void){
+    if(ble_ops.preempt != NULL)
+        return ble_ops.preempt();
+    return true;
+}
+
+bool eq3_hal_ble_probe(const uint8_t *bda){
+    return false;
+}
+
+enum eq3_probe_state eq3_hal_ble_probe_state(void){
+    return EQ3_PROBE_IDLE;
+}
+
+void eq3_hal_ble_idle(void){
+    if(ble_ops.idle != NULL)
+        ble_ops.idle();
+}
+
+void eq3_hal_ble_open_timeout(const uint8_t *bda){
+    trace_bda("timeout", bda);
+}
+
+int eq3_hal_link_quality(const uint8_t *bda){
+    if(ble_ops.link_quality != NULL)
+        return ble_ops.link_quality(bda);
+    return EQ3_LINK_QUALITY_UNKNOWN;
+}
+
+void eq3_hal_report(const char *mac_addr, const char *json){
+    eq3_linux_trace("report", "%s %s", mac_addr, json);
+    if(report_cb != NULL)
+        report_cb(mac_addr, json);
+    else
+        printf("%s %s\n", mac_addr, json);
+}
+
+void eq3_hal_log_event(const char *event){
+    eq3_linux_trace("log", "%s", event);
+    EQ3_LOGI("EQ3_LOG", "%s", event);
+}
+
+void eq3_hal_command_queued(const uint8_t *bda, const uint8_t *frame, int len, int quality){
+    if(queued_cb != NULL)
+        queued_cb(bda, frame, len, quality);
+}
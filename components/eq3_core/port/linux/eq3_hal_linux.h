@@ -0,0 +1,38 @@
+#ifndef EQ3_HAL_LINUX_H
+#define EQ3_HAL_LINUX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* BLE backend plugged in by the host program - unset functions behave as an absent radio */
+struct eq3_linux_ble {
+    void (*open)(const uint8_t *bda);
+    void (*close)(void);
+    int (*link_quality)(const uint8_t *bda);
+    bool (*preempt)(void);              /* A command wants the radio - stop any scan, false to make it wait */
+    void (*idle)(void);                 /* Nothing left to send - scans may resume */
+};
+
+void eq3_linux_set_ble(const struct eq3_linux_ble *ble);
+void eq3_linux_get_ble(struct eq3_linux_ble *ble);
+void eq3_linux_set_report(void (*report)(const char *mac_addr, const char *json));
+void eq3_linux_set_command_queued(void (*queued)(const uint8_t *bda, const uint8_t *frame, int len, int quality));
+
+/* Clock - a speed above 1 runs the valve timeouts and delays faster than real time */
+void eq3_linux_set_speed(int factor);
+void eq3_linux_wait(int64_t until_us);
+
+/* Virtual time - the clock starts at 0 and only moves in eq3_linux_wait(), which returns at once */
+void eq3_linux_set_virtual_time(bool enable);
+bool eq3_linux_virtual_time(void);
+
+/* Event trace (timer ticks, opens, closes, reports, log events) with the time of each */
+void eq3_linux_set_trace(FILE *trace);
+void eq3_linux_trace(const char *event, const char *fmt, ...);
+
+/* Scheduler timer - the host program runs eq3_sched_tick() through eq3_linux_run_timer() */
+int64_t eq3_linux_timer_due(void);
+bool eq3_linux_run_timer(void);
+
+#endif
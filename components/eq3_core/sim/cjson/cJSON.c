@@ -0,0 +1,622 @@
+/*
+ * Host cJSON subset - see cJSON.h
+ */
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+struct print_buffer {
+    char *buf;
+    size_t len;
+    size_t used;
+    int failed;
+};
+
+struct parse_buffer {
+    const char *content;
+    size_t length;
+    size_t offset;
+};
+
+static cJSON *new_item(int type){
+    cJSON *item = calloc(1, sizeof(cJSON));
+    if(item != NULL)
+        item->type = type;
+    return item;
+}
+
+static char *copy_string(const char *string){
+    size_t len = strlen(string) + 1;
+    char *copy = malloc(len);
+    if(copy != NULL)
+        memcpy(copy, string, len);
+    return copy;
+}
+
+void cJSON_Delete(cJSON *item){
+    cJSON *next;
+    while(item != NULL){
+        next = item->next;
+        if(item->child != NULL)
+            cJSON_Delete(item->child);
+        free(item->valuestring);
+        free(item->string);
+        free(item);
+        item = next;
+    }
+}
+
+void cJSON_free(void *object){
+    free(object);
+}
+
+/* ========== Create and add */
+
+cJSON *cJSON_CreateNull(void){
+    return new_item(cJSON_NULL);
+}
+
+cJSON *cJSON_CreateTrue(void){
+    return new_item(cJSON_True);
+}
+
+cJSON *cJSON_CreateFalse(void){
+    return new_item(cJSON_False);
+}
+
+cJSON *cJSON_CreateBool(cJSON_bool boolean){
+    return new_item(boolean ? cJSON_True : cJSON_False);
+}
+
+/* valueint saturates as in cJSON */
+cJSON *cJSON_CreateNumber(double num){
+    cJSON *item = new_item(cJSON_Number);
+    if(item != NULL){
+        item->valuedouble = num;
+        if(num >= INT_MAX)
+            item->valueint = INT_MAX;
+        else if(num <= (double)INT_MIN)
+            item->valueint = INT_MIN;
+        else
+            item->valueint = (int)num;
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateString(const char *string){
+    cJSON *item = new_item(cJSON_String);
+    if(item != NULL && (item->valuestring = copy_string(string)) == NULL){
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateArray(void){
+    return new_item(cJSON_Array);
+}
+
+cJSON *cJSON_CreateObject(void){
+    return new_item(cJSON_Object);
+}
+
+cJSON_bool cJSON_AddItemToArray(cJSON *array, cJSON *item){
+    cJSON *last;
+    if(array == NULL || item == NULL || array == item)
+        return 0;
+    if(array->child == NULL){
+        array->child = item;
+        item->prev = item;
+        item->next = NULL;
+    }else{
+        /* The head's prev points at the last item */
+        last = array->child->prev;
+        last->next = item;
+        item->prev = last;
+        array->child->prev = item;
+    }
+    return 1;
+}
+
+cJSON_bool cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item){
+    char *key;
+    if(object == NULL || string == NULL || item == NULL || object == item)
+        return 0;
+    if((key = copy_string(string)) == NULL)
+        return 0;
+    free(item->string);
+    item->string = key;
+    return cJSON_AddItemToArray(object, item);
+}
+
+static cJSON *add_to_object(cJSON *object, const char *name, cJSON *item){
+    if(cJSON_AddItemToObject(object, name, item))
+        return item;
+    cJSON_Delete(item);
+    return NULL;
+}
+
+cJSON *cJSON_AddNullToObject(cJSON *object, const char *name){
+    return add_to_object(object, name, cJSON_CreateNull());
+}
+
+cJSON *cJSON_AddTrueToObject(cJSON *object, const char *name){
+    return add_to_object(object, name, cJSON_CreateTrue());
+}
+
+cJSON *cJSON_AddFalseToObject(cJSON *object, const char *name){
+    return add_to_object(object, name, cJSON_CreateFalse());
+}
+
+cJSON *cJSON_AddBoolToObject(cJSON *object, const char *name, cJSON_bool boolean){
+    return add_to_object(object, name, cJSON_CreateBool(boolean));
+}
+
+cJSON *cJSON_AddNumberToObject(cJSON *object, const char *name, double number){
+    return add_to_object(object, name, cJSON_CreateNumber(number));
+}
+
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *string){
+    return add_to_object(object, name, cJSON_CreateString(string));
+}
+
+cJSON *cJSON_AddObjectToObject(cJSON *object, const char *name){
+    return add_to_object(object, name, cJSON_CreateObject());
+}
+
+cJSON *cJSON_AddArrayToObject(cJSON *object, const char *name){
+    return add_to_object(object, name, cJSON_CreateArray());
+}
+
+/* ========== Lookups */
+
+int cJSON_GetArraySize(const cJSON *array){
+    cJSON *child;
+    int size = 0;
+    if(array == NULL)
+        return 0;
+    for(child = array->child; child != NULL; child = child->next)
+        size++;
+    return size;
+}
+
+cJSON *cJSON_GetArrayItem(const cJSON *array, int index){
+    cJSON *child;
+    if(array == NULL || index < 0)
+        return NULL;
+    for(child = array->child; child != NULL && index > 0; child = child->next)
+        index--;
+    return child;
+}
+
+static int compare_names(const char *a, const char *b, int case_sensitive){
+    if(case_sensitive)
+        return strcmp(a, b);
+    for(; tolower((unsigned char)*a) == tolower((unsigned char)*b); a++, b++){
+        if(*a == 0)
+            return 0;
+    }
+    return tolower((unsigned char)*a) - tolower((unsigned char)*b);
+}
+
+static cJSON *get_object_item(const cJSON *object, const char *name, int case_sensitive){
+    cJSON *child;
+    if(object == NULL || name == NULL)
+        return NULL;
+    for(child = object->child; child != NULL; child = child->next){
+        if(child->string != NULL && compare_names(name, child->string, case_sensitive) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string){
+    return get_object_item(object, string, 0);
+}
+
+cJSON *cJSON_GetObjectItemCaseSensitive(const cJSON *object, const char *string){
+    return get_object_item(object, string, 1);
+}
+
+void cJSON_DeleteItemFromObject(cJSON *object, const char *string){
+    cJSON *item = get_object_item(object, string, 0);
+    if(item == NULL)
+        return;
+    if(item == object->child){
+        object->child = item->next;
+        if(item->next != NULL)
+            item->next->prev = item->prev;
+    }else{
+        item->prev->next = item->next;
+        if(item->next != NULL)
+            item->next->prev = item->prev;
+        else
+            object->child->prev = item->prev;
+    }
+    item->next = NULL;
+    item->prev = NULL;
+    cJSON_Delete(item);
+}
+
+cJSON_bool cJSON_IsString(const cJSON *item){
+    return item != NULL && (item->type & 0xff) == cJSON_String;
+}
+
+cJSON_bool cJSON_IsNumber(const cJSON *item){
+    return item != NULL && (item->type & 0xff) == cJSON_Number;
+}
+
+cJSON_bool cJSON_IsObject(const cJSON *item){
+    return item != NULL && (item->type & 0xff) == cJSON_Object;
+}
+
+cJSON_bool cJSON_IsArray(const cJSON *item){
+    return item != NULL && (item->type & 0xff) == cJSON_Array;
+}
+
+/* ========== Unformatted printing */
+
+static void append(struct print_buffer *p, const char *str, size_t len){
+    if(p->failed)
+        return;
+    if(p->used + len + 1 > p->len){
+        size_t newlen = (p->used + len + 1) * 2;
+        char *newbuf = realloc(p->buf, newlen);
+        if(newbuf == NULL){
+            p->failed = 1;
+            return;
+        }
+        p->buf = newbuf;
+        p->len = newlen;
+    }
+    memcpy(p->buf + p->used, str, len);
+    p->used += len;
+    p->buf[p->used] = 0;
+}
+
+static void print_number(struct print_buffer *p, const cJSON *item){
+    char number[26];
+    double d = item->valuedouble, test = 0;
+
+    if(isnan(d) || isinf(d))
+        snprintf(number, sizeof(number), "null");
+    else if(d == (double)item->valueint)
+        snprintf(number, sizeof(number), "%d", item->valueint);
+    else{
+        /* 15 digits unless that does not survive the round trip */
+        snprintf(number, sizeof(number), "%1.15g", d);
+        if(sscanf(number, "%lg", &test) != 1 || fabs(test - d) > (fabs(test) > fabs(d) ? fabs(test) : fabs(d)) * DBL_EPSILON)
+            snprintf(number, sizeof(number), "%1.17g", d);
+    }
+    append(p, number, strlen(number));
+}
+
+static void print_string(struct print_buffer *p, const char *str){
+    const unsigned char *ptr;
+    char escape[8];
+
+    append(p, "\"", 1);
+    for(ptr = (const unsigned char *)(str != NULL ? str : ""); *ptr != 0; ptr++){
+        switch(*ptr){
+        case '"':
+            append(p, "\\\"", 2);
+            break;
+        case '\\':
+            append(p, "\\\\", 2);
+            break;
+        case '\b':
+            append(p, "\\b", 2);
+            break;
+        case '\f':
+            append(p, "\\f", 2);
+            break;
+        case '\n':
+            append(p, "\\n", 2);
+            break;
+        case '\r':
+            append(p, "\\r", 2);
+            break;
+        case '\t':
+            append(p, "\\t", 2);
+            break;
+        default:
+            if(*ptr < 32){
+                snprintf(escape, sizeof(escape), "\\u%04x", *ptr);
+                append(p, escape, 6);
+            }else{
+                append(p, (const char *)ptr, 1);
+            }
+        }
+    }
+    append(p, "\"", 1);
+}
+
+static void print_value(struct print_buffer *p, const cJSON *item){
+    const cJSON *child;
+
+    switch(item->type & 0xff){
+    case cJSON_NULL:
+        append(p, "null", 4);
+        break;
+    case cJSON_False:
+        append(p, "false", 5);
+        break;
+    case cJSON_True:
+        append(p, "true", 4);
+        break;
+    case cJSON_Number:
+        print_number(p, item);
+        break;
+    case cJSON_Raw:
+        if(item->valuestring != NULL)
+            append(p, item->valuestring, strlen(item->valuestring));
+        break;
+    case cJSON_String:
+        print_string(p, item->valuestring);
+        break;
+    case cJSON_Array:
+        append(p, "[", 1);
+        for(child = item->child; child != NULL; child = child->next){
+            print_value(p, child);
+            if(child->next != NULL)
+                append(p, ",", 1);
+        }
+        append(p, "]", 1);
+        break;
+    case cJSON_Object:
+        append(p, "{", 1);
+        for(child = item->child; child != NULL; child = child->next){
+            print_string(p, child->string);
+            append(p, ":", 1);
+            print_value(p, child);
+            if(child->next != NULL)
+                append(p, ",", 1);
+        }
+        append(p, "}", 1);
+        break;
+    default:
+        p->failed = 1;
+    }
+}
+
+char *cJSON_PrintUnformatted(const cJSON *item){
+    struct print_buffer p = { .buf = NULL, .len = 0, .used = 0, .failed = 0 };
+    if(item == NULL)
+        return NULL;
+    append(&p, "", 0);
+    print_value(&p, item);
+    if(p.failed){
+        free(p.buf);
+        return NULL;
+    }
+    return p.buf;
+}
+
+/* ========== Parsing */
+
+static cJSON *parse_value(struct parse_buffer *in, int depth);
+
+static void skip_whitespace(struct parse_buffer *in){
+    while(in->offset < in->length && (unsigned char)in->content[in->offset] <= 32)
+        in->offset++;
+}
+
+static int peek(struct parse_buffer *in){
+    return in->offset < in->length ? (unsigned char)in->content[in->offset] : -1;
+}
+
+static int match(struct parse_buffer *in, const char *word){
+    size_t len = strlen(word);
+    if(in->length - in->offset < len || strncmp(in->content + in->offset, word, len) != 0)
+        return 0;
+    in->offset += len;
+    return 1;
+}
+
+static int parse_hex4(const char *str, unsigned int *value){
+    int i;
+    *value = 0;
+    for(i = 0; i < 4; i++){
+        *value <<= 4;
+        if(str[i] >= '0' && str[i] <= '9')
+            *value |= str[i] - '0';
+        else if(str[i] >= 'a' && str[i] <= 'f')
+            *value |= str[i] - 'a' + 10;
+        else if(str[i] >= 'A' && str[i] <= 'F')
+            *value |= str[i] - 'A' + 10;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+/* A JSON string to a new NUL terminated UTF-8 string */
+static char *parse_string(struct parse_buffer *in){
+    size_t start, end, out = 0;
+    char *str;
+
+    if(peek(in) != '"')
+        return NULL;
+    start = ++in->offset;
+    for(end = start; end < in->length && in->content[end] != '"'; end++){
+        if(in->content[end] == '\\')
+            end++;
+    }
+    if(end >= in->length)
+        return NULL;
+    /* Escapes only ever shrink the string */
+    if((str = malloc(end - start + 1)) == NULL)
+        return NULL;
+    while(in->offset < end){
+        char c = in->content[in->offset++];
+        unsigned int code, low;
+        if(c != '\\'){
+            str[out++] = c;
+            continue;
+        }
+        c = in->content[in->offset++];
+        switch(c){
+        case 'b': str[out++] = '\b'; break;
+        case 'f': str[out++] = '\f'; break;
+        case 'n': str[out++] = '\n'; break;
+        case 'r': str[out++] = '\r'; break;
+        case 't': str[out++] = '\t'; break;
+        case '"': case '\\': case '/': str[out++] = c; break;
+        case 'u':
+            if(end - in->offset < 4 || parse_hex4(in->content + in->offset, &code) == 0)
+                goto fail;
+            in->offset += 4;
+            /* A surrogate pair */
+            if(code >= 0xd800 && code <= 0xdbff){
+                if(end - in->offset < 6 || in->content[in->offset] != '\\' || in->content[in->offset + 1] != 'u' ||
+                   parse_hex4(in->content + in->offset + 2, &low) == 0 || low < 0xdc00 || low > 0xdfff)
+                    goto fail;
+                in->offset += 6;
+                code = 0x10000 + (((code & 0x3ff) << 10) | (low & 0x3ff));
+            }else if(code >= 0xdc00 && code <= 0xdfff){
+                goto fail;
+            }
+            if(code < 0x80){
+                str[out++] = code;
+            }else if(code < 0x800){
+                str[out++] = 0xc0 | (code >> 6);
+                str[out++] = 0x80 | (code & 0x3f);
+            }else if(code < 0x10000){
+                str[out++] = 0xe0 | (code >> 12);
+                str[out++] = 0x80 | ((code >> 6) & 0x3f);
+                str[out++] = 0x80 | (code & 0x3f);
+            }else{
+                str[out++] = 0xf0 | (code >> 18);
+                str[out++] = 0x80 | ((code >> 12) & 0x3f);
+                str[out++] = 0x80 | ((code >> 6) & 0x3f);
+                str[out++] = 0x80 | (code & 0x3f);
+            }
+            break;
+        default:
+            goto fail;
+        }
+    }
+    str[out] = 0;
+    in->offset = end + 1;
+    return str;
+fail:
+    free(str);
+    return NULL;
+}
+
+static cJSON *parse_number(struct parse_buffer *in){
+    char number[64];
+    size_t len = 0;
+    char *endptr;
+    double d;
+
+    while(in->offset + len < in->length && len < sizeof(number) - 1 &&
+          strchr("0123456789+-eE.", in->content[in->offset + len]) != NULL){
+        number[len] = in->content[in->offset + len];
+        len++;
+    }
+    number[len] = 0;
+    d = strtod(number, &endptr);
+    if(endptr == number)
+        return NULL;
+    in->offset += endptr - number;
+    return cJSON_CreateNumber(d);
+}
+
+static cJSON *parse_container(struct parse_buffer *in, int depth, int type){
+    cJSON *item = new_item(type), *child;
+    char close = type == cJSON_Object ? '}' : ']';
+    char *name = NULL;
+
+    if(item == NULL)
+        return NULL;
+    in->offset++;
+    skip_whitespace(in);
+    if(peek(in) == close){
+        in->offset++;
+        return item;
+    }
+    while(1){
+        skip_whitespace(in);
+        if(type == cJSON_Object){
+            if((name = parse_string(in)) == NULL)
+                goto fail;
+            skip_whitespace(in);
+            if(peek(in) != ':')
+                goto fail;
+            in->offset++;
+        }
+        if((child = parse_value(in, depth + 1)) == NULL)
+            goto fail;
+        child->string = name;
+        name = NULL;
+        cJSON_AddItemToArray(item, child);
+        skip_whitespace(in);
+        if(peek(in) == ','){
+            in->offset++;
+            continue;
+        }
+        if(peek(in) != close)
+            goto fail;
+        in->offset++;
+        return item;
+    }
+fail:
+    free(name);
+    cJSON_Delete(item);
+    return NULL;
+}
+
+static cJSON *parse_value(struct parse_buffer *in, int depth){
+    cJSON *item;
+    char *str;
+
+    if(depth > 1000)
+        return NULL;
+    skip_whitespace(in);
+    switch(peek(in)){
+    case 'n':
+        return match(in, "null") ? cJSON_CreateNull() : NULL;
+    case 'f':
+        return match(in, "false") ? cJSON_CreateFalse() : NULL;
+    case 't':
+        return match(in, "true") ? cJSON_CreateTrue() : NULL;
+    case '"':
+        if((str = parse_string(in)) == NULL || (item = new_item(cJSON_String)) == NULL){
+            free(str);
+            return NULL;
+        }
+        item->valuestring = str;
+        return item;
+    case '[':
+        return parse_container(in, depth, cJSON_Array);
+    case '{':
+        return parse_container(in, depth, cJSON_Object);
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        return parse_number(in);
+    default:
+        return NULL;
+    }
+}
+
+cJSON *cJSON_ParseWithLength(const char *value, size_t buffer_length){
+    struct parse_buffer in = { .content = value, .length = buffer_length, .offset = 0 };
+    if(value == NULL || buffer_length == 0)
+        return NULL;
+    return parse_value(&in, 0);
+}
+
+cJSON *cJSON_Parse(const char *value){
+    if(value == NULL)
+        return NULL;
+    return cJSON_ParseWithLength(value, strlen(value) + 1);
+}
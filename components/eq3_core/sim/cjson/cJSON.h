@@ -0,0 +1,76 @@
+#ifndef cJSON__h
+#define cJSON__h
+
+/*
+ * The part of the cJSON API used by main/, for host builds without the ESP-IDF json component
+ *
+ * Only used when neither $IDF_PATH/components/json/cJSON nor a system libcjson is found. The
+ * unformatted printer follows cJSON 1.7: members in insertion order, no whitespace, numbers with
+ * an integer value printed with %d, others with %1.15g unless that does not read back the same
+ * double (then %1.17g), and the same string escapes. Lookups by name ignore case as in cJSON.
+ */
+
+#include <stddef.h>
+
+#define cJSON_Invalid (0)
+#define cJSON_False  (1 << 0)
+#define cJSON_True   (1 << 1)
+#define cJSON_NULL   (1 << 2)
+#define cJSON_Number (1 << 3)
+#define cJSON_String (1 << 4)
+#define cJSON_Array  (1 << 5)
+#define cJSON_Object (1 << 6)
+#define cJSON_Raw    (1 << 7)
+
+typedef int cJSON_bool;
+
+typedef struct cJSON {
+    struct cJSON *next;
+    struct cJSON *prev;
+    struct cJSON *child;
+    int type;
+    char *valuestring;
+    int valueint;
+    double valuedouble;
+    char *string;
+} cJSON;
+
+cJSON *cJSON_Parse(const char *value);
+cJSON *cJSON_ParseWithLength(const char *value, size_t buffer_length);
+char *cJSON_PrintUnformatted(const cJSON *item);
+void cJSON_Delete(cJSON *item);
+void cJSON_free(void *object);
+
+int cJSON_GetArraySize(const cJSON *array);
+cJSON *cJSON_GetArrayItem(const cJSON *array, int index);
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string);
+cJSON *cJSON_GetObjectItemCaseSensitive(const cJSON *object, const char *string);
+
+cJSON_bool cJSON_IsString(const cJSON *item);
+cJSON_bool cJSON_IsNumber(const cJSON *item);
+cJSON_bool cJSON_IsObject(const cJSON *item);
+cJSON_bool cJSON_IsArray(const cJSON *item);
+
+cJSON *cJSON_CreateNull(void);
+cJSON *cJSON_CreateTrue(void);
+cJSON *cJSON_CreateFalse(void);
+cJSON *cJSON_CreateBool(cJSON_bool boolean);
+cJSON *cJSON_CreateNumber(double num);
+cJSON *cJSON_CreateString(const char *string);
+cJSON *cJSON_CreateArray(void);
+cJSON *cJSON_CreateObject(void);
+
+cJSON_bool cJSON_AddItemToArray(cJSON *array, cJSON *item);
+cJSON_bool cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item);
+void cJSON_DeleteItemFromObject(cJSON *object, const char *string);
+
+cJSON *cJSON_AddNullToObject(cJSON *object, const char *name);
+cJSON *cJSON_AddTrueToObject(cJSON *object, const char *name);
+cJSON *cJSON_AddFalseToObject(cJSON *object, const char *name);
+cJSON *cJSON_AddBoolToObject(cJSON *object, const char *name, cJSON_bool boolean);
+cJSON *cJSON_AddNumberToObject(cJSON *object, const char *name, double number);
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *string);
+cJSON *cJSON_AddObjectToObject(cJSON *object, const char *name);
+cJSON *cJSON_AddArrayToObject(cJSON *object, const char *name);
+
+#endif
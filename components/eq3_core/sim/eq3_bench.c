@@ -0,0 +1,352 @@
+/*
+ * Command throughput and latency benchmarks
+ *
+ *   eq3_bench -o bench.json
+ *
+ * runs a fixed set of scenarios against the simulated fleet in virtual time and writes one JSON
+ * object per scenario. Commands go in through the mqtt topic parser (<id>radin/trv/<address>/
+ * settemp) exactly as they arrive on the hub, so the figures cover the whole path from an mqtt
+ * message to the status report. The same seed always gives the same results - diff the output
+ * of two versions to see what changed.
+ *
+ * Per command the queue wait runs from the mqtt message to the first open of a session for its
+ * valve and the latency to its status (or error) report. A retry that was requeued behind a later
+ * command for the same valve is matched in arrival order, which is what the hub's user sees. *
+ * capacity_per_min is the commands reported per minute the scheduler was busy (a session running
+ * or commands queued) and peak_queue the most commands outstanding at once. A scenario whose
+ * queue held more than a minute of work is "saturated": its waits measure the length of the
+ * burst as much as the scheduler. burst and slider are meant to be - compare their waits against
+ * peak_queue / capacity_per_min, not against the other scenarios.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+#include "eq3_hal_linux.h"
+#include "eq3_sim.h"
+
+#define BENCH_TAG "EQ3_BENCH"
+
+/* Fewer than the 49 temperatures a valve cycles through - see eq3_simfleet.c */
+#define MAX_PENDING 48
+#define MAX_ARRIVALS 4096
+
+struct arrival {
+    int64_t at;
+    int valve;
+};
+
+struct valve_pending {
+    int64_t submitted[MAX_PENDING];
+    bool started[MAX_PENDING];
+    int head;
+    int count;
+    int sent;
+};
+
+struct scenario {
+    const char *name;
+    const char *description;
+    int valves;
+    int dead_valve;             /* Valve that never answers or -1 */
+    int scan_interval_s;        /* A 30s scan this often or 0 */
+    int (*arrivals)(struct arrival *list, int valves);
+};
+
+static struct valve_pending pending[EQ3_SIM_MAX_VALVES];
+static struct arrival arrivals[MAX_ARRIVALS];
+static int64_t waits[MAX_ARRIVALS], latencies[MAX_ARRIVALS];
+static int waited, completed, failed;
+static struct eq3_linux_ble sim_ble;
+
+/* One command to every valve, three times a quarter of an hour apart */
+static int burst_arrivals(struct arrival *list, int valves){
+    int count = 0, round, n;
+    for(round = 0; round < 3; round++){
+        for(n = 0; n < valves; n++){
+            list[count].at = (int64_t)round * 900 * 1000000;
+            list[count++].valve = n;
+        }
+    }
+    return count;
+}
+
+/* A thermostat slider dragged across its range - 20 changes to one valve in 5s, every 5 minutes,
+ * with the other valves polled in the background */
+static int slider_arrivals(struct arrival *list, int valves){
+    int count = 0, round, step, n;
+    for(round = 0; round < 6; round++){
+        for(step = 0; step < 20; step++){
+            list[count].at = ((int64_t)round * 300 * 1000 + step * 250) * 1000;
+            list[count++].valve = 0;
+        }
+        for(n = 1; n < valves; n++){
+            list[count].at = ((int64_t)round * 300 + 60 + n * 10) * 1000000;
+            list[count++].valve = n;
+        }
+    }
+    return count;
+}
+
+/* Every valve polled every 5 minutes for two hours, start times spread out */
+static int poll_arrivals(struct arrival *list, int valves){
+    int count = 0, round, n;
+    for(n = 0; n < valves; n++){
+        int64_t offset = (int64_t)(eq3_sim_random() % 300000) * 1000;
+        for(round = 0; round < 24; round++){
+            list[count].at = offset + (int64_t)round * 300 * 1000000;
+            list[count++].valve = n;
+        }
+    }
+    return count;
+}
+
+/* A command to a random valve every 20s for an hour */
+static int random_arrivals(struct arrival *list, int valves){
+    int count;
+    for(count = 0; count < 180; count++){
+        list[count].at = (int64_t)count * 20 * 1000000;
+        list[count].valve = eq3_sim_random() % valves;
+    }
+    return count;
+}
+
+static const struct scenario scenarios[] = {
+    { "burst", "one command to each of 40 valves at once, 3 times", 40, -1, 0, burst_arrivals },
+    { "slider", "20 changes to one valve in 5s every 5 minutes, 9 other valves polled", 10, -1, 0, slider_arrivals },
+    { "dead_valve", "10 valves polled every 5 minutes for 2 hours, one out of range", 10, 3, 0, poll_arrivals },
+    { "scan_mix", "command to one of 20 valves every 20s for an hour, 30s scan every 2 minutes", 20, -1, 120, random_arrivals },
+};
+
+static int arrival_order(const void *a, const void *b){
+    const struct arrival *aa = a, *ab = b;
+    if(aa->at != ab->at)
+        return aa->at < ab->at ? -1 : 1;
+    return aa->valve - ab->valve;
+}
+
+static int cmp_time(const void *a, const void *b){
+    int64_t la = *(const int64_t *)a, lb = *(const int64_t *)b;
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+static double percentile_ms(int64_t *sorted, int count, int pct){
+    int idx;
+    if(count == 0)
+        return 0;
+    idx = (count * pct + 99) / 100 - 1;
+    return sorted[idx < 0 ? 0 : idx] / 1000.0;
+}
+
+/* The first session opened for a valve starts its oldest waiting command */
+static void bench_open(const uint8_t *bda){
+    int n = eq3_sim_find(bda);
+    int idx;
+    if(n >= 0){
+        struct valve_pending *vp = &pending[n];
+        for(idx = 0; idx < vp->count; idx++){
+            int slot = (vp->head + idx) % MAX_PENDING;
+            if(vp->started[slot] == false){
+                vp->started[slot] = true;
+                waits[waited++] = eq3_hal_time_us() - vp->submitted[slot];
+                break;
+            }
+        }
+    }
+    sim_ble.open(bda);
+}
+
+static void report(const char *mac_addr, const char *json){
+    unsigned int b[6];
+    uint8_t bda[6];
+    int n, idx;
+    struct valve_pending *vp;
+
+    if(sscanf(mac_addr, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return;
+    for(idx = 0; idx < 6; idx++)
+        bda[idx] = b[idx];
+    if((n = eq3_sim_find(bda)) < 0 || pending[n].count == 0)
+        return;
+    vp = &pending[n];
+    latencies[completed + failed] = eq3_hal_time_us() - vp->submitted[vp->head];
+    vp->head = (vp->head + 1) % MAX_PENDING;
+    vp->count--;
+    if(strstr(json, "\"error\"") != NULL)
+        failed++;
+    else
+        completed++;
+}
+
+/* Publish <id>radin/trv/<address>/settemp to the hub */
+static bool submit(int n){
+    struct valve_pending *vp = &pending[n];
+    char topic[80], payload[8], addr[20], cmd[EQ3_TOPIC_CMD_MAX];
+    int halfdegrees, slot;
+
+    if(vp->count == MAX_PENDING)
+        return false;
+    halfdegrees = 10 + (vp->sent++ % 49);
+    eq3_sim_address(n, addr, sizeof(addr));
+    snprintf(topic, sizeof(topic), "benchradin/trv/%s/settemp", addr);
+    snprintf(payload, sizeof(payload), "%d.%d", halfdegrees / 2, halfdegrees & 1 ? 5 : 0);
+    slot = (vp->head + vp->count) % MAX_PENDING;
+    vp->submitted[slot] = eq3_hal_time_us();
+    vp->started[slot] = false;
+    vp->count++;
+    if(eq3_topic_command(topic, payload, strlen(payload), cmd, sizeof(cmd)) != 0 || handle_request(cmd) != 0){
+        vp->count--;
+        return false;
+    }
+    return true;
+}
+
+static int run_scenario(const struct scenario *sc, uint32_t seed, FILE *out, bool last){
+    struct eq3_sim_config config;
+    struct eq3_sim_stats stats;
+    struct eq3_linux_ble hooks;
+    int count, sent = 0, next = 0, total, peak_queue = 0;
+    int64_t next_scan = -1, end = 0, busy = 0;
+    double capacity;
+
+    eq3_sim_default_config(&config);
+    config.valves = sc->valves;
+    config.out_of_range_pct = 0;
+    config.seed = seed;
+    eq3_linux_set_virtual_time(true);
+    if(eq3_sim_init(&config) != 0)
+        return -1;
+    eq3_sim_set_in_range(sc->dead_valve, false);
+    eq3_linux_get_ble(&sim_ble);
+    memcpy(&hooks, &sim_ble, sizeof(hooks));
+    hooks.open = bench_open;
+    eq3_linux_set_ble(&hooks);
+    eq3_linux_set_report(report);
+
+    memset(pending, 0, sizeof(pending));
+    waited = completed = failed = 0;
+    count = sc->arrivals(arrivals, sc->valves);
+    qsort(arrivals, count, sizeof(struct arrival), arrival_order);
+    if(sc->scan_interval_s > 0)
+        next_scan = 0;
+
+    /* Run until every command is reported and the scheduler has gone quiet */
+    while(1){
+        int64_t wake, due, before;
+        bool idle;
+
+        while(next < count && arrivals[next].at <= eq3_hal_time_us()){
+            if(submit(arrivals[next].valve))
+                sent++;
+            next++;
+        }
+        if(sent - completed - failed > peak_queue)
+            peak_queue = sent - completed - failed;
+        if(next_scan >= 0 && next_scan <= eq3_hal_time_us()){
+            eq3_sim_scan(30000);
+            next_scan = next < count ? next_scan + (int64_t)sc->scan_interval_s * 1000000 : -1;
+        }
+        eq3_linux_run_timer();
+        due = eq3_sim_run();
+
+        total = completed + failed;
+        if(next == count && total >= sent && end == 0)
+            end = eq3_hal_time_us();
+        wake = next < count ? arrivals[next].at : -1;
+        if(next_scan >= 0 && (wake < 0 || next_scan < wake))
+            wake = next_scan;
+        if(due >= 0 && (wake < 0 || due < wake))
+            wake = due;
+        if(eq3_linux_timer_due() >= 0 && (wake < 0 || eq3_linux_timer_due() < wake))
+            wake = eq3_linux_timer_due();
+        if(wake < 0)
+            break;
+        idle = eq3_sched_idle();
+        before = eq3_hal_time_us();
+        eq3_linux_wait(wake);
+        if(idle == false)
+            busy += eq3_hal_time_us() - before;
+    }
+    total = completed + failed;
+    if(total < sent){
+        EQ3_LOGE(BENCH_TAG, "%s: scheduler stalled with %d of %d commands outstanding", sc->name, sent - total, sent);
+        end = eq3_hal_time_us();
+    }
+
+    eq3_sim_get_stats(&stats);
+    qsort(waits, waited, sizeof(int64_t), cmp_time);
+    qsort(latencies, total, sizeof(int64_t), cmp_time);
+    capacity = busy > 0 ? total * 60000000.0 / busy : 0;
+    /* One line per scenario so a diff of two runs shows the scenarios that moved */
+    fprintf(out, "    {\"scenario\":\"%s\",\"description\":\"%s\",\"valves\":%d,\"commands\":%d,\"ok\":%d,\"failed\":%d,"
+                 "\"duration_s\":%.1f,\"commands_per_min\":%.2f,\"capacity_per_min\":%.2f,\"peak_queue\":%d,"
+                 "\"saturated\":%s,\"queue_wait_ms\":{\"p50\":%.0f,\"p99\":%.0f},"
+                 "\"latency_ms\":{\"p50\":%.0f,\"p99\":%.0f,\"max\":%.0f},\"retries_per_success\":%.3f,"
+                 "\"ble_session_s_per_command\":%.2f,\"opens\":%d,\"open_failures\":%d,\"drops\":%d,"
+                 "\"scans\":%d,\"scans_preempted\":%d,\"scan_holds\":%d}%s\n",
+            sc->name, sc->description, sc->valves, sent, completed, failed,
+            end / 1000000.0, end > 0 ? total * 60000000.0 / end : 0,
+            capacity, peak_queue, peak_queue > capacity ? "true" : "false",
+            percentile_ms(waits, waited, 50), percentile_ms(waits, waited, 99),
+            percentile_ms(latencies, total, 50), percentile_ms(latencies, total, 99), total > 0 ? latencies[total - 1] / 1000.0 : 0,
+            completed > 0 ? (double)(stats.opens - total) / completed : 0,
+            total > 0 ? stats.session_us / 1000000.0 / total : 0,
+            stats.opens, stats.open_failures, stats.drops, stats.scans, stats.scans_preempted, stats.scan_holds, last ? "" : ",");
+    return total < sent ? -1 : 0;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-o output file] [-r scenario] [-s seed] [-l (list scenarios)] [-q | -v]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    const char *only = NULL, *out_path = NULL;
+    uint32_t seed = 1;
+    FILE *out = stdout;
+    int opt, idx, last = -1, rc = 0;
+    int nscenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+
+    while((opt = getopt(argc, argv, "o:r:s:lqv")) != -1){
+        switch(opt){
+        case 'o': out_path = optarg; break;
+        case 'r': only = optarg; break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'l':
+            for(idx = 0; idx < nscenarios; idx++)
+                printf("%-12s %s\n", scenarios[idx].name, scenarios[idx].description);
+            return 0;
+        case 'q': eq3_hal_log_level = 0; break;
+        case 'v': eq3_hal_log_level = 2; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    for(idx = 0; idx < nscenarios; idx++){
+        if(only == NULL || strcmp(only, scenarios[idx].name) == 0)
+            last = idx;
+    }
+    if(last < 0){
+        usage(argv[0]);
+        return 1;
+    }
+    if(out_path != NULL && (out = fopen(out_path, "w")) == NULL){
+        perror(out_path);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"seed\":%u,\n  \"scenarios\":[\n", (unsigned)seed);
+    for(idx = 0; idx <= last; idx++){
+        if(only == NULL || strcmp(only, scenarios[idx].name) == 0){
+            if(run_scenario(&scenarios[idx], seed, out, idx == last) != 0)
+                rc = 1;
+        }
+    }
+    fprintf(out, "  ]\n}\n");
+    if(out != stdout)
+        fclose(out);
+    return rc;
+}
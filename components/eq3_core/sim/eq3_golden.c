@@ -0,0 +1,378 @@
+/*
+ * Golden output of the status, device list and Home Assistant discovery encoders
+ *
+ *   eq3_golden -o golden        write every output to golden/<case>.json and golden/<case>.cbor
+ *   eq3_golden -c golden        compare every output byte for byte with the files in golden
+ *   eq3_golden -n 100000        time each encoder over the cases, one JSON object per encoder
+ *
+ * The cases are fixed notifications and device lists covering every mode bit, the temperature
+ * and offset limits, short notifications and empty and full device lists - the documents Home
+ * Assistant and the other subscribers parse. Write the golden files with the version before a
+ * change to an encoder and compare with the version after it: any difference is a change to
+ * what is published.
+ *
+ * The discovery payloads come from main/eq3_ha_discovery.c built on the host twice, for a hub on
+ * its own and for one sharing valves (CONFIG_EQ3_MULTI_HUB), with cJSON printing them as
+ * eq3_wifi.c does. The station address is the fixed one of the host shims.
+ *
+ * The timings count the allocations made in the encoders (malloc, calloc and realloc are wrapped
+ * at link time) as well as the time per document.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eq3_hal.h"
+#include "eq3_status.h"
+#include "cJSON.h"
+
+#define GOLDEN_MAX_OUTPUT 4096
+
+struct status_case {
+    const char *name;
+    uint8_t notify[16];
+    int len;
+};
+
+/* PROP_INFO_RETURN notifications: 02 01 mode valve 04 temp [holiday end 4 bytes, window 2, comfort, eco, offset] */
+static const struct status_case status_cases[] = {
+    { "status_auto", { 0x02, 0x01, 0x08, 0x00, 0x04, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_manual", { 0x02, 0x01, 0x09, 0x40, 0x04, 0x2b, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_holiday", { 0x02, 0x01, 0x0a, 0x10, 0x04, 0x22, 0x1f, 0x15, 0x0c, 0x24, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_boost", { 0x02, 0x01, 0x0c, 0x50, 0x04, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_window", { 0x02, 0x01, 0x18, 0x00, 0x04, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_locked", { 0x02, 0x01, 0x29, 0x20, 0x04, 0x28, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_low_battery", { 0x02, 0x01, 0x88, 0x00, 0x04, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_all_bits", { 0x02, 0x01, 0xff, 0x64, 0x04, 0x3b, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_off", { 0x02, 0x01, 0x09, 0x00, 0x04, 0x09, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_on", { 0x02, 0x01, 0x09, 0x64, 0x04, 0x3c, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x07 }, 15 },
+    { "status_offset_min", { 0x02, 0x01, 0x08, 0x00, 0x04, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x00 }, 15 },
+    { "status_offset_max", { 0x02, 0x01, 0x08, 0x00, 0x04, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x0e }, 15 },
+    { "status_offset_half", { 0x02, 0x01, 0x08, 0x00, 0x04, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x18, 0x03, 0x2a, 0x22, 0x04 }, 15 },
+    { "status_no_offset", { 0x02, 0x01, 0x08, 0x00, 0x04, 0x2a }, 6 },
+    { "status_mode_only", { 0x02, 0x01, 0x08 }, 3 },
+    { "status_empty", { 0x02, 0x01 }, 2 },
+};
+
+#define GOLDEN_MAX_DEVICES 8
+
+struct devlist_case {
+    const char *name;
+    int num;
+    struct eq3_devlist_entry devs[GOLDEN_MAX_DEVICES];
+};
+
+static const struct devlist_case devlist_cases[] = {
+    { "devlist_empty", 0, { { { 0 } } } },
+    { "devlist_one", 1, { { { 0x00, 0x1a, 0x22, 0x11, 0xe7, 0x20 }, -77 } } },
+    { "devlist_limits", 3, {
+        { { 0x00, 0x1a, 0x22, 0x00, 0x00, 0x00 }, -128 },
+        { { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, 0 },
+        { { 0x00, 0x1a, 0x22, 0x0a, 0xb0, 0x0c }, -9 } } },
+    { "devlist_full", 8, {
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x00 }, -40 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x01 }, -51 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x02 }, -62 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x03 }, -73 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x04 }, -84 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x05 }, -95 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x06 }, -100 },
+        { { 0x00, 0x1a, 0x22, 0x10, 0x00, 0x07 }, -105 } } },
+};
+
+/* Discovery of one valve by hubs with different mqtt ids */
+struct ha_case {
+    const char *name;
+    uint8_t mac[6];
+    const char *id;
+    bool multi_hub;
+};
+
+static const struct ha_case ha_cases[] = {
+    { "default", { 0x00, 0x1a, 0x22, 0x11, 0xe7, 0x20 }, "eq3_", false },
+    { "mqtt_id", { 0x00, 0x1a, 0x22, 0x0a, 0xb0, 0x0c }, "upstairs_", false },
+    { "multi_hub", { 0x00, 0x1a, 0x22, 0x11, 0xe7, 0x20 }, "hub2_", true },
+};
+
+/* main/eq3_ha_discovery.c for a hub on its own and for one sharing valves */
+void single_ha_discovery_refresh_url(void);
+cJSON *single_generate_ha_therm_payload(char mac[6], char *id);
+cJSON *single_generate_ha_valve_payload(char mac[6], char *id);
+cJSON *single_generate_ha_battery_payload(char mac[6], char *id);
+cJSON *single_generate_ha_device_payload(char mac[6], char *id);
+void multi_ha_discovery_refresh_url(void);
+cJSON *multi_generate_ha_therm_payload(char mac[6], char *id);
+cJSON *multi_generate_ha_valve_payload(char mac[6], char *id);
+cJSON *multi_generate_ha_battery_payload(char mac[6], char *id);
+cJSON *multi_generate_ha_device_payload(char mac[6], char *id);
+
+#define NUM_STATUS_CASES ((int)(sizeof(status_cases) / sizeof(status_cases[0])))
+#define NUM_DEVLIST_CASES ((int)(sizeof(devlist_cases) / sizeof(devlist_cases[0])))
+#define NUM_HA_CASES ((int)(sizeof(ha_cases) / sizeof(ha_cases[0])))
+
+static const uint8_t golden_bda[6] = { 0x00, 0x1a, 0x22, 0x11, 0xe7, 0x20 };
+#define GOLDEN_MAC "00:1A:22:11:E7:20"
+
+/* Allocations made through the wrapped allocators */
+static long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size){
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size){
+    allocs++;
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+/* The encoders - one output per case, returning its length or -1 */
+struct encoder {
+    const char *name;
+    const char *ext;
+    int cases;
+    const char *(*case_name)(int idx);
+    int (*encode)(int idx, uint8_t *buf, int len);
+};
+
+static const char *status_name(int idx){
+    return status_cases[idx].name;
+}
+
+static const char *devlist_name(int idx){
+    return devlist_cases[idx].name;
+}
+
+static int status_json(int idx, uint8_t *buf, int len){
+    struct eq3_status status;
+    eq3_decode_status((uint8_t *)status_cases[idx].notify, status_cases[idx].len, &status);
+    return eq3_status_to_json(&status, GOLDEN_MAC, (char *)buf, len);
+}
+
+static int status_cbor(int idx, uint8_t *buf, int len){
+    struct eq3_status status;
+    eq3_decode_status((uint8_t *)status_cases[idx].notify, status_cases[idx].len, &status);
+    return eq3_status_to_cbor(&status, (uint8_t *)golden_bda, buf, len);
+}
+
+static int devlist_json(int idx, uint8_t *buf, int len){
+    return eq3_devlist_to_json((struct eq3_devlist_entry *)devlist_cases[idx].devs, devlist_cases[idx].num, (char *)buf, len);
+}
+
+static int devlist_cbor(int idx, uint8_t *buf, int len){
+    return eq3_devlist_to_cbor((struct eq3_devlist_entry *)devlist_cases[idx].devs, devlist_cases[idx].num, buf, len);
+}
+
+/* Print a discovery payload as it is published, or -1 if it doesn't fit */
+static int ha_json(cJSON *(*single)(char mac[6], char *id), cJSON *(*multi)(char mac[6], char *id), int idx, uint8_t *buf, int len){
+    const struct ha_case *hc = &ha_cases[idx];
+    cJSON *root = (hc->multi_hub ? multi : single)((char *)hc->mac, (char *)hc->id);
+    char *payload = cJSON_PrintUnformatted(root);
+    int plen = payload != NULL ? strlen(payload) : -1;
+
+    if(plen > len)
+        plen = -1;
+    if(plen > 0)
+        memcpy(buf, payload, plen);
+    cJSON_free(payload);
+    cJSON_Delete(root);
+    return plen;
+}
+
+/* ha_<entity>_<case> */
+static const char *ha_name(const char *entity, int idx){
+    static char name[48];
+    snprintf(name, sizeof(name), "ha_%s_%s", entity, ha_cases[idx].name);
+    return name;
+}
+
+static const char *ha_climate_name(int idx){
+    return ha_name("climate", idx);
+}
+
+static const char *ha_valve_name(int idx){
+    return ha_name("valve", idx);
+}
+
+static const char *ha_battery_name(int idx){
+    return ha_name("battery", idx);
+}
+
+static const char *ha_device_name(int idx){
+    return ha_name("device", idx);
+}
+
+static int ha_climate_json(int idx, uint8_t *buf, int len){
+    return ha_json(single_generate_ha_therm_payload, multi_generate_ha_therm_payload, idx, buf, len);
+}
+
+static int ha_valve_json(int idx, uint8_t *buf, int len){
+    return ha_json(single_generate_ha_valve_payload, multi_generate_ha_valve_payload, idx, buf, len);
+}
+
+static int ha_battery_json(int idx, uint8_t *buf, int len){
+    return ha_json(single_generate_ha_battery_payload, multi_generate_ha_battery_payload, idx, buf, len);
+}
+
+static int ha_device_json(int idx, uint8_t *buf, int len){
+    return ha_json(single_generate_ha_device_payload, multi_generate_ha_device_payload, idx, buf, len);
+}
+
+static const struct encoder encoders[] = {
+    { "status_json", "json", NUM_STATUS_CASES, status_name, status_json },
+    { "status_cbor", "cbor", NUM_STATUS_CASES, status_name, status_cbor },
+    { "devlist_json", "json", NUM_DEVLIST_CASES, devlist_name, devlist_json },
+    { "devlist_cbor", "cbor", NUM_DEVLIST_CASES, devlist_name, devlist_cbor },
+    { "ha_climate_json", "json", NUM_HA_CASES, ha_climate_name, ha_climate_json },
+    { "ha_valve_json", "json", NUM_HA_CASES, ha_valve_name, ha_valve_json },
+    { "ha_battery_json", "json", NUM_HA_CASES, ha_battery_name, ha_battery_json },
+    { "ha_device_json", "json", NUM_HA_CASES, ha_device_name, ha_device_json },
+};
+
+#define NUM_ENCODERS ((int)(sizeof(encoders) / sizeof(encoders[0])))
+
+static int64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_output(const char *name, const char *ext, const uint8_t *buf, int len){
+    int idx;
+    printf("%s.%s ", name, ext);
+    if(strcmp(ext, "json") == 0){
+        fwrite(buf, 1, len, stdout);
+    }else{
+        for(idx = 0; idx < len; idx++)
+            printf("%02x", buf[idx]);
+    }
+    printf("\n");
+}
+
+static int write_output(const char *dir, const char *name, const char *ext, const uint8_t *buf, int len){
+    char path[512];
+    FILE *out;
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    if((out = fopen(path, "wb")) == NULL){
+        perror(path);
+        return -1;
+    }
+    fwrite(buf, 1, len, out);
+    fclose(out);
+    return 0;
+}
+
+/* 0 if the file holds exactly the output */
+static int compare_output(const char *dir, const char *name, const char *ext, const uint8_t *buf, int len){
+    char path[512];
+    uint8_t golden[GOLDEN_MAX_OUTPUT + 1];
+    FILE *in;
+    int golden_len, idx;
+
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    if((in = fopen(path, "rb")) == NULL){
+        printf("%s.%s: no golden file\n", name, ext);
+        return -1;
+    }
+    golden_len = fread(golden, 1, sizeof(golden), in);
+    fclose(in);
+    if(golden_len == len && memcmp(golden, buf, len) == 0)
+        return 0;
+    for(idx = 0; idx < len && idx < golden_len && golden[idx] == buf[idx]; idx++)
+        ;
+    printf("%s.%s: differs at byte %d (%d bytes, golden %d)\n", name, ext, idx, len, golden_len);
+    return -1;
+}
+
+/* Time the encoder over all its cases, iterations times */
+static void time_encoder(const struct encoder *enc, int iterations, bool last){
+    uint8_t buf[GOLDEN_MAX_OUTPUT];
+    long bytes = 0, start_allocs;
+    int64_t start;
+    int iter, idx;
+
+    for(idx = 0; idx < enc->cases; idx++)
+        bytes += enc->encode(idx, buf, sizeof(buf));
+    start_allocs = allocs;
+    start = now_ns();
+    for(iter = 0; iter < iterations; iter++){
+        for(idx = 0; idx < enc->cases; idx++)
+            enc->encode(idx, buf, sizeof(buf));
+    }
+    printf("    {\"encoder\":\"%s\",\"cases\":%d,\"bytes\":%ld,\"ns_per_doc\":%.1f,\"allocs_per_doc\":%.2f}%s\n",
+           enc->name, enc->cases, bytes, (double)(now_ns() - start) / ((double)iterations * enc->cases),
+           (double)(allocs - start_allocs) / ((double)iterations * enc->cases), last ? "" : ",");
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-o golden dir | -c golden dir | -n iterations] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    const char *write_dir = NULL, *compare_dir = NULL;
+    uint8_t buf[GOLDEN_MAX_OUTPUT];
+    int opt, enc, idx, len, iterations = 0, outputs = 0, differ = 0;
+
+    eq3_hal_log_level = 0;
+    while((opt = getopt(argc, argv, "o:c:n:v")) != -1){
+        switch(opt){
+        case 'o': write_dir = optarg; break;
+        case 'c': compare_dir = optarg; break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'v': eq3_hal_log_level = 2; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(write_dir != NULL && compare_dir != NULL){
+        usage(argv[0]);
+        return 1;
+    }
+    single_ha_discovery_refresh_url();
+    multi_ha_discovery_refresh_url();
+
+    if(iterations > 0){
+        printf("{\n  \"iterations\":%d,\n  \"encoders\":[\n", iterations);
+        for(enc = 0; enc < NUM_ENCODERS; enc++)
+            time_encoder(&encoders[enc], iterations, enc == NUM_ENCODERS - 1);
+        printf("  ]\n}\n");
+        return 0;
+    }
+
+    for(enc = 0; enc < NUM_ENCODERS; enc++){
+        for(idx = 0; idx < encoders[enc].cases; idx++){
+            const char *name = encoders[enc].case_name(idx);
+            if((len = encoders[enc].encode(idx, buf, sizeof(buf))) < 0){
+                printf("%s.%s: encoder failed\n", name, encoders[enc].ext);
+                differ++;
+                continue;
+            }
+            outputs++;
+            if(write_dir != NULL){
+                if(write_output(write_dir, name, encoders[enc].ext, buf, len) != 0)
+                    return 1;
+            }else if(compare_dir != NULL){
+                if(compare_output(compare_dir, name, encoders[enc].ext, buf, len) != 0)
+                    differ++;
+            }else{
+                print_output(name, encoders[enc].ext, buf, len);
+            }
+        }
+    }
+    if(write_dir != NULL)
+        printf("%d outputs written to %s\n", outputs, write_dir);
+    else if(compare_dir != NULL)
+        printf("%d outputs, %d differ from %s\n", outputs, differ, compare_dir);
+    return differ > 0 ? 1 : 0;
+}
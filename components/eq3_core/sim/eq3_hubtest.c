@@ -0,0 +1,406 @@
+/*
+ * Two hubs sharing one broker
+ *
+ *   eq3_hubtest              run every test
+ *   eq3_hubtest -r name      run one
+ *   eq3_hubtest -l           list the tests
+ *
+ * main/eq3_hubs.c is built twice (see CMakeLists.txt) with its entry points and the functions it
+ * calls renamed to hub_a_... and hub_b_..., so two independent hubs run in one process. A small
+ * broker in this file routes their publishes: retained messages, subscriptions with a trailing #,
+ * delivery to the publisher itself and the last will when a hub drops off. The rssi reports the
+ * hub task would send are published by the tests.
+ *
+ * The FreeRTOS mutexes of sim/idf check the lock order. Home Assistant discovery is modelled with
+ * its own lock held while it asks hub_owns(), the order the discovery task used to take them, so
+ * a hub calling back into discovery with hub_lock held shows up as a lock order error. Each hub
+ * also has the recursive lock of its esp-mqtt client: held while messages and the connect are
+ * handed to the hub, as the mqtt task does, and taken by every publish and subscribe - so the hub
+ * task publishing with hub_lock held is an error too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eq3_hal.h"
+#include "eq3_hal_linux.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "eq3_gap.h"
+#include "eq3_wifi.h"
+
+#define CHECK(cond, fmt, ...) do { if(!(cond)){ fprintf(stderr, "%s: " fmt "\n", test_name, ##__VA_ARGS__); return -1; } } while(0)
+
+#define HUB_TOPIC "eq3hub"
+#define MAX_SUBS 8
+#define MAX_RETAINED 16
+#define MAX_QUEUED 64
+#define MAX_EVENTS 8
+
+struct hubtest {
+    const char *name;
+    const char *description;
+    int (*run)(void);
+};
+
+struct test_hub {
+    const char *id;
+    bool connected;
+    char subs[MAX_SUBS][64];
+    int num_subs;
+    SemaphoreHandle_t discovery_lock;
+    SemaphoreHandle_t client_lock;  /* The esp-mqtt client's api lock */
+    int discoveries;                /* ha_discovery_force_device() calls */
+    /* The renamed entry points of this copy of eq3_hubs.c */
+    void (*init)(const char *id);
+    void (*connected_cb)(void);
+    bool (*message)(const char *topic, const char *data, int len);
+    bool (*owns)(uint8_t *bda);
+};
+
+struct message {
+    int to;
+    char topic[64];
+    char data[160];
+};
+
+static const char *test_name;
+static struct test_hub hubs[2];
+static struct { char topic[64]; char data[160]; } retained[MAX_RETAINED];
+static int num_retained;
+static struct message queue[MAX_QUEUED];
+static int queue_head, queue_len;
+static char events[MAX_EVENTS][160];
+static int num_events;
+
+static bool topic_matches(const char *sub, const char *topic){
+    int len = strlen(sub);
+    if(len >= 2 && strcmp(sub + len - 2, "/#") == 0)
+        return strncmp(sub, topic, len - 1) == 0 || (strncmp(sub, topic, len - 2) == 0 && topic[len - 2] == 0);
+    return strcmp(sub, topic) == 0;
+}
+
+static void enqueue(int to, const char *topic, const char *data, int len){
+    struct message *m;
+    if(queue_len == MAX_QUEUED){
+        fprintf(stderr, "%s: broker queue full\n", test_name);
+        exit(2);
+    }
+    m = &queue[(queue_head + queue_len++) % MAX_QUEUED];
+    m->to = to;
+    snprintf(m->topic, sizeof(m->topic), "%s", topic);
+    snprintf(m->data, sizeof(m->data), "%.*s", len, data);
+}
+
+/* Route a publish to every connected hub subscribed to it - the publisher included */
+static void broker_publish(const char *topic, const char *data, int len, int retain){
+    int i;
+
+    if(retain){
+        for(i = 0; i < num_retained && strcmp(retained[i].topic, topic) != 0; i++)
+            ;
+        if(i == num_retained && num_retained < MAX_RETAINED)
+            num_retained++;
+        if(i < MAX_RETAINED){
+            snprintf(retained[i].topic, sizeof(retained[i].topic), "%s", topic);
+            snprintf(retained[i].data, sizeof(retained[i].data), "%.*s", len, data);
+        }
+    }
+    if(strcmp(topic, HUB_TOPIC "/event") == 0 && num_events < MAX_EVENTS)
+        snprintf(events[num_events++], sizeof(events[0]), "%.*s", len, data);
+    for(i = 0; i < 2; i++){
+        int s;
+        if(hubs[i].connected == false)
+            continue;
+        for(s = 0; s < hubs[i].num_subs; s++){
+            if(topic_matches(hubs[i].subs[s], topic)){
+                enqueue(i, topic, data, len);
+                break;
+            }
+        }
+    }
+}
+
+static void broker_subscribe(int hub, const char *topic){
+    struct test_hub *h = &hubs[hub];
+    int i;
+
+    for(i = 0; i < h->num_subs; i++){
+        if(strcmp(h->subs[i], topic) == 0)
+            return;
+    }
+    if(h->num_subs < MAX_SUBS)
+        snprintf(h->subs[h->num_subs++], sizeof(h->subs[0]), "%s", topic);
+    for(i = 0; i < num_retained; i++){
+        if(topic_matches(topic, retained[i].topic))
+            enqueue(hub, retained[i].topic, retained[i].data, strlen(retained[i].data));
+    }
+}
+
+/* Deliver everything queued, including what the deliveries publish */
+static void pump(void){
+    while(queue_len > 0){
+        struct message m = queue[queue_head];
+        queue_head = (queue_head + 1) % MAX_QUEUED;
+        queue_len--;
+        if(hubs[m.to].connected == true){
+            xSemaphoreTakeRecursive(hubs[m.to].client_lock, portMAX_DELAY);
+            hubs[m.to].message(m.topic, m.data, strlen(m.data));
+            xSemaphoreGiveRecursive(hubs[m.to].client_lock);
+        }
+    }
+}
+
+/* Discovery asking about a valve the way ha_discovery_task used to - with its own lock held */
+static bool discovery_owns(int hub, uint8_t *bda){
+    bool owned;
+    xSemaphoreTake(hubs[hub].discovery_lock, portMAX_DELAY);
+    owned = hubs[hub].owns(bda);
+    xSemaphoreGive(hubs[hub].discovery_lock);
+    return owned;
+}
+
+static void force_device(int hub, char *bda){
+    xSemaphoreTake(hubs[hub].discovery_lock, portMAX_DELAY);
+    hubs[hub].discoveries++;
+    xSemaphoreGive(hubs[hub].discovery_lock);
+}
+
+/* The functions each copy of eq3_hubs.c calls, and its entry points */
+#define HUB_GLUE(x, n)                                                                          \
+    void hub_##x##_init(const char *id);                                                        \
+    void hub_##x##_connected(void);                                                             \
+    bool hub_##x##_message(const char *topic, const char *data, int len);                       \
+    bool hub_##x##_owns(uint8_t *bda);                                                          \
+    int hub_##x##_mqtt_publish(const char *topic, const char *data, int len, int retain){        \
+        xSemaphoreTakeRecursive(hubs[n].client_lock, portMAX_DELAY);                            \
+        broker_publish(topic, data, len, retain);                                               \
+        xSemaphoreGiveRecursive(hubs[n].client_lock);                                           \
+        return 0;                                                                               \
+    }                                                                                           \
+    int hub_##x##_mqtt_subscribe(const char *topic){                                            \
+        xSemaphoreTakeRecursive(hubs[n].client_lock, portMAX_DELAY);                            \
+        broker_subscribe(n, topic);                                                             \
+        xSemaphoreGiveRecursive(hubs[n].client_lock);                                           \
+        return 0;                                                                               \
+    }                                                                                           \
+    mqttconnstate hub_##x##_ismqttconnected(void){                                              \
+        return hubs[n].connected ? MQTT_CONNECTED : MQTT_NOT_CONNECTED;                         \
+    }                                                                                           \
+    void hub_##x##_ha_discovery_force_device(char *bda){                                        \
+        force_device(n, bda);                                                                   \
+    }                                                                                           \
+    enum eq3_scanstate hub_##x##_eq3gap_get_device_list(struct found_device **devlist, int *numdevs){ \
+        return EQ3_NO_SCAN_RESULTS;                                                             \
+    }
+
+HUB_GLUE(a, 0)
+HUB_GLUE(b, 1)
+
+/* Connect a hub - its connect message, then the subscriptions made in connected_cb */
+static void hub_connect(int hub){
+    char topic[64];
+    hubs[hub].connected = true;
+    hubs[hub].num_subs = 0;
+    snprintf(topic, sizeof(topic), "%sradout/connect", hubs[hub].id);
+    broker_publish(topic, "Heating control active", strlen("Heating control active"), 0);
+    xSemaphoreTakeRecursive(hubs[hub].client_lock, portMAX_DELAY);
+    hubs[hub].connected_cb();
+    xSemaphoreGiveRecursive(hubs[hub].client_lock);
+    pump();
+}
+
+/* The broker notices a hub has gone and publishes its last will */
+static void hub_drop(int hub){
+    char topic[64];
+    hubs[hub].connected = false;
+    snprintf(topic, sizeof(topic), "%sradout", hubs[hub].id);
+    broker_publish(topic, "Heating control offline", strlen("Heating control offline"), 0);
+    pump();
+}
+
+/* What the hub task publishes every report interval for a valve it can hear */
+static void report_rssi(int hub, const char *mac_addr, int rssi){
+    char topic[80], value[8];
+    snprintf(topic, sizeof(topic), "%s/rssi/%s/%s", HUB_TOPIC, mac_addr, hubs[hub].id);
+    snprintf(value, sizeof(value), "%d", rssi);
+    broker_publish(topic, value, strlen(value), 0);
+    pump();
+    eq3_linux_wait(eq3_hal_time_us() + 60 * 1000000LL);
+}
+
+static const char *owner_message(const char *mac_addr){
+    char topic[64];
+    int i;
+    snprintf(topic, sizeof(topic), "%s/owner/%s", HUB_TOPIC, mac_addr);
+    for(i = 0; i < num_retained; i++){
+        if(strcmp(retained[i].topic, topic) == 0)
+            return retained[i].data;
+    }
+    return "";
+}
+
+static bool has_event(const char *event){
+    int i;
+    for(i = 0; i < num_events; i++){
+        if(strstr(events[i], event) != NULL)
+            return true;
+    }
+    return false;
+}
+
+/* Exactly one of the connected hubs serves the valve - the one named in the retained owner message */
+static int check_owner(int expected, uint8_t *bda, const char *mac_addr){
+    char expect[64];
+    int hub;
+    for(hub = 0; hub < 2; hub++){
+        bool owns = discovery_owns(hub, bda);
+        if(hubs[hub].connected == true)
+            CHECK(owns == (hub == expected), "owner should be %s - %s owns %d (%s)", hubs[expected].id, hubs[hub].id, owns, owner_message(mac_addr));
+    }
+    snprintf(expect, sizeof(expect), "{\"hub\":\"%s\"", hubs[expected].id);
+    CHECK(strncmp(owner_message(mac_addr), expect, strlen(expect)) == 0, "owner message %s", owner_message(mac_addr));
+    CHECK(idf_lock_errors() == 0, "lock order error");
+    return 0;
+}
+
+static void setup(void){
+    memset(hubs, 0, sizeof(hubs));
+    num_retained = queue_head = queue_len = num_events = 0;
+    hubs[0] = (struct test_hub){ .id = "hubA", .init = hub_a_init, .connected_cb = hub_a_connected, .message = hub_a_message, .owns = hub_a_owns };
+    hubs[1] = (struct test_hub){ .id = "hubB", .init = hub_b_init, .connected_cb = hub_b_connected, .message = hub_b_message, .owns = hub_b_owns };
+    eq3_linux_set_virtual_time(true);
+    hubs[0].discovery_lock = xSemaphoreCreateMutex();
+    hubs[1].discovery_lock = xSemaphoreCreateMutex();
+    hubs[0].client_lock = xSemaphoreCreateRecursiveMutex();
+    hubs[1].client_lock = xSemaphoreCreateRecursiveMutex();
+    hubs[0].init(hubs[0].id);
+    hubs[1].init(hubs[1].id);
+    hub_connect(0);
+    hub_connect(1);
+}
+
+/* Claim, hysteresis, takeover on the last will and handback */
+static int claim_takeover_handback(void){
+    uint8_t bda[6] = { 0x00, 0x1a, 0x22, 0x0a, 0x0b, 0x0c };
+    const char *mac_addr = "00:1A:22:0A:0B:0C";
+    int discoveries;
+
+    setup();
+    CHECK(idf_lock_errors() == 0, "lock order error connecting");
+
+    /* Hub a hears the valve first and claims it */
+    report_rssi(0, mac_addr, -70);
+    if(check_owner(0, bda, mac_addr) != 0)
+        return -1;
+    CHECK(hubs[0].discoveries == 1, "hub a published discovery %d times", hubs[0].discoveries);
+
+    /* Hub b is better, but not by the hysteresis margin - a keeps it */
+    report_rssi(1, mac_addr, -66);
+    report_rssi(0, mac_addr, -70);
+    if(check_owner(0, bda, mac_addr) != 0)
+        return -1;
+
+    /* Hub a goes away - b takes over and remembers a */
+    hub_drop(0);
+    if(check_owner(1, bda, mac_addr) != 0)
+        return -1;
+    CHECK(strstr(owner_message(mac_addr), "\"from\":\"hubA\"") != NULL, "takeover owner message %s", owner_message(mac_addr));
+    CHECK(has_event("\"event\":\"takeover\""), "no takeover event");
+    CHECK(hubs[1].discoveries == 1, "hub b published discovery %d times", hubs[1].discoveries);
+
+    /* Hub a is back - it learns b has the valve, and b hands it back once a reports it */
+    discoveries = hubs[0].discoveries;
+    hub_connect(0);
+    report_rssi(0, mac_addr, -70);
+    if(check_owner(0, bda, mac_addr) != 0)
+        return -1;
+    CHECK(has_event("\"event\":\"handback\""), "no handback event");
+    CHECK(hubs[0].discoveries == discoveries + 1, "hub a published discovery %d times after the handback", hubs[0].discoveries - discoveries);
+
+    /* Hub b now beats a by more than the margin and claims it */
+    report_rssi(1, mac_addr, -60);
+    if(check_owner(1, bda, mac_addr) != 0)
+        return -1;
+    return 0;
+}
+
+/* The owner stops reporting without a last will - the other hub's task notices and takes over */
+static int silent_owner(void){
+    uint8_t bda[6] = { 0x00, 0x1a, 0x22, 0x0a, 0x0b, 0x0d };
+    const char *mac_addr = "00:1A:22:0A:0B:0D";
+    int i;
+
+    setup();
+    report_rssi(0, mac_addr, -70);
+    report_rssi(1, mac_addr, -75);
+    if(check_owner(0, bda, mac_addr) != 0)
+        return -1;
+
+    /* Hub a loses its link and the broker hasn't noticed - only b's reports go on */
+    hubs[0].connected = false;
+    for(i = 0; i < 4; i++){
+        report_rssi(1, mac_addr, -75);
+        idf_run_tasks("hub_task");
+        pump();
+    }
+    CHECK(idf_lock_errors() == 0, "lock order error in the hub task");
+    CHECK(discovery_owns(1, bda) == true, "hub b did not take over (%s)", owner_message(mac_addr));
+    CHECK(strstr(owner_message(mac_addr), "{\"hub\":\"hubB\",\"from\":\"hubA\"") != NULL, "owner message %s", owner_message(mac_addr));
+    CHECK(has_event("\"event\":\"takeover\""), "no takeover event");
+    CHECK(hubs[1].discoveries == 1, "hub b published discovery %d times", hubs[1].discoveries);
+    return 0;
+}
+
+static const struct hubtest tests[] = {
+    { "hubs_failover", "claim, hysteresis, takeover on the last will and handback between two hubs", claim_takeover_handback },
+    { "hubs_silent_owner", "takeover by the hub task when the owner stops reporting without a last will", silent_owner },
+};
+
+#define NUM_TESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-r test] [-l (list tests)] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    const char *only = NULL;
+    int opt, idx, ran = 0, failures = 0;
+
+    eq3_hal_log_level = 0;
+    while((opt = getopt(argc, argv, "r:lvh")) != -1){
+        switch(opt){
+        case 'r':
+            only = optarg;
+            break;
+        case 'l':
+            for(idx = 0; idx < NUM_TESTS; idx++)
+                printf("%-16s %s\n", tests[idx].name, tests[idx].description);
+            return 0;
+        case 'v':
+            eq3_hal_log_level = 2;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for(idx = 0; idx < NUM_TESTS; idx++){
+        if(only != NULL && strcmp(only, tests[idx].name) != 0)
+            continue;
+        test_name = tests[idx].name;
+        ran++;
+        if(tests[idx].run() != 0)
+            failures++;
+        else
+            printf("%s: ok\n", test_name);
+    }
+    if(ran == 0){
+        fprintf(stderr, "no test %s\n", only);
+        return 1;
+    }
+    return failures;
+}
@@ -0,0 +1,522 @@
+/*
+ * Replay of a BLE capture from the hub (/capture or <mqttid>radout/capture)
+ *
+ *   eq3_replay eq3.cap          replay the sessions into the scheduler and print the status reports
+ *   eq3_replay -p eq3.cap       print the records
+ *   eq3_replay -b 10000 eq3.cap time the decoder and serializers on every notification
+ *
+ * The replay runs in virtual time. Each command queued on the hub is submitted again at the same
+ * time with the link quality the hub had for the valve. Every open the scheduler makes is
+ * answered with the next captured session for that valve: the open fails, the link drops or the
+ * valve notifies after the same delays as on the hub. The summary counts the writes that differ
+ * from the capture and opens the capture has no session for, either of which means the command
+ * encoding or the scheduler behaves differently than on the hub.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+#include "eq3_status.h"
+#include "eq3_capture.h"
+#include "eq3_hal_linux.h"
+
+#define REPLAY_TAG "EQ3_REPLAY"
+
+/* Time an open to a missing valve takes to fail when the capture has nothing for it */
+#define REPLAY_OPEN_FAIL_MS 30000
+
+enum session_outcome { OUTCOME_NONE = 0, OUTCOME_OPENED, OUTCOME_OPEN_FAILED };
+
+struct session {
+    uint8_t bda[6];
+    int64_t open_us;
+    enum session_outcome outcome;
+    int64_t result_us;          /* Opened or failed */
+    bool has_write;
+    uint8_t frame[EQ3_CAPTURE_DATA_MAX];
+    int frame_len;
+    bool has_notify;
+    uint8_t notify[EQ3_CAPTURE_DATA_MAX];
+    int notify_len;
+    int64_t notify_us;
+    bool dropped;
+    int64_t drop_us;
+    bool used;
+};
+
+enum replay_event_type { REPLAY_OPENED = 0, REPLAY_OPEN_FAILED, REPLAY_NOTIFY, REPLAY_DROPPED, REPLAY_DISCONNECTED, REPLAY_CLOSED };
+
+struct replay_event {
+    bool pending;
+    int64_t due;
+    enum replay_event_type type;
+    struct session *session;
+};
+
+#define REPLAY_MAX_EVENTS 8
+
+struct submission {
+    int64_t at;
+    uint8_t bda[6];
+    int quality;
+    char cmd[EQ3_TOPIC_CMD_MAX];
+};
+
+static struct eq3_capture_record *records;
+static int num_records;
+static struct session *sessions;
+static int num_sessions;
+static struct submission *submissions;
+static int num_submissions, submitted;
+static struct replay_event events[REPLAY_MAX_EVENTS];
+
+static struct {
+    int reports;
+    int writes_matched;
+    int writes_differ;
+    int extra_opens;            /* Opens with no captured session left for the valve */
+    int unknown_commands;       /* Queued commands that don't decode */
+} replay_stats;
+
+static int read_capture(const char *path){
+    FILE *in = fopen(path, "rb");
+    uint8_t *buf;
+    long size;
+    int count, idx, rdidx;
+
+    if(in == NULL){
+        perror(path);
+        return -1;
+    }
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if(size <= 0 || (buf = malloc(size)) == NULL || fread(buf, 1, size, in) != (size_t)size){
+        fprintf(stderr, "%s: unable to read\n", path);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    if((count = eq3_capture_get_header(buf, size)) < 0){
+        fprintf(stderr, "%s: not a capture\n", path);
+        free(buf);
+        return -1;
+    }
+    records = calloc(count > 0 ? count : 1, sizeof(struct eq3_capture_record));
+    rdidx = EQ3_CAPTURE_HEADER_LEN;
+    for(idx = 0; idx < count; idx++){
+        int used = eq3_capture_get_record(&buf[rdidx], size - rdidx, &records[idx]);
+        if(used < 0){
+            fprintf(stderr, "%s: record %d is malformed - using the %d before it\n", path, idx, idx);
+            break;
+        }
+        rdidx += used;
+    }
+    num_records = idx;
+    free(buf);
+    return 0;
+}
+
+static void print_records(void){
+    int idx, byte;
+    for(idx = 0; idx < num_records; idx++){
+        struct eq3_capture_record *rec = &records[idx];
+        printf("%u.%03u %-8s %02X:%02X:%02X:%02X:%02X:%02X", rec->time_ms / 1000, rec->time_ms % 1000, eq3_capture_type_name(rec->type),
+               rec->bda[0], rec->bda[1], rec->bda[2], rec->bda[3], rec->bda[4], rec->bda[5]);
+        if(rec->handle != 0)
+            printf(" 0x%04x", rec->handle);
+        if(rec->len > 0)
+            printf(" ");
+        for(byte = 0; byte < rec->len; byte++)
+            printf("%02x", rec->data[byte]);
+        printf("\n");
+    }
+}
+
+/* Group the records into sessions - anything before the first open of a valve is from a session
+ * the ring no longer holds the start of. Commands queued are picked up by build_submissions() */
+static void build_sessions(void){
+    int idx, sidx;
+    sessions = calloc(num_records > 0 ? num_records : 1, sizeof(struct session));
+    num_sessions = 0;
+    for(idx = 0; idx < num_records; idx++){
+        struct eq3_capture_record *rec = &records[idx];
+        struct session *s = NULL;
+        int64_t at = (int64_t)rec->time_ms * 1000;
+
+        if(rec->type == EQ3_CAP_OPEN){
+            s = &sessions[num_sessions++];
+            memcpy(s->bda, rec->bda, sizeof(s->bda));
+            s->open_us = at;
+            continue;
+        }
+        for(sidx = num_sessions - 1; sidx >= 0 && s == NULL; sidx--){
+            if(memcmp(sessions[sidx].bda, rec->bda, sizeof(rec->bda)) == 0)
+                s = &sessions[sidx];
+        }
+        if(s == NULL)
+            continue;
+        switch(rec->type){
+        case EQ3_CAP_OPENED:
+            s->outcome = OUTCOME_OPENED;
+            s->result_us = at;
+            break;
+        case EQ3_CAP_OPEN_FAILED:
+            s->outcome = OUTCOME_OPEN_FAILED;
+            s->result_us = at;
+            break;
+        case EQ3_CAP_WRITE:
+            s->has_write = true;
+            s->frame_len = rec->len;
+            memcpy(s->frame, rec->data, rec->len);
+            break;
+        case EQ3_CAP_NOTIFY:
+            if(s->has_notify == false){
+                s->has_notify = true;
+                s->notify_len = rec->len;
+                memcpy(s->notify, rec->data, rec->len);
+                s->notify_us = at;
+            }
+            break;
+        case EQ3_CAP_DISCONNECT:
+            if(rec->len > 0 && rec->data[0] != 0 && s->has_notify == false){
+                s->dropped = true;
+                s->drop_us = at;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* The command text that encodes to a captured write */
+static bool frame_command(const uint8_t *frame, int len, char *cmd, int cmdlen){
+    if(len < 2)
+        return false;
+    switch(frame[0]){
+    case PROP_TEMPERATURE_WRITE:
+        if(frame[1] == 0x09)
+            snprintf(cmd, cmdlen, "off");
+        else if(frame[1] == 0x3c)
+            snprintf(cmd, cmdlen, "on");
+        else
+            snprintf(cmd, cmdlen, "settemp %d.%d", frame[1] >> 1, frame[1] & 0x01 ? 5 : 0);
+        return true;
+    case PROP_MODE_WRITE:
+        snprintf(cmd, cmdlen, "%s", frame[1] & 0x40 ? "manual" : "auto");
+        return true;
+    case PROP_BOOST:
+        snprintf(cmd, cmdlen, "%s", frame[1] ? "boost" : "unboost");
+        return true;
+    case PROP_LOCK:
+        snprintf(cmd, cmdlen, "%s", frame[1] ? "lock" : "unlock");
+        return true;
+    case PROP_OFFSET:
+        snprintf(cmd, cmdlen, "offset %.1f", frame[1] / 2.0 - 3.5);
+        return true;
+    case PROP_INFO_QUERY:
+        if(len < 1 + SET_TIME_BYTES)
+            return false;
+        snprintf(cmd, cmdlen, "settime %02x%02x%02x%02x%02x%02x", frame[1], frame[2], frame[3], frame[4], frame[5], frame[6]);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Each queued command is submitted again at the time it was queued */
+static void build_submissions(void){
+    int idx;
+    submissions = calloc(num_records > 0 ? num_records : 1, sizeof(struct submission));
+    num_submissions = 0;
+    for(idx = 0; idx < num_records; idx++){
+        struct eq3_capture_record *rec = &records[idx];
+        struct submission *sub = &submissions[num_submissions];
+        char text[EQ3_TOPIC_CMD_MAX - 20];
+
+        if(rec->type != EQ3_CAP_COMMAND || rec->len < 1)
+            continue;
+        if(frame_command(&rec->data[1], rec->len - 1, text, sizeof(text)) == false){
+            replay_stats.unknown_commands++;
+            continue;
+        }
+        sub->at = (int64_t)rec->time_ms * 1000;
+        memcpy(sub->bda, rec->bda, sizeof(sub->bda));
+        sub->quality = rec->data[0] == 0xff ? EQ3_LINK_QUALITY_UNKNOWN : rec->data[0];
+        snprintf(sub->cmd, sizeof(sub->cmd), "%02x:%02x:%02x:%02x:%02x:%02x %s",
+                 rec->bda[0], rec->bda[1], rec->bda[2], rec->bda[3], rec->bda[4], rec->bda[5], text);
+        num_submissions++;
+    }
+}
+
+/* The link quality the hub saw for the valve's last command - it picks the retries and timeout */
+static int replay_link_quality(const uint8_t *bda){
+    int idx;
+    for(idx = submitted - 1; idx >= 0; idx--){
+        if(memcmp(submissions[idx].bda, bda, 6) == 0)
+            return submissions[idx].quality;
+    }
+    return EQ3_LINK_QUALITY_UNKNOWN;
+}
+
+static void add_event(enum replay_event_type type, struct session *session, int64_t delay_us){
+    int idx;
+    for(idx = 0; idx < REPLAY_MAX_EVENTS; idx++){
+        if(events[idx].pending == false){
+            events[idx].pending = true;
+            events[idx].due = eq3_hal_time_us() + (delay_us > 0 ? delay_us : 0);
+            events[idx].type = type;
+            events[idx].session = session;
+            return;
+        }
+    }
+    EQ3_LOGE(REPLAY_TAG, "Event list full");
+}
+
+/* Answer the open with the next captured session for the valve */
+static void replay_open(const uint8_t *bda){
+    struct session *s = NULL;
+    int idx;
+
+    memset(events, 0, sizeof(events));
+    for(idx = 0; idx < num_sessions && s == NULL; idx++){
+        if(sessions[idx].used == false && memcmp(sessions[idx].bda, bda, 6) == 0)
+            s = &sessions[idx];
+    }
+    if(s == NULL){
+        replay_stats.extra_opens++;
+        add_event(REPLAY_OPEN_FAILED, NULL, (int64_t)REPLAY_OPEN_FAIL_MS * 1000);
+        return;
+    }
+    s->used = true;
+    switch(s->outcome){
+    case OUTCOME_OPENED:
+        add_event(REPLAY_OPENED, s, s->result_us - s->open_us);
+        if(s->has_notify == true)
+            add_event(REPLAY_NOTIFY, s, s->notify_us - s->open_us);
+        else
+            add_event(REPLAY_DROPPED, s, s->dropped == true ? s->drop_us - s->open_us : s->result_us - s->open_us);
+        break;
+    case OUTCOME_OPEN_FAILED:
+        add_event(REPLAY_OPEN_FAILED, s, s->result_us - s->open_us);
+        break;
+    default:
+        /* The capture ends while this open was still going */
+        add_event(REPLAY_OPEN_FAILED, s, (int64_t)REPLAY_OPEN_FAIL_MS * 1000);
+        break;
+    }
+}
+
+static void replay_close(void){
+    add_event(REPLAY_DISCONNECTED, NULL, 5000);
+}
+
+/* The same handling of the notification as the GATT client on the hub */
+static void replay_notify(struct session *s){
+    if(s->notify_len >= 2 && s->notify[0] == PROP_INFO_RETURN && s->notify[1] == 1){
+        struct eq3_status status;
+        char statrep[EQ3_STATUS_JSON_MAX];
+        char mac_addr[20];
+        eq3_decode_status(s->notify, s->notify_len, &status);
+        sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", s->bda[0], s->bda[1], s->bda[2], s->bda[3], s->bda[4], s->bda[5]);
+        if(eq3_status_to_json(&status, mac_addr, statrep, sizeof(statrep)) > 0)
+            eq3_hal_report(mac_addr, statrep);
+    }
+    eq3_sched_done();
+}
+
+static void fire(struct replay_event *event){
+    struct session *s = event->session;
+    int len;
+    const uint8_t *frame;
+
+    switch(event->type){
+    case REPLAY_OPENED:
+        eq3_sched_opened();
+        frame = eq3_sched_frame(&len);
+        if(s->has_write == true){
+            if(len == s->frame_len && memcmp(frame, s->frame, len) == 0){
+                replay_stats.writes_matched++;
+            }else{
+                replay_stats.writes_differ++;
+                EQ3_LOGW(REPLAY_TAG, "Write to %02X:%02X:%02X:%02X:%02X:%02X differs from the capture", s->bda[0], s->bda[1], s->bda[2],
+                         s->bda[3], s->bda[4], s->bda[5]);
+            }
+        }
+        break;
+    case REPLAY_OPEN_FAILED:
+        eq3_sched_error(eq3_sched_bda(), "TRV not available");
+        break;
+    case REPLAY_NOTIFY:
+        replay_notify(s);
+        break;
+    case REPLAY_DROPPED:
+        eq3_sched_disconnected(true);
+        add_event(REPLAY_CLOSED, NULL, 1000);
+        break;
+    case REPLAY_DISCONNECTED:
+        eq3_sched_disconnected(false);
+        add_event(REPLAY_CLOSED, NULL, 1000);
+        break;
+    case REPLAY_CLOSED:
+        eq3_sched_closed();
+        break;
+    }
+}
+
+static int64_t replay_run(void){
+    int64_t next = -1;
+    int idx;
+    for(idx = 0; idx < REPLAY_MAX_EVENTS; idx++){
+        if(events[idx].pending == true && events[idx].due <= eq3_hal_time_us()){
+            struct replay_event event = events[idx];
+            events[idx].pending = false;
+            fire(&event);
+        }
+    }
+    for(idx = 0; idx < REPLAY_MAX_EVENTS; idx++){
+        if(events[idx].pending == true && (next < 0 || events[idx].due < next))
+            next = events[idx].due;
+    }
+    return next;
+}
+
+static void report(const char *mac_addr, const char *json){
+    int64_t now = eq3_hal_time_us();
+    replay_stats.reports++;
+    printf("%lld.%03lld %s %s\n", (long long)(now / 1000000), (long long)(now / 1000 % 1000), mac_addr, json);
+}
+
+static void replay(void){
+    static const struct eq3_linux_ble replay_ble = {
+        .open = replay_open,
+        .close = replay_close,
+        .link_quality = replay_link_quality,
+    };
+    int unused = 0, idx;
+
+    eq3_linux_set_virtual_time(true);
+    eq3_linux_set_ble(&replay_ble);
+    eq3_linux_set_report(report);
+    build_sessions();
+    build_submissions();
+
+    while(1){
+        int64_t wake, due;
+        while(submitted < num_submissions && submissions[submitted].at <= eq3_hal_time_us())
+            handle_request(submissions[submitted++].cmd);
+        eq3_linux_run_timer();
+        due = replay_run();
+
+        wake = submitted < num_submissions ? submissions[submitted].at : -1;
+        if(due >= 0 && (wake < 0 || due < wake))
+            wake = due;
+        if(eq3_linux_timer_due() >= 0 && (wake < 0 || eq3_linux_timer_due() < wake))
+            wake = eq3_linux_timer_due();
+        if(wake < 0)
+            break;
+        eq3_linux_wait(wake);
+    }
+    for(idx = 0; idx < num_sessions; idx++){
+        if(sessions[idx].used == false)
+            unused++;
+    }
+    printf("records %d, sessions %d (%d not replayed), commands %d (%d unknown), reports %d\n",
+           num_records, num_sessions, unused, num_submissions, replay_stats.unknown_commands, replay_stats.reports);
+    printf("writes %d matched, %d differ, %d opens without a captured session\n",
+           replay_stats.writes_matched, replay_stats.writes_differ, replay_stats.extra_opens);
+}
+
+static int64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Decoder and serializer cost per notification on the captured traffic */
+static void benchmark(int reps){
+    struct eq3_status status;
+    char statrep[EQ3_STATUS_JSON_MAX];
+    uint8_t binrep[EQ3_STATUS_CBOR_MAX];
+    int64_t decode_ns = 0, json_ns = 0, cbor_ns = 0, start;
+    int idx, rep, notifies = 0;
+    long bytes = 0;
+
+    eq3_hal_log_level = 0;
+    for(rep = 0; rep < reps; rep++){
+        for(idx = 0; idx < num_records; idx++){
+            struct eq3_capture_record *rec = &records[idx];
+            if(rec->type != EQ3_CAP_NOTIFY || rec->len < 2 || rec->data[0] != PROP_INFO_RETURN)
+                continue;
+            start = now_ns();
+            eq3_decode_status(rec->data, rec->len, &status);
+            decode_ns += now_ns() - start;
+            start = now_ns();
+            bytes += eq3_status_to_json(&status, "00:00:00:00:00:00", statrep, sizeof(statrep));
+            json_ns += now_ns() - start;
+            start = now_ns();
+            eq3_status_to_cbor(&status, rec->bda, binrep, sizeof(binrep));
+            cbor_ns += now_ns() - start;
+            notifies++;
+        }
+    }
+    if(notifies == 0){
+        printf("no status notifications in the capture\n");
+        return;
+    }
+    printf("%d notifications x %d: decode %.0f ns, json %.0f ns (%ld bytes), cbor %.0f ns\n", notifies / reps, reps,
+           (double)decode_ns / notifies, (double)json_ns / notifies, bytes / notifies, (double)cbor_ns / notifies);
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-p (print records)] [-b repetitions (benchmark)] [-t trace file] [-q | -v] capture\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    bool print = false;
+    int reps = 0, opt;
+    const char *trace_path = NULL;
+    FILE *trace = NULL;
+
+    while((opt = getopt(argc, argv, "pb:t:qv")) != -1){
+        switch(opt){
+        case 'p': print = true; break;
+        case 'b': reps = atoi(optarg); break;
+        case 't': trace_path = optarg; break;
+        case 'q': eq3_hal_log_level = 0; break;
+        case 'v': eq3_hal_log_level = 2; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind != argc - 1){
+        usage(argv[0]);
+        return 1;
+    }
+    if(read_capture(argv[optind]) != 0)
+        return 1;
+
+    if(print == true){
+        print_records();
+    }else if(reps > 0){
+        benchmark(reps);
+    }else{
+        if(trace_path != NULL){
+            if((trace = fopen(trace_path, "w")) == NULL){
+                perror(trace_path);
+                return 1;
+            }
+            eq3_linux_set_trace(trace);
+        }
+        replay();
+        if(trace != NULL)
+            fclose(trace);
+    }
+    return 0;
+}
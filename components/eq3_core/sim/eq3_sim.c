@@ -0,0 +1,450 @@
+/*
+ * Simulated fleet of EQ-3 valves
+ *
+ * One session runs at a time, exactly as on the hub. Each valve keeps the state the commands
+ * written to it have set so the status notifications it sends back are consistent.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+#include "eq3_status.h"
+#include "eq3_radio.h"
+#include "eq3_hal_linux.h"
+#include "eq3_sim.h"
+
+#define SIM_TAG "EQ3_SIM"
+
+/* Attribute handles of the command and notification characteristics on a real valve */
+#define SIM_CHAR_HANDLE 0x0411
+#define SIM_RESP_CHAR_HANDLE 0x0421
+
+struct sim_valve {
+    uint8_t bda[6];
+    int rssi;
+    bool in_range;
+    uint8_t mode;
+    uint8_t temp;
+    uint8_t offset;
+};
+
+enum sim_event_type { SIM_OPENED = 0, SIM_OPEN_FAILED, SIM_NOTIFY, SIM_DROPPED, SIM_DISCONNECTED, SIM_CLOSED };
+
+struct sim_event {
+    bool pending;
+    int64_t due;
+    enum sim_event_type type;
+    int valve;
+};
+
+#define SIM_MAX_EVENTS 8
+
+static struct eq3_sim_config conf;
+static struct sim_valve fleet[EQ3_SIM_MAX_VALVES];
+static struct sim_event events[SIM_MAX_EVENTS];
+static struct eq3_sim_stats stats;
+static uint32_t rand_state = 1;
+static void (*capture_cb)(const struct eq3_capture_record *rec) = NULL;
+
+/* Radio use outside the events list - sim_open() clears that */
+static bool in_session = false;
+static int64_t session_start = 0;
+static struct {
+    struct eq3_radio_scan radio;
+    int64_t until;              /* End of the running scan or -1 */
+    int64_t stopped_until;      /* A preempted scan is still stopping */
+} scan = { .until = -1 };
+
+/* xorshift32 - the same seed gives the same fleet and the same failures */
+uint32_t eq3_sim_random(void){
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void capture(uint8_t type, const uint8_t *bda, uint16_t handle, const uint8_t *data, int len);
+
+/* The command as the hub's eq3_hal_command_queued() records it */
+static void capture_command(const uint8_t *bda, const uint8_t *frame, int len, int quality){
+    uint8_t data[EQ3_CAPTURE_DATA_MAX];
+    if(len >= EQ3_CAPTURE_DATA_MAX)
+        return;
+    data[0] = quality == EQ3_LINK_QUALITY_UNKNOWN ? 0xff : quality;
+    memcpy(&data[1], frame, len);
+    capture(EQ3_CAP_COMMAND, bda, 0, data, len + 1);
+}
+
+void eq3_sim_set_capture(void (*capture)(const struct eq3_capture_record *rec)){
+    capture_cb = capture;
+    eq3_linux_set_command_queued(capture != NULL ? capture_command : NULL);
+}
+
+static void capture(uint8_t type, const uint8_t *bda, uint16_t handle, const uint8_t *data, int len){
+    struct eq3_capture_record rec;
+    if(capture_cb == NULL)
+        return;
+    memset(&rec, 0, sizeof(rec));
+    rec.time_ms = (uint32_t)(eq3_hal_time_us() / 1000);
+    rec.type = type;
+    memcpy(rec.bda, bda, sizeof(rec.bda));
+    rec.handle = handle;
+    rec.len = len;
+    if(len > 0)
+        memcpy(rec.data, data, len);
+    capture_cb(&rec);
+}
+
+static bool chance(int pct){
+    return (int)(eq3_sim_random() % 100) < pct;
+}
+
+static void add_event(enum sim_event_type type, int valve, int delay_ms){
+    int idx;
+    for(idx = 0; idx < SIM_MAX_EVENTS; idx++){
+        if(events[idx].pending == false){
+            events[idx].pending = true;
+            events[idx].due = eq3_hal_time_us() + (int64_t)delay_ms * 1000;
+            events[idx].type = type;
+            events[idx].valve = valve;
+            return;
+        }
+    }
+    EQ3_LOGE(SIM_TAG, "Event list full");
+}
+
+int eq3_sim_find(const uint8_t *bda){
+    int n;
+    for(n = 0; n < conf.valves; n++){
+        if(memcmp(fleet[n].bda, bda, 6) == 0)
+            return n;
+    }
+    return -1;
+}
+
+const uint8_t *eq3_sim_bda(int n){
+    return fleet[n].bda;
+}
+
+bool eq3_sim_in_range(int n){
+    return fleet[n].in_range;
+}
+
+void eq3_sim_set_in_range(int n, bool in_range){
+    if(n >= 0 && n < conf.valves)
+        fleet[n].in_range = in_range;
+}
+
+int eq3_sim_rssi(int n){
+    return fleet[n].rssi;
+}
+
+int eq3_sim_valves(void){
+    return conf.valves;
+}
+
+void eq3_sim_address(int n, char *buf, int len){
+    const uint8_t *bda = fleet[n].bda;
+    snprintf(buf, len, "%02x:%02x:%02x:%02x:%02x:%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+void eq3_sim_get_stats(struct eq3_sim_stats *out){
+    memcpy(out, &stats, sizeof(stats));
+}
+
+/* Apply the characteristic write the scheduler made to the valve */
+static void apply_frame(struct sim_valve *valve, const uint8_t *frame, int len){
+    if(len < 2)
+        return;
+    switch(frame[0]){
+    case PROP_TEMPERATURE_WRITE:
+        valve->temp = frame[1];
+        break;
+    case PROP_MODE_WRITE:
+        if(frame[1] & 0x40)
+            valve->mode |= MANUAL;
+        else
+            valve->mode &= ~MANUAL;
+        break;
+    case PROP_BOOST:
+        if(frame[1])
+            valve->mode |= BOOST;
+        else
+            valve->mode &= ~BOOST;
+        break;
+    case PROP_LOCK:
+        if(frame[1])
+            valve->mode |= LOCKED;
+        else
+            valve->mode &= ~LOCKED;
+        break;
+    case PROP_OFFSET:
+        valve->offset = frame[1];
+        break;
+    default:
+        /* PROP_INFO_QUERY (set time) only asks for the status */
+        break;
+    }
+}
+
+/* Send the PROP_INFO_RETURN notification and report it as eq3_main.c does */
+static void notify(int n){
+    struct sim_valve *valve = &fleet[n];
+    uint8_t value[15];
+    struct eq3_status status;
+    char statrep[EQ3_STATUS_JSON_MAX];
+    char mac_addr[20];
+    const uint8_t *frame;
+    int len, open;
+
+    frame = eq3_sched_frame(&len);
+    apply_frame(valve, frame, len);
+
+    /* Valve opening follows the target temperature - fully open when boosting */
+    open = valve->mode & BOOST ? 100 : valve->temp > 36 ? (valve->temp - 36) * 4 : 0;
+    if(open > 100)
+        open = 100;
+
+    memset(value, 0, sizeof(value));
+    value[0] = PROP_INFO_RETURN;
+    value[1] = 0x01;
+    value[2] = valve->mode | DST;
+    value[3] = (uint8_t)open;
+    value[4] = 0x04;
+    value[5] = valve->temp;
+    value[10] = 0x18;           /* Window open temperature 12C */
+    value[11] = 0x03;           /* Window open time 15 minutes */
+    value[12] = 0x2a;           /* Comfort 21C */
+    value[13] = 0x22;           /* Eco 17C */
+    value[14] = valve->offset;
+
+    capture(EQ3_CAP_NOTIFY, valve->bda, SIM_RESP_CHAR_HANDLE, value, sizeof(value));
+    eq3_decode_status(value, sizeof(value), &status);
+    sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", valve->bda[0], valve->bda[1], valve->bda[2], valve->bda[3], valve->bda[4], valve->bda[5]);
+    if(eq3_status_to_json(&status, mac_addr, statrep, sizeof(statrep)) > 0)
+        eq3_hal_report(mac_addr, statrep);
+    stats.notifies++;
+    eq3_sched_done();
+}
+
+static void end_session(void){
+    if(in_session == true){
+        stats.session_us += eq3_hal_time_us() - session_start;
+        in_session = false;
+    }
+}
+
+static void sim_open(const uint8_t *bda){
+    int n = eq3_sim_find(bda);
+    int jitter = 0, stopping = 0;
+
+    /* A new open abandons anything left over from the last session */
+    memset(events, 0, sizeof(events));
+    end_session();
+    in_session = true;
+    session_start = eq3_hal_time_us();
+    stats.opens++;
+    capture(EQ3_CAP_OPEN, bda, 0, NULL, 0);
+    if(scan.stopped_until > session_start)
+        stopping = (int)((scan.stopped_until - session_start) / 1000);
+    if(n < 0 || fleet[n].in_range == false){
+        add_event(SIM_OPEN_FAILED, n, stopping + conf.open_fail_ms);
+        return;
+    }
+    if(conf.connect_jitter_ms > 0)
+        jitter = (int)(eq3_sim_random() % (2 * conf.connect_jitter_ms + 1)) - conf.connect_jitter_ms;
+    add_event(SIM_OPENED, n, stopping + (conf.connect_ms + jitter > 0 ? conf.connect_ms + jitter : 0));
+}
+
+static void sim_close(void){
+    stats.closes++;
+    add_event(SIM_DISCONNECTED, -1, 5);
+}
+
+static void start_scan(void){
+    int64_t now = eq3_hal_time_us();
+    scan.until = now + (int64_t)eq3_radio_scan_start(&scan.radio, now) * 1000;
+}
+
+void eq3_sim_scan(int duration_ms){
+    scan.radio.duration_ms = duration_ms;
+    if(scan.until >= 0)
+        return;
+    if(in_session == true || eq3_sched_idle() == false)
+        scan.radio.requested = true;
+    else
+        start_scan();
+}
+
+bool eq3_sim_scanning(void){
+    return scan.until >= 0;
+}
+
+/* The same arbitration as the hub - stopping a scan takes scan_stop_ms of radio time */
+static bool sim_preempt(void){
+    switch(eq3_radio_preempt(&scan.radio, eq3_hal_time_us())){
+    case EQ3_RADIO_STOP_SCAN:
+        stats.scans_preempted++;
+        scan.until = -1;
+        scan.stopped_until = eq3_hal_time_us() + (int64_t)conf.scan_stop_ms * 1000;
+        return true;
+    case EQ3_RADIO_START_SCAN:
+        start_scan();
+        stats.scan_holds++;
+        return false;
+    case EQ3_RADIO_HOLD:
+        stats.scan_holds++;
+        return false;
+    case EQ3_RADIO_GO:
+    default:
+        return true;
+    }
+}
+
+static void sim_idle(void){
+    if(scan.radio.requested == true && in_session == false)
+        start_scan();
+}
+
+/* Link quality from the rssi only - the hub also scores the connection history */
+static int sim_link_quality(const uint8_t *bda){
+    int n = eq3_sim_find(bda);
+    int quality;
+    if(n < 0)
+        return EQ3_LINK_QUALITY_UNKNOWN;
+    quality = (fleet[n].rssi + 100) * 100 / 60;
+    return quality < 0 ? 0 : quality > 100 ? 100 : quality;
+}
+
+static void fire(struct sim_event *event){
+    static const char *names[] = { "opened", "failed", "notify", "dropped", "disconn", "closed" };
+    eq3_linux_trace(names[event->type], "%d", event->valve);
+    switch(event->type){
+    case SIM_OPENED: {
+        const uint8_t *frame;
+        int len;
+        capture(EQ3_CAP_OPENED, fleet[event->valve].bda, 0, NULL, 0);
+        eq3_sched_opened();
+        frame = eq3_sched_frame(&len);
+        capture(EQ3_CAP_WRITE, fleet[event->valve].bda, SIM_CHAR_HANDLE, frame, len);
+        /* Service search, notify registration and the write happen before the status comes back */
+        if(chance(conf.drop_pct))
+            add_event(SIM_DROPPED, event->valve, conf.notify_ms / 2);
+        else
+            add_event(SIM_NOTIFY, event->valve, conf.notify_ms);
+        break;
+    }
+    case SIM_OPEN_FAILED:
+        stats.open_failures++;
+        capture(EQ3_CAP_OPEN_FAILED, eq3_sched_bda(), 0, NULL, 0);
+        end_session();
+        eq3_sched_error(eq3_sched_bda(), "TRV not available");
+        break;
+    case SIM_NOTIFY:
+        notify(event->valve);
+        break;
+    case SIM_DROPPED: {
+        uint8_t dropped = 1;
+        stats.drops++;
+        capture(EQ3_CAP_DISCONNECT, fleet[event->valve].bda, 0, &dropped, 1);
+        eq3_sched_disconnected(true);
+        add_event(SIM_CLOSED, event->valve, 1);
+        break;
+    }
+    case SIM_DISCONNECTED: {
+        uint8_t dropped = 0;
+        capture(EQ3_CAP_DISCONNECT, eq3_sched_bda(), 0, &dropped, 1);
+        eq3_sched_disconnected(false);
+        add_event(SIM_CLOSED, event->valve, 1);
+        break;
+    }
+    case SIM_CLOSED:
+        end_session();
+        eq3_sched_closed();
+        break;
+    }
+}
+
+int64_t eq3_sim_run(void){
+    int64_t next = -1;
+    int idx;
+
+    if(scan.until >= 0 && scan.until <= eq3_hal_time_us()){
+        eq3_linux_trace("scanned", "");
+        stats.scans++;
+        scan.until = -1;
+        eq3_radio_scan_done(&scan.radio);
+    }
+    for(idx = 0; idx < SIM_MAX_EVENTS; idx++){
+        if(events[idx].pending == true && events[idx].due <= eq3_hal_time_us()){
+            struct sim_event event = events[idx];
+            events[idx].pending = false;
+            fire(&event);
+        }
+    }
+    for(idx = 0; idx < SIM_MAX_EVENTS; idx++){
+        if(events[idx].pending == true && (next < 0 || events[idx].due < next))
+            next = events[idx].due;
+    }
+    if(scan.until >= 0 && (next < 0 || scan.until < next))
+        next = scan.until;
+    return next;
+}
+
+void eq3_sim_default_config(struct eq3_sim_config *config){
+    config->valves = 20;
+    config->connect_ms = 800;
+    config->connect_jitter_ms = 400;
+    config->notify_ms = 600;
+    config->open_fail_ms = 30000;
+    config->drop_pct = 2;
+    config->out_of_range_pct = 5;
+    config->rssi_min = -95;
+    config->rssi_max = -55;
+    config->scan_stop_ms = 200;
+    config->scan_max_preempt = 3;
+    config->seed = 1;
+}
+
+int eq3_sim_init(const struct eq3_sim_config *config){
+    static const struct eq3_linux_ble sim_ble = {
+        .open = sim_open,
+        .close = sim_close,
+        .link_quality = sim_link_quality,
+        .preempt = sim_preempt,
+        .idle = sim_idle,
+    };
+    int n;
+
+    if(config->valves < 1 || config->valves > EQ3_SIM_MAX_VALVES || config->rssi_max < config->rssi_min)
+        return -1;
+    memcpy(&conf, config, sizeof(conf));
+    memset(events, 0, sizeof(events));
+    memset(&stats, 0, sizeof(stats));
+    memset(&scan, 0, sizeof(scan));
+    eq3_radio_init(&scan.radio, 0, conf.scan_max_preempt);
+    scan.until = -1;
+    in_session = false;
+    rand_state = config->seed != 0 ? config->seed : 1;
+
+    for(n = 0; n < conf.valves; n++){
+        struct sim_valve *valve = &fleet[n];
+        /* 00:1a:22 is the EQ-3 OUI */
+        valve->bda[0] = 0x00;
+        valve->bda[1] = 0x1a;
+        valve->bda[2] = 0x22;
+        valve->bda[3] = 0x10;
+        valve->bda[4] = n >> 8;
+        valve->bda[5] = n & 0xff;
+        valve->rssi = conf.rssi_min + (int)(eq3_sim_random() % (conf.rssi_max - conf.rssi_min + 1));
+        valve->in_range = !chance(conf.out_of_range_pct);
+        valve->mode = AUTO;
+        valve->temp = 40;       /* 20C */
+        valve->offset = 7;      /* 0C */
+    }
+    eq3_linux_set_ble(&sim_ble);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef EQ3_SIM_H
+#define EQ3_SIM_H
+
+/*
+ * Simulated fleet of EQ-3 valves for the Linux port
+ *
+ * Plugs into the Linux HAL as its BLE backend and answers the scheduler the way the GATT client
+ * in main/eq3_main.c does: connection opened, status notification (a PROP_INFO_RETURN frame
+ * decoded and reported through eq3_status), link dropped or the open failing.
+ *
+ * Scans share the radio the way they do on the hub: a command stops a running scan (the open
+ * waits scan_stop_ms for that) and the scan carries on with the time it had left once the
+ * scheduler is idle. After scan_max_preempt sessions have gone ahead of it the scan takes the
+ * radio between two sessions and finishes first while commands wait.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "eq3_capture.h"
+
+#define EQ3_SIM_MAX_VALVES 1024
+
+struct eq3_sim_config {
+    int valves;                 /* Fleet size */
+    int connect_ms;             /* Mean time to open a connection */
+    int connect_jitter_ms;      /* +/- spread on the connect time */
+    int notify_ms;              /* Write to status notification */
+    int open_fail_ms;           /* Time for an open to an absent valve to fail */
+    int drop_pct;               /* Chance a session loses the link before the notification */
+    int out_of_range_pct;       /* Valves that never answer */
+    int rssi_min;               /* Link rssi is spread over rssi_min..rssi_max */
+    int rssi_max;
+    int scan_stop_ms;           /* Stopping a scan before a connection can open */
+    int scan_max_preempt;       /* Sessions that may go ahead of one scan (CONFIG_EQ3_SCAN_MAX_PREEMPT) */
+    uint32_t seed;
+};
+
+struct eq3_sim_stats {
+    int opens;                  /* Connections attempted */
+    int open_failures;
+    int drops;
+    int notifies;               /* Status notifications sent */
+    int closes;
+    int64_t session_us;         /* Radio time spent on sessions, open to close or failure */
+    int scans;                  /* Scans that ran to the end */
+    int scans_preempted;        /* Scans stopped for a command */
+    int scan_holds;             /* Scheduler ticks a command waited for a scan to finish */
+};
+
+void eq3_sim_default_config(struct eq3_sim_config *config);
+int eq3_sim_init(const struct eq3_sim_config *config);
+
+/* Fire the BLE events that are due - returns the time of the next one or -1 */
+int64_t eq3_sim_run(void);
+
+/* Address of valve n as used in commands */
+void eq3_sim_address(int n, char *buf, int len);
+const uint8_t *eq3_sim_bda(int n);
+int eq3_sim_find(const uint8_t *bda);
+bool eq3_sim_in_range(int n);
+void eq3_sim_set_in_range(int n, bool in_range);
+int eq3_sim_rssi(int n);
+int eq3_sim_valves(void);
+
+/* Scan for duration_ms - straight away if the radio is free, otherwise once the scheduler is idle */
+void eq3_sim_scan(int duration_ms);
+bool eq3_sim_scanning(void);
+
+/* Hand every open, write, notification and disconnect to capture() as the hub's capture ring records them */
+void eq3_sim_set_capture(void (*capture)(const struct eq3_capture_record *rec));
+
+uint32_t eq3_sim_random(void);
+void eq3_sim_get_stats(struct eq3_sim_stats *stats);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Load test of the command queue and session scheduler against a simulated valve fleet
+ *
+ *   eq3_simfleet -n 50 -c 5000 -r 0.05 -x 200
+ *
+ * sends 5000 settemp commands spread over 50 valves at one every 20s (in simulated time) with
+ * the clock running 200 times faster than real time, then prints the throughput and the
+ * command latency distribution. Latency runs from handle_request() to the status (or the
+ * error once the retries are used up) being reported.
+ *
+ * The hub works through one valve at a time, so there is a rate it can sustain: the commands
+ * reported divided by the time the scheduler was busy. That capacity is printed with the run -
+ * above it the queue only grows and the latencies measure the length of the run rather than
+ * the scheduler. The default rate stays below it for the default fleet.
+ *
+ *   eq3_simfleet -V -T 86400 -r 0.1 -t day.trace
+ *
+ * runs a simulated day in virtual time - no waiting at all - and writes every timer tick, open,
+ * close, report and valve event with its time to day.trace. The same options and seed always
+ * give the same trace, so two traces can be diffed to see what a scheduler change did.
+ * -C writes the valve traffic in the hub's capture format for eq3_replay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eq3_hal.h"
+#include "eq3_sched.h"
+#include "eq3_hal_linux.h"
+#include "eq3_sim.h"
+
+/* Commands in flight per valve - fewer than the 49 temperatures submit() cycles through, as a
+ * requeued retry with the same temperature would make the scheduler drop the new command as a
+ * duplicate without any report */
+#define MAX_PENDING 48
+
+struct valve_pending {
+    int64_t submitted[MAX_PENDING];
+    int head;
+    int count;
+    int sent;                   /* Commands sent - picks the next temperature */
+};
+
+static struct valve_pending *pending;
+static int64_t *latencies;
+static int completed = 0, failed = 0, unmatched = 0;
+
+/* Capture file being built - the count in its header is 16 bit */
+#define MAX_CAPTURE_RECORDS 0xffff
+static uint8_t *capture_buf = NULL;
+static int capture_len = 0, capture_count = 0;
+
+static void capture(const struct eq3_capture_record *rec){
+    if(capture_count == MAX_CAPTURE_RECORDS)
+        return;
+    capture_len += eq3_capture_put_record(&capture_buf[capture_len], EQ3_CAPTURE_RECORD_LEN + EQ3_CAPTURE_DATA_MAX, rec);
+    capture_count++;
+}
+
+static int write_capture(const char *path){
+    FILE *out = fopen(path, "wb");
+    uint8_t header[EQ3_CAPTURE_HEADER_LEN];
+    if(out == NULL){
+        perror(path);
+        return -1;
+    }
+    eq3_capture_put_header(header, sizeof(header), capture_count);
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(capture_buf, 1, capture_len, out);
+    fclose(out);
+    return 0;
+}
+
+/* A status or an error for a valve completes its oldest outstanding command */
+static void report(const char *mac_addr, const char *json){
+    unsigned int b[6];
+    uint8_t bda[6];
+    int n, idx;
+    struct valve_pending *vp;
+
+    if(sscanf(mac_addr, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return;
+    for(idx = 0; idx < 6; idx++)
+        bda[idx] = b[idx];
+    if((n = eq3_sim_find(bda)) < 0 || pending[n].count == 0){
+        unmatched++;
+        return;
+    }
+    vp = &pending[n];
+    latencies[completed + failed] = eq3_hal_time_us() - vp->submitted[vp->head];
+    vp->head = (vp->head + 1) % MAX_PENDING;
+    vp->count--;
+    if(strstr(json, "\"error\"") != NULL)
+        failed++;
+    else
+        completed++;
+    EQ3_LOGI("EQ3_SIMFLEET", "%s", json);
+}
+
+/* Consecutive commands to a valve differ so none are dropped as duplicates */
+static bool submit(int n){
+    struct valve_pending *vp = &pending[n];
+    char addr[20], cmd[48];
+    int halfdegrees;
+
+    if(vp->count == MAX_PENDING)
+        return false;
+    halfdegrees = 10 + (vp->sent++ % 49);
+    eq3_sim_address(n, addr, sizeof(addr));
+    snprintf(cmd, sizeof(cmd), "%s settemp %d.%d", addr, halfdegrees / 2, halfdegrees & 1 ? 5 : 0);
+    vp->submitted[(vp->head + vp->count) % MAX_PENDING] = eq3_hal_time_us();
+    vp->count++;
+    if(handle_request(cmd) != 0){
+        vp->count--;
+        return false;
+    }
+    return true;
+}
+
+/* Real elapsed time, whatever the simulated clock does */
+static int64_t wall_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_latency(const void *a, const void *b){
+    int64_t la = *(const int64_t *)a, lb = *(const int64_t *)b;
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+static double percentile_ms(int64_t *sorted, int count, int pct){
+    int idx;
+    if(count == 0)
+        return 0;
+    idx = (count * pct + 99) / 100 - 1;
+    if(idx < 0)
+        idx = 0;
+    return sorted[idx] / 1000.0;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-n valves] [-c commands] [-r commands/s, 0 = all at once] [-l connect ms] [-j jitter ms]\n"
+                    "       [-m notify ms] [-f open fail ms] [-d drop %%] [-o out of range %%] [-s seed] [-x speed] [-q | -v]\n"
+                    "       [-V (virtual time)] [-T seconds (commands = rate x seconds)] [-t trace file] [-C capture file]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    struct eq3_sim_config config;
+    struct eq3_sim_stats stats;
+    int commands = 200, sent = 0, opt, total;
+    double rate = 0.05, capacity;
+    int speed = 1000, duration = 0;
+    bool virtual_time = false;
+    const char *trace_path = NULL, *capture_path = NULL;
+    FILE *trace = NULL;
+    int64_t next_arrival = 0, interval, start, wall_start, busy = 0;
+
+    eq3_sim_default_config(&config);
+    while((opt = getopt(argc, argv, "n:c:r:l:j:m:f:d:o:s:x:T:t:C:Vqv")) != -1){
+        switch(opt){
+        case 'n': config.valves = atoi(optarg); break;
+        case 'c': commands = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'l': config.connect_ms = atoi(optarg); break;
+        case 'j': config.connect_jitter_ms = atoi(optarg); break;
+        case 'm': config.notify_ms = atoi(optarg); break;
+        case 'f': config.open_fail_ms = atoi(optarg); break;
+        case 'd': config.drop_pct = atoi(optarg); break;
+        case 'o': config.out_of_range_pct = atoi(optarg); break;
+        case 's': config.seed = strtoul(optarg, NULL, 0); break;
+        case 'x': speed = atoi(optarg); break;
+        case 'T': duration = atoi(optarg); break;
+        case 't': trace_path = optarg; break;
+        case 'C': capture_path = optarg; break;
+        case 'V': virtual_time = true; break;
+        case 'q': eq3_hal_log_level = 0; break;
+        case 'v': eq3_hal_log_level = 2; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(duration > 0)
+        commands = rate > 0 ? (int)(rate * duration) : commands;
+    if(commands < 1 || eq3_sim_init(&config) != 0){
+        usage(argv[0]);
+        return 1;
+    }
+    pending = calloc(config.valves, sizeof(struct valve_pending));
+    latencies = calloc(commands, sizeof(int64_t));
+    if(pending == NULL || latencies == NULL)
+        return 1;
+
+    if(trace_path != NULL){
+        if((trace = fopen(trace_path, "w")) == NULL){
+            perror(trace_path);
+            return 1;
+        }
+        eq3_linux_set_trace(trace);
+    }
+    if(capture_path != NULL){
+        if((capture_buf = malloc((size_t)MAX_CAPTURE_RECORDS * (EQ3_CAPTURE_RECORD_LEN + EQ3_CAPTURE_DATA_MAX))) == NULL)
+            return 1;
+        eq3_sim_set_capture(capture);
+    }
+
+    eq3_linux_set_virtual_time(virtual_time);
+    eq3_linux_set_speed(speed);
+    eq3_linux_set_report(report);
+    interval = rate > 0 ? (int64_t)(1000000 / rate) : 0;
+    wall_start = wall_us();
+    start = eq3_hal_time_us();
+    next_arrival = start;
+
+    while(1){
+        int64_t wake, due, before;
+        bool idle;
+
+        /* Commands go to the valves in a random order */
+        while(sent < commands && next_arrival <= eq3_hal_time_us()){
+            if(submit(eq3_sim_random() % config.valves))
+                sent++;
+            next_arrival += interval;
+        }
+        eq3_linux_run_timer();
+        due = eq3_sim_run();
+
+        total = completed + failed;
+        if(sent == commands && total >= sent)
+            break;
+        wake = sent < commands ? next_arrival : -1;
+        if(due >= 0 && (wake < 0 || due < wake))
+            wake = due;
+        if(eq3_linux_timer_due() >= 0 && (wake < 0 || eq3_linux_timer_due() < wake))
+            wake = eq3_linux_timer_due();
+        if(wake < 0){
+            fprintf(stderr, "Scheduler stalled with %d of %d commands outstanding\n", sent - total, sent);
+            break;
+        }
+        /* Time with a session running or commands queued is time the hub could not take more */
+        idle = eq3_sched_idle();
+        before = eq3_hal_time_us();
+        eq3_linux_wait(wake);
+        if(idle == false)
+            busy += eq3_hal_time_us() - before;
+    }
+
+    double sim_s = (eq3_hal_time_us() - start) / 1000000.0;
+    double wall_s = (wall_us() - wall_start) / 1000000.0;
+    total = completed + failed;
+    eq3_sim_get_stats(&stats);
+    qsort(latencies, total, sizeof(int64_t), cmp_latency);
+    capacity = busy > 0 ? total * 1000000.0 / busy : 0;
+
+    if(virtual_time == true)
+        printf("valves %d, commands %d, rate %.2f/s, seed %u, virtual time\n", config.valves, sent, rate, (unsigned)config.seed);
+    else
+        printf("valves %d, commands %d, rate %.2f/s, seed %u, speed x%d\n", config.valves, sent, rate, (unsigned)config.seed, speed);
+    printf("completed %d ok, %d failed, %d unmatched reports in %.1f s simulated (%.1f s wall)\n",
+           completed, failed, unmatched, sim_s, wall_s);
+    printf("throughput %.3f commands/s\n", sim_s > 0 ? total / sim_s : 0);
+    printf("latency ms: p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %.0f\n",
+           percentile_ms(latencies, total, 50), percentile_ms(latencies, total, 90), percentile_ms(latencies, total, 99),
+           total > 0 ? latencies[(total * 999 + 999) / 1000 - 1] / 1000.0 : 0, total > 0 ? latencies[total - 1] / 1000.0 : 0);
+    printf("sessions: %d opens, %d open failures, %d drops, %d notifications, %d closes\n",
+           stats.opens, stats.open_failures, stats.drops, stats.notifies, stats.closes);
+    printf("capacity %.3f commands/s (%.1f s of scheduler time per command)",
+           capacity, total > 0 ? busy / 1000000.0 / total : 0);
+    if(rate > 0)
+        printf(", offered %.3f/s (%.0f%% of capacity)\n", rate, capacity > 0 ? rate * 100 / capacity : 0);
+    else
+        printf(", offered all at once\n");
+    if(rate == 0 || rate > capacity)
+        printf("saturated: the queue grew for the whole run, so the latencies depend on -c rather than the scheduler"
+               " - use -r below %.3f to measure it\n", capacity);
+
+    if(trace != NULL)
+        fclose(trace);
+    if(capture_path != NULL){
+        write_capture(capture_path);
+        free(capture_buf);
+    }
+    free(pending);
+    free(latencies);
+    return 0;
+}
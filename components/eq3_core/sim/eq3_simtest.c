@@ -0,0 +1,276 @@
+/*
+ * Scenario tests on the simulated fleet
+ *
+ *   eq3_simtest              run every test
+ *   eq3_simtest -r name      run one (ctest runs them one at a time)
+ *   eq3_simtest -l           list the tests
+ *
+ * Each test drives the scheduler and the simulated fleet in virtual time and checks an outcome
+ * rather than a figure - a command reported once, a scan that finishes. The exit status is the
+ * number of tests that failed.
+ *
+ * Commands reach the hub through a model of a broker holding a persistent session: it delivers
+ * QoS 1 messages while the hub is connected, keeps the ones whose PUBACK was lost and delivers
+ * them again with the dup flag when the hub reconnects. The hub side is the one of eq3_vhub.c
+ * and main/eq3_wifi.c - eq3_dedup_repeat(), then the topic parser and handle_request().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+#include "eq3_hal_linux.h"
+#include "eq3_sim.h"
+
+#define CHECK(cond, fmt, ...) do { if(!(cond)){ fprintf(stderr, "%s: " fmt "\n", test_name, ##__VA_ARGS__); return -1; } } while(0)
+
+struct simtest {
+    const char *name;
+    const char *description;
+    int (*run)(void);
+};
+
+static const char *test_name;
+static int reports, errors;
+static int64_t test_start, scan_done_at;
+
+/* Broker side of the hub's session - QoS 1 messages not yet acknowledged */
+#define BROKER_INFLIGHT 8
+
+struct broker_msg {
+    int msg_id;
+    char topic[80];
+    char payload[8];
+    bool acked;
+};
+
+static struct {
+    struct broker_msg inflight[BROKER_INFLIGHT];
+    int next_id;
+    int commands;               /* Commands handle_request() took */
+} broker;
+static struct eq3_dedup deliveries;
+
+static void count_report(const char *mac_addr, const char *json){
+    if(strstr(json, "\"error\"") != NULL)
+        errors++;
+    else
+        reports++;
+}
+
+static void setup(int valves){
+    struct eq3_sim_config config;
+    eq3_sim_default_config(&config);
+    config.valves = valves;
+    config.out_of_range_pct = 0;
+    config.drop_pct = 0;
+    eq3_linux_set_virtual_time(true);
+    eq3_sim_init(&config);
+    eq3_linux_set_report(count_report);
+    reports = errors = 0;
+    test_start = eq3_hal_time_us();
+    scan_done_at = -1;
+    memset(&broker, 0, sizeof(broker));
+    memset(&deliveries, 0, sizeof(deliveries));
+}
+
+/* A message arriving at the hub as an mqtt data event */
+static void hub_receive(const struct broker_msg *msg, bool dup){
+    char cmd[EQ3_TOPIC_CMD_MAX];
+
+    if(eq3_dedup_repeat(&deliveries, msg->msg_id, dup, msg->topic, strlen(msg->topic), msg->payload, strlen(msg->payload)) == true)
+        return;
+    if(eq3_topic_command(msg->topic, msg->payload, strlen(msg->payload), cmd, sizeof(cmd)) == 0 && handle_request(cmd) == 0)
+        broker.commands++;
+}
+
+/* settemp to valve n at QoS 1 - ack_lost drops the connection before the hub's PUBACK gets back */
+static void broker_publish(int n, const char *temp, bool ack_lost){
+    struct broker_msg *msg = &broker.inflight[broker.next_id % BROKER_INFLIGHT];
+    char addr[20];
+
+    eq3_sim_address(n, addr, sizeof(addr));
+    msg->msg_id = ++broker.next_id;
+    snprintf(msg->topic, sizeof(msg->topic), "testradin/trv/%s/settemp", addr);
+    snprintf(msg->payload, sizeof(msg->payload), "%s", temp);
+    hub_receive(msg, false);
+    msg->acked = !ack_lost;
+}
+
+/* The hub is back with the session present - everything unacknowledged is sent again as a dup */
+static void broker_reconnect(void){
+    int idx;
+    for(idx = 0; idx < BROKER_INFLIGHT; idx++){
+        if(broker.inflight[idx].msg_id != 0 && broker.inflight[idx].acked == false){
+            hub_receive(&broker.inflight[idx], true);
+            broker.inflight[idx].acked = true;
+        }
+    }
+}
+
+/* <id>radin/trv/<address>/settemp to valve n - a different temperature each time so it is never merged */
+static int submit(int n){
+    static int sent = 0;
+    char topic[80], payload[8], addr[20], cmd[EQ3_TOPIC_CMD_MAX];
+    int halfdegrees = 10 + (sent++ % 49);
+
+    eq3_sim_address(n, addr, sizeof(addr));
+    snprintf(topic, sizeof(topic), "testradin/trv/%s/settemp", addr);
+    snprintf(payload, sizeof(payload), "%d.%d", halfdegrees / 2, halfdegrees & 1 ? 5 : 0);
+    if(eq3_topic_command(topic, payload, strlen(payload), cmd, sizeof(cmd)) != 0)
+        return -1;
+    return handle_request(cmd);
+}
+
+/* Run the scheduler and the fleet until the time given, a command every interval_ms (0 for none) */
+static void run_until(int64_t until, int interval_ms, int *sent){
+    int64_t next_cmd = interval_ms > 0 ? eq3_hal_time_us() : -1;
+
+    while(eq3_hal_time_us() < until){
+        int64_t wake = until, due;
+        if(next_cmd >= 0 && next_cmd <= eq3_hal_time_us()){
+            if(submit(*sent % eq3_sim_valves()) == 0)
+                (*sent)++;
+            next_cmd += (int64_t)interval_ms * 1000;
+        }
+        eq3_linux_run_timer();
+        due = eq3_sim_run();
+        if(scan_done_at < 0 && eq3_sim_scanning() == false){
+            struct eq3_sim_stats stats;
+            eq3_sim_get_stats(&stats);
+            if(stats.scans > 0)
+                scan_done_at = eq3_hal_time_us() - test_start;
+        }
+        if(next_cmd >= 0 && next_cmd < wake)
+            wake = next_cmd;
+        if(due >= 0 && due < wake)
+            wake = due;
+        if(eq3_linux_timer_due() >= 0 && eq3_linux_timer_due() < wake)
+            wake = eq3_linux_timer_due();
+        eq3_linux_wait(wake);
+    }
+}
+
+/* Commands faster than the valves can take them - the scan must still finish, and no command may be lost to it */
+static int scan_under_load(void){
+    struct eq3_sim_stats stats;
+    struct eq3_sim_config config;
+    int sent = 0;
+
+    eq3_sim_default_config(&config);
+    setup(10);
+    eq3_sim_scan(30000);
+    run_until(eq3_hal_time_us() + 600 * 1000000LL, 2000, &sent);
+    run_until(eq3_hal_time_us() + 3600 * 1000000LL, 0, &sent);
+    eq3_sim_get_stats(&stats);
+    CHECK(stats.scans == 1, "scan did not finish (%d preempted, %d holds)", stats.scans_preempted, stats.scan_holds);
+    CHECK(stats.scans_preempted <= config.scan_max_preempt, "scan preempted %d times, limit %d", stats.scans_preempted, config.scan_max_preempt);
+    /* Finished well before the load stopped - a few sessions and 30s of scanning */
+    CHECK(scan_done_at < 120 * 1000000LL, "scan took %lld ms", (long long)(scan_done_at / 1000));
+    CHECK(stats.scan_holds > 0, "no command waited for the scan");
+    CHECK(reports + errors == sent, "%d commands sent, %d reported", sent, reports + errors);
+    CHECK(errors == 0, "%d commands failed", errors);
+    return 0;
+}
+
+/* A command every 20s - each one stops the scan, which carries on where it left off */
+static int scan_resumes(void){
+    struct eq3_sim_stats stats;
+    int sent = 0;
+
+    setup(10);
+    eq3_sim_scan(30000);
+    run_until(eq3_hal_time_us() + 300 * 1000000LL, 20000, &sent);
+    eq3_sim_get_stats(&stats);
+    CHECK(stats.scans == 1, "scan did not finish (%d preempted)", stats.scans_preempted);
+    CHECK(stats.scans_preempted >= 1, "scan was never preempted");
+    CHECK(stats.scan_holds == 0, "%d holds with the radio mostly free", stats.scan_holds);
+    /* 30s of scanning plus the sessions that interrupted it */
+    CHECK(scan_done_at < 60 * 1000000LL, "scan took %lld ms", (long long)(scan_done_at / 1000));
+    CHECK(reports == sent, "%d commands sent, %d reported", sent, reports);
+    return 0;
+}
+
+/* The broker drops mid-command and redelivers it after the valve was set - it is carried out once,
+ * while the same setting published again as a new message still is */
+static int redelivery_once(void){
+    struct eq3_sim_stats stats;
+    int sent = 0;
+
+    setup(4);
+    broker_publish(1, "21.5", true);
+    /* The scheduler takes the command on its next tick and opens the session */
+    run_until(eq3_hal_time_us() + 2 * 1000000LL, 0, &sent);
+    CHECK(eq3_sched_busy() == true, "no session running when the connection dropped");
+    /* Offline for a minute - the session finishes and reports */
+    run_until(eq3_hal_time_us() + 60 * 1000000LL, 0, &sent);
+    CHECK(reports == 1, "%d reports before the reconnect", reports);
+    broker_reconnect();
+    run_until(eq3_hal_time_us() + 60 * 1000000LL, 0, &sent);
+    eq3_sim_get_stats(&stats);
+    CHECK(broker.commands == 1, "command carried out %d times", broker.commands);
+    CHECK(deliveries.dropped == 1, "%d redeliveries dropped", deliveries.dropped);
+    CHECK(stats.opens == 1 && reports == 1, "%d sessions, %d reports", stats.opens, reports);
+
+    broker_publish(1, "21.5", false);
+    run_until(eq3_hal_time_us() + 60 * 1000000LL, 0, &sent);
+    CHECK(broker.commands == 2 && reports == 2, "repeated setting: %d commands, %d reports", broker.commands, reports);
+    CHECK(errors == 0, "%d commands failed", errors);
+    return 0;
+}
+
+static const struct simtest tests[] = {
+    { "scan_under_load", "a scan requested under a constant command load finishes after the preempt limit", scan_under_load },
+    { "scan_resumes", "a preempted scan resumes with the time it had left", scan_resumes },
+    { "redelivery_once", "a command redelivered after a broker reconnect is carried out once", redelivery_once },
+};
+
+#define NUM_TESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-r test] [-l (list tests)] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    const char *only = NULL;
+    int opt, idx, ran = 0, failures = 0;
+
+    eq3_hal_log_level = 0;
+    while((opt = getopt(argc, argv, "r:lvh")) != -1){
+        switch(opt){
+        case 'r':
+            only = optarg;
+            break;
+        case 'l':
+            for(idx = 0; idx < NUM_TESTS; idx++)
+                printf("%-16s %s\n", tests[idx].name, tests[idx].description);
+            return 0;
+        case 'v':
+            eq3_hal_log_level = 2;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for(idx = 0; idx < NUM_TESTS; idx++){
+        if(only != NULL && strcmp(only, tests[idx].name) != 0)
+            continue;
+        test_name = tests[idx].name;
+        ran++;
+        if(tests[idx].run() != 0)
+            failures++;
+        else
+            printf("%s: ok\n", test_name);
+    }
+    if(ran == 0){
+        fprintf(stderr, "no test %s\n", only);
+        return 1;
+    }
+    return failures;
+}
@@ -0,0 +1,295 @@
+/*
+ * Virtual hub - the hub's mqtt topics, web endpoints and command pipeline in one Linux process
+ *
+ *   eq3_vhub -b mqtt://127.0.0.1:1883 -i vhub -p 8080 -n 50
+ *
+ * Commands arrive on <id>radin/trv/<address>/<command> or through /sendCommand, go through the
+ * real queue and scheduler to a simulated fleet, and the status comes back on
+ * <id>radout/status/<address> - the same topics as the ESP32. A message on <id>radin/scan
+ * publishes every valve of the fleet as a discovery burst. Mongoose provides both the mqtt
+ * client and the web server, as it does the web server on the ESP32.
+ *
+ * Like the hub it keeps its mqtt session and takes commands at QoS 1, so a command burst
+ * published while the connection is down is delivered when it reconnects - /status counts the
+ * commands and the repeated deliveries that were dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "mongoose.h"
+
+#include "eq3_hal.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
+#include "eq3_hal_linux.h"
+#include "eq3_sim.h"
+
+#define VHUB_TAG "EQ3_VHUB"
+
+#define VHUB_TOPIC_LEN 64
+#define MQTT_RECONNECT_US 3000000
+
+static struct mg_mgr mgr;
+static struct mg_connection *mqtt_conn = NULL;
+static bool mqtt_ready = false;          /* CONNACK received */
+static const char *broker = "mqtt://127.0.0.1:1883";
+static char id[32] = "vhub";
+static char intopicbase[VHUB_TOPIC_LEN];
+static char outtopicbase[VHUB_TOPIC_LEN];
+static volatile bool running = true;
+static struct eq3_dedup deliveries;
+
+/* Counters for /status */
+static struct {
+    int mqtt_commands;
+    int web_commands;
+    int rejected;
+    int reports;
+    int published;
+} counters;
+
+static void publish(const char *topic, const char *data){
+    struct mg_str t = mg_str(topic), d = mg_str(data);
+    if(mqtt_ready == false)
+        return;
+    mg_mqtt_pub(mqtt_conn, &t, &d, 0, false);
+    counters.published++;
+}
+
+/* Command results from the scheduler and the simulated valves */
+static void report(const char *mac_addr, const char *json){
+    char topic[VHUB_TOPIC_LEN + 32];
+    snprintf(topic, sizeof(topic), "%s/status/%s", outtopicbase, mac_addr);
+    publish(topic, json);
+    counters.reports++;
+}
+
+/* Every valve of the fleet as if a scan had just found them all */
+static void discovery_burst(void){
+    char topic[VHUB_TOPIC_LEN + 32];
+    char entry[64], mac_addr[18];
+    int len = 16 + eq3_sim_valves() * (int)sizeof(entry);
+    char *devlist = malloc(len);
+    int wridx, n;
+
+    if(devlist == NULL)
+        return;
+    wridx = snprintf(devlist, len, "{\"devices\":[");
+    for(n = 0; n < eq3_sim_valves(); n++){
+        const uint8_t *bda = eq3_sim_bda(n);
+        if(eq3_sim_in_range(n) == false)
+            continue;
+        sprintf(mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+        snprintf(entry, sizeof(entry), "{\"rssi\":%d,\"bleaddr\":\"%s\"}", eq3_sim_rssi(n), mac_addr);
+        snprintf(topic, sizeof(topic), "%s/device/%s", outtopicbase, mac_addr);
+        publish(topic, entry);
+        wridx += snprintf(&devlist[wridx], len - wridx, "%s%s", wridx > 12 ? "," : "", entry);
+    }
+    snprintf(&devlist[wridx], len - wridx, "]}");
+    snprintf(topic, sizeof(topic), "%s/devlist", outtopicbase);
+    publish(topic, devlist);
+    free(devlist);
+}
+
+static void mqtt_message(struct mg_mqtt_message *mm){
+    char topic[VHUB_TOPIC_LEN + 64];
+    char cmd[EQ3_TOPIC_CMD_MAX];
+    /* The dup flag is bit 3 of the fixed header */
+    bool dup = mm->dgram.len > 0 && (mm->dgram.ptr[0] & 0x08) != 0;
+
+    if(eq3_dedup_repeat(&deliveries, mm->qos > 0 ? mm->id : 0, dup, mm->topic.ptr, (int)mm->topic.len,
+                        mm->data.ptr, (int)mm->data.len) == true)
+        return;
+    snprintf(topic, sizeof(topic), "%.*s", (int)mm->topic.len, mm->topic.ptr);
+    if(strstr(topic, "/trv") != NULL){
+        if(eq3_topic_command(topic, mm->data.ptr, (int)mm->data.len, cmd, sizeof(cmd)) == 0 && handle_request(cmd) == 0)
+            counters.mqtt_commands++;
+        else
+            counters.rejected++;
+    }
+    if(strstr(topic, "/scan") != NULL)
+        discovery_burst();
+    if(strstr(topic, "/check") != NULL){
+        snprintf(topic, sizeof(topic), "%s/checkresp", outtopicbase);
+        publish(topic, "sw ver vhub");
+    }
+}
+
+static void mqtt_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_data){
+    switch(ev){
+    case MG_EV_ERROR:
+        EQ3_LOGE(VHUB_TAG, "mqtt error %s", (char *)ev_data);
+        break;
+    case MG_EV_MQTT_OPEN: {
+        char topic[VHUB_TOPIC_LEN + 16];
+        struct mg_str t;
+        EQ3_LOGI(VHUB_TAG, "Connected to %s", broker);
+        mqtt_ready = true;
+        snprintf(topic, sizeof(topic), "%s/#", intopicbase);
+        t = mg_str(topic);
+        mg_mqtt_sub(c, &t, 1);
+        snprintf(topic, sizeof(topic), "%s/connect", outtopicbase);
+        publish(topic, "Heating control (virtual hub) active");
+        break;
+    }
+    case MG_EV_MQTT_MSG:
+        mqtt_message((struct mg_mqtt_message *)ev_data);
+        break;
+    case MG_EV_CLOSE:
+        EQ3_LOGW(VHUB_TAG, "mqtt connection closed");
+        if(c == mqtt_conn){
+            mqtt_conn = NULL;
+            mqtt_ready = false;
+        }
+        break;
+    }
+}
+
+static void mqtt_connect(void){
+    struct mg_mqtt_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.client_id = mg_str(id);
+    opts.clean = false;
+    opts.keepalive = 60;
+    mqtt_conn = mg_mqtt_connect(&mgr, broker, &opts, mqtt_handler, NULL);
+}
+
+/* /status - what the scheduler and the simulated fleet have been doing */
+static void serve_status(struct mg_connection *c){
+    struct eq3_sim_stats stats;
+    eq3_sim_get_stats(&stats);
+    mg_http_reply(c, 200, "Content-Type: application/json\r\n",
+                  "{\"mqtt\":%s,\"busy\":%s,\"idle\":%s,\"mqtt_commands\":%d,\"duplicates\":%d,\"web_commands\":%d,\"rejected\":%d,"
+                  "\"reports\":%d,\"published\":%d,\"opens\":%d,\"open_failures\":%d,\"drops\":%d,\"notifications\":%d}\n",
+                  mqtt_ready ? "true" : "false", eq3_sched_busy() ? "true" : "false", eq3_sched_idle() ? "true" : "false",
+                  counters.mqtt_commands, deliveries.dropped, counters.web_commands, counters.rejected, counters.reports, counters.published,
+                  stats.opens, stats.open_failures, stats.drops, stats.notifies);
+}
+
+/* / and /getdevices - the valves of the fleet */
+static void serve_device_list(struct mg_connection *c){
+    int len = 256 + eq3_sim_valves() * 80;
+    char *html = malloc(len);
+    int wridx, n;
+
+    if(html == NULL){
+        mg_http_reply(c, 500, "", "No memory\n");
+        return;
+    }
+    wridx = snprintf(html, len, "<html><head><title>EQ-3 virtual hub</title></head><body><h2>Valves</h2><table>"
+                                "<tr><th>Address</th><th>rssi</th><th>In range</th></tr>");
+    for(n = 0; n < eq3_sim_valves() && wridx < len; n++){
+        const uint8_t *bda = eq3_sim_bda(n);
+        wridx += snprintf(&html[wridx], len - wridx, "<tr><td>%02X:%02X:%02X:%02X:%02X:%02X</td><td>%d</td><td>%s</td></tr>",
+                          bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], eq3_sim_rssi(n), eq3_sim_in_range(n) ? "yes" : "no");
+    }
+    if(wridx < len)
+        snprintf(&html[wridx], len - wridx, "</table></body></html>");
+    mg_http_reply(c, 200, "Content-Type: text/html\r\n", "%s", html);
+    free(html);
+}
+
+static void http_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_data){
+    struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+    if(ev != MG_EV_HTTP_MSG)
+        return;
+    if(mg_http_match_uri(hm, "/sendCommand")){
+        /* Same form fields as the hub's command page */
+        char devstr[19], cmdstr[16], valstr[15], request[52];
+        devstr[0] = cmdstr[0] = valstr[0] = 0;
+        mg_http_get_var(&hm->body, "device", devstr, sizeof(devstr));
+        mg_http_get_var(&hm->body, "command", cmdstr, sizeof(cmdstr));
+        mg_http_get_var(&hm->body, "value", valstr, sizeof(valstr));
+        snprintf(request, sizeof(request), "%s %s %s", devstr, cmdstr, valstr);
+        if(handle_request(request) == 0){
+            counters.web_commands++;
+            mg_http_reply(c, 200, "Content-Type: text/plain\r\n", "Command submitted\n");
+        }else{
+            counters.rejected++;
+            mg_http_reply(c, 400, "Content-Type: text/plain\r\n", "Command error\n");
+        }
+    }else if(mg_http_match_uri(hm, "/status")){
+        serve_status(c);
+    }else if(mg_http_match_uri(hm, "/") || mg_http_match_uri(hm, "/getdevices")){
+        serve_device_list(c);
+    }else{
+        mg_http_reply(c, 404, "", "Not found\n");
+    }
+}
+
+static void stop(int sig){
+    running = false;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-b broker url] [-i mqtt id] [-p http port] [-n valves] [-l connect ms] [-d drop %%]\n"
+                    "       [-o out of range %%] [-s seed] [-q | -v]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    struct eq3_sim_config config;
+    char listen_url[32];
+    int port = 8080, opt;
+    int64_t reconnect_at = 0;
+
+    eq3_sim_default_config(&config);
+    while((opt = getopt(argc, argv, "b:i:p:n:l:d:o:s:qv")) != -1){
+        switch(opt){
+        case 'b': broker = optarg; break;
+        case 'i': snprintf(id, sizeof(id), "%s", optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'n': config.valves = atoi(optarg); break;
+        case 'l': config.connect_ms = atoi(optarg); break;
+        case 'd': config.drop_pct = atoi(optarg); break;
+        case 'o': config.out_of_range_pct = atoi(optarg); break;
+        case 's': config.seed = strtoul(optarg, NULL, 0); break;
+        case 'q': eq3_hal_log_level = 0; break;
+        case 'v': eq3_hal_log_level = 2; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(eq3_sim_init(&config) != 0){
+        usage(argv[0]);
+        return 1;
+    }
+    snprintf(intopicbase, sizeof(intopicbase), "%sradin", id);
+    snprintf(outtopicbase, sizeof(outtopicbase), "%sradout", id);
+    eq3_linux_set_report(report);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    mg_mgr_init(&mgr);
+    snprintf(listen_url, sizeof(listen_url), "http://0.0.0.0:%d", port);
+    if(mg_http_listen(&mgr, listen_url, http_handler, NULL) == NULL){
+        EQ3_LOGE(VHUB_TAG, "Can't listen on %s", listen_url);
+        return 1;
+    }
+    printf("virtual hub %s: %d valves, web on port %d, broker %s\n", id, config.valves, port, broker);
+
+    while(running){
+        int64_t now = eq3_hal_time_us(), wake, due;
+        int poll_ms;
+
+        if(mqtt_conn == NULL && now >= reconnect_at){
+            mqtt_connect();
+            reconnect_at = now + MQTT_RECONNECT_US;
+        }
+        eq3_linux_run_timer();
+        due = eq3_sim_run();
+
+        /* Sleep in the mongoose poll until the scheduler or a valve has something to do */
+        wake = now + 1000000;
+        if(due >= 0 && due < wake)
+            wake = due;
+        if(eq3_linux_timer_due() >= 0 && eq3_linux_timer_due() < wake)
+            wake = eq3_linux_timer_due();
+        poll_ms = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        mg_mgr_poll(&mgr, poll_ms);
+    }
+    mg_mgr_free(&mgr);
+    return 0;
+}
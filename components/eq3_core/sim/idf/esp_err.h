@@ -0,0 +1,12 @@
+#ifndef ESP_ERR_H
+#define ESP_ERR_H
+
+/* ESP-IDF error codes used by the modules from main/ built on the host */
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+
+#endif
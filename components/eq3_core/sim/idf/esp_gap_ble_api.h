@@ -0,0 +1,11 @@
+#ifndef ESP_GAP_BLE_API_H
+#define ESP_GAP_BLE_API_H
+
+/* The Bluedroid types used in the headers of main/ */
+
+#include <stdint.h>
+
+typedef uint8_t esp_bd_addr_t[6];
+typedef uint8_t esp_ble_addr_type_t;
+
+#endif
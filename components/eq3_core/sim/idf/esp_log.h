@@ -0,0 +1,15 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+/* ESP-IDF logging for the modules from main/ built on the host - goes to the eq3_core host log */
+
+#include "eq3_hal.h"
+
+#define ESP_LOGE(tag, fmt, ...) EQ3_LOGE(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) EQ3_LOGW(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) EQ3_LOGI(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { } while(0)
+
+#define esp_log_buffer_hex(tag, buf, len) do { } while(0)
+
+#endif
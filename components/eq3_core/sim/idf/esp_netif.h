@@ -0,0 +1,25 @@
+#ifndef ESP_NETIF_H
+#define ESP_NETIF_H
+
+/* The station interface for the modules from main/ built on the host - always up at 192.168.1.60 */
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef struct {
+    uint32_t addr;              /* Network byte order */
+} esp_ip4_addr_t;
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *if_key);
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info);
+
+#endif
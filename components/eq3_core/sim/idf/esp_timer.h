@@ -0,0 +1,10 @@
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+/* The esp_timer clock is the Linux port clock, so virtual time moves it too */
+
+#include "eq3_hal.h"
+
+#define esp_timer_get_time() eq3_hal_time_us()
+
+#endif
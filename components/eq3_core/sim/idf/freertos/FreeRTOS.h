@@ -0,0 +1,23 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+/*
+ * FreeRTOS for the modules from main/ built on the host. The tests call into a module from one
+ * thread, so a task only runs a pass of its loop when a test asks and a mutex only records the
+ * order locks are taken in - taking a held lock or taking two locks in both orders is reported as
+ * a deadlock.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffu
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#endif
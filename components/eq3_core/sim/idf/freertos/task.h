@@ -0,0 +1,19 @@
+#ifndef FREERTOS_TASK_H
+#define FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *parm);
+
+/* Tasks only run when a test asks - the handle is returned so notifications can be counted */
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack, void *parm, int priority, TaskHandle_t *handle);
+void xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+void vTaskDelay(TickType_t ticks);
+
+/* One pass of the loop of every task created with this name - from its first ulTaskNotifyTake(),
+ * which returns as if the wait timed out, to the next one. Returns the number of tasks run */
+int idf_run_tasks(const char *name);
+
+#endif
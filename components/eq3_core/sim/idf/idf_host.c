@@ -0,0 +1,198 @@
+/*
+ * FreeRTOS tasks and mutexes for the modules from main/ built on the host
+ *
+ * Everything runs on the test's thread. A mutex never blocks - it keeps track of which locks are
+ * held and in which order they have been taken. A recursive mutex taken again by its holder only
+ * counts the depth, as it doesn't wait. Taking a lock that is already held, or taking
+ * lock b while holding a when a has been taken while holding b before, is a deadlock on the hub
+ * and is logged and counted for idf_lock_errors().
+ *
+ * The station interface is up at 192.168.1.60 and NVS never opens, as on a hub whose nvs
+ * partition is missing - callers fall back to publishing everything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "eq3_hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_netif.h"
+#include "nvs.h"
+
+#define IDF_TAG "IDF_HOST"
+
+#define IDF_MAX_MUTEXES 32
+#define IDF_MAX_TASKS 16
+
+struct idf_mutex {
+    int index;
+    bool held;
+    bool recursive;
+    int depth;
+};
+
+struct idf_task {
+    TaskFunction_t func;
+    const char *name;
+    void *parm;
+};
+
+static struct idf_mutex mutexes[IDF_MAX_MUTEXES];
+static int num_mutexes = 0;
+static bool taken_before[IDF_MAX_MUTEXES][IDF_MAX_MUTEXES];     /* [a][b] - b was taken while a was held */
+static int lock_errors = 0;
+static struct idf_task tasks[IDF_MAX_TASKS];
+static int num_tasks = 0;
+static jmp_buf task_pass;           /* Back to idf_run_tasks() at the end of a pass */
+static int task_waits = -1;         /* ulTaskNotifyTake() calls in this pass, -1 outside one */
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void){
+    if(num_mutexes == IDF_MAX_MUTEXES)
+        return NULL;
+    mutexes[num_mutexes].index = num_mutexes;
+    mutexes[num_mutexes].held = false;
+    mutexes[num_mutexes].recursive = false;
+    mutexes[num_mutexes].depth = 0;
+    return &mutexes[num_mutexes++];
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void){
+    SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    if(mutex != NULL)
+        mutex->recursive = true;
+    return mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t wait){
+    if(mutex->held == true){
+        mutex->depth++;
+        return pdTRUE;
+    }
+    if(xSemaphoreTake(mutex, wait) != pdTRUE)
+        return pdFALSE;
+    mutex->depth = 1;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex){
+    if(mutex->held == false)
+        return pdFALSE;
+    if(--mutex->depth == 0)
+        mutex->held = false;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t wait){
+    int i;
+
+    if(mutex->held == true){
+        EQ3_LOGE(IDF_TAG, "Mutex %d taken while held", mutex->index);
+        lock_errors++;
+        return pdFALSE;
+    }
+    for(i = 0; i < num_mutexes; i++){
+        if(mutexes[i].held == false)
+            continue;
+        if(taken_before[mutex->index][i] == true){
+            EQ3_LOGE(IDF_TAG, "Mutexes %d and %d taken in both orders", i, mutex->index);
+            lock_errors++;
+        }
+        taken_before[i][mutex->index] = true;
+    }
+    mutex->held = true;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex){
+    if(mutex->held == false)
+        return pdFALSE;
+    mutex->held = false;
+    return pdTRUE;
+}
+
+int idf_lock_errors(void){
+    int errors = lock_errors;
+    lock_errors = 0;
+    return errors;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack, void *parm, int priority, TaskHandle_t *handle){
+    if(num_tasks == IDF_MAX_TASKS)
+        return pdFALSE;
+    tasks[num_tasks].func = task;
+    tasks[num_tasks].name = name;
+    tasks[num_tasks].parm = parm;
+    num_tasks++;
+    if(handle != NULL)
+        *handle = (TaskHandle_t)(intptr_t)num_tasks;
+    return pdPASS;
+}
+
+void xTaskNotifyGive(TaskHandle_t task){
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait){
+    if(task_waits >= 0 && task_waits++ > 0)
+        longjmp(task_pass, 1);
+    return 0;
+}
+
+int idf_run_tasks(const char *name){
+    volatile int idx, ran = 0;
+
+    for(idx = 0; idx < num_tasks; idx++){
+        if(strcmp(tasks[idx].name, name) != 0)
+            continue;
+        task_waits = 0;
+        if(setjmp(task_pass) == 0)
+            tasks[idx].func(tasks[idx].parm);
+        task_waits = -1;
+        ran++;
+    }
+    return ran;
+}
+
+void vTaskDelay(TickType_t ticks){
+}
+
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *if_key){
+    return NULL;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info){
+    uint8_t *addr = (uint8_t *)&ip_info->ip.addr;
+    addr[0] = 192;
+    addr[1] = 168;
+    addr[2] = 1;
+    addr[3] = 60;
+    ip_info->netmask.addr = 0x00ffffff;
+    ip_info->gw.addr = 0;
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle){
+    return ESP_FAIL;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value){
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value){
+    return ESP_FAIL;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key){
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle){
+    return ESP_FAIL;
+}
+
+void nvs_close(nvs_handle_t handle){
+}
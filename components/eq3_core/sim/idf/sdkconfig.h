@@ -0,0 +1,19 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+/*
+ * Configuration for the modules from main/ built on the host by the tests - the multi hub
+ * options with the Kconfig defaults and Home Assistant device discovery. -DEQ3_HOST_SINGLE_HUB
+ * builds a module for a hub on its own.
+ */
+
+#ifndef EQ3_HOST_SINGLE_HUB
+#define CONFIG_EQ3_MULTI_HUB 1
+#endif
+#define CONFIG_EQ3_HUB_TOPIC "eq3hub"
+#define CONFIG_EQ3_HUB_HYSTERESIS 6
+#define CONFIG_EQ3_HUB_REPORT_INTERVAL 60
+#define CONFIG_EQ3_HUB_MIN_RSSI -90
+#define CONFIG_EQ3_HA_DEVICE_DISCOVERY 1
+
+#endif
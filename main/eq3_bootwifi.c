@@ -29,6 +29,7 @@
 #include "eq3_main.h"
 #include "eq3_gap.h"
 #include "eq3_wifi.h"
+#include "eq3_capture_ring.h"
 
 /* Webcontent */
 #include "eq3_htmlpages.h"
@@ -282,6 +283,21 @@ static int mongoose_serve_config_page(struct mg_connection *nc){
     return 0;
 }
 
+/* Serve the BLE capture ring as a file for eq3_replay */
+static int mongoose_serve_capture(struct mg_connection *nc){
+    uint8_t *capture;
+    int len = eq3_capture_export(&capture);
+    if(len < 0){
+        mg_http_reply(nc, 404, "Content-Type: text/plain\n", "Capture disabled\n");
+        return -1;
+    }
+    mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                  "Content-Disposition: attachment; filename=\"eq3.cap\"\r\nContent-Length: %d\r\n\r\n", len);
+    mg_send(nc, capture, len);
+    free(capture);
+    return 0;
+}
+
 /* Serve a found device list page */
 static int mongoose_serve_device_list(struct mg_connection *nc){
     int wridx = 0;
@@ -295,10 +311,9 @@ static int mongoose_serve_device_list(struct mg_connection *nc){
             /* Copy header into buffer */
             wridx += sprintf(&devlisthtml[wridx], devlisthead);
             /* Collate device list in buffer */
-            while(devwalk != NULL){
+            for(int devnum = 0; devnum < numdevices; devnum++, devwalk++){
                 wridx += sprintf(&devlisthtml[wridx], devlistentry, devwalk->bda[0], devwalk->bda[1], devwalk->bda[2], 
                      devwalk->bda[3], devwalk->bda[4], devwalk->bda[5], devwalk->rssi); 	
-                devwalk = devwalk->next;
             }
         
             /* Copy footer into buffer */
@@ -330,11 +345,10 @@ static int mongoose_serve_command_list(struct mg_connection *nc){
             /* Copy header into buffer */
             wridx += sprintf(&devlisthtml[wridx], command_device_head);
             /* Collate device list in buffer */
-            while(devwalk != NULL){
+            for(int devnum = 0; devnum < numdevices; devnum++, devwalk++){
                 char bleaddr[18];
                 sprintf(bleaddr, "%02X:%02X:%02X:%02X:%02X:%02X", devwalk->bda[0], devwalk->bda[1], devwalk->bda[2], devwalk->bda[3], devwalk->bda[4], devwalk->bda[5]);
                 wridx += sprintf(&devlisthtml[wridx], select_device_entry, bleaddr, bleaddr);
-                devwalk = devwalk->next;
             }
         
             /* Copy footer into buffer */
@@ -384,7 +398,9 @@ static int mongoose_serve_status(struct mg_connection *nc){
         //nc->flags |= MG_F_SEND_AND_CLOSE;
     }else{
         char status[14];
+        char ready[16] = "-";
         int64_t uptime = esp_timer_get_time();
+        int64_t readytime = mqtt_ready_time();
         uint32_t days;
         uint8_t hours, minutes;
         mqttconnstate connected = ismqttconnected();
@@ -400,6 +416,8 @@ static int mongoose_serve_status(struct mg_connection *nc){
                 sprintf(status, "Not connected");
                 break;
         }
+        if(readytime != 0)
+            sprintf(ready, "%d mS", (int)(readytime / 1000));
         uptime /= 1000000;
         days = uptime / 86400;
         uptime -= (days * 86400);
@@ -407,8 +425,11 @@ static int mongoose_serve_status(struct mg_connection *nc){
         uptime -= (hours * 3600);
         minutes = uptime / 60;
         uptime -= (minutes * 60);
-        char *htmlstr = malloc(strlen(connectedstatus) + strlen(connectionInfo.mqtturl) + strlen(connectionInfo.mqttid) + 15 + 10);
-        sprintf(htmlstr, connectedstatus, connectionInfo.mqtturl, connectionInfo.mqttid, status, (int)days, hours, minutes, (uint8_t)uptime);
+        const char *radio = radio_state();
+        char buffered[80];
+        status_buffer_describe(buffered, sizeof(buffered));
+        char *htmlstr = malloc(strlen(connectedstatus) + strlen(connectionInfo.mqtturl) + strlen(connectionInfo.mqttid) + 15 + 10 + sizeof(ready) + strlen(radio) + strlen(buffered));
+        sprintf(htmlstr, connectedstatus, connectionInfo.mqtturl, connectionInfo.mqttid, status, (int)days, hours, minutes, (uint8_t)uptime, ready, radio, buffered);
         mongoose_serve_content(nc, htmlstr, true);
         free(htmlstr);
         //nc->flags |= MG_F_SEND_AND_CLOSE;
@@ -488,9 +509,9 @@ static void mongoose_event_handler(struct mg_connection *nc, int ev, void *evDat
                 valstr = getqueryarg(query, "value");
                 if(devstr != NULL && cmdstr != NULL){
                     if(valstr != NULL)
-                        sprintf(request, "%s %s %s", devstr, cmdstr, valstr);
+                        snprintf(request, sizeof(request), "%s %s %s", devstr, cmdstr, valstr);
                     else
-                        sprintf(request, "%s %s", devstr, cmdstr);
+                        snprintf(request, sizeof(request), "%s %s", devstr, cmdstr);
                     ESP_LOGI(tag, "Http set command %s\n", request);
                     if(handle_request(request) == 0){
                         mg_http_reply(nc, 200, 0, "Content-Type: text/plain\n", "");
@@ -583,7 +604,7 @@ static void mongoose_event_handler(struct mg_connection *nc, int ev, void *evDat
                 mg_http_get_var(&message->body, "device", devstr, 18);
                 mg_http_get_var(&message->body, "command", cmdstr, 15);
                 mg_http_get_var(&message->body, "value", valstr, 14);
-                sprintf(request, "%s %s %s", devstr, cmdstr, valstr);
+                snprintf(request, sizeof(request), "%s %s %s", devstr, cmdstr, valstr);
                 if(handle_request(request) == 0){
                     mongoose_serve_content(nc, (char *)commandsubmitted, true);
                 }else{
@@ -594,8 +615,10 @@ static void mongoose_event_handler(struct mg_connection *nc, int ev, void *evDat
                 mongoose_serve_device_list(nc);
             }else if(strcmp(uri, "/status") == 0){
                 mongoose_serve_status(nc);
+            }else if(strcmp(uri, "/capture") == 0){
+                mongoose_serve_capture(nc);
             }else if(strcmp(uri, "/scan") == 0){
-                start_scan();
+                eq3gap_request_scan();
                 mongoose_serve_content(nc, (char *)scanning, true);
                 //nc->flags |= MG_F_SEND_AND_CLOSE;
             }else if(strcmp(uri, "/upload") == 0){
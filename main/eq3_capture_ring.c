@@ -0,0 +1,94 @@
+/*
+ * Capture of GATT traffic with the valves
+ *
+ * Every command queued and every open, write, notification and disconnect goes into a fixed ring
+ * in RAM, the oldest record being overwritten once it is full. The ring is exported in the
+ * eq3_capture format on /capture and <mqttid>radout/capture so field problems can be replayed on
+ * a host with eq3_replay.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eq3_capture.h"
+#include "eq3_capture_ring.h"
+
+#define CAPTURE_TAG "EQ3_CAPTURE"
+
+#if CONFIG_EQ3_CAPTURE_RECORDS > 0
+static struct eq3_capture_record ring[CONFIG_EQ3_CAPTURE_RECORDS];
+static int ring_next = 0;       /* Slot the next record goes in */
+static int ring_count = 0;
+/* Records come from the BLE task, exports from the mqtt and web server tasks */
+static SemaphoreHandle_t ring_lock = NULL;
+#endif
+
+void eq3_capture_init(void){
+#if CONFIG_EQ3_CAPTURE_RECORDS > 0
+    ring_lock = xSemaphoreCreateMutex();
+#endif
+}
+
+void eq3_capture_add(uint8_t type, const uint8_t *bda, uint16_t handle, const uint8_t *data, int len){
+#if CONFIG_EQ3_CAPTURE_RECORDS > 0
+    struct eq3_capture_record *rec;
+    if(ring_lock == NULL)
+        return;
+    if(len > EQ3_CAPTURE_DATA_MAX)
+        len = EQ3_CAPTURE_DATA_MAX;
+    xSemaphoreTake(ring_lock, portMAX_DELAY);
+    rec = &ring[ring_next];
+    rec->time_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    rec->type = type;
+    rec->len = len > 0 ? len : 0;
+    memcpy(rec->bda, bda, sizeof(rec->bda));
+    rec->handle = handle;
+    if(rec->len > 0)
+        memcpy(rec->data, data, rec->len);
+    ring_next = (ring_next + 1) % CONFIG_EQ3_CAPTURE_RECORDS;
+    if(ring_count < CONFIG_EQ3_CAPTURE_RECORDS)
+        ring_count++;
+    xSemaphoreGive(ring_lock);
+#endif
+}
+
+void eq3_capture_clear(void){
+#if CONFIG_EQ3_CAPTURE_RECORDS > 0
+    if(ring_lock == NULL)
+        return;
+    xSemaphoreTake(ring_lock, portMAX_DELAY);
+    ring_next = 0;
+    ring_count = 0;
+    xSemaphoreGive(ring_lock);
+#endif
+}
+
+int eq3_capture_export(uint8_t **buf){
+#if CONFIG_EQ3_CAPTURE_RECORDS > 0
+    int len, idx, wridx, slot;
+    if(ring_lock == NULL)
+        return -1;
+    /* Room for every record at its longest - only the used part is sent */
+    len = EQ3_CAPTURE_HEADER_LEN + CONFIG_EQ3_CAPTURE_RECORDS * (EQ3_CAPTURE_RECORD_LEN + EQ3_CAPTURE_DATA_MAX);
+    if((*buf = malloc(len)) == NULL){
+        ESP_LOGE(CAPTURE_TAG, "No memory for capture export");
+        return -1;
+    }
+    xSemaphoreTake(ring_lock, portMAX_DELAY);
+    wridx = eq3_capture_put_header(*buf, len, ring_count);
+    slot = (ring_next + CONFIG_EQ3_CAPTURE_RECORDS - ring_count) % CONFIG_EQ3_CAPTURE_RECORDS;
+    for(idx = 0; idx < ring_count; idx++){
+        wridx += eq3_capture_put_record(&(*buf)[wridx], len - wridx, &ring[slot]);
+        slot = (slot + 1) % CONFIG_EQ3_CAPTURE_RECORDS;
+    }
+    xSemaphoreGive(ring_lock);
+    ESP_LOGI(CAPTURE_TAG, "Exported %d records (%d bytes)", idx, wridx);
+    return wridx;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef EQ3_CAPTURE_RING_H
+#define EQ3_CAPTURE_RING_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* RAM ring of the last CONFIG_EQ3_CAPTURE_RECORDS BLE events - does nothing when that is 0 */
+void eq3_capture_init(void);
+void eq3_capture_add(uint8_t type, const uint8_t *bda, uint16_t handle, const uint8_t *data, int len);
+void eq3_capture_clear(void);
+
+/* Capture file of the ring, oldest record first - returns its length (caller frees *buf) or -1 */
+int eq3_capture_export(uint8_t **buf);
+
+#endif
@@ -33,6 +33,7 @@
 #include "driver/uart.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "esp_bt.h"
 #include "esp_gap_ble_api.h"
@@ -42,81 +43,141 @@
 
 #include "eq3_wifi.h"
 #include "eq3_gap.h"
+#include "eq3_status.h"
+#include "eq3_radio.h"
+#include "eq3_registry.h"
 
 #define EQ3_DBG_TAG "EQ3_CTRL"
 
-// For string handling
-#define N_ELEMS(x) ( sizeof(x) / sizeof((x)[0]) )
-typedef const char *ConstString;
-
-// Matching names for GAP scanning of remote devices
-static ConstString remote_device_names[] = {
-	"CC-RT-M-BLE",
-	"CC-RT-BLE",
+// Matching names for GAP scanning of remote devices - lengths are worked out at compile time
+#define EQ3_NAME(n) { n, sizeof(n) - 1 }
+static const struct {
+    const char *name;
+    uint8_t len;
+} remote_device_names[] = {
+	EQ3_NAME("CC-RT-M-BLE"),
+	EQ3_NAME("CC-RT-BLE"),
 };
+#define N_NAMES ( sizeof(remote_device_names) / sizeof(remote_device_names[0]) )
 
 ///Declare static functions
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
 
 static void scan_done(void);
+static void start_scan(void);
+static void device_found(struct found_device *dev);
 
 static bool gap_scanning = false;
 static bool gap_initialised = false;
 
-static struct found_device *found_devices = NULL;
+/* Found devices are held in discovery order in found_devices[]. device_index[] is an open addressing
+ * hash table (linear probing) keyed by the bluetooth address holding the position in found_devices[]
+ * so an advertisement is matched to its device without walking the list */
+#define DEVICE_INDEX_SIZE (EQ3_MAX_DEVICES * 2)
+#define DEVICE_INDEX_EMPTY 0xff
+
+static struct found_device found_devices[EQ3_MAX_DEVICES];
+static uint8_t device_index[DEVICE_INDEX_SIZE];
 static int num_devices = 0;
 
-static void free_found_devices(){
-    struct found_device *nextdev, *thisdev = found_devices;
-    while(thisdev != NULL){
-        nextdev = thisdev->next;
-	free(thisdev);
-	thisdev = nextdev;
+static void init_found_devices(){
+    static bool table_initialised = false;
+    if(table_initialised == false){
+        memset(device_index, DEVICE_INDEX_EMPTY, sizeof(device_index));
+        num_devices = 0;
+        table_initialised = true;
     }
-    found_devices = NULL;
-    num_devices = 0;
-}
-
-int add_found_device(esp_bd_addr_t *bda, int rssi){
-    int rc = 0;
-    struct found_device *lastdev, *walkdevs = found_devices;
-    if(found_devices == NULL){
-        walkdevs = malloc(sizeof(struct found_device));
-	if(walkdevs != NULL){
-	    walkdevs->next = NULL;
-	    memcpy(&walkdevs->bda, bda, sizeof(esp_bd_addr_t));
-            walkdevs->rssi = rssi;
-	    found_devices = walkdevs;
-	    //ESP_LOGI(EQ3_DBG_TAG, "Started list:");
-	    num_devices++;
-	    //esp_log_buffer_hex(EQ3_DBG_TAG, walkdevs->bda, sizeof(esp_bd_addr_t));
-            //ESP_LOGI(EQ3_DBG_TAG, "RSSI %d", rssi);
-	}
-    }else{
-	lastdev = NULL;
-	while(walkdevs != NULL){
-	    if(memcmp(&walkdevs->bda, bda, sizeof(esp_bd_addr_t)) == 0)
-	        break;
-	    lastdev = walkdevs;
-	    walkdevs = walkdevs->next;
-	}
-	if(walkdevs == NULL){
-	    walkdevs = malloc(sizeof(struct found_device));
-	    if(walkdevs != NULL){
-	        walkdevs->next = NULL;
-	        memcpy(&walkdevs->bda, bda, sizeof(esp_bd_addr_t));
-                walkdevs->rssi = rssi;
-	        lastdev->next = walkdevs;
-		//ESP_LOGI(EQ3_DBG_TAG, "Added to list:");
-		num_devices++;
-		//esp_log_buffer_hex(EQ3_DBG_TAG, walkdevs->bda, sizeof(esp_bd_addr_t));
-                //ESP_LOGI(EQ3_DBG_TAG, "RSSI %d", rssi);
-	    }
-	}else{
-	    rc = 1;
-	}
+}
+
+/* Hash of the 48-bit address - the last 3 bytes are the device specific part */
+static int device_hash(const uint8_t *bda){
+    uint32_t key = ((uint32_t)bda[0] << 8 | bda[1]) ^ ((uint32_t)bda[2] << 24 | (uint32_t)bda[3] << 16 | (uint32_t)bda[4] << 8 | bda[5]);
+    return (key * 2654435761u) >> 16 & (DEVICE_INDEX_SIZE - 1);
+}
+
+/* Find a device in the table - if not found *slot is the free index slot for it */
+static struct found_device *find_device(const uint8_t *bda, int *slot){
+    struct found_device *dev;
+    int idx = device_hash(bda);
+
+    while(device_index[idx] != DEVICE_INDEX_EMPTY){
+        dev = &found_devices[device_index[idx]];
+        if(memcmp(dev->bda, bda, sizeof(esp_bd_addr_t)) == 0)
+            return dev;
+        idx = (idx + 1) & (DEVICE_INDEX_SIZE - 1);
+    }
+    if(slot != NULL)
+        *slot = idx;
+    return NULL;
+}
+
+/* Update the rssi statistics of a device from an advertisement */
+static void update_device(struct found_device *dev, int rssi){
+    /* First sighting of a valve loaded from the registry */
+    if(dev->last_seen == 0){
+        dev->rssi_min = dev->rssi_max = rssi;
+        dev->rssi_ewma = rssi * EQ3_RSSI_EWMA_SCALE;
+    }
+    dev->rssi = rssi;
+    if(rssi < dev->rssi_min)
+        dev->rssi_min = rssi;
+    if(rssi > dev->rssi_max)
+        dev->rssi_max = rssi;
+    /* ewma with alpha 1/8 */
+    dev->rssi_ewma += ((rssi * EQ3_RSSI_EWMA_SCALE) - dev->rssi_ewma) / 8;
+    dev->last_seen = esp_timer_get_time();
+}
+
+static void init_link(struct found_device *dev){
+    dev->conn_rssi = EQ3_RSSI_UNKNOWN;
+    dev->sessions = 0;
+    dev->open_failures = 0;
+    dev->drops = 0;
+    dev->last_disconnect = 0;
+}
+
+/* Add a device or update the rssi statistics of a known one - returns 1 if the device was already known, -1 if the table is full */
+int add_found_device(esp_bd_addr_t *bda, int rssi, esp_ble_addr_type_t addr_type){
+    struct found_device *dev;
+    int slot;
+
+    dev = find_device(*bda, &slot);
+    if(dev != NULL){
+        update_device(dev, rssi);
+        return 1;
     }
-    return rc;
+    if(num_devices >= EQ3_MAX_DEVICES)
+        return -1;
+
+    dev = &found_devices[num_devices];
+    memcpy(dev->bda, bda, sizeof(esp_bd_addr_t));
+    dev->addr_type = addr_type;
+    dev->rssi = dev->rssi_min = dev->rssi_max = rssi;
+    dev->rssi_ewma = rssi * EQ3_RSSI_EWMA_SCALE;
+    dev->last_seen = esp_timer_get_time();
+    init_link(dev);
+    device_index[slot] = num_devices;
+    num_devices++;
+    return 0;
+}
+
+/* Add a valve known from the registry - it has not been seen since boot */
+void eq3gap_add_known_device(uint8_t *bda, esp_ble_addr_type_t addr_type){
+    struct found_device *dev;
+    int slot;
+
+    init_found_devices();
+    if(find_device(bda, &slot) != NULL || num_devices >= EQ3_MAX_DEVICES)
+        return;
+    dev = &found_devices[num_devices];
+    memcpy(dev->bda, bda, sizeof(esp_bd_addr_t));
+    dev->addr_type = addr_type;
+    dev->rssi = dev->rssi_min = dev->rssi_max = EQ3_RSSI_UNKNOWN;
+    dev->rssi_ewma = EQ3_RSSI_UNKNOWN * EQ3_RSSI_EWMA_SCALE;
+    dev->last_seen = 0;
+    init_link(dev);
+    device_index[slot] = num_devices;
+    num_devices++;
 }
 
 /* BT GAP device scanning code */
@@ -125,8 +186,223 @@ static esp_ble_scan_params_t ble_scan_params = {
     .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
     .scan_filter_policy     = BLE_SCAN_FILTER_ALLOW_ALL,
     .scan_interval          = 0x50,
-    .scan_window            = 0x30
+    .scan_window            = 0x30,
+#ifdef CONFIG_EQ3_SCAN_DUPLICATE_FILTER
+    /* Let the controller drop repeated advertisements - one report per device per scan is all discovery needs */
+    .scan_duplicate         = BLE_SCAN_DUPLICATE_ENABLE
+#else
+    .scan_duplicate         = BLE_SCAN_DUPLICATE_DISABLE
+#endif
+};
+
+#ifdef CONFIG_EQ3_SCAN_OUI_FILTER
+/* eQ-3 AG's IEEE address block (00:1A:22) */
+static const uint8_t eq3_oui[3] = { 0x00, 0x1a, 0x22 };
+#endif
+
+/* Host CPU time spent handling advertisements in the GAP callback during the current scan */
+static int64_t adv_cpu_time = 0;
+static uint32_t adv_count = 0;
+
+/* What the scanner is doing - a discovery scan runs for 30 seconds, presence scanning runs continuously */
+enum gap_mode { GAP_IDLE = 0, GAP_DISCOVERY, GAP_PRESENCE, GAP_PROBE };
+static enum gap_mode gap_mode = GAP_IDLE;
+
+/* A pre-empted discovery scan carries on with the time it had left - see eq3_radio.h */
+#define DISCOVERY_SCAN_TIME 30
+static struct eq3_radio_scan radio = {
+    .duration_ms = DISCOVERY_SCAN_TIME * 1000,
+    .max_preempt = CONFIG_EQ3_SCAN_MAX_PREEMPT,
+};
+static int scan_time = 0;               /* Seconds of the scan being started */
+
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+/* Low duty cycle passive scan between discovery scans to keep the rssi and last seen times of known valves up to date.
+ * Intervals are in units of 0.625mS - a 30mS window every CONFIG_EQ3_PRESENCE_SCAN_INTERVAL mS */
+static esp_ble_scan_params_t presence_scan_params = {
+    .scan_type              = BLE_SCAN_TYPE_PASSIVE,
+    .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
+    .scan_filter_policy     = BLE_SCAN_FILTER_ALLOW_ALL,
+    .scan_interval          = CONFIG_EQ3_PRESENCE_SCAN_INTERVAL * 8 / 5,
+    .scan_window            = 0x30,
+    .scan_duplicate         = BLE_SCAN_DUPLICATE_DISABLE   /* Every advertisement updates the rssi */
+};
+
+/* Presence scanning is stopped while a GATT connection is in progress */
+static bool presence_paused = false;
+
+static void start_presence_scan(void){
+#ifdef CONFIG_EQ3_PRESENCE_WHITELIST
+    /* Only known valves get through to the host - the whitelist can only be changed while not scanning */
+    esp_ble_gap_clear_whitelist();
+    for(int devnum = 0; devnum < num_devices; devnum++)
+        esp_ble_gap_update_whitelist(true, (uint8_t *)found_devices[devnum].bda,
+                                     found_devices[devnum].addr_type == BLE_ADDR_TYPE_RANDOM ? BLE_WL_ADDR_TYPE_RANDOM : BLE_WL_ADDR_TYPE_PUBLIC);
+    presence_scan_params.scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ONLY_WLST;
+#endif
+    gap_mode = GAP_PRESENCE;
+    ESP_LOGI(EQ3_DBG_TAG, "Presence scan");
+    esp_ble_gap_set_scan_params(&presence_scan_params);
+}
+#endif
+
+/* Stop presence scanning (e.g. before connecting to a valve) */
+void eq3gap_presence_pause(void){
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+    if(presence_paused == false){
+        presence_paused = true;
+        if(gap_mode == GAP_PRESENCE)
+            esp_ble_gap_stop_scanning();
+    }
+#endif
+}
+
+/* Restart presence scanning once the BLE link is free again */
+void eq3gap_presence_resume(void){
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+    if(presence_paused == true){
+        presence_paused = false;
+        if(gap_mode == GAP_PRESENCE)
+            esp_ble_gap_start_scanning(0);
+    }
+#endif
+}
+
+/* Has a valve been seen (advertising or connected) in the last max_age_s seconds */
+bool eq3gap_seen_within(uint8_t *bda, int max_age_s){
+    struct found_device *dev = find_device(bda, NULL);
+    if(dev == NULL || dev->last_seen == 0)
+        return false;
+    return esp_timer_get_time() - dev->last_seen < (int64_t)max_age_s * 1000000;
+}
+
+/* A connection to the valve succeeded */
+void eq3gap_mark_seen(uint8_t *bda){
+    struct found_device *dev = find_device(bda, NULL);
+    if(dev != NULL)
+        dev->last_seen = esp_timer_get_time();
+}
+
+/* Ask the controller for the rssi of an open connection - the answer arrives as a GAP event */
+void eq3gap_read_link_rssi(uint8_t *bda){
+    esp_err_t err = esp_ble_gap_read_rssi(bda);
+    if(err != ESP_OK)
+        ESP_LOGW(EQ3_DBG_TAG, "read rssi failed, error code = %x", err);
+}
+
+/* Session statistics - an opened connection also counts as seeing the valve */
+void eq3gap_link_event(uint8_t *bda, enum eq3_link_event event, int reason){
+    struct found_device *dev = find_device(bda, NULL);
+    if(dev == NULL)
+        return;
+    switch(event){
+        case EQ3_LINK_OPENED:
+            dev->sessions++;
+            dev->last_seen = esp_timer_get_time();
+            break;
+        case EQ3_LINK_OPEN_FAILED:
+            dev->open_failures++;
+            break;
+        case EQ3_LINK_DROPPED:
+            dev->drops++;
+            /* Fall through */
+        case EQ3_LINK_CLOSED:
+            dev->last_disconnect = reason;
+            break;
+    }
+}
+
+/* 0-100 from the connected (else advertised) rssi scaled by the share of sessions that worked */
+static int link_quality(struct found_device *dev){
+    int rssi, score, attempts, good;
+
+    if(dev->conn_rssi != EQ3_RSSI_UNKNOWN)
+        rssi = dev->conn_rssi;
+    else if(dev->last_seen != 0)
+        rssi = dev->rssi_ewma / EQ3_RSSI_EWMA_SCALE;
+    else
+        return EQ3_LINK_QUALITY_UNKNOWN;
+    /* -95 dBm or worse scores 0, -55 dBm or better 100 */
+    score = (rssi + 95) * 100 / 40;
+    if(score < 0)
+        score = 0;
+    if(score > 100)
+        score = 100;
+    attempts = dev->sessions + dev->open_failures;
+    good = dev->sessions > dev->drops ? dev->sessions - dev->drops : 0;
+    return score * (good + 1) / (attempts + 1);
+}
+
+int eq3gap_link_quality(uint8_t *bda){
+    struct found_device *dev = find_device(bda, NULL);
+    if(dev == NULL)
+        return EQ3_LINK_QUALITY_UNKNOWN;
+    return link_quality(dev);
+}
+
+/* Link statistics for the link topic - returns the length or -1 if the valve isn't known */
+int eq3gap_link_json(uint8_t *bda, char *buf, int len){
+    struct found_device *dev = find_device(bda, NULL);
+    if(dev == NULL)
+        return -1;
+    return snprintf(buf, len, "{\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"rssi\":%d,\"scan_rssi\":%d,\"quality\":%d,"
+                    "\"sessions\":%d,\"open_failures\":%d,\"drops\":%d,\"last_disconnect\":%d}",
+                    bda[0], bda[1], bda[2], bda[3], bda[4], bda[5], dev->conn_rssi, dev->rssi_ewma / EQ3_RSSI_EWMA_SCALE,
+                    link_quality(dev), dev->sessions, dev->open_failures, dev->drops, dev->last_disconnect);
+}
+
+/* Publish the link statistics of a valve after a session or a failed open */
+void eq3gap_publish_link(uint8_t *bda){
+    char linkrep[200];
+    char mac_addr[20];
+    if(eq3gap_link_json(bda, linkrep, sizeof(linkrep)) > 0){
+        sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+        send_trv_link(linkrep, mac_addr);
+    }
+}
+
+/* Probe - a short full duty cycle scan for one valve before connecting to it. Ends as soon as the valve advertises */
+static esp_ble_scan_params_t probe_scan_params = {
+    .scan_type              = BLE_SCAN_TYPE_PASSIVE,
+    .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
+    .scan_filter_policy     = BLE_SCAN_FILTER_ALLOW_ALL,
+    .scan_interval          = 0x50,
+    .scan_window            = 0x50,
+    .scan_duplicate         = BLE_SCAN_DUPLICATE_DISABLE
 };
+static uint8_t probe_bda[6];
+static int probe_duration;
+static volatile enum eq3_probe_state probe_state = EQ3_PROBE_IDLE;
+
+/* Start a probe - false if a discovery scan is running (it will see the valve anyway) */
+bool eq3gap_probe(uint8_t *bda, int duration_s){
+    if(gap_mode == GAP_DISCOVERY || gap_mode == GAP_PROBE)
+        return false;
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+    if(gap_mode == GAP_PRESENCE && presence_paused == false)
+        esp_ble_gap_stop_scanning();
+#endif
+    memcpy(probe_bda, bda, sizeof(probe_bda));
+    probe_duration = duration_s;
+    probe_state = EQ3_PROBE_RUNNING;
+    gap_mode = GAP_PROBE;
+    esp_ble_gap_set_scan_params(&probe_scan_params);
+    return true;
+}
+
+enum eq3_probe_state eq3gap_probe_state(void){
+    return probe_state;
+}
+
+/* Probe scan has stopped - go back to presence scanning */
+static void probe_done(void){
+    if(probe_state == EQ3_PROBE_RUNNING)
+        probe_state = EQ3_PROBE_NOT_FOUND;
+    gap_mode = GAP_IDLE;
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+    start_presence_scan();
+#endif
+}
 
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param){
     uint8_t *adv_name = NULL;
@@ -134,10 +410,20 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
     
     switch (event) {
     case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
-        //the unit of the duration is second
-        uint32_t duration = 30;
-        esp_ble_gap_start_scanning(duration);
-	free_found_devices();
+        if(gap_mode == GAP_PROBE){
+            esp_ble_gap_start_scanning(probe_duration);
+            break;
+        }
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+        if(gap_mode == GAP_PRESENCE){
+            /* No timeout - runs until paused or a discovery scan is requested */
+            if(presence_paused == false)
+                esp_ble_gap_start_scanning(0);
+            break;
+        }
+#endif
+        /* What is left of the scan if it was pre-empted - the unit of the duration is second */
+        esp_ble_gap_start_scanning(scan_time);
         break;
     }
 
@@ -155,7 +441,35 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
     case ESP_GAP_BLE_SCAN_RESULT_EVT: {
         esp_ble_gap_cb_param_t *scan_result = (esp_ble_gap_cb_param_t *)param;
         switch (scan_result->scan_rst.search_evt) {
-            case ESP_GAP_SEARCH_INQ_RES_EVT:
+            case ESP_GAP_SEARCH_INQ_RES_EVT: {
+                int64_t advtime = esp_timer_get_time();
+                adv_count++;
+                /* Probing for one valve - stop as soon as it is heard */
+                if(gap_mode == GAP_PROBE){
+                    if(probe_state == EQ3_PROBE_RUNNING && memcmp(scan_result->scan_rst.bda, probe_bda, sizeof(probe_bda)) == 0){
+                        add_found_device(&scan_result->scan_rst.bda, scan_result->scan_rst.rssi, scan_result->scan_rst.ble_addr_type);
+                        probe_state = EQ3_PROBE_FOUND;
+                        esp_ble_gap_stop_scanning();
+                    }
+                    adv_cpu_time += esp_timer_get_time() - advtime;
+                    break;
+                }
+                /* Presence scanning only tracks valves we already know - a hash lookup of the address, no need to parse the advertisement.
+                 * A passive scan doesn't see the scan response carrying the name anyway */
+                if(gap_mode == GAP_PRESENCE){
+                    struct found_device *dev = find_device(scan_result->scan_rst.bda, NULL);
+                    if(dev != NULL)
+                        update_device(dev, scan_result->scan_rst.rssi);
+                    adv_cpu_time += esp_timer_get_time() - advtime;
+                    break;
+                }
+#ifdef CONFIG_EQ3_SCAN_OUI_FILTER
+                /* Drop anything outside eQ-3's address block without parsing it */
+                if(memcmp(scan_result->scan_rst.bda, eq3_oui, sizeof(eq3_oui)) != 0){
+                    adv_cpu_time += esp_timer_get_time() - advtime;
+                    break;
+                }
+#endif
                 /* esp_log_buffer_hex(EQ3_DBG_TAG, scan_result->scan_rst.bda, 6);
                    ESP_LOGI(EQ3_DBG_TAG,
                             "searched Adv Data Len %d, Scan Response Len %d",
@@ -168,23 +482,45 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
                 //esp_log_buffer_char(EQ3_DBG_TAG, adv_name, adv_name_len);
                 //esp_log_buffer_hex(EQ3_DBG_TAG, scan_result->scan_rst.bda, 6);
                 if (adv_name != NULL){
-                    for (int i = 0; i < N_ELEMS(remote_device_names); ++i){
-                        if (strlen(remote_device_names[i]) == adv_name_len
-                            && strncmp( (char *)adv_name, remote_device_names[i], adv_name_len) == 0)
+                    for (int i = 0; i < N_NAMES; ++i){
+                        if (remote_device_names[i].len == adv_name_len
+                            && memcmp(adv_name, remote_device_names[i].name, adv_name_len) == 0)
                         {
-                            if(add_found_device(&scan_result->scan_rst.bda, scan_result->scan_rst.rssi) == 0){
-                                ESP_LOGI(EQ3_DBG_TAG, "Found device %s - rssi %d, ble_addr_type: %d", remote_device_names[i], scan_result->scan_rst.rssi
+                            int added = add_found_device(&scan_result->scan_rst.bda, scan_result->scan_rst.rssi, scan_result->scan_rst.ble_addr_type);
+                            if(added < 0){
+                                ESP_LOGW(EQ3_DBG_TAG, "Device table full");
+                            }else if(added == 0){
+                                ESP_LOGI(EQ3_DBG_TAG, "Found device %s - rssi %d, ble_addr_type: %d", remote_device_names[i].name, scan_result->scan_rst.rssi
                                 		, scan_result->scan_rst.ble_addr_type
 										);
                                 esp_log_buffer_hex(EQ3_DBG_TAG, scan_result->scan_rst.bda, 6);
+                                device_found(find_device(scan_result->scan_rst.bda, NULL));
+                                eq3_registry_add(scan_result->scan_rst.bda, scan_result->scan_rst.ble_addr_type, remote_device_names[i].name);
+                                /* Announce the new device to Home Assistant */
+                                ha_discovery_add_device((char *)scan_result->scan_rst.bda);
                             }
+                            break;
                         }
                     }
                 }
+                adv_cpu_time += esp_timer_get_time() - advtime;
                 break;
+            }
             case ESP_GAP_SEARCH_INQ_CMPL_EVT:
+                if(gap_mode == GAP_PROBE){
+                    probe_done();
+                    break;
+                }
                 gap_scanning = false;
+                gap_mode = GAP_IDLE;
+                eq3_radio_scan_done(&radio);
+                ESP_LOGI(EQ3_DBG_TAG, "Scan handled %d advertisements in %d uS", (int)adv_count, (int)adv_cpu_time);
+                adv_count = 0;
+                adv_cpu_time = 0;
                 scan_done();
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+                start_presence_scan();
+#endif
                 break;
             default:
                 break;
@@ -199,6 +535,9 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
             break;
         }
         ESP_LOGI(EQ3_DBG_TAG, "Scan finished successfully");
+        /* Stopped because the valve was heard (not a presence scan stopping ahead of the probe) */
+        if(gap_mode == GAP_PROBE && probe_state == EQ3_PROBE_FOUND)
+            probe_done();
         break;
 
     case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
@@ -209,6 +548,22 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
         }
         ESP_LOGI(EQ3_DBG_TAG, "stop adv successfully");
         break;
+    case ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT: {
+        struct found_device *dev;
+        if(param->read_rssi_cmpl.status != ESP_BT_STATUS_SUCCESS){
+            ESP_LOGW(EQ3_DBG_TAG, "read rssi failed, status = %x", param->read_rssi_cmpl.status);
+            break;
+        }
+        if((dev = find_device(param->read_rssi_cmpl.remote_addr, NULL)) != NULL){
+            /* Average the samples of a session - the first one after a reboot stands alone */
+            if(dev->conn_rssi == EQ3_RSSI_UNKNOWN)
+                dev->conn_rssi = param->read_rssi_cmpl.rssi;
+            else
+                dev->conn_rssi = (dev->conn_rssi * 3 + param->read_rssi_cmpl.rssi) / 4;
+            ESP_LOGI(EQ3_DBG_TAG, "connection rssi %d (avg %d)", param->read_rssi_cmpl.rssi, dev->conn_rssi);
+        }
+        break;
+    }
     case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
         ESP_LOGI(EQ3_DBG_TAG,
                 "update connection params status = %d, "
@@ -229,8 +584,8 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
     }
 }
 
-/* Start a scan */
-void start_scan(){
+/* Register for GAP events - before any scan or probe */
+void eq3gap_init(){
     esp_err_t ret;
     //register the  callback function to the gap module
     ret = esp_ble_gap_register_callback(esp_gap_cb);
@@ -238,56 +593,175 @@ void start_scan(){
         ESP_LOGE(EQ3_DBG_TAG, "%s gap register failed, error code = %x\n", __func__, ret);
         return;
     }
+    init_found_devices();
+}
+
+/* Start a discovery scan - only from eq3gap_run_pending_scan() so it never competes with a valve connection */
+static void start_scan(){
+    if(gap_mode == GAP_PRESENCE)
+        ESP_LOGI(EQ3_DBG_TAG, "Presence scan handled %d advertisements in %d uS", (int)adv_count, (int)adv_cpu_time);
+    adv_count = 0;
+    adv_cpu_time = 0;
+#ifdef CONFIG_EQ3_PRESENCE_SCAN
+    /* Scan parameters can't be changed while scanning */
+    if(gap_mode == GAP_PRESENCE && presence_paused == false)
+        esp_ble_gap_stop_scanning();
+#endif
 
     gap_scanning = true;
     gap_initialised = true;
+    gap_mode = GAP_DISCOVERY;
+    scan_time = (eq3_radio_scan_start(&radio, esp_timer_get_time()) + 999) / 1000;
     
-    ret = esp_ble_gap_set_scan_params(&ble_scan_params);
-    
+    esp_ble_gap_set_scan_params(&ble_scan_params);
+}
+
+/* =========================================
+ * Radio arbitration
+ * Valve sessions (probe, connect, command) come first, a requested discovery scan runs between sessions
+ * and presence scanning fills the rest of the time. Scan requests can come from any task.
+ */
+
+/* Ask for a discovery scan (mqtt, http or boot). A running probe is left to finish - the scan is
+ * run after the session like any other request */
+void eq3gap_request_scan(void){
+    radio.requested = true;
+}
+
+/* Called by the command task while no valve session is running */
+void eq3gap_run_pending_scan(void){
+    if(radio.requested == true && gap_mode != GAP_DISCOVERY && gap_mode != GAP_PROBE)
+        start_scan();
+}
+
+/* A valve session needs the radio - stop a discovery scan and finish it once the commands are done.
+ * Only CONFIG_EQ3_SCAN_MAX_PREEMPT sessions may go ahead of a running or waiting scan. After that the
+ * scan gets the radio between two sessions and keeps it until it has finished - the command waits (false) */
+bool eq3gap_preempt_scan(void){
+    /* A probe is part of the session */
+    if(gap_mode == GAP_PROBE)
+        return true;
+    switch(eq3_radio_preempt(&radio, esp_timer_get_time())){
+    case EQ3_RADIO_START_SCAN:
+        ESP_LOGI(EQ3_DBG_TAG, "Discovery scan deferred %d times - finishing it before the next command", radio.deferrals);
+        start_scan();
+        return false;
+    case EQ3_RADIO_HOLD:
+        return false;
+    case EQ3_RADIO_STOP_SCAN:
+        ESP_LOGI(EQ3_DBG_TAG, "Discovery scan pre-empted by a command (%d/%d, %dmS left)", radio.deferrals, radio.max_preempt, radio.remaining_ms);
+        gap_mode = GAP_IDLE;
+        gap_scanning = false;
+        esp_ble_gap_stop_scanning();
+        return true;
+    case EQ3_RADIO_GO:
+    default:
+        return true;
+    }
+}
+
+/* What the radio is doing, for the status page */
+const char *eq3gap_state(void){
+    switch(gap_mode){
+        case GAP_DISCOVERY:
+            return "discovery scan";
+        case GAP_PROBE:
+            return "probing valve";
+        case GAP_PRESENCE:
+            return radio.requested ? "presence scan (scan pending)" : "presence scan";
+        case GAP_IDLE:
+        default:
+            return radio.requested ? "idle (scan pending)" : "idle";
+    }
+}
+
+#ifdef CONFIG_EQ3_MQTT_BINARY
+/* Publish the device list as cbor */
+static void scan_done_bin(struct eq3_devlist_entry *devs, int numseen){
+    int binlen = EQ3_DEVLIST_CBOR_MAX(numseen);
+    uint8_t *report = malloc(binlen);
+    if(report == NULL)
+        return;
+
+    int64_t enctime = esp_timer_get_time();
+    binlen = eq3_devlist_to_cbor(devs, numseen, report, binlen);
+    enctime = esp_timer_get_time() - enctime;
+    ESP_LOGI(EQ3_DBG_TAG, "devlist cbor %d bytes in %d uS", binlen, (int)enctime);
+    if(binlen > 0)
+        send_device_list_bin(report, binlen);
+    free(report);
+}
+#endif
+
+static void devlist_entry(struct eq3_devlist_entry *entry, struct found_device *dev){
+    memcpy(entry->bda, dev->bda, sizeof(entry->bda));
+    entry->rssi = dev->rssi;
+}
+
+/* Publish a newly found device straight away rather than waiting for the end of the scan */
+static void device_found(struct found_device *dev){
+    struct eq3_devlist_entry entry;
+    char json[EQ3_DEVLIST_ENTRY_MAX + 1];
+    char mac_addr[18];
+    devlist_entry(&entry, dev);
+    eq3_devlist_entry_to_json(&entry, json, sizeof(json));
+    sprintf(mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", dev->bda[0], dev->bda[1], dev->bda[2], dev->bda[3], dev->bda[4], dev->bda[5]);
+    send_device_found(json, mac_addr);
 }
 
 /* Scan complete */
 static void scan_done(){
     ESP_LOGI(EQ3_DBG_TAG, "Scan complete\nDevices found:\n");
 
-    /* Yuck - magic numbers */
-    char *report = malloc((44 * num_devices) + 15);
-    int wridx = 12;
-    struct found_device *devwalk = found_devices;
-    sprintf(report, "{\"devices\":[");
-    if(devwalk != NULL){
-        int devnum = 0;
-        while(devwalk != NULL){
-            ESP_LOGI(EQ3_DBG_TAG, "Device:");
-            esp_log_buffer_hex(EQ3_DBG_TAG, devwalk->bda, 6);
-            ESP_LOGI(EQ3_DBG_TAG, "rssi %d", devwalk->rssi);
-	
-            /* {"devices":[{"rssi":-123,"bleaddr":"00:00:00:00:00:00"},....]} */
-
-	    wridx += sprintf(&report[wridx], "{\"rssi\":%d,\"bleaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\"},", 
-                 devwalk->rssi, devwalk->bda[0], devwalk->bda[1], devwalk->bda[2], 
-                 devwalk->bda[3], devwalk->bda[4], devwalk->bda[5]);
-	
-	    devnum++;
-            devwalk = devwalk->next;
-        }
-        if(devnum > 0)
-            wridx--;
-        sprintf(&report[wridx], "]}");
-	    send_device_list(report);    
-        //free(report);
-    }else{
+    if(num_devices == 0){
         ESP_LOGI(EQ3_DBG_TAG, "None");
+        return;
+    }
+
+    /* The table size bounds the document */
+    struct eq3_devlist_entry *devs = malloc(sizeof(struct eq3_devlist_entry) * num_devices);
+    int len = EQ3_DEVLIST_JSON_MAX(num_devices);
+    char *report = malloc(len);
+    if(devs == NULL || report == NULL){
+        free(devs);
+        free(report);
+        return;
+    }
+    int devnum, numseen = 0;
+    struct found_device *devwalk;
+    for(devnum = 0; devnum < num_devices; devnum++){
+        devwalk = &found_devices[devnum];
+        /* Known from the registry but not seen yet */
+        if(devwalk->last_seen == 0)
+            continue;
+        ESP_LOGI(EQ3_DBG_TAG, "Device:");
+        esp_log_buffer_hex(EQ3_DBG_TAG, devwalk->bda, 6);
+        ESP_LOGI(EQ3_DBG_TAG, "rssi %d (min %d max %d avg %d)", devwalk->rssi, devwalk->rssi_min, devwalk->rssi_max, devwalk->rssi_ewma / EQ3_RSSI_EWMA_SCALE);
+        devlist_entry(&devs[numseen++], devwalk);
     }
+    int64_t enctime = esp_timer_get_time();
+    int wridx = eq3_devlist_to_json(devs, numseen, report, len);
+    enctime = esp_timer_get_time() - enctime;
+    ESP_LOGI(EQ3_DBG_TAG, "devlist json %d bytes in %d uS", wridx, (int)enctime);
+    /* send_device_list() keeps the report until it is published */
+    if(wridx > 0)
+        send_device_list(report);
+    else
+        free(report);
+#ifdef CONFIG_EQ3_MQTT_BINARY
+    scan_done_bin(devs, numseen);
+#endif
+    free(devs);
 }
 
-/* Make the device list available to others */
-/* Be aware there is no semaphore lock on the devlist so make sure to never call start_scan() 
- * when parsing a list returned from this call */
+/* Make the device list available to others - an array of numdevs entries in the order found */
+/* There is no semaphore lock on the devlist - entries are only ever added so the first numdevs
+ * entries stay valid while a scan adds more */
 enum eq3_scanstate eq3gap_get_device_list(struct found_device **devlist, int *numdevs){
-    if(gap_initialised == false)
+    if(gap_initialised == false && num_devices == 0)
         return EQ3_NO_SCAN_RESULTS;
-    if(gap_scanning == false){
+    /* Valves from the registry are available while the scan is running */
+    if(gap_scanning == false || num_devices > 0){
         if(devlist != NULL)
             *devlist = found_devices;
         if(numdevs != NULL)
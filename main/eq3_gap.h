@@ -1,20 +1,79 @@
 
 #ifndef EQ3_GAP_H
+#define EQ3_GAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_gap_ble_api.h"
+#include "eq3_hal.h"
+
+/* Size of the found device table */
+#define EQ3_MAX_DEVICES 64
+
+/* rssi of a valve from the registry which has not been seen since boot */
+#define EQ3_RSSI_UNKNOWN -127
+
+/* rssi_ewma is held in 1/16 dBm */
+#define EQ3_RSSI_EWMA_SCALE 16
 
 /* Device list handling */
 struct found_device {
   //esp_bd_addr_t bda;
   char bda[6]; /* Should really make this consistent with esp_bd_addr_t */
-  int rssi;
-  struct found_device *next;
+  esp_ble_addr_type_t addr_type;
+  int rssi;           /* Last advertisement */
+  int rssi_min;
+  int rssi_max;
+  int rssi_ewma;
+  int64_t last_seen;  /* esp_timer time of the last advertisement - 0 if not seen since boot */
+  /* Link statistics from valve sessions */
+  int conn_rssi;          /* rssi read while connected - EQ3_RSSI_UNKNOWN if never connected */
+  uint16_t sessions;      /* Connections opened */
+  uint16_t open_failures; /* Connections that failed to open */
+  uint16_t drops;         /* Connections lost without us closing them */
+  uint8_t last_disconnect;/* Reason code of the last disconnect */
 };
 
 enum eq3_scanstate { EQ3_NO_SCAN_RESULTS = 0, EQ3_SCAN_UNDERWAY, EQ3_SCAN_COMPLETE };
 
+enum eq3_link_event { EQ3_LINK_OPENED = 0, EQ3_LINK_OPEN_FAILED, EQ3_LINK_CLOSED, EQ3_LINK_DROPPED };
+
 enum eq3_scanstate eq3gap_get_device_list(struct found_device **devlist, int *numdevs);
 
-void start_scan(void);
+void eq3gap_init(void);
+
+void eq3gap_request_scan(void);
+
+void eq3gap_run_pending_scan(void);
+
+bool eq3gap_preempt_scan(void);
+
+const char *eq3gap_state(void);
+
+void eq3gap_add_known_device(uint8_t *bda, esp_ble_addr_type_t addr_type);
 
 bool scan_complete(void);
 
+void eq3gap_presence_pause(void);
+
+void eq3gap_presence_resume(void);
+
+bool eq3gap_seen_within(uint8_t *bda, int max_age_s);
+
+void eq3gap_mark_seen(uint8_t *bda);
+
+bool eq3gap_probe(uint8_t *bda, int duration_s);
+
+enum eq3_probe_state eq3gap_probe_state(void);
+
+void eq3gap_read_link_rssi(uint8_t *bda);
+
+void eq3gap_link_event(uint8_t *bda, enum eq3_link_event event, int reason);
+
+int eq3gap_link_quality(uint8_t *bda);
+
+int eq3gap_link_json(uint8_t *bda, char *buf, int len);
+
+void eq3gap_publish_link(uint8_t *bda);
+
 #endif
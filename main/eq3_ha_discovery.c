@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <esp_netif.h>
 #include <esp_log.h>
+#include <nvs.h>
+#include "eq3_main.h"
 
 #if (__STDC_VERSION__ >= 199901L)
 #include <stdint.h>
@@ -11,6 +13,90 @@
 
 #define HA_TAG "HA_DISCOVERY"
 
+#define HA_DISCOVERY_NAMESPACE "ha_disc"     // Namespace in NVS for published payload hashes
+
+/* "configuration_url" - looked up once per discovery run rather than for every payload */
+static char config_url[24] = "";
+
+/* Refresh the configuration url from the current station IP address */
+void ha_discovery_refresh_url (void) {
+    esp_netif_t* netif = NULL;
+    netif = esp_netif_get_handle_from_ifkey ("WIFI_STA_DEF");
+    esp_netif_ip_info_t ipInfo;
+    esp_netif_get_ip_info (netif, &ipInfo);
+    uint8_t* ip_address_bytes = (uint8_t*)&(ipInfo.ip.addr);
+    snprintf (config_url, sizeof (config_url), "http://%u.%u.%u.%u", ip_address_bytes[0], ip_address_bytes[1], ip_address_bytes[2], ip_address_bytes[3]);
+}
+
+/* Prefix of entity names, unique ids and discovery topics. Hubs sharing valves use a common
+ * prefix so whichever hub owns a valve updates the same Home Assistant entities */
+const char* ha_object_id (char* id) {
+#ifdef CONFIG_EQ3_MULTI_HUB
+    return CONFIG_EQ3_HUB_TOPIC "_";
+#else
+    return id;
+#endif
+}
+
+/* FNV-1a hash of a rendered payload */
+uint32_t ha_payload_hash (const char* payload) {
+    uint32_t hash = 2166136261u;
+    while (*payload != 0) {
+        hash ^= (uint8_t)*payload++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* NVS key for the hash of a device's payload - 12 hex digits of address and the component letter */
+static void ha_hash_key (char mac[6], char component, char key[14]) {
+    snprintf (key, 14, "%02x%02x%02x%02x%02x%02x%c", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], component);
+}
+
+/* Has this payload changed since it was last published */
+bool ha_payload_changed (char mac[6], char component, uint32_t hash) {
+    nvs_handle handle;
+    char key[14];
+    uint32_t stored = 0;
+
+    if (nvs_open (HA_DISCOVERY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return true;
+    ha_hash_key (mac, component, key);
+    esp_err_t err = nvs_get_u32 (handle, key, &stored);
+    nvs_close (handle);
+    return err != ESP_OK || stored != hash;
+}
+
+/* Forget the hash of a payload which is no longer published - true if one was stored */
+bool ha_payload_forget (char mac[6], char component) {
+    nvs_handle handle;
+    char key[14];
+
+    if (nvs_open (HA_DISCOVERY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return false;
+    ha_hash_key (mac, component, key);
+    esp_err_t err = nvs_erase_key (handle, key);
+    if (err == ESP_OK)
+        nvs_commit (handle);
+    nvs_close (handle);
+    return err == ESP_OK;
+}
+
+/* Remember the hash of a published payload */
+void ha_payload_published (char mac[6], char component, uint32_t hash) {
+    nvs_handle handle;
+    char key[14];
+
+    if (nvs_open (HA_DISCOVERY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGE (HA_TAG, "Unable to open nvs for payload hash");
+        return;
+    }
+    ha_hash_key (mac, component, key);
+    nvs_set_u32 (handle, key, hash);
+    nvs_commit (handle);
+    nvs_close (handle);
+}
+
 cJSON* generate_ha_therm_payload (char mac[6], char *id) {
     char rawmacstr[7];
     char macstr[18];
@@ -18,12 +104,10 @@ cJSON* generate_ha_therm_payload (char mac[6], char *id) {
     snprintf (rawmacstr, sizeof(rawmacstr), "%02X%02X%02X", mac[3], mac[4], mac[5]);
     snprintf (macstr, sizeof(macstr), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-    ESP_LOGI (HA_TAG, "rawmacstr: %s", rawmacstr);
-
     cJSON* root = cJSON_CreateObject ();
     // "name": "eq3_{{rawmacstr}}_thermostat"
     char buffer[80];
-    snprintf (buffer, sizeof (buffer), "%s%s_thermostat", id, rawmacstr);
+    snprintf (buffer, sizeof (buffer), "%s%s_thermostat", ha_object_id (id), rawmacstr);
     cJSON_AddStringToObject (root, "name", buffer);
     // "unique_id": "eq3_YYYYYY_thermostat"
     cJSON_AddStringToObject (root, "unique_id", buffer);
@@ -31,20 +115,16 @@ cJSON* generate_ha_therm_payload (char mac[6], char *id) {
     cJSON* device;
     cJSON_AddItemToObject (root, "device", device = cJSON_CreateObject ());
     // "name": "Equiva EQ-3 BT YYYYYY"
-    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", id, rawmacstr);
+    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", ha_object_id (id), rawmacstr);
     cJSON_AddStringToObject (device, "name", buffer);
     // "configuration_url": "http://123.123.123.123"
-    esp_netif_t* netif = NULL;
-    netif = esp_netif_get_handle_from_ifkey ("WIFI_STA_DEF");
-    esp_netif_ip_info_t ipInfo;
-    esp_netif_get_ip_info (netif, &ipInfo);
-    uint8_t* ip_address_bytes = (uint8_t*)&(ipInfo.ip.addr);
-    snprintf (buffer, sizeof (buffer), "http://%u.%u.%u.%u", ip_address_bytes[0], ip_address_bytes[1], ip_address_bytes[2], ip_address_bytes[3]);
-    cJSON_AddStringToObject (device, "configuration_url", buffer);
+    cJSON_AddStringToObject (device, "configuration_url", config_url);
     // "manufacturer": "Equiva"
     cJSON_AddStringToObject (device, "manufacturer", "Equiva");
     // "model": "EQ-3 BT"
     cJSON_AddStringToObject (device, "model", "EQ-3 BT");
+    // "sw_version": "1.70"
+    cJSON_AddStringToObject (device, "sw_version", EQ3_MAJVER "." EQ3_MINVER EQ3_EXTRAVER);
     // "identifiers": ["XX:XX:XX:YY:YY:YY"]
     cJSON* identifiers = cJSON_AddArrayToObject (device, "identifiers");
     //cJSON* identifier = cJSON_CreateString (macstr);
@@ -84,9 +164,6 @@ cJSON* generate_ha_therm_payload (char mac[6], char *id) {
     // "current_temperature_template" : "{{ value_json.temp }}"
     cJSON_AddStringToObject (root, "current_temperature_template", buffer);
 
-    char* ha_therm_payload = cJSON_Print (root);
-    ESP_LOGI (HA_TAG, "HA Climate autodiscovery\n%s", ha_therm_payload);
-
     return root;
 }
 
@@ -97,12 +174,10 @@ cJSON* generate_ha_valve_payload (char mac[6], char *id) {
     snprintf (rawmacstr, sizeof (rawmacstr), "%02X%02X%02X", mac[3], mac[4], mac[5]);
     snprintf (macstr, sizeof (macstr), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-    ESP_LOGI (HA_TAG, "rawmacstr: %s", rawmacstr);
-
     cJSON* root = cJSON_CreateObject ();
     // "name": "eq3_{{rawmacstr}}_valve"
-    char buffer[40];
-    snprintf (buffer, sizeof (buffer), "%s%s_valve", id, rawmacstr);
+    char buffer[80];
+    snprintf (buffer, sizeof (buffer), "%s%s_valve", ha_object_id (id), rawmacstr);
     cJSON_AddStringToObject (root, "name", buffer);
     // "unique_id": "eq3_YYYYYY_valve"
     cJSON_AddStringToObject (root, "unique_id", buffer);
@@ -110,20 +185,16 @@ cJSON* generate_ha_valve_payload (char mac[6], char *id) {
     cJSON* device;
     cJSON_AddItemToObject (root, "device", device = cJSON_CreateObject ());
     // "name": "Equiva EQ-3 BT YYYYYY"
-    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", id, rawmacstr);
+    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", ha_object_id (id), rawmacstr);
     cJSON_AddStringToObject (device, "name", buffer);
     // "configuration_url": "http://123.123.123.123"
-    esp_netif_t* netif = NULL;
-    netif = esp_netif_get_handle_from_ifkey ("WIFI_STA_DEF");
-    esp_netif_ip_info_t ipInfo;
-    esp_netif_get_ip_info (netif, &ipInfo);
-    uint8_t* ip_address_bytes = (uint8_t*)&(ipInfo.ip.addr);
-    snprintf (buffer, sizeof (buffer), "http://%u.%u.%u.%u", ip_address_bytes[0], ip_address_bytes[1], ip_address_bytes[2], ip_address_bytes[3]);
-    cJSON_AddStringToObject (device, "configuration_url", buffer);
+    cJSON_AddStringToObject (device, "configuration_url", config_url);
     // "manufacturer": "Equiva"
     cJSON_AddStringToObject (device, "manufacturer", "Equiva");
     // "model": "EQ-3 BT"
     cJSON_AddStringToObject (device, "model", "EQ-3 BT");
+    // "sw_version": "1.70"
+    cJSON_AddStringToObject (device, "sw_version", EQ3_MAJVER "." EQ3_MINVER EQ3_EXTRAVER);
     // "identifiers": ["XX:XX:XX:YY:YY:YY"]
     cJSON* identifiers = cJSON_AddArrayToObject (device, "identifiers");
     cJSON_AddItemToArray (identifiers, cJSON_CreateString (macstr));
@@ -137,9 +208,6 @@ cJSON* generate_ha_valve_payload (char mac[6], char *id) {
     // "value_template": "{{ value_json.valve }}"
     cJSON_AddStringToObject (root, "value_template", "{{ value_json.valve }}");
 
-    char* ha_valve_payload = cJSON_Print (root);
-    ESP_LOGI (HA_TAG, "HA Valve autodiscovery\n%s", ha_valve_payload);
-
     return root;
 }
 
@@ -150,12 +218,10 @@ cJSON* generate_ha_battery_payload (char mac[6], char *id) {
     snprintf (rawmacstr, sizeof (rawmacstr), "%02X%02X%02X", mac[3], mac[4], mac[5]);
     snprintf (macstr, sizeof (macstr), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-    ESP_LOGI (HA_TAG, "rawmacstr: %s", rawmacstr);
-
     cJSON* root = cJSON_CreateObject ();
     // "name": "eq3_{{rawmacstr}}_battery"
-    char buffer[40];
-    snprintf (buffer, sizeof (buffer), "%s%s_battery", id, rawmacstr);
+    char buffer[80];
+    snprintf (buffer, sizeof (buffer), "%s%s_battery", ha_object_id (id), rawmacstr);
     cJSON_AddStringToObject (root, "name", buffer);
     // "unique_id": "eq3_YYYYYY_battery"
     cJSON_AddStringToObject (root, "unique_id", buffer);
@@ -163,20 +229,16 @@ cJSON* generate_ha_battery_payload (char mac[6], char *id) {
     cJSON* device;
     cJSON_AddItemToObject (root, "device", device = cJSON_CreateObject ());
     // "name": "Equiva EQ-3 BT YYYYYY"
-    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", id, rawmacstr);
+    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", ha_object_id (id), rawmacstr);
     cJSON_AddStringToObject (device, "name", buffer);
     // "configuration_url": "http://123.123.123.123"
-    esp_netif_t* netif = NULL;
-    netif = esp_netif_get_handle_from_ifkey ("WIFI_STA_DEF");
-    esp_netif_ip_info_t ipInfo;
-    esp_netif_get_ip_info (netif, &ipInfo);
-    uint8_t* ip_address_bytes = (uint8_t*)&(ipInfo.ip.addr);
-    snprintf (buffer, sizeof (buffer), "http://%u.%u.%u.%u", ip_address_bytes[0], ip_address_bytes[1], ip_address_bytes[2], ip_address_bytes[3]);
-    cJSON_AddStringToObject (device, "configuration_url", buffer);
+    cJSON_AddStringToObject (device, "configuration_url", config_url);
     // "manufacturer": "Equiva"
     cJSON_AddStringToObject (device, "manufacturer", "Equiva");
     // "model": "EQ-3 BT"
     cJSON_AddStringToObject (device, "model", "EQ-3 BT");
+    // "sw_version": "1.70"
+    cJSON_AddStringToObject (device, "sw_version", EQ3_MAJVER "." EQ3_MINVER EQ3_EXTRAVER);
     // "identifiers": ["XX:XX:XX:YY:YY:YY"]
     cJSON* identifiers = cJSON_AddArrayToObject (device, "identifiers");
     cJSON_AddItemToArray (identifiers, cJSON_CreateString (macstr));
@@ -192,9 +254,111 @@ cJSON* generate_ha_battery_payload (char mac[6], char *id) {
     // "payload_off": "LOW"
     cJSON_AddStringToObject (root, "payload_on", "LOW");
 
-    char* ha_valve_payload = cJSON_Print (root);
-    ESP_LOGI (HA_TAG, "HA Battery autodiscovery\n%s", ha_valve_payload);
-
     return root;
 }
 
+#ifdef CONFIG_EQ3_HA_DEVICE_DISCOVERY
+/* Start a component of the device discovery payload - "platform", "name" and "unique_id" */
+static cJSON* ha_add_component (cJSON* components, const char* platform, char* id, char* rawmacstr, const char* suffix) {
+    char buffer[80];
+
+    cJSON* cmp = cJSON_CreateObject ();
+    cJSON_AddStringToObject (cmp, "platform", platform);
+    // "name": "eq3_YYYYYY_window"
+    snprintf (buffer, sizeof (buffer), "%s%s_%s", ha_object_id (id), rawmacstr, suffix);
+    cJSON_AddStringToObject (cmp, "name", buffer);
+    // "unique_id": "eq3_YYYYYY_window"
+    cJSON_AddStringToObject (cmp, "unique_id", buffer);
+    cJSON_AddItemToObject (components, buffer, cmp);
+    return cmp;
+}
+
+/* Reuse one of the single entity payloads as a component - it shares the device block at the top level */
+static void ha_add_legacy_component (cJSON* components, const char* platform, cJSON* payload) {
+    cJSON_DeleteItemFromObject (payload, "device");
+    cJSON_AddStringToObject (payload, "platform", platform);
+    cJSON* uid = cJSON_GetObjectItem (payload, "unique_id");
+    cJSON_AddItemToObject (components, uid->valuestring, payload);
+}
+
+/* Home Assistant device based discovery - a single payload with every entity of the TRV */
+cJSON* generate_ha_device_payload (char mac[6], char *id) {
+    char rawmacstr[7];
+    char macstr[18];
+    char buffer[80];
+    char state_topic[80];
+
+    snprintf (rawmacstr, sizeof (rawmacstr), "%02X%02X%02X", mac[3], mac[4], mac[5]);
+    snprintf (macstr, sizeof (macstr), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf (state_topic, sizeof (state_topic), "%sradout/status/%s", id, macstr);
+
+    cJSON* root = cJSON_CreateObject ();
+    // "device": {
+    cJSON* device;
+    cJSON_AddItemToObject (root, "device", device = cJSON_CreateObject ());
+    // "name": "Equiva EQ-3 BT YYYYYY"
+    snprintf (buffer, sizeof (buffer), "%sEquiva EQ-3 BT %s", ha_object_id (id), rawmacstr);
+    cJSON_AddStringToObject (device, "name", buffer);
+    // "configuration_url": "http://123.123.123.123"
+    cJSON_AddStringToObject (device, "configuration_url", config_url);
+    // "manufacturer": "Equiva"
+    cJSON_AddStringToObject (device, "manufacturer", "Equiva");
+    // "model": "EQ-3 BT"
+    cJSON_AddStringToObject (device, "model", "EQ-3 BT");
+    // "sw_version": "1.70"
+    cJSON_AddStringToObject (device, "sw_version", EQ3_MAJVER "." EQ3_MINVER EQ3_EXTRAVER);
+    // "identifiers": ["XX:XX:XX:YY:YY:YY"]
+    cJSON* identifiers = cJSON_AddArrayToObject (device, "identifiers");
+    cJSON_AddItemToArray (identifiers, cJSON_CreateString (macstr));
+    // "origin": {"name": "esp32_mqtt_eq3", "sw_version": "1.70"}
+    cJSON* origin;
+    cJSON_AddItemToObject (root, "origin", origin = cJSON_CreateObject ());
+    cJSON_AddStringToObject (origin, "name", "esp32_mqtt_eq3");
+    cJSON_AddStringToObject (origin, "sw_version", EQ3_MAJVER "." EQ3_MINVER EQ3_EXTRAVER);
+    // "components": {
+    cJSON* components = cJSON_AddObjectToObject (root, "components");
+
+    /* Climate, valve and battery entities keep the unique_ids of the single entity payloads */
+    ha_add_legacy_component (components, "climate", generate_ha_therm_payload (mac, id));
+    ha_add_legacy_component (components, "sensor", generate_ha_valve_payload (mac, id));
+    ha_add_legacy_component (components, "binary_sensor", generate_ha_battery_payload (mac, id));
+
+    // Open window detected
+    cJSON* cmp = ha_add_component (components, "binary_sensor", id, rawmacstr, "window");
+    cJSON_AddStringToObject (cmp, "device_class", "window");
+    cJSON_AddStringToObject (cmp, "state_topic", state_topic);
+    cJSON_AddStringToObject (cmp, "value_template", "{{ 'ON' if value_json.window == 'open' else 'OFF' }}");
+
+    // Boost - "eq3_radin/trv/XX:XX:XX:YY:YY:YY/boost" with ON/OFF
+    cmp = ha_add_component (components, "switch", id, rawmacstr, "boost");
+    snprintf (buffer, sizeof (buffer), "%sradin/trv/%s/boost", id, macstr);
+    cJSON_AddStringToObject (cmp, "command_topic", buffer);
+    cJSON_AddStringToObject (cmp, "state_topic", state_topic);
+    cJSON_AddStringToObject (cmp, "value_template", "{{ 'ON' if value_json.boost == 'active' else 'OFF' }}");
+
+    // Keypad lock - "eq3_radin/trv/XX:XX:XX:YY:YY:YY/lock" with ON/OFF
+    cmp = ha_add_component (components, "lock", id, rawmacstr, "lock");
+    snprintf (buffer, sizeof (buffer), "%sradin/trv/%s/lock", id, macstr);
+    cJSON_AddStringToObject (cmp, "command_topic", buffer);
+    cJSON_AddStringToObject (cmp, "payload_lock", "ON");
+    cJSON_AddStringToObject (cmp, "payload_unlock", "OFF");
+    cJSON_AddStringToObject (cmp, "state_topic", state_topic);
+    cJSON_AddStringToObject (cmp, "value_template", "{{ value_json.state }}");
+    cJSON_AddStringToObject (cmp, "state_locked", "locked");
+    cJSON_AddStringToObject (cmp, "state_unlocked", "unlocked");
+
+    // Temperature offset - "eq3_radin/trv/XX:XX:XX:YY:YY:YY/offset" -3.5 to 3.5
+    cmp = ha_add_component (components, "number", id, rawmacstr, "offset");
+    snprintf (buffer, sizeof (buffer), "%sradin/trv/%s/offset", id, macstr);
+    cJSON_AddStringToObject (cmp, "command_topic", buffer);
+    cJSON_AddStringToObject (cmp, "state_topic", state_topic);
+    cJSON_AddStringToObject (cmp, "value_template", "{{ value_json.offsetTemp }}");
+    cJSON_AddNumberToObject (cmp, "min", -3.5);
+    cJSON_AddNumberToObject (cmp, "max", 3.5);
+    cJSON_AddNumberToObject (cmp, "step", 0.5);
+    cJSON_AddStringToObject (cmp, "unit_of_measurement", "°C");
+    cJSON_AddStringToObject (cmp, "entity_category", "config");
+
+    return root;
+}
+#endif
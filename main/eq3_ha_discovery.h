@@ -1,7 +1,25 @@
 #ifndef EQ3_HA_H
 #define EQ3_HA_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <cJSON.h>
+#include "sdkconfig.h"
+
+/* Payload components tracked in the published hashes */
+#define HA_COMPONENT_CLIMATE  'c'
+#define HA_COMPONENT_VALVE    'v'
+#define HA_COMPONENT_BATTERY  'b'
+#define HA_COMPONENT_DEVICE   'd'
+#define HA_COMPONENT_LEGACY   'l'   /* Single entity configs of older firmware cleared - not a payload */
+
+void ha_discovery_refresh_url (void);
+const char* ha_object_id (char* id);
+
+uint32_t ha_payload_hash (const char* payload);
+bool ha_payload_changed (char mac[6], char component, uint32_t hash);
+bool ha_payload_forget (char mac[6], char component);
+void ha_payload_published (char mac[6], char component, uint32_t hash);
 
 
 cJSON* generate_ha_therm_payload (char mac[6], char* id);
@@ -10,4 +28,8 @@ cJSON* generate_ha_valve_payload (char mac[6], char* id);
 
 cJSON* generate_ha_battery_payload (char mac[6], char* id);
 
+#ifdef CONFIG_EQ3_HA_DEVICE_DISCOVERY
+cJSON* generate_ha_device_payload (char mac[6], char* id);
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+/*
+ * ESP-IDF side of the eq3_core hardware abstraction
+ *
+ * Clock, timer, scans, link statistics and reporting for the core scheduler. The GATT client
+ * (eq3_hal_ble_open/close) lives in eq3_main.c with the rest of the connection handling.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eq3_hal.h"
+#include "eq3_capture.h"
+#include "eq3_capture_ring.h"
+#include "eq3_main.h"
+#include "eq3_gap.h"
+#include "eq3_timer.h"
+#include "eq3_wifi.h"
+#include "eq3_bootwifi.h"
+
+#define HAL_TAG "EQ3_HAL"
+
+int64_t eq3_hal_time_us(void){
+    return esp_timer_get_time();
+}
+
+/* Only once ntp has set the clock */
+bool eq3_hal_localtime(struct tm *timeinfo){
+    time_t now = 0;
+    if(ntp_enabled() == false)
+        return false;
+    time(&now);
+    localtime_r(&now, timeinfo);
+    return true;
+}
+
+void eq3_hal_timer_start(unsigned int delay_ms){
+    start_timer(delay_ms);
+}
+
+bool eq3_hal_ble_preempt(void){
+    return eq3gap_preempt_scan();
+}
+
+bool eq3_hal_ble_probe(const uint8_t *bda){
+#if CONFIG_EQ3_PROBE_TIME > 0
+    if(eq3gap_seen_within((uint8_t *)bda, CONFIG_EQ3_SEEN_MAX_AGE) == false &&
+       eq3gap_probe((uint8_t *)bda, CONFIG_EQ3_PROBE_TIME) == true){
+        ESP_LOGI(HAL_TAG, "Probe for BLE device:");
+        esp_log_buffer_hex(HAL_TAG, bda, 6);
+        return true;
+    }
+#endif
+    return false;
+}
+
+enum eq3_probe_state eq3_hal_ble_probe_state(void){
+    return eq3gap_probe_state();
+}
+
+/* Nothing left to send - presence scanning can use the radio again */
+void eq3_hal_ble_idle(void){
+    eq3gap_presence_resume();
+}
+
+/* The connection never opened - counts against the link like a failed open */
+void eq3_hal_ble_open_timeout(const uint8_t *bda){
+    eq3gap_link_event((uint8_t *)bda, EQ3_LINK_OPEN_FAILED, 0);
+    eq3gap_publish_link((uint8_t *)bda);
+}
+
+int eq3_hal_link_quality(const uint8_t *bda){
+    return eq3gap_link_quality((uint8_t *)bda);
+}
+
+void eq3_hal_report(const char *mac_addr, const char *json){
+    send_trv_status((char *)json, (char *)mac_addr);
+}
+
+void eq3_hal_log_event(const char *event){
+    eq3_add_log((char *)event);
+}
+
+void eq3_hal_command_queued(const uint8_t *bda, const uint8_t *frame, int len, int quality){
+    uint8_t data[EQ3_CAPTURE_DATA_MAX];
+    if(len >= EQ3_CAPTURE_DATA_MAX)
+        return;
+    data[0] = quality == EQ3_LINK_QUALITY_UNKNOWN ? 0xff : quality;
+    memcpy(&data[1], frame, len);
+    eq3_capture_add(EQ3_CAP_COMMAND, bda, 0, data, len + 1);
+}
@@ -100,6 +100,9 @@ const char connectedstatus[] = R"EOF(
 <tr><td>MQTT ID:</td><td>%s</td></tr> 
 <tr><td>MQTT status:</td><td>%s</td></tr> 
 <tr><td>Uptime:</td><td>%d days %02d:%02d:%02d</td></tr> 
+<tr><td>Boot to ready:</td><td>%s</td></tr> 
+<tr><td>Radio:</td><td>%s</td></tr> 
+<tr><td>Status buffer:</td><td>%s</td></tr> 
 </table>
 )EOF";
 
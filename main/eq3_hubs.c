@@ -0,0 +1,505 @@
+/*
+ * Cooperation between several hubs on one broker
+ *
+ * Every hub reports the rssi it sees for each valve on <topic>/rssi/<address>/<hub id>.
+ * Each valve is owned by one hub, held retained on <topic>/owner/<address>. A hub only claims a
+ * valve for itself - when it has the best link and either nobody owns the valve or it beats the
+ * owner by the hysteresis margin - so all hubs settle on the same owner without a master.
+ * Only the owner talks to the valve and publishes its Home Assistant discovery.
+ *
+ * Hubs watch each other through their last will (<id>radout) and the rssi reports. When an owner
+ * goes away the best remaining hub that can hear the valve well enough takes it over, remembering
+ * the original owner in the owner message, and hands it back once that hub reports the valve again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+
+#include "eq3_hubs.h"
+#include "eq3_gap.h"
+#include "eq3_wifi.h"
+
+#define HUB_TAG "EQ3_HUBS"
+
+#ifdef CONFIG_EQ3_MULTI_HUB
+
+#define HUB_SELF 0                  // hubs[0] is this hub
+#define HUB_NONE -1
+#define HUB_RSSI_NONE EQ3_RSSI_UNKNOWN
+#define HUB_MISSED_REPORTS 3        // A hub silent for this many report intervals is treated as gone
+
+struct hub {
+    char id[HUB_ID_LEN];
+    bool alive;
+    int64_t last_heard;             // esp_timer time of the last report from the hub
+    int64_t down_time;              // When the hub was seen to go away - for the takeover latency
+    int64_t up_time;                // When it came back - for the handback latency
+};
+
+struct valve_owner {
+    uint8_t bda[6];
+    int8_t owner;                   // Index into hubs[] - HUB_NONE if not yet known
+    int8_t from;                    // Owner before a failover - HUB_NONE if not taken over
+    int8_t rssi[EQ3_MAX_HUBS];      // Last reported rssi per hub
+};
+
+static struct hub hubs[EQ3_MAX_HUBS];
+static int num_hubs = 0;
+static struct valve_owner valves[EQ3_MAX_DEVICES];
+static int num_valves = 0;
+static SemaphoreHandle_t hub_lock = NULL;
+static TaskHandle_t hub_task_handle = NULL;
+
+/* Valves claimed under hub_lock - their discovery is queued once the lock has been released */
+static uint8_t claimed[EQ3_MAX_DEVICES][6];
+static int num_claimed = 0;
+
+/* Owner and event messages made under hub_lock, published once it has been released */
+struct hub_publish {
+    struct hub_publish *next;
+    int retain;
+    char topic[64];
+    char payload[];
+};
+static struct hub_publish *outbox = NULL;
+
+static void mac_string(uint8_t *bda, char mac_addr[18]){
+    sprintf(mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+static bool parse_mac(const char *str, uint8_t *bda){
+    return sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", &bda[0], &bda[1], &bda[2], &bda[3], &bda[4], &bda[5]) == 6;
+}
+
+/* Follow the last will and the connect message of another hub */
+static void watch_hub(const char *id){
+    char topic[HUB_ID_LEN + 16];
+    snprintf(topic, sizeof(topic), "%sradout", id);
+    mqtt_subscribe(topic);
+    snprintf(topic, sizeof(topic), "%sradout/connect", id);
+    mqtt_subscribe(topic);
+}
+
+/* Index of a hub - added if it is new. HUB_NONE if the table is full */
+static int find_hub(const char *id, int len){
+    int i;
+    if(len <= 0 || len >= HUB_ID_LEN)
+        return HUB_NONE;
+    for(i = 0; i < num_hubs; i++){
+        if(strncmp(hubs[i].id, id, len) == 0 && hubs[i].id[len] == 0)
+            return i;
+    }
+    if(num_hubs == EQ3_MAX_HUBS){
+        ESP_LOGW(HUB_TAG, "Too many hubs - ignoring %.*s", len, id);
+        return HUB_NONE;
+    }
+    memcpy(hubs[num_hubs].id, id, len);
+    hubs[num_hubs].id[len] = 0;
+    /* Assumed alive until it misses its reports or its last will arrives */
+    hubs[num_hubs].alive = true;
+    hubs[num_hubs].last_heard = esp_timer_get_time();
+    hubs[num_hubs].down_time = 0;
+    hubs[num_hubs].up_time = 0;
+    ESP_LOGI(HUB_TAG, "Hub %s", hubs[num_hubs].id);
+    if(num_hubs != HUB_SELF)
+        watch_hub(hubs[num_hubs].id);
+    return num_hubs++;
+}
+
+static struct valve_owner *find_valve(uint8_t *bda, bool add){
+    int i;
+    for(i = 0; i < num_valves; i++){
+        if(memcmp(valves[i].bda, bda, sizeof(valves[i].bda)) == 0)
+            return &valves[i];
+    }
+    if(add == false || num_valves == EQ3_MAX_DEVICES)
+        return NULL;
+    memcpy(valves[num_valves].bda, bda, sizeof(valves[num_valves].bda));
+    valves[num_valves].owner = HUB_NONE;
+    valves[num_valves].from = HUB_NONE;
+    for(i = 0; i < EQ3_MAX_HUBS; i++)
+        valves[num_valves].rssi[i] = HUB_RSSI_NONE;
+    return &valves[num_valves++];
+}
+
+/* Is hub a a better owner than hub b - ties go to the lowest id so every hub agrees */
+static bool better_link(struct valve_owner *v, int a, int b){
+    if(v->rssi[a] != v->rssi[b])
+        return v->rssi[a] > v->rssi[b];
+    return strcmp(hubs[a].id, hubs[b].id) < 0;
+}
+
+/* Queue a publish until hub_unlock() - the mqtt client lock is held while esp-mqtt calls hub_message(),
+ * so publishing with hub_lock held would take the two locks in the opposite order */
+static void queue_publish(const char *topic, const char *payload, int retain){
+    struct hub_publish *pub, **tail;
+    int len = strlen(payload);
+
+    if((pub = malloc(sizeof(struct hub_publish) + len + 1)) == NULL){
+        ESP_LOGE(HUB_TAG, "No memory to publish %s", topic);
+        return;
+    }
+    pub->next = NULL;
+    pub->retain = retain;
+    snprintf(pub->topic, sizeof(pub->topic), "%s", topic);
+    memcpy(pub->payload, payload, len + 1);
+    for(tail = &outbox; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = pub;
+}
+
+static void publish_owner(struct valve_owner *v){
+    char topic[64];
+    char mac_addr[18];
+    char *payload;
+    cJSON *root = cJSON_CreateObject();
+
+    mac_string(v->bda, mac_addr);
+    snprintf(topic, sizeof(topic), "%s/owner/%s", CONFIG_EQ3_HUB_TOPIC, mac_addr);
+    cJSON_AddStringToObject(root, "hub", hubs[v->owner].id);
+    if(v->from != HUB_NONE)
+        cJSON_AddStringToObject(root, "from", hubs[v->from].id);
+    payload = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if(payload != NULL){
+        queue_publish(topic, payload, 1);
+        cJSON_free(payload);
+    }
+}
+
+static void queue_discovery(uint8_t *bda){
+    if(num_claimed < EQ3_MAX_DEVICES)
+        memcpy(claimed[num_claimed++], bda, sizeof(claimed[0]));
+}
+
+/* Release hub_lock, then send the messages queued while it was held and announce the valves claimed.
+ * ha_discovery_force_device() takes the discovery lock, which is held while hub_owns() is asked, so it
+ * must not be called under hub_lock either */
+static void hub_unlock(void){
+    uint8_t bda[EQ3_MAX_DEVICES][6];
+    struct hub_publish *pub, *next;
+    int num, i;
+
+    num = num_claimed;
+    memcpy(bda, claimed, num * sizeof(bda[0]));
+    num_claimed = 0;
+    pub = outbox;
+    outbox = NULL;
+    xSemaphoreGive(hub_lock);
+    for(; pub != NULL; pub = next){
+        next = pub->next;
+        mqtt_publish(pub->topic, pub->payload, strlen(pub->payload), pub->retain);
+        free(pub);
+    }
+    for(i = 0; i < num; i++)
+        ha_discovery_force_device((char *)bda[i]);
+}
+
+/* Report a takeover or handback with how long the valve was without a working owner */
+static void publish_event(const char *event, struct valve_owner *v, int from, int to, int64_t since){
+    char topic[40];
+    char mac_addr[18];
+    char payload[160];
+    int latency = (int)((esp_timer_get_time() - since) / 1000);
+
+    mac_string(v->bda, mac_addr);
+    ESP_LOGI(HUB_TAG, "%s of %s from %s to %s after %d mS", event, mac_addr, hubs[from].id, hubs[to].id, latency);
+    snprintf(topic, sizeof(topic), "%s/event", CONFIG_EQ3_HUB_TOPIC);
+    snprintf(payload, sizeof(payload), "{\"event\":\"%s\",\"trv\":\"%s\",\"from\":\"%s\",\"to\":\"%s\",\"latency_ms\":%d}",
+             event, mac_addr, hubs[from].id, hubs[to].id, latency);
+    queue_publish(topic, payload, 0);
+}
+
+/* Decide whether this hub should take the valve over */
+static void evaluate(struct valve_owner *v){
+    int best = HUB_NONE, i;
+    int owner = v->owner;
+
+    for(i = 0; i < num_hubs; i++){
+        if(hubs[i].alive == true && v->rssi[i] != HUB_RSSI_NONE && (best == HUB_NONE || better_link(v, i, best)))
+            best = i;
+    }
+    if(best != HUB_SELF || owner == HUB_SELF)
+        return;
+    if(owner != HUB_NONE && hubs[owner].alive == false){
+        /* Orphaned - only taken over if we can reach it reliably */
+        if(v->rssi[HUB_SELF] < CONFIG_EQ3_HUB_MIN_RSSI)
+            return;
+        if(v->from == HUB_NONE)
+            v->from = owner;
+        v->owner = HUB_SELF;
+        publish_owner(v);
+        publish_event("takeover", v, owner, HUB_SELF, hubs[owner].down_time);
+        queue_discovery(v->bda);
+        return;
+    }
+    /* Keep the owner until its link has been reported and we beat it by the margin */
+    if(owner != HUB_NONE && (v->rssi[owner] == HUB_RSSI_NONE ||
+                             v->rssi[HUB_SELF] < v->rssi[owner] + CONFIG_EQ3_HUB_HYSTERESIS))
+        return;
+
+    char mac_addr[18];
+    mac_string(v->bda, mac_addr);
+    ESP_LOGI(HUB_TAG, "Claiming %s (rssi %d, owner %s rssi %d)", mac_addr, v->rssi[HUB_SELF],
+             owner == HUB_NONE ? "none" : hubs[owner].id, owner == HUB_NONE ? 0 : v->rssi[owner]);
+    v->owner = HUB_SELF;
+    v->from = HUB_NONE;
+    publish_owner(v);
+    queue_discovery(v->bda);
+}
+
+/* Give a valve back to its original owner once that hub can hear it again */
+static void handback(struct valve_owner *v){
+    int from = v->from;
+
+    if(v->owner != HUB_SELF || from == HUB_NONE || hubs[from].alive == false ||
+       v->rssi[from] == HUB_RSSI_NONE || v->rssi[from] < CONFIG_EQ3_HUB_MIN_RSSI)
+        return;
+    v->owner = from;
+    v->from = HUB_NONE;
+    publish_owner(v);
+    /* up_time is 0 if the hub was already back when we started */
+    publish_event("handback", v, HUB_SELF, from, hubs[from].up_time != 0 ? hubs[from].up_time : hubs[from].last_heard);
+}
+
+static void hub_up(int hub){
+    if(hubs[hub].alive == true)
+        return;
+    hubs[hub].alive = true;
+    hubs[hub].up_time = esp_timer_get_time();
+    ESP_LOGI(HUB_TAG, "Hub %s is back", hubs[hub].id);
+}
+
+/* A hub has gone - forget its links and take over what it owned */
+static void hub_down(int hub, const char *reason){
+    int i;
+
+    if(hub == HUB_SELF || hubs[hub].alive == false)
+        return;
+    hubs[hub].alive = false;
+    hubs[hub].down_time = esp_timer_get_time();
+    ESP_LOGW(HUB_TAG, "Hub %s gone (%s)", hubs[hub].id, reason);
+    for(i = 0; i < num_valves; i++){
+        valves[i].rssi[hub] = HUB_RSSI_NONE;
+        if(valves[i].owner == hub)
+            evaluate(&valves[i]);
+    }
+}
+
+static void rssi_message(uint8_t *bda, const char *hubid, int idlen, const char *data, int len){
+    char value[8];
+    int hub, rssi;
+    struct valve_owner *v;
+
+    if(len <= 0 || len >= sizeof(value))
+        return;
+    memcpy(value, data, len);
+    value[len] = 0;
+    rssi = atoi(value);
+    if(rssi <= HUB_RSSI_NONE || rssi >= 0)
+        return;
+    if((hub = find_hub(hubid, idlen)) == HUB_NONE || (v = find_valve(bda, true)) == NULL)
+        return;
+    hubs[hub].last_heard = esp_timer_get_time();
+    hub_up(hub);
+    v->rssi[hub] = rssi;
+    handback(v);
+    evaluate(v);
+}
+
+static void owner_message(uint8_t *bda, const char *data, int len){
+    struct valve_owner *v;
+    cJSON *root, *hub, *from;
+    int owner;
+    char mac_addr[18];
+
+    if(len == 0 || (root = cJSON_ParseWithLength(data, len)) == NULL)
+        return;
+    hub = cJSON_GetObjectItem(root, "hub");
+    from = cJSON_GetObjectItem(root, "from");
+    if(hub != NULL && hub->valuestring != NULL && (v = find_valve(bda, true)) != NULL &&
+       (owner = find_hub(hub->valuestring, strlen(hub->valuestring))) != HUB_NONE && owner != v->owner){
+        mac_string(bda, mac_addr);
+        ESP_LOGI(HUB_TAG, "%s owned by %s", mac_addr, hubs[owner].id);
+        if(v->owner == HUB_SELF)
+            ESP_LOGI(HUB_TAG, "Handed %s over to %s", mac_addr, hubs[owner].id);
+        else if(owner == HUB_SELF)
+            queue_discovery(bda);
+        v->owner = owner;
+        v->from = HUB_NONE;
+        if(from != NULL && from->valuestring != NULL)
+            v->from = find_hub(from->valuestring, strlen(from->valuestring));
+        evaluate(v);
+    }
+    cJSON_Delete(root);
+}
+
+/* Report the rssi of every valve we can hear */
+static void report_rssi(void){
+    struct found_device *devices;
+    int numdevs = 0, i;
+    char topic[80];
+    char mac_addr[18];
+    char value[12];
+
+    if(eq3gap_get_device_list(&devices, &numdevs) != EQ3_SCAN_COMPLETE)
+        return;
+    for(i = 0; i < numdevs; i++){
+        if(devices[i].last_seen == 0)
+            continue;
+        mac_string((uint8_t *)devices[i].bda, mac_addr);
+        snprintf(topic, sizeof(topic), "%s/rssi/%s/%s", CONFIG_EQ3_HUB_TOPIC, mac_addr, hubs[HUB_SELF].id);
+        snprintf(value, sizeof(value), "%d", devices[i].rssi_ewma / EQ3_RSSI_EWMA_SCALE);
+        mqtt_publish(topic, value, strlen(value), 0);
+    }
+}
+
+/* Hubs which have stopped reporting without a last will (e.g. the broker hasn't noticed yet) */
+static void check_hubs(void){
+    int64_t now = esp_timer_get_time();
+    int i;
+
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    for(i = 1; i < num_hubs; i++){
+        if(hubs[i].alive == true && now - hubs[i].last_heard > (int64_t)CONFIG_EQ3_HUB_REPORT_INTERVAL * HUB_MISSED_REPORTS * 1000000)
+            hub_down(i, "no reports");
+    }
+    hub_unlock();
+}
+
+static void hub_task(void *parm){
+    while(1){
+        /* Woken early by a (re)connect */
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_EQ3_HUB_REPORT_INTERVAL * 1000));
+        if(ismqttconnected() == MQTT_CONNECTED){
+            report_rssi();
+            check_hubs();
+        }
+    }
+}
+
+void hub_init(const char *id){
+    if(hub_lock != NULL)
+        return;
+    hub_lock = xSemaphoreCreateMutex();
+    find_hub(id, strlen(id));
+    xTaskCreate(hub_task, "hub_task", 3072, NULL, 5, &hub_task_handle);
+}
+
+void hub_connected(void){
+    char topic[40];
+    int i;
+    snprintf(topic, sizeof(topic), "%s/#", CONFIG_EQ3_HUB_TOPIC);
+    mqtt_subscribe(topic);
+    /* Nothing was heard while we were disconnected - give the other hubs time to report */
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    for(i = 1; i < num_hubs; i++){
+        hubs[i].last_heard = esp_timer_get_time();
+        watch_hub(hubs[i].id);
+    }
+    xSemaphoreGive(hub_lock);
+    if(hub_task_handle != NULL)
+        xTaskNotifyGive(hub_task_handle);
+}
+
+/* Last will (<id>radout) or connect message (<id>radout/connect) of another hub */
+static bool peer_message(const char *topic, const char *data, int len){
+    bool found = false;
+    int i, idlen;
+
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    for(i = 1; i < num_hubs && found == false; i++){
+        idlen = strlen(hubs[i].id);
+        if(strncmp(topic, hubs[i].id, idlen) != 0)
+            continue;
+        if(strcmp(topic + idlen, "radout") == 0){
+            hub_down(i, "last will");
+            found = true;
+        }else if(strcmp(topic + idlen, "radout/connect") == 0){
+            hub_up(i);
+            hubs[i].last_heard = esp_timer_get_time();
+            found = true;
+        }
+    }
+    hub_unlock();
+    return found;
+}
+
+/* Messages on the shared topic or from other hubs - false if the topic isn't ours */
+bool hub_message(const char *topic, const char *data, int len){
+    int baselen = strlen(CONFIG_EQ3_HUB_TOPIC);
+    uint8_t bda[6];
+    const char *ptr;
+
+    if(hub_lock == NULL)
+        return false;
+    if(strncmp(topic, CONFIG_EQ3_HUB_TOPIC, baselen) != 0 || topic[baselen] != '/')
+        return peer_message(topic, data, len);
+    ptr = topic + baselen + 1;
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    if(strncmp(ptr, "rssi/", 5) == 0 && parse_mac(ptr + 5, bda) == true && ptr[5 + 17] == '/')
+        rssi_message(bda, ptr + 5 + 18, strlen(ptr + 5 + 18), data, len);
+    else if(strncmp(ptr, "owner/", 6) == 0 && parse_mac(ptr + 6, bda) == true)
+        owner_message(bda, data, len);
+    hub_unlock();
+    return true;
+}
+
+/* Should this hub act on commands for a valve - valves nobody has claimed yet are served */
+bool hub_owns(uint8_t *bda){
+    struct valve_owner *v;
+    bool owned = true;
+
+    if(hub_lock == NULL)
+        return true;
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    if((v = find_valve(bda, false)) != NULL && v->owner != HUB_NONE)
+        owned = v->owner == HUB_SELF;
+    xSemaphoreGive(hub_lock);
+    return owned;
+}
+
+/* Id of the hub owning a valve - false if unknown */
+bool hub_owner_id(uint8_t *bda, char *id, int len){
+    struct valve_owner *v;
+    bool found = false;
+
+    if(hub_lock == NULL)
+        return false;
+    xSemaphoreTake(hub_lock, portMAX_DELAY);
+    if((v = find_valve(bda, false)) != NULL && v->owner != HUB_NONE){
+        snprintf(id, len, "%s", hubs[v->owner].id);
+        found = true;
+    }
+    xSemaphoreGive(hub_lock);
+    return found;
+}
+
+#else
+
+void hub_init(const char *id){
+}
+
+void hub_connected(void){
+}
+
+bool hub_message(const char *topic, const char *data, int len){
+    return false;
+}
+
+bool hub_owns(uint8_t *bda){
+    return true;
+}
+
+bool hub_owner_id(uint8_t *bda, char *id, int len){
+    return false;
+}
+
+#endif
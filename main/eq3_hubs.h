@@ -0,0 +1,19 @@
+#ifndef EQ3_HUBS_H
+#define EQ3_HUBS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/* Cooperation between several hubs sharing a broker - each valve is owned by the hub with the best link */
+#define EQ3_MAX_HUBS 4
+
+#define HUB_ID_LEN 30
+
+void hub_init(const char *id);
+void hub_connected(void);
+bool hub_message(const char *topic, const char *data, int len);
+bool hub_owns(uint8_t *bda);
+bool hub_owner_id(uint8_t *bda, char *id, int len);
+
+#endif
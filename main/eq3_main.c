@@ -28,7 +28,6 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
-#include <ctype.h>
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "driver/uart.h"
@@ -42,52 +41,30 @@
 #include "esp_bt_main.h"
 
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "lwip/err.h"
 #include "lwip/apps/sntp.h"
 
 #include "eq3_main.h"
+#include "eq3_cmd.h"
+#include "eq3_sched.h"
 #include "eq3_gap.h"
 #include "eq3_timer.h"
 #include "eq3_wifi.h"
+#include "eq3_status.h"
+#include "eq3_registry.h"
+#include "eq3_capture.h"
+#include "eq3_capture_ring.h"
 
 #include "eq3_bootwifi.h"
 
 #define GATTC_TAG "EQ3_MAIN"
 #define INVALID_HANDLE   0
 
-#define EQ3_DISCONNECT 0
 #define START_WIFI     1
 #define RESTART_WIFI   2
 #define EQ3_REBOOT     3
 
-/* Request ids for TRV */
-#define PROP_ID_QUERY            0x00
-#define PROP_ID_RETURN           0x01
-#define PROP_INFO_RETURN         0x02
-#define PROP_INFO_QUERY          0x03
-#define PROP_COMFORT_ECO_CONFIG  0x11
-#define PROP_OFFSET              0x13
-#define PROP_WINDOW_OPEN_CONFIG  0x14
-#define PROP_SCHEDULE_QUERY      0x20
-#define PROP_SCHEDULE_RETURN     0x21
-#define PROP_MODE_WRITE          0x40
-#define PROP_TEMPERATURE_WRITE   0x41
-#define PROP_COMFORT             0x43
-#define PROP_ECO                 0x44
-#define PROP_BOOST               0x45
-#define PROP_LOCK                0x80
-
-/* Status bits */
-#define AUTO                     0x00
-#define MANUAL                   0x01
-#define AWAY                     0x02
-#define BOOST                    0x04
-#define DST                      0x08
-#define WINDOW                   0x10
-#define LOCKED                   0x20
-#define UNKNOWN                  0x40
-#define LOW_BATTERY              0x80
-
 static bool wifistartdelay = true;     /* Should we delay before connecting wifi at boot */
 static bool reboot_requested = false;  /* This never gets reset once a reboot is requested */
 
@@ -114,16 +91,6 @@ static int setnextcmd(int cmd, int time_s){
 static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param);
 static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t *param);
 
-/* Define REQUEUE_RETRY to push a retry attempt for a command to the back of the queue. This means that if a list of trv commands is present an out-of-service
- * trv cannot hold-off the other valves for its entire retry cycle */
-#define REQUEUE_RETRY
-
-#define EQ3_CMD_DONE    0
-#define EQ3_CMD_RETRY   1
-#define EQ3_CMD_FAILED  2
-/* Command complete success/fail acknowledgement */
-static int command_complete(bool success);
-
 /* EQ-3 service identifier */
 static esp_gatt_srvc_id_t eq3_service_id = {
     .id = {
@@ -164,39 +131,8 @@ static esp_bt_uuid_t eq3_resp_filter_char_uuid = {
     .uuid = {.uuid128 = {0x2a, 0xeb, 0xe0, 0xf4, 0x90, 0x6c, 0x41, 0xaf, 0x96, 0x09, 0x29, 0xcd, 0x4d, 0x43, 0xe8, 0xd0},},
 };
 
-/* 40s timeout on BLE state machine actions */
-#define BLE_OPERATION_TIMEOUT 40
-
-struct _action {
-    uint16_t cmd_len;
-    uint8_t cmd_val[20];
-    esp_bd_addr_t cmd_bleda;   /* BLE Device Address */
-
-    bool get_server;
-    bool connection_open;
-    bool ble_operation_in_progress;
-    int ble_operation_time;
-    bool outstanding_timer;
-};
-
-/* Current TRV command being sent to EQ-3 */
-struct _action current_action = {
-    .cmd_len = 0,
-    .cmd_val[0] = 0,
-    .get_server = false,
-    .connection_open = false,
-    .ble_operation_in_progress = false,
-    .ble_operation_time = 0,
-    .outstanding_timer = false,
-};
-
-/* Start a 1 second timer */
-static void runtimer(void){
-    if(current_action.outstanding_timer == false){
-        current_action.outstanding_timer = true;
-        start_timer(1000);
-    }
-}
+/* The EQ-3 service turned up in the service search */
+static bool service_found = false;
 
 static esp_gattc_char_elem_t elemres;
 static esp_gattc_char_elem_t *char_elem_result = &elemres;
@@ -227,25 +163,6 @@ static struct gattc_profile_inst gl_profile_tab[PROFILE_NUM] = {
     },
 };
 
-static void gattc_command_error(esp_bd_addr_t bleda, char *error){
-    /* Only send the response if there are no retries available */
-    if(command_complete(false) == EQ3_CMD_FAILED){
-        char statrep[120];
-        char mac_addr[20];
-        int statidx = 0;
-        statidx += sprintf (&statrep[statidx], "{");
-        sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", bleda[0], bleda[1], bleda[2], bleda[3], bleda[4], bleda[5]);
-        //statidx += sprintf (&statrep[statidx], "\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\",", bleda[0], bleda[1], bleda[2], bleda[3], bleda[4], bleda[5]);
-        statidx += sprintf (&statrep[statidx], "\"trv\":\"%s\",", mac_addr);
-        statidx += sprintf (&statrep[statidx], "\"error\":\"%s\"}", error);
-        send_trv_status (statrep, mac_addr);
-        eq3_add_log(statrep);
-    }
-    /* 2 second delay until disconnect to allow any background GATTC stuff to complete */
-    setnextcmd(EQ3_DISCONNECT, 2);
-    runtimer();
-}
-
 /* Callback function to handle GATT-Client events */ 
 /* While we've discovered the EQ-3 devices with the GAP handler we need to check the service we want is available when we connect
  * so we connect to the device and search its services before we try to set our chosen characteristic */
@@ -288,38 +205,49 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         memcpy(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
         ESP_LOGI(GATTC_TAG, "REMOTE BDA:");
         esp_log_buffer_hex(GATTC_TAG, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, sizeof(esp_bd_addr_t));
+        /* A connection is as good as an advertisement for knowing the valve is in range */
+        eq3gap_mark_seen(gl_profile_tab[PROFILE_A_APP_ID].remote_bda);
         esp_err_t mtu_ret = esp_ble_gattc_send_mtu_req(gattc_if, conn_id);
         if (mtu_ret){
             ESP_LOGE(GATTC_TAG, "config MTU error, error code = %x", mtu_ret);
         }
         break;
-    case ESP_GATTC_OPEN_EVT:
+    case ESP_GATTC_OPEN_EVT: {
         /* Profile connection opened */
+        uint8_t *bda = (uint8_t *)eq3_sched_bda();
         if (param->open.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "open failed, status %d", p_data->open.status); 
-            gattc_command_error(current_action.cmd_bleda, "TRV not available");
+            eq3_capture_add(EQ3_CAP_OPEN_FAILED, bda, 0, NULL, 0);
+            eq3gap_link_event(bda, EQ3_LINK_OPEN_FAILED, 0);
+            eq3gap_publish_link(bda);
+            eq3_sched_error(bda, "TRV not available");
             break;
         }else{
             ESP_LOGI(GATTC_TAG, "open success");
-            current_action.connection_open = true;
+            eq3_capture_add(EQ3_CAP_OPENED, bda, 0, NULL, 0);
+            eq3_sched_opened();
+            eq3gap_link_event(bda, EQ3_LINK_OPENED, 0);
+            eq3gap_read_link_rssi(bda);
         }
         break;
+    }
     case ESP_GATTC_CLOSE_EVT:
         /* Profile connection closed */
         if(param->close.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "close failed, status %d", p_data->close.status);
         }else{
             ESP_LOGI(GATTC_TAG, "close success");
-            current_action.connection_open = false;
+            eq3_sched_closed();
+            break;
         }
         /* Wait before we connect to the next EQ-3 to send a queued command */
-        runtimer();
+        eq3_sched_wake();
         break;
     case ESP_GATTC_CFG_MTU_EVT:
         /* MTU has been set */
         if (param->cfg_mtu.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG,"config mtu failed, error status = %x", param->cfg_mtu.status);
-            gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "TRV error");
+            eq3_sched_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "TRV error");
             break;
         }
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_CFG_MTU_EVT, Status %d, MTU %d, conn_id %d", param->cfg_mtu.status, param->cfg_mtu.mtu, param->cfg_mtu.conn_id);
@@ -341,7 +269,7 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             }
           }
           if(checkcount == ESP_UUID_LEN_128) {
-            current_action.get_server = true;
+            service_found = true;
             ESP_LOGI(GATTC_TAG, "Found EQ-3");
             gl_profile_tab[PROFILE_A_APP_ID].service_start_handle = p_data->search_res.start_handle;
             gl_profile_tab[PROFILE_A_APP_ID].service_end_handle = p_data->search_res.end_handle;
@@ -353,11 +281,16 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         /* Search is complete */
         if (p_data->search_cmpl.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "search service failed, error status = %x", p_data->search_cmpl.status);
-            gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "TRV error");
+            eq3_sched_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "TRV error");
             break;
         }
         ESP_LOGI(GATTC_TAG, "Search Complete - get req characteristics");
-        if (current_action.get_server == true){
+        /* Handles from an earlier connection save looking up the characteristics */
+        if (service_found == true && eq3_registry_get_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda,
+                    &gl_profile_tab[PROFILE_A_APP_ID].char_handle, &gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle) == true){
+            ESP_LOGI(GATTC_TAG, "eq-3 using cached handles");
+            esp_ble_gattc_register_for_notify (gattc_if, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle);
+        }else if (service_found == true){
             uint16_t count = 0;
             esp_gatt_status_t status = esp_ble_gattc_get_attr_count( gattc_if, p_data->search_cmpl.conn_id, ESP_GATT_DB_CHARACTERISTIC, gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
                                                                      gl_profile_tab[PROFILE_A_APP_ID].service_end_handle, INVALID_HANDLE, &count);
@@ -449,16 +382,19 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
                 }else{
                     ESP_LOGE(GATTC_TAG, "No command attribute found!");
                 }
+                if(gl_profile_tab[PROFILE_A_APP_ID].char_handle != 0 && gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle != 0)
+                    eq3_registry_set_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
+                                             gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle);
                     
             }else{
                 ESP_LOGE(GATTC_TAG, "EQ-3 characteristics not found");
-                gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Not an EQ-3");
+                eq3_sched_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Not an EQ-3");
                 break;
             }
         }else{
             ESP_LOGE(GATTC_TAG, "EQ-3 service not available from this server!");
             /* Wait 2 seconds for background GATTC operations then disconnect */
-            gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Not an EQ-3");
+            eq3_sched_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Not an EQ-3");
             break;
         }
         break;
@@ -466,13 +402,19 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
     case ESP_GATTC_REG_FOR_NOTIFY_EVT: {
         if (p_data->reg_for_notify.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "REG FOR NOTIFY failed: error status = %d", p_data->reg_for_notify.status);
+            /* Cached handles may be stale - look them up again on the retry */
+            eq3_registry_set_handles(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, 0, 0);
             /* Disconnect */
-            gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "EQ-3 notify error");
+            eq3_sched_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "EQ-3 notify error");
         }else{
             /* Now we're ready to send our command to the EQ-3 trv */
+            int cmd_len;
+            const uint8_t *cmd_val = eq3_sched_frame(&cmd_len);
             ESP_LOGI(GATTC_TAG, "Send eq3 command");
+            eq3_capture_add(EQ3_CAP_WRITE, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
+                            cmd_val, cmd_len);
             esp_ble_gattc_write_char( gattc_if, gl_profile_tab[PROFILE_A_APP_ID].conn_id, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-                                  current_action.cmd_len, current_action.cmd_val, ESP_GATT_WRITE_TYPE_RSP, ESP_GATT_AUTH_REQ_NONE);
+                                  cmd_len, (uint8_t *)cmd_val, ESP_GATT_WRITE_TYPE_RSP, ESP_GATT_AUTH_REQ_NONE);
         }
         break;
     }
@@ -481,118 +423,47 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         /* Decode this and create a json message to send back to the controlling broker to keep state-machine up-to-date and acknowledge settings */
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_NOTIFY_EVT, Receive notify value:");
         esp_log_buffer_hex(GATTC_TAG, p_data->notify.value, p_data->notify.value_len);
-
-        uint8_t tempval, temphalf = 0;
-        char statrep[240];
-        char mac_addr[20];
-        int statidx = 0;
-        float temperature = 0;
-
-        statidx += sprintf (&statrep[statidx], "{");
-        sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", gl_profile_tab[PROFILE_A_APP_ID].remote_bda[0], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[1],
-                 gl_profile_tab[PROFILE_A_APP_ID].remote_bda[2], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[3], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[4], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[5]);
-        //statidx += sprintf (&statrep[statidx], "\"trv\":\"%02X:%02X:%02X:%02X:%02X:%02X\",", gl_profile_tab[PROFILE_A_APP_ID].remote_bda[0], gl_profile_tab[PROFILE_A_APP_ID].remote_bda[1],
-        statidx += sprintf (&statrep[statidx], "\"trv\":\"%s\",", mac_addr);
+        eq3_capture_add(EQ3_CAP_NOTIFY, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, p_data->notify.handle,
+                        p_data->notify.value, p_data->notify.value_len);
+        /* Second rssi sample at the end of the session */
+        eq3gap_read_link_rssi(gl_profile_tab[PROFILE_A_APP_ID].remote_bda);
 
         if(p_data->notify.value[0] == PROP_INFO_RETURN && p_data->notify.value[1] == 1){
-            if(p_data->notify.value_len > 5){
-                tempval = p_data->notify.value[5];
-                if(tempval & 0x01)
-                    temphalf = 5;
-                tempval >>= 1;
-                ESP_LOGI (GATTC_TAG, "eq3 settemp is %d.%d C", tempval, temphalf);
-                temperature = (float)tempval + (float)temphalf/10.0;
-                statidx += sprintf (&statrep[statidx], "\"temp\":\"%d.%d\"", tempval, temphalf);
-            }
-            if(p_data->notify.value_len >= 14){
-                int8_t offsetval, offsethalf = 0;
-                offsetval = p_data->notify.value[14];
-                offsetval -= 7; // The offset temperature is encoded in steps of 0.5°C between -3.5°C and 3.5°C
-
-                if(offsetval & 0x01)
-                    offsethalf = 5;
-                offsetval >>= 1;
-                ESP_LOGI(GATTC_TAG, "eq3 offsettemp is %d.%d C", offsetval, offsethalf);
-                statidx += sprintf(&statrep[statidx], ",\"offsetTemp\":\"%d.%d\"", offsetval, offsethalf);
-            }
-            if(p_data->notify.value_len > 3){
-                tempval = p_data->notify.value[3];
-                ESP_LOGI(GATTC_TAG, "eq3 valve %d%% open\n", tempval);
-                statidx += sprintf(&statrep[statidx], ",\"valve\":\"%d\"", tempval);
-            }
-            if(p_data->notify.value_len > 2){
-                tempval = p_data->notify.value[2];
-                statidx += sprintf(&statrep[statidx], ",\"mode\":");
-                if(tempval & MANUAL){
-                    ESP_LOGI(GATTC_TAG, "eq3 set manual");
-                    statidx += sprintf(&statrep[statidx], "\"manual\"");
-                }else if(tempval & AWAY){
-                    ESP_LOGI(GATTC_TAG, "eq3 set holiday");
-                    statidx += sprintf(&statrep[statidx], "\"holiday\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 set auto");
-                    statidx += sprintf(&statrep[statidx], "\"auto\"");
-                }
-                statidx += sprintf (&statrep[statidx], ",\"mode_ha\":");
-                if (temperature < 5) {
-                    ESP_LOGI (GATTC_TAG, "eq3 HA mode is OFF");
-                    statidx += sprintf (&statrep[statidx], "\"off\"");
-                } else if ((tempval & MANUAL) && (temperature >= 5)) {
-                    ESP_LOGI (GATTC_TAG, "eq3 HA mode is HEAT");
-                    statidx += sprintf (&statrep[statidx], "\"heat\"");
-                } else {
-                    ESP_LOGI (GATTC_TAG, "eq3 HA mode is AUTO");
-                    statidx += sprintf (&statrep[statidx], "\"auto\"");
-                }
-                statidx += sprintf (&statrep[statidx], ",\"boost\":");
-                if(tempval & BOOST){
-                    ESP_LOGI(GATTC_TAG, "eq3 boost");
-                    statidx += sprintf(&statrep[statidx], "\"active\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 no boost");
-                    statidx += sprintf(&statrep[statidx], "\"inactive\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"window\":");
-                if(tempval & WINDOW){
-                    ESP_LOGI(GATTC_TAG, "eq3 window open");
-                    statidx += sprintf(&statrep[statidx], "\"open\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 window closed");
-                    statidx += sprintf(&statrep[statidx], "\"closed\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"state\":");
-                if(tempval & LOCKED){
-                    ESP_LOGI(GATTC_TAG, "eq3 locked");
-                    statidx += sprintf(&statrep[statidx], "\"locked\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 unlocked");
-                    statidx += sprintf(&statrep[statidx], "\"unlocked\"");
-                }
-                statidx += sprintf(&statrep[statidx], ",\"battery\":");
-                if(tempval & LOW_BATTERY){
-                    ESP_LOGI(GATTC_TAG, "eq3 battery LOW");
-                    statidx += sprintf(&statrep[statidx], "\"LOW\"");
-                }else{
-                    ESP_LOGI(GATTC_TAG, "eq3 battery good");
-                    statidx += sprintf(&statrep[statidx], "\"GOOD\"");
-                }
-            }
-            statidx += sprintf(&statrep[statidx], "}");
-            /* Send the status report we just collated */
+            struct eq3_status status;
+            char statrep[EQ3_STATUS_JSON_MAX];
+            char mac_addr[20];
+            uint8_t *bda = gl_profile_tab[PROFILE_A_APP_ID].remote_bda;
+            int64_t enctime = esp_timer_get_time();
+
+            eq3_decode_status(p_data->notify.value, p_data->notify.value_len, &status);
+            sprintf (mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+            int statlen = eq3_status_to_json(&status, mac_addr, statrep, sizeof(statrep));
+            enctime = esp_timer_get_time() - enctime;
+            /* Send the status report we just collated and keep it for the snapshot */
             send_trv_status(statrep, mac_addr);
+            store_trv_status(statrep, mac_addr);
+            eq3_registry_set_status(bda, p_data->notify.value, p_data->notify.value_len);
             /* Add to the log */
             eq3_add_log(statrep);
+#ifdef CONFIG_EQ3_MQTT_BINARY
+            uint8_t binrep[EQ3_STATUS_CBOR_MAX];
+            int64_t bintime = esp_timer_get_time();
+            int binlen = eq3_status_to_cbor(&status, bda, binrep, sizeof(binrep));
+            bintime = esp_timer_get_time() - bintime;
+            if(binlen > 0)
+                send_trv_status_bin(binrep, binlen, mac_addr);
+            ESP_LOGI(GATTC_TAG, "status json %d bytes in %d uS, cbor %d bytes in %d uS", statlen, (int)enctime, binlen, (int)bintime);
+#else
+            ESP_LOGI(GATTC_TAG, "status json %d bytes in %d uS", statlen, (int)enctime);
+#endif
         }else{
             ESP_LOGI(GATTC_TAG, "eq3 got response 0x%x, 0x%x\n", p_data->notify.value[0], p_data->notify.value[1]);
         }
 
         if(ESP_OK != esp_ble_gattc_unregister_for_notify (gattc_if, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, gl_profile_tab[PROFILE_A_APP_ID].resp_char_handle)){
             ESP_LOGI(GATTC_TAG, "eq3 failed to unreg for notify\n");
-            /* Notify the successful command */
-            command_complete(true);
-            /* 2 second delay until disconnect to allow any background GATTC stuff to complete */
-            setnextcmd(EQ3_DISCONNECT, 2);
-            runtimer();
+            /* Notify the successful command - the connection is closed after a short delay */
+            eq3_sched_done();
         }
 
     break;
@@ -604,11 +475,8 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
             /* Continue to disconnect */
         }
         ESP_LOGI(GATTC_TAG, "eq3 unregistered for notification\n");
-        /* Notify the successful command */
-        command_complete(true);
-        /* 2 second delay until disconnect to allow any background GATTC stuff to complete */
-        setnextcmd(EQ3_DISCONNECT, 2);
-        runtimer();
+        /* Notify the successful command - the connection is closed after a short delay */
+        eq3_sched_done();
 
         break;
     }  
@@ -617,20 +485,26 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         if (p_data->write.status != ESP_GATT_OK){
             ESP_LOGE(GATTC_TAG, "write char failed, error status = %x", p_data->write.status);
             /* Disconnect */
-            gattc_command_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Unable to write to EQ-3");
+            eq3_sched_error(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, "Unable to write to EQ-3");
             break;
         }
         ESP_LOGI(GATTC_TAG, "write char success ");
         break;
     case ESP_GATTC_DISCONNECT_EVT:
         /* Disconnected */
-        current_action.get_server = false;
+        service_found = false;
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_DISCONNECT_EVT, status = %d", p_data->disconnect.reason);
         //esp_ble_gattc_app_unregister(gl_profile_tab[PROFILE_A_APP_ID].gattc_if);
-        current_action.ble_operation_in_progress = false;
 
-        if(p_data->disconnect.reason != ESP_GATT_CONN_TERMINATE_LOCAL_HOST)
-            gattc_command_error(current_action.cmd_bleda, "Device unavailable");
+        eq3gap_link_event(p_data->disconnect.remote_bda, p_data->disconnect.reason == ESP_GATT_CONN_TERMINATE_LOCAL_HOST ?
+                          EQ3_LINK_CLOSED : EQ3_LINK_DROPPED, p_data->disconnect.reason);
+        eq3gap_publish_link(p_data->disconnect.remote_bda);
+        {
+            uint8_t dropped = p_data->disconnect.reason != ESP_GATT_CONN_TERMINATE_LOCAL_HOST;
+            eq3_capture_add(EQ3_CAP_DISCONNECT, p_data->disconnect.remote_bda, 0, &dropped, 1);
+        }
+
+        eq3_sched_disconnected(p_data->disconnect.reason != ESP_GATT_CONN_TERMINATE_LOCAL_HOST);
 
         break;
     default:
@@ -667,39 +541,10 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp
 
 #define BUF_SIZE (1024)
 
-#define MAX_CMD_BYTES 6
-#define SET_TIME_BYTES 6
-#define MAX_CMD_RETRIES 3
-
 /* Message queue of EQ-3 messages */
 QueueHandle_t msgQueue = NULL;
 QueueHandle_t timer_queue = NULL;
 
-typedef enum {
-    EQ3_BOOST = 0,
-    EQ3_UNBOOST,
-    EQ3_AUTO,
-    EQ3_MANUAL,
-    EQ3_ECO,
-    EQ3_SETTEMP,
-    EQ3_OFFSET,
-    EQ3_SETTIME,
-    EQ3_LOCK,
-    EQ3_UNLOCK,
-}eq3_bt_cmd;
-
-struct eq3cmd{
-    esp_bd_addr_t bleda;
-    eq3_bt_cmd cmd;
-    unsigned char cmdparms[MAX_CMD_BYTES];
-    int retries;
-    struct eq3cmd *next;
-};
-
-static void enqueue_command(struct eq3cmd *newcmd);
-
-struct eq3cmd *cmdqueue = NULL;
-
 /* Task to handle local UART and accept EQ-3 commands for test/debug */
 static void uart_task()
 {
@@ -758,357 +603,37 @@ static void uart_task()
 /* Schedule a reboot after commands have completed or very shortly */ 
 void schedule_reboot(void){
     reboot_requested = true;
-    if(current_action.ble_operation_in_progress == false)
-        runtimer();
-}
-
-/* Handle an EQ-3 command from uart or mqtt */
-int handle_request(char *cmdstr){
-    char *cmdptr = cmdstr;
-    struct eq3cmd *newcmd;
-    eq3_bt_cmd command; 
-    unsigned char cmdparms[MAX_CMD_BYTES];  
-    bool start = false;
-
-    ESP_LOGI (GATTC_TAG, "Handle command %s", cmdptr);
-    
-    // Skip the bleaddr
-    while(*cmdptr != 0 && !isxdigit((int)*cmdptr))
-        cmdptr++;
-    while(*cmdptr != 0 && (isxdigit((int)*cmdptr) || *cmdptr == ':'))
-        cmdptr++;
-    // Skip any spaces
-    while(*cmdptr == ' ')
-        cmdptr++;    
-    if(start == false && strncmp((const char *)cmdptr, "settime", 7) == 0){
-        start = true;
-
-        if(cmdptr[7] != 0 && strlen(cmdptr + 8) < 12){
-            //free(newcmd);
-            /* TODO more validation of time argument */
-            ESP_LOGI(GATTC_TAG, "Invalid time argument %s", cmdptr + 8);
-            return -1;
-        }
-        /* Numerals following the command are used to set the time. If there are none the
-         * valve time will be set according to the ntp time if is is synchronised */
-        if (isalnum ((int)cmdptr[8]) && (strlen (cmdptr + 8) < 12)) {
-            char hexdigit[3];
-            int dig;
-            hexdigit[2] = 0;
-            for(dig=0; dig < SET_TIME_BYTES; dig++){
-                hexdigit[0] = *(cmdptr + 8 + (dig * 2));
-                hexdigit[1] = *(cmdptr + 9 + (dig * 2));
-                cmdparms[dig] = (unsigned char)strtol(hexdigit, NULL, 16);
-            }
-        }else{
-            /* TODO - only if time is synchronised */
-            if(ntp_enabled() == true){
-                time_t now = 0;
-                struct tm timeinfo = { 0 };
-                time(&now);
-                localtime_r(&now, &timeinfo);
-                cmdparms[0] = timeinfo.tm_year - 100;
-                cmdparms[1] = timeinfo.tm_mon + 1;
-                cmdparms[2] = timeinfo.tm_mday;
-                cmdparms[3] = timeinfo.tm_hour;
-                cmdparms[4] = timeinfo.tm_min;
-                cmdparms[5] = timeinfo.tm_sec;
-            }else{
-                ESP_LOGI(GATTC_TAG, "Cannot set valve time via ntp as ntp is not enabled");
-                return -1;
-            }
-        }
-        command = EQ3_SETTIME;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "boost", 5) == 0){
-        start = true;
-        command = EQ3_BOOST;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "unboost", 7) == 0){
-        start = true;
-        command = EQ3_UNBOOST;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "auto", 4) == 0){
-        start = true;
-        command = EQ3_AUTO;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "manual", 6) == 0){
-        start = true;
-        command = EQ3_MANUAL;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "lock", 4) == 0){
-        start = true;
-        command = EQ3_LOCK;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "unlock", 6) == 0){
-        start = true;
-        command = EQ3_UNLOCK;
-    }
-    if(start == false && strncmp((const char *)cmdptr, "offset", 6) == 0){
-        char *endmsg;
-        float offset = strtof(cmdptr + 7, &endmsg);
-        if(offset < -3.5 || offset > 3.5){
-            // Error
-            //free(newcmd);
-            return -1;
-        }
-        offset += 3.5;
-        offset *= 2;
-        cmdparms[0] = (unsigned char)offset;
-        start = true;
-        command = EQ3_OFFSET;
-        ESP_LOGI(GATTC_TAG, "set offset val 0x%x\n", cmdparms[0]);
-    }
-    if(start == false && strncmp((const char *)cmdptr, "settemp", 7) == 0){
-        char *endmsg;
-        float temp = strtof(cmdptr + 8, &endmsg);
-        int inttemp = (int)temp;
-        if(inttemp >= 5 && inttemp < 30){
-            start = true;
-            command = EQ3_SETTEMP;
-            cmdparms[0] = (unsigned char)(inttemp << 1);
-            if(temp - (float)inttemp >= 0.5)
-                cmdparms[0] |= 0x01;
-        }else{
-            ESP_LOGI(GATTC_TAG, "Invalid temperature %0.1f requested", temp);
-            //free(newcmd);
-            return -1;
-        }
-    }
-    if (start == false && strncmp ((const char*)cmdptr, "mode", 4) == 0) {
-        start = true;
-        cmdptr += 5;
-        ESP_LOGI (GATTC_TAG, "Command mode: \"%s\"", cmdptr);
-        if (strncmp ((const char*)cmdptr, "auto", 4) == 0) {
-            command = EQ3_AUTO;
-        }else if (strncmp ((const char*)cmdptr, "off", 3) == 0) {
-            command = EQ3_SETTEMP;
-            cmdparms[0] = 0x09; /* (30 << 1) */
-        } else if (strncmp ((const char*)cmdptr, "heat", 4) == 0) {
-            command = EQ3_MANUAL;
-        } else {
-            start = false;
-        }
-    }
-    if (start == false && strncmp ((const char*)cmdptr, "off", 3) == 0) {
-        /* 'Off' is achieved by setting the required temperature to 4.5 */
-        start = true;
-        command = EQ3_SETTEMP;
-        cmdparms[0] = 0x09; /* (4 << 1) | 0x01 */
-    }
-    if(start == false && strncmp((const char *)cmdptr, "on", 2) == 0){
-        /* 'On' is achieved by setting the required temperature to 30 */
-        start = true;
-        command = EQ3_SETTEMP;
-        cmdparms[0] = 0x3c; /* (30 << 1) */
-    }
-    
-    if(start == true){
-        int parm;
-
-        eq3_add_log(cmdstr);
-        newcmd = malloc(sizeof(struct eq3cmd));
-
-        // TODO - what if malloc fails?
-
-        newcmd->cmd = command;
-        for(parm=0; parm < MAX_CMD_BYTES; parm++)
-            newcmd->cmdparms[parm] = cmdparms[parm];
-        newcmd->retries = MAX_CMD_RETRIES;
-
-        while(*cmdstr != 0 && !isxdigit((int)*cmdstr))
-            cmdstr++;
-    
-        int adidx = ESP_BD_ADDR_LEN;
-        while(adidx > 0){
-            newcmd->bleda[ESP_BD_ADDR_LEN - adidx] = strtol(cmdstr, &cmdstr, 16);
-            while(*cmdstr != 0 && !isxdigit((int)*cmdstr))
-                cmdstr++;
-            adidx--;
-        }
-    
-        ESP_LOGI(GATTC_TAG, "Requested address:");
-        esp_log_buffer_hex(GATTC_TAG, newcmd->bleda, sizeof(esp_bd_addr_t));
-
-        newcmd->next = NULL;
-    
-        enqueue_command(newcmd);
-
-        if(current_action.ble_operation_in_progress == false){
-            /* Only schedule the command if ble is currently idle */
-            //if(timer_running() == false){
-            //    ESP_LOGI(GATTC_TAG, "Timer not running so starting it");
-                runtimer();
-            //}
-        }
-    }else{
-        ESP_LOGI(GATTC_TAG, "Invalid command %s", cmdptr);
-        return -1;
-    }
-    return 0;
+    if(eq3_sched_busy() == false)
+        eq3_sched_wake();
 }
 
-/* Enqueue a command into the list */
-static void enqueue_command(struct eq3cmd *newcmd){
-    struct eq3cmd *qwalk = cmdqueue;
-    struct eq3cmd *lastCommandForDevice = NULL;
-
-    if(cmdqueue == NULL){
-        cmdqueue = newcmd;
-        ESP_LOGI(GATTC_TAG, "Add queue head");
-    }else{
-        if(memcmp(qwalk->bleda, newcmd->bleda, sizeof(esp_bd_addr_t)) == 0)
-            lastCommandForDevice = qwalk;
-
-        while(qwalk->next != NULL){
-            qwalk = qwalk->next;
-            if(memcmp(qwalk->bleda, newcmd->bleda, sizeof(esp_bd_addr_t)) == 0)
-                lastCommandForDevice = qwalk;
-        }
-
-        //don't add the same command again if it already is the last command for a specific device
-        if(lastCommandForDevice != NULL
-                && lastCommandForDevice->cmd == newcmd->cmd
-                && memcmp(lastCommandForDevice->cmdparms, newcmd->cmdparms, MAX_CMD_BYTES) == 0)
-        {
-            ESP_LOGI(GATTC_TAG, "Command still pending");
-            return;
-        }
-
-        qwalk->next = newcmd;
-        ESP_LOGI(GATTC_TAG, "Add queue end");
-     }
+/* Open the GATT connection for the current command */
+void eq3_hal_ble_open(const uint8_t *bda){
+    ESP_LOGI(GATTC_TAG, "Open virtual server connection for BLE device:");
+    esp_log_buffer_hex(GATTC_TAG, bda, sizeof(esp_bd_addr_t));
+    /* Keep the radio free for the connection */
+    eq3gap_presence_pause();
+    eq3_capture_add(EQ3_CAP_OPEN, bda, 0, NULL, 0);
+    esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, (uint8_t *)bda, 0x00, true);
+    /*
+    #define BLE_ADDR_PUBLIC         0x00
+    #define BLE_ADDR_RANDOM         0x01
+    #define BLE_ADDR_PUBLIC_ID      0x02
+    #define BLE_ADDR_RANDOM_ID      0x03
+     */
+    //TODO: BLE_ADDR_PUBLIC Verify https://github.com/espressif/esp-idf/blob/a0468b2bd64c48d093309a4b3d623a7343c205c0/components/bt/bluedroid/stack/include/stack/bt_types.h
 }
 
-/* Get the next command off the queue and encode the characteristic parameters */
-static int setup_command(void){
-    if(cmdqueue != NULL){
-        int parm;
-        switch(cmdqueue->cmd){
-        case EQ3_SETTIME:
-            current_action.cmd_val[0] = PROP_INFO_QUERY;
-            for(parm=0; parm < SET_TIME_BYTES; parm++)
-                current_action.cmd_val[1 + parm] = cmdqueue->cmdparms[parm];
-            current_action.cmd_len = 1 + SET_TIME_BYTES;
-            break;
-        case EQ3_BOOST:
-            current_action.cmd_val[0] = PROP_BOOST;
-            current_action.cmd_val[1] = 0x01;
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_UNBOOST:
-            current_action.cmd_val[0] = PROP_BOOST;
-            current_action.cmd_val[1] = 0x00;
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_AUTO:
-            current_action.cmd_val[0] = PROP_MODE_WRITE;
-            current_action.cmd_val[1] = 0x00;
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_MANUAL:
-            current_action.cmd_val[0] = PROP_MODE_WRITE;
-            current_action.cmd_val[1] = 0x40;
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_SETTEMP:
-            current_action.cmd_val[0] = PROP_TEMPERATURE_WRITE;
-            current_action.cmd_val[1] = cmdqueue->cmdparms[0];
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_OFFSET:
-            current_action.cmd_val[0] = PROP_OFFSET;
-            current_action.cmd_val[1] = cmdqueue->cmdparms[0];
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_LOCK:
-            current_action.cmd_val[0] = PROP_LOCK;
-            current_action.cmd_val[1] = 1;
-            current_action.cmd_len = 2;
-            break;
-        case EQ3_UNLOCK:
-            current_action.cmd_val[0] = PROP_LOCK;
-            current_action.cmd_val[1] = 0;
-            current_action.cmd_len = 2;
-            break;
-        default:
-            ESP_LOGI(GATTC_TAG, "Can't handle that command yet");
-            break;
-        }
-        memcpy(current_action.cmd_bleda, cmdqueue->bleda, sizeof(esp_bd_addr_t));
-        //struct eq3cmd *delcmd = cmdqueue;
-        //cmdqueue = cmdqueue->next;
-        //free(delcmd);
-    }
-    return 0;
-}
-
-static int command_complete(bool success){
-    bool deletehead = false;
-    int rc = EQ3_CMD_RETRY;
-
-    if(success == true){
-        deletehead = true;
-        rc = EQ3_CMD_DONE;
-    }else if(cmdqueue == NULL){
-        rc = EQ3_CMD_DONE;
-    }else{
-        /* Command failed - retry if there are any retries left */
-        
-        /* Normal operation - retry the same command until all attempts are exhausted 
-         * OR
-         * define REQUEUE_RETRY to push the command to the end of the list to retry once all other currently queued commands are complete. */        
-        if(--cmdqueue->retries <= 0){
-            deletehead = true;
-            ESP_LOGE(GATTC_TAG, "Command failed - retries exhausted");
-            rc = EQ3_CMD_FAILED;
-        }else{
-#ifdef REQUEUE_RETRY
-            ESP_LOGE(GATTC_TAG, "Command failed - requeue for retry");
-            /* If there are no other queued commands just retry this one */
-            if(cmdqueue->next != NULL){
-                struct eq3cmd *mvcmd = cmdqueue;
-                while(mvcmd->next != NULL)
-                    mvcmd = mvcmd->next;
-                /* Attach head to tail */
-                mvcmd->next = cmdqueue;
-                cmdqueue = cmdqueue->next;
-                /* Detach head from new tail */
-                mvcmd->next->next = NULL;
-            }
-#else
-            ESP_LOGE(GATTC_TAG, "Command failed - retry");
-#endif  
-        }
-    }
-    if(deletehead && cmdqueue != NULL){
-        /* Delete this command from the queue */
-        struct eq3cmd *delcmd = cmdqueue;
-        cmdqueue = cmdqueue->next;
-        free(delcmd);
-    }
-    return rc;
+/* Close the connection once the command has finished */
+void eq3_hal_ble_close(void){
+    esp_ble_gattc_close (gl_profile_tab[PROFILE_A_APP_ID].gattc_if, gl_profile_tab[PROFILE_A_APP_ID].conn_id);
 }
 
-/* Run the next EQ-3 command from the list */
-static int run_command(void){
-    if(cmdqueue != NULL){
-        ESP_LOGI(GATTC_TAG, "Sending next command");
-        setup_command();
-        ESP_LOGI(GATTC_TAG, "Open virtual server connection for BLE device:");
-        esp_log_buffer_hex(GATTC_TAG, current_action.cmd_bleda, sizeof(esp_bd_addr_t));
-        current_action.ble_operation_in_progress = true;
-        current_action.ble_operation_time = 0;
-        esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, current_action.cmd_bleda, 0x00, true);
-        /*
-        #define BLE_ADDR_PUBLIC         0x00
-        #define BLE_ADDR_RANDOM         0x01
-        #define BLE_ADDR_PUBLIC_ID      0x02
-        #define BLE_ADDR_RANDOM_ID      0x03
-         */
-        //TODO: BLE_ADDR_PUBLIC Verify https://github.com/espressif/esp-idf/blob/a0468b2bd64c48d093309a4b3d623a7343c205c0/components/bt/bluedroid/stack/include/stack/bt_types.h
-    }
-    return 0;
+/* What the radio is doing - a valve session or one of the scans */
+const char *radio_state(void){
+    if(eq3_sched_in_session() == true)
+        return "valve session";
+    return eq3gap_state();
 }
 
 /* Callback from config - copy url, username and password for mqtt broker */
@@ -1157,7 +682,7 @@ void wifidone(int rc){
         ESP_LOGI(GATTC_TAG, "WiFi connection failed - entering AP mode for 5 minutes\n"); 
         /* Max 5 minutes as AP then we retry station mode */
         setnextcmd(RESTART_WIFI, 300);
-        runtimer();
+        eq3_sched_wake();
     }else{
         /* We are station and connected */
         ESP_LOGI(GATTC_TAG, "WiFi network connected\n");
@@ -1257,6 +782,9 @@ void app_main(){
 
     /* Initialise the circular log */
     eq3_log_init();
+    eq3_capture_init();
+    /* Status cache for snapshots - filled from the registry and the BLE task */
+    trv_state_init();
     /* Add a boot record */
     eq3_add_log((char *)"Boot");
 
@@ -1288,15 +816,19 @@ void app_main(){
 
     if(wifistartdelay == true){
         setnextcmd(START_WIFI, 5);
-        runtimer();
+        eq3_sched_wake();
     }else{
         ESP_LOGI(GATTC_TAG, "Init wifi");
         //initialise_wifi();
         bootWiFi(wifidone, confparms);
     }
     
+    /* Valves known from previous boots are available straight away */
+    eq3_registry_load();
+
     /* Kick off a GAP scan */
-    start_scan();
+    eq3gap_init();
+    eq3gap_request_scan();
     
     /* Main polling loop */
     uint8_t *msg = NULL;
@@ -1311,20 +843,14 @@ void app_main(){
 
         /* Timer message handling */
         if(xQueueReceive(timer_queue, &evt, 0)){
-            ESP_LOGI(GATTC_TAG, "Timer0 event (nextcmd.running=%d, nextcmd.countdown=%d, ble_operation_in_progress=%d)", nextcmd.running, nextcmd.countdown, current_action.ble_operation_in_progress);
-            current_action.outstanding_timer = false;
-            
+            ESP_LOGI(GATTC_TAG, "Timer0 event (nextcmd.running=%d, nextcmd.countdown=%d, ble_operation_in_progress=%d)", nextcmd.running, nextcmd.countdown, eq3_sched_busy());
+            /* Valve sessions */
+            eq3_sched_tick();
+
             if(nextcmd.running == true){
                 //ESP_LOGI(GATTC_TAG, "countdown is %d\n", nextcmd.countdown);
                 if(--nextcmd.countdown <= 0){
                     switch(nextcmd.cmd){
-                        case EQ3_DISCONNECT:
-                            if(current_action.connection_open == true){
-                                ESP_LOGI(GATTC_TAG, "Close virtual server connection");
-                                esp_ble_gattc_close (gl_profile_tab[PROFILE_A_APP_ID].gattc_if, gl_profile_tab[PROFILE_A_APP_ID].conn_id);
-                            }
-                            runtimer();
-                            break;
                         case START_WIFI:
                             ESP_LOGI(GATTC_TAG, "Init wifi");
                             bootWiFi(wifidone, confparms);
@@ -1337,29 +863,17 @@ void app_main(){
                     }
                     nextcmd.running = false;
                 }else{
-                    runtimer();
-                }
-            }else{
-                if(current_action.ble_operation_in_progress == false){
-                    run_command();
-                    /* If there are no outstanding commands we can reboot if required */
-                    if(current_action.ble_operation_in_progress == false && reboot_requested == true){
-                        esp_restart();
-                    }
-                }else{
-                    if(++current_action.ble_operation_time >= BLE_OPERATION_TIMEOUT){
-                        ESP_LOGE(GATTC_TAG, "BLE operation timed out\n");
-                        current_action.ble_operation_in_progress = false;
-                        current_action.ble_operation_time = 0;
-                        gattc_command_error(current_action.cmd_bleda, "BLE system failure");
-                        //run_command();
-                    }else{
-                        /* Restart the timer */
-                        runtimer();
-                    }
+                    eq3_sched_wake();
                 }
             }
+            /* If there are no outstanding commands we can reboot if required */
+            if(eq3_sched_busy() == false && reboot_requested == true){
+                esp_restart();
+            }
         }
+        /* A requested scan runs between valve sessions */
+        if(eq3_sched_idle() == true)
+            eq3gap_run_pending_scan();
         //ESP_LOGI(GATTC_TAG, "Loop");
     }
 }
@@ -8,10 +8,12 @@
 void eq3_log_init(void);
 void eq3_add_log(char *log);
 
-int handle_request(char *cmdstr);
+#include "eq3_sched.h"      /* handle_request() */
 
 void schedule_reboot(void);
 
+const char *radio_state(void);
+
 /* LOLIN_OLED can be defined if using a LOLIN OLED ESP32 board */
 /* This uses the https://github.com/TaraHoleInIt/tarablessd1306 SSD1306 driver */
 //#define LOLIN_OLED
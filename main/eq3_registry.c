@@ -0,0 +1,248 @@
+/*
+ * Persistent registry of known EQ-3 valves
+ *
+ * One NVS blob per valve keyed by its address. The registry is loaded at boot so the valves
+ * are known (and announced to Home Assistant) before the first scan has finished.
+ * The records are also kept in RAM: scans, service discovery and status notifications all
+ * arrive on the BLE tasks, so they only update the RAM copy there and the registry task writes
+ * the changed records to flash later. Status notifications only count as a change when the
+ * mode or setpoint has changed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "eq3_registry.h"
+#include "eq3_status.h"
+#include "eq3_gap.h"
+#include "eq3_wifi.h"
+
+#define REGISTRY_TAG "EQ3_REGISTRY"
+
+#define REGISTRY_NAMESPACE "trv_reg"        // Namespace in NVS for known valves
+#define REGISTRY_WRITE_DELAY_MS 30000       // Collect changes for this long before writing them
+
+/* Known valves - changed records wait here to be written by the registry task */
+static struct registry_entry {
+    struct trv_record rec;
+    bool used;
+    bool dirty;
+} records[EQ3_MAX_DEVICES];
+static SemaphoreHandle_t records_lock = NULL;
+static TaskHandle_t registry_task_handle = NULL;
+
+/* NVS key - 12 hex digits of the address */
+static void record_key(uint8_t *bda, char key[13]){
+    snprintf(key, 13, "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+static bool read_record(nvs_handle handle, const char *key, struct trv_record *rec){
+    size_t size = sizeof(struct trv_record);
+    if(nvs_get_blob(handle, key, rec, &size) != ESP_OK || size != sizeof(struct trv_record) || rec->version != TRV_RECORD_VERSION)
+        return false;
+    return true;
+}
+
+/* Entry of a valve, a free one if create is set - NULL if there is none. Called with records_lock */
+static struct registry_entry *find_entry(uint8_t *bda, bool create){
+    struct registry_entry *entry = NULL;
+    int i;
+    for(i = 0; i < EQ3_MAX_DEVICES; i++){
+        if(records[i].used == false){
+            if(entry == NULL && create == true)
+                entry = &records[i];
+        }else if(memcmp(records[i].rec.bda, bda, sizeof(records[i].rec.bda)) == 0){
+            return &records[i];
+        }
+    }
+    if(entry != NULL){
+        memset(entry, 0, sizeof(*entry));
+        entry->used = true;
+        entry->rec.version = TRV_RECORD_VERSION;
+        memcpy(entry->rec.bda, bda, sizeof(entry->rec.bda));
+    }
+    return entry;
+}
+
+/* Queue a changed record for writing - called with records_lock, wake the registry task when true */
+static bool mark_dirty(struct registry_entry *entry){
+    bool wake = entry->dirty == false;
+    entry->dirty = true;
+    return wake;
+}
+
+static void registry_task(void *parm);
+
+/* Load every known valve into the device table, Home Assistant discovery and the snapshot cache */
+int eq3_registry_load(void){
+    nvs_handle handle;
+    nvs_iterator_t it = NULL;
+    nvs_entry_info_t info;
+    struct trv_record rec;
+    struct registry_entry *entry;
+    int loaded = 0;
+    int64_t loadtime = esp_timer_get_time();
+
+    if(records_lock == NULL){
+        records_lock = xSemaphoreCreateMutex();
+        xTaskCreate(registry_task, "registry_task", 3072, NULL, 3, &registry_task_handle);
+    }
+
+    if(nvs_open(REGISTRY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK){
+        ESP_LOGI(REGISTRY_TAG, "No known valves");
+        return 0;
+    }
+    esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, REGISTRY_NAMESPACE, NVS_TYPE_BLOB, &it);
+    while(err == ESP_OK){
+        nvs_entry_info(it, &info);
+        if(read_record(handle, info.key, &rec) == true){
+            char mac_addr[18];
+            sprintf(mac_addr, "%02X:%02X:%02X:%02X:%02X:%02X", rec.bda[0], rec.bda[1], rec.bda[2], rec.bda[3], rec.bda[4], rec.bda[5]);
+            xSemaphoreTake(records_lock, portMAX_DELAY);
+            if((entry = find_entry(rec.bda, true)) != NULL)
+                entry->rec = rec;
+            xSemaphoreGive(records_lock);
+            if(entry == NULL){
+                ESP_LOGW(REGISTRY_TAG, "Registry full - skipping %s", mac_addr);
+                err = nvs_entry_next(&it);
+                continue;
+            }
+            ESP_LOGI(REGISTRY_TAG, "Known valve %s (%.*s)", mac_addr, (int)sizeof(rec.name), rec.name);
+            eq3gap_add_known_device(rec.bda, rec.addr_type);
+            ha_discovery_add_device((char *)rec.bda);
+            if(rec.status_len > 0){
+                struct eq3_status status;
+                char statrep[EQ3_STATUS_JSON_MAX];
+                eq3_decode_status(rec.status, rec.status_len, &status);
+                if(eq3_status_to_json(&status, mac_addr, statrep, sizeof(statrep)) > 0)
+                    store_trv_status(statrep, mac_addr);
+            }
+            loaded++;
+        }
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+    nvs_close(handle);
+    ESP_LOGI(REGISTRY_TAG, "Loaded %d valves in %d uS", loaded, (int)(esp_timer_get_time() - loadtime));
+    return loaded;
+}
+
+/* A scan found a valve - called from the GAP callback */
+int eq3_registry_add(uint8_t *bda, uint8_t addr_type, const char *name){
+    struct registry_entry *entry;
+    bool wake = false;
+
+    if(records_lock == NULL)
+        return -1;
+    xSemaphoreTake(records_lock, portMAX_DELAY);
+    if((entry = find_entry(bda, true)) != NULL && (entry->rec.addr_type != addr_type ||
+       strncmp(entry->rec.name, name, sizeof(entry->rec.name)) != 0)){
+        entry->rec.addr_type = addr_type;
+        strncpy(entry->rec.name, name, sizeof(entry->rec.name));
+        wake = mark_dirty(entry);
+    }
+    xSemaphoreGive(records_lock);
+    if(wake == true)
+        xTaskNotifyGive(registry_task_handle);
+    return entry != NULL ? 0 : -1;
+}
+
+/* Remember the characteristic handles found by service discovery (0 to forget them) */
+int eq3_registry_set_handles(uint8_t *bda, uint16_t char_handle, uint16_t resp_char_handle){
+    struct registry_entry *entry;
+    bool wake = false;
+
+    if(records_lock == NULL)
+        return -1;
+    xSemaphoreTake(records_lock, portMAX_DELAY);
+    if((entry = find_entry(bda, false)) != NULL &&
+       (entry->rec.char_handle != char_handle || entry->rec.resp_char_handle != resp_char_handle)){
+        entry->rec.char_handle = char_handle;
+        entry->rec.resp_char_handle = resp_char_handle;
+        wake = mark_dirty(entry);
+    }
+    xSemaphoreGive(records_lock);
+    if(wake == true)
+        xTaskNotifyGive(registry_task_handle);
+    return entry != NULL ? 0 : -1;
+}
+
+/* Cached characteristic handles - false if they need to be looked up */
+bool eq3_registry_get_handles(uint8_t *bda, uint16_t *char_handle, uint16_t *resp_char_handle){
+    struct registry_entry *entry;
+    bool found = false;
+
+    if(records_lock == NULL)
+        return false;
+    xSemaphoreTake(records_lock, portMAX_DELAY);
+    if((entry = find_entry(bda, false)) != NULL && entry->rec.char_handle != 0 && entry->rec.resp_char_handle != 0){
+        *char_handle = entry->rec.char_handle;
+        *resp_char_handle = entry->rec.resp_char_handle;
+        found = true;
+    }
+    xSemaphoreGive(records_lock);
+    return found;
+}
+
+/* Keep the last status notification of a valve - the record is only written again if the
+ * mode (byte 2) or setpoint (byte 5) has changed */
+int eq3_registry_set_status(uint8_t *bda, uint8_t *value, int len){
+    struct registry_entry *entry;
+    struct trv_record *rec;
+    bool wake = false;
+
+    if(records_lock == NULL)
+        return -1;
+    if(len > sizeof(rec->status))
+        len = sizeof(rec->status);
+    xSemaphoreTake(records_lock, portMAX_DELAY);
+    if((entry = find_entry(bda, false)) != NULL){
+        rec = &entry->rec;
+        if(rec->status_len != len || (len > 2 && rec->status[2] != value[2]) || (len > 5 && rec->status[5] != value[5]))
+            wake = mark_dirty(entry);
+        memcpy(rec->status, value, len);
+        rec->status_len = len;
+    }
+    xSemaphoreGive(records_lock);
+    if(wake == true)
+        xTaskNotifyGive(registry_task_handle);
+    return entry != NULL ? 0 : -1;
+}
+
+/* Write the changed records - woken by the first change and then waits so a run of
+ * changes (someone turning the dial, a scan finding the whole fleet) is written once */
+static void registry_task(void *parm){
+    struct trv_record rec;
+    nvs_handle handle;
+    char key[13];
+    bool dirty;
+    int i;
+
+    while(1){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(REGISTRY_WRITE_DELAY_MS));
+        if(nvs_open(REGISTRY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK){
+            ESP_LOGE(REGISTRY_TAG, "Unable to open nvs");
+            continue;
+        }
+        for(i = 0; i < EQ3_MAX_DEVICES; i++){
+            xSemaphoreTake(records_lock, portMAX_DELAY);
+            rec = records[i].rec;
+            dirty = records[i].dirty;
+            records[i].dirty = false;
+            xSemaphoreGive(records_lock);
+            if(dirty == true){
+                record_key(rec.bda, key);
+                nvs_set_blob(handle, key, &rec, sizeof(rec));
+            }
+        }
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef EQ3_REGISTRY_H
+#define EQ3_REGISTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Known TRVs are kept in NVS so they are available straight after boot */
+#define TRV_RECORD_VERSION 1
+
+struct trv_record {
+    uint8_t version;
+    uint8_t addr_type;          /* esp_ble_addr_type_t */
+    uint8_t bda[6];
+    char name[16];              /* Advertised name */
+    uint16_t char_handle;       /* Command characteristic - 0 if not known */
+    uint16_t resp_char_handle;  /* Notification characteristic */
+    uint8_t status_len;
+    uint8_t status[15];         /* Last PROP_INFO_RETURN notification */
+};
+
+int eq3_registry_load(void);
+int eq3_registry_add(uint8_t *bda, uint8_t addr_type, const char *name);
+int eq3_registry_set_handles(uint8_t *bda, uint16_t char_handle, uint16_t resp_char_handle);
+bool eq3_registry_get_handles(uint8_t *bda, uint16_t *char_handle, uint16_t *resp_char_handle);
+int eq3_registry_set_status(uint8_t *bda, uint8_t *value, int len);
+
+#endif
@@ -20,22 +20,27 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_wifi.h"
 #include "esp_wpa2.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "mqtt_client.h"
 
 #include "eq3_main.h"
+#include "eq3_cmd.h"
+#include "eq3_status.h"
 #include "eq3_wifi.h"
 #include "eq3_gap.h"
 #include "eq3_ha_discovery.h"
+#include "eq3_hubs.h"
+#include "eq3_capture_ring.h"
 
 static const char *MQTT_TAG = "mqtt";
 
@@ -46,21 +51,50 @@ static const char *MQTT_TAG = "mqtt";
 static void connected_cb(esp_mqtt_event_handle_t event);
 static void data_cb(esp_mqtt_event_handle_t event);
 
+/* The outbox may take at most this share of the heap free when mqtt starts, and at least 4 KB -
+ * BLE, the web server and TLS need the rest */
+#define OUTBOX_HEAP_SHARE 4
+#define OUTBOX_MIN_LIMIT (4 * 1024)
+
+/* With a persistent session the broker keeps commands for the hub while it is reconnecting */
+#ifdef CONFIG_EQ3_MQTT_PERSISTENT_SESSION
+#define MQTT_COMMAND_QOS 1
+#else
+#define MQTT_COMMAND_QOS 0
+#endif
+
 static esp_mqtt_client_handle_t repclient = NULL;
 static bool mqtt_config_error = false;
 static char *devlist = NULL;
+static int64_t connect_time = 0;       /* Time of the last broker connection for command latency reporting */
+static int64_t ready_time = 0;         /* Time from boot to the first broker connection */
+static bool first_command = false;
+/* Commands the broker has delivered again after a reconnect */
+static struct eq3_dedup deliveries;
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+/* Publishes the status reports held while the broker was unreachable */
+static TaskHandle_t status_flush_handle = NULL;
+#endif
+#ifdef CONFIG_EQ3_MQTT_BINARY
+/* Binary (cbor) topic tree can be switched on/off at runtime with <mqttid>radin/binary on|off */
+static bool binary_enabled = true;
+#endif
 
 //static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event){
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data){
     esp_mqtt_event_handle_t event = event_data;
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(MQTT_TAG, "MQTT connected");
+            ESP_LOGI(MQTT_TAG, "MQTT connected (session %s)", event->session_present ? "resumed" : "new");
             connected_cb(event);
             break;
         case MQTT_EVENT_DISCONNECTED:
             repclient = NULL;
+#ifdef CONFIG_EQ3_MQTT_PERSISTENT_SESSION
+            ESP_LOGI(MQTT_TAG, "MQTT disconnected - wait for reconnect, the broker keeps commands until then");
+#else
             ESP_LOGI(MQTT_TAG, "MQTT disconnected - wait for reconnect");
+#endif
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGI(MQTT_TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -106,6 +140,204 @@ mqttconnstate ismqttconnected(void){
     return repclient == NULL ? MQTT_NOT_CONNECTED : MQTT_CONNECTED;
 }
 
+/* Time in uS from boot until the first broker connection (ready to accept commands) - 0 if not yet connected */
+int64_t mqtt_ready_time(void){
+    return ready_time;
+}
+
+/* =========================================
+ * Home Assistant discovery
+ */
+
+/* Home Assistant birth/last will topic */
+#define HA_STATUS_TOPIC "homeassistant/status"
+
+/* Time between the discovery messages for each device to avoid flooding the broker */
+#define HA_DISCOVERY_INTERVAL_MS 250
+
+/* Devices to announce to Home Assistant */
+struct ha_device {
+    char bda[6];
+    bool published;
+    bool force;         /* Publish even if the payload is unchanged */
+    struct ha_device *next;
+};
+
+static struct ha_device *ha_devices = NULL;
+static SemaphoreHandle_t ha_device_lock = NULL;
+static TaskHandle_t ha_discovery_handle = NULL;
+
+/* Render a discovery payload and publish it (retained) if it differs from the last one published */
+static void publish_ha_payload(char *bda, char component, cJSON *root, char *topic, bool force){
+    char *payload = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if(payload == NULL)
+        return;
+    uint32_t hash = ha_payload_hash(payload);
+    if(force == true || ha_payload_changed(bda, component, hash) == true){
+        ESP_LOGI(MQTT_TAG, "Discovery topic: %s", topic);
+        ESP_LOGI(MQTT_TAG, "Discovery payload: %s", payload);
+        if(repclient != NULL && esp_mqtt_client_publish(repclient, topic, payload, strlen(payload), 0, 1) >= 0) // retain on
+            ha_payload_published(bda, component, hash);
+    }else{
+        ESP_LOGI(MQTT_TAG, "Discovery unchanged: %s", topic);
+    }
+    cJSON_free(payload);
+}
+
+/* Publish the retained discovery config messages for one device */
+static void publish_ha_discovery(char *bda, bool force){
+    char topic[155];
+
+    ESP_LOGI (MQTT_TAG, "EQ3: %02X:%02X:%02X:%02X:%02X:%02X", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+
+#ifdef CONFIG_EQ3_HA_DEVICE_DISCOVERY
+    /* Clear any single entity configs published before, they share unique_ids with the device components.
+     * Firmware older than the payload hashes left them retained without a hash, so they are cleared
+     * once for every device whatever is stored and after that only when a hash says they were published */
+    bool legacy = ha_payload_changed(bda, HA_COMPONENT_LEGACY, 1);
+    int rc = 0;
+    if(ha_payload_forget(bda, HA_COMPONENT_CLIMATE) == true || legacy == true){
+        snprintf (topic, sizeof (topic), "homeassistant/climate/%s%02X%02X%02X_thermostat/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+        rc |= mqtt_publish(topic, "", 0, 1);
+    }
+    if(ha_payload_forget(bda, HA_COMPONENT_VALVE) == true || legacy == true){
+        snprintf (topic, sizeof (topic), "homeassistant/sensor/%s%02X%02X%02X_valve/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+        rc |= mqtt_publish(topic, "", 0, 1);
+    }
+    if(ha_payload_forget(bda, HA_COMPONENT_BATTERY) == true || legacy == true){
+        snprintf (topic, sizeof (topic), "homeassistant/binary_sensor/%s%02X%02X%02X_battery/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+        rc |= mqtt_publish(topic, "", 0, 1);
+    }
+    if(legacy == true && rc >= 0)
+        ha_payload_published(bda, HA_COMPONENT_LEGACY, 1);
+
+    //Home Assistant device based discovery - one message with every entity
+    snprintf (topic, sizeof (topic), "homeassistant/device/%s%02X%02X%02X/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+    publish_ha_payload(bda, HA_COMPONENT_DEVICE, generate_ha_device_payload (bda, mqtt_id), topic, force);
+#else
+    /* Clear a device based config published before */
+    if(ha_payload_forget(bda, HA_COMPONENT_DEVICE) == true){
+        snprintf (topic, sizeof (topic), "homeassistant/device/%s%02X%02X%02X/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+        mqtt_publish(topic, "", 0, 1);
+    }
+
+    //Home Assistant autodiscovery message for climate device
+    snprintf (topic, sizeof (topic), "homeassistant/climate/%s%02X%02X%02X_thermostat/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+    publish_ha_payload(bda, HA_COMPONENT_CLIMATE, generate_ha_therm_payload (bda, mqtt_id), topic, force);
+
+    //Home Assistant autodiscovery message for valve position sensor
+    snprintf (topic, sizeof (topic), "homeassistant/sensor/%s%02X%02X%02X_valve/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+    publish_ha_payload(bda, HA_COMPONENT_VALVE, generate_ha_valve_payload (bda, mqtt_id), topic, force);
+
+    //Home Assistant autodiscovery message for battery state
+    snprintf (topic, sizeof (topic), "homeassistant/binary_sensor/%s%02X%02X%02X_battery/config", ha_object_id (mqtt_id), bda[3], bda[4], bda[5]);
+    publish_ha_payload(bda, HA_COMPONENT_BATTERY, generate_ha_battery_payload (bda, mqtt_id), topic, force);
+#endif
+}
+
+/* Task to publish discovery for devices as they become known - one device per interval */
+static void ha_discovery_task(void *parm){
+    while(1){
+        struct ha_device *dev;
+        char bda[6];
+        bool found = false, force = false;
+
+        while(repclient != NULL && found == false){
+            bool pending = false;
+            xSemaphoreTake(ha_device_lock, portMAX_DELAY);
+            for(dev = ha_devices; dev != NULL; dev = dev->next){
+                if(dev->published == false){
+                    dev->published = true;
+                    memcpy(bda, dev->bda, sizeof(bda));
+                    force = dev->force;
+                    dev->force = false;
+                    pending = true;
+                    break;
+                }
+            }
+            xSemaphoreGive(ha_device_lock);
+            if(pending == false)
+                break;
+            /* Another hub owns this valve and publishes its discovery. Asked without ha_device_lock held -
+             * the hub code takes its own lock first and then queues discovery */
+            found = hub_owns((uint8_t *)bda);
+        }
+        if(found == true){
+            publish_ha_discovery(bda, force);
+            vTaskDelay(pdMS_TO_TICKS(HA_DISCOVERY_INTERVAL_MS));
+        }else{
+            /* Nothing (more) to do - wait for a new device or a reconnect */
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            ha_discovery_refresh_url();
+        }
+    }
+}
+
+static void ha_discovery_init(void){
+    if(ha_device_lock == NULL)
+        ha_device_lock = xSemaphoreCreateMutex();
+}
+
+/* A device has been found - queue its discovery messages */
+void ha_discovery_add_device(char *bda){
+    struct ha_device *dev;
+    bool queued;
+
+    ha_discovery_init();
+    xSemaphoreTake(ha_device_lock, portMAX_DELAY);
+    for(dev = ha_devices; dev != NULL; dev = dev->next){
+        if(memcmp(dev->bda, bda, sizeof(dev->bda)) == 0)
+            break;
+    }
+    if(dev == NULL && (dev = malloc(sizeof(struct ha_device))) != NULL){
+        memcpy(dev->bda, bda, sizeof(dev->bda));
+        dev->published = false;
+        dev->force = false;
+        dev->next = ha_devices;
+        ha_devices = dev;
+    }
+    /* The discovery task clears published under the lock */
+    queued = dev != NULL && dev->published == false;
+    xSemaphoreGive(ha_device_lock);
+    if(queued == true && ha_discovery_handle != NULL)
+        xTaskNotifyGive(ha_discovery_handle);
+}
+
+/* Publish discovery for a device even if it hasn't changed - this hub has just taken it over */
+void ha_discovery_force_device(char *bda){
+    struct ha_device *dev;
+
+    ha_discovery_add_device(bda);
+    xSemaphoreTake(ha_device_lock, portMAX_DELAY);
+    for(dev = ha_devices; dev != NULL; dev = dev->next){
+        if(memcmp(dev->bda, bda, sizeof(dev->bda)) == 0){
+            dev->published = false;
+            dev->force = true;
+        }
+    }
+    xSemaphoreGive(ha_device_lock);
+    if(ha_discovery_handle != NULL)
+        xTaskNotifyGive(ha_discovery_handle);
+}
+
+/* Republish discovery for all known devices. Unless forced (Home Assistant has restarted)
+ * only payloads which have changed since they were last published are sent - a device already
+ * forced by a takeover or handback stays forced */
+static void ha_discovery_republish(bool force){
+    struct ha_device *dev;
+
+    ha_discovery_init();
+    xSemaphoreTake(ha_device_lock, portMAX_DELAY);
+    for(dev = ha_devices; dev != NULL; dev = dev->next){
+        dev->published = false;
+        dev->force |= force;
+    }
+    xSemaphoreGive(ha_device_lock);
+    if(ha_discovery_handle != NULL)
+        xTaskNotifyGive(ha_discovery_handle);
+}
+
 /* MQTT connected callback */
 static void connected_cb(esp_mqtt_event_handle_t event){
     esp_log_level_set("MQTT_CLIENT", ESP_LOG_VERBOSE);
@@ -117,10 +349,23 @@ static void connected_cb(esp_mqtt_event_handle_t event){
     sprintf(topic, "%s/#", intopicbase);
     repclient = client;
 
-    /* Subscribe to /espradin/# for commands */
-    esp_mqtt_client_subscribe(client, topic, 0);
+    /* Subscribe to /espradin/# for commands - a resumed session keeps the subscription but a new
+     * one doesn't, and subscribing again is harmless */
+    esp_mqtt_client_subscribe(client, topic, MQTT_COMMAND_QOS);
     ESP_LOGI(MQTT_TAG, "[APP] Start subscribe, topic: %s", topic);
 
+    /* Home Assistant birth message asks for discovery to be resent */
+    esp_mqtt_client_subscribe(client, HA_STATUS_TOPIC, 0);
+
+    /* Rssi reports and valve ownership shared with other hubs */
+    hub_connected();
+
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+    /* Status reports from while the broker was unreachable */
+    if(status_flush_handle != NULL)
+        xTaskNotifyGive(status_flush_handle);
+#endif
+
     /* Publish welcome message to /espradout */
     sprintf(topic, "%s/connect", outtopicbase);
     sprintf(startmsg, "Heating control v%s.%s%s active", EQ3_MAJVER, EQ3_MINVER, EQ3_EXTRAVER);
@@ -141,74 +386,88 @@ static void connected_cb(esp_mqtt_event_handle_t event){
         devlist = NULL;
     }
 
-    struct found_device* eq3_devices;
-    int num_eq3;
-    enum eq3_scanstate result = EQ3_NO_SCAN_RESULTS;
-    while (result != EQ3_SCAN_COMPLETE) {
-        result = eq3gap_get_device_list (&eq3_devices, &num_eq3);
-        if (result == EQ3_SCAN_COMPLETE) {
-            struct found_device* eq3_device = eq3_devices;
-            ESP_LOGI (MQTT_TAG, "Found %d devices", num_eq3);
-            while (eq3_device != NULL) {
-                ESP_LOGI (MQTT_TAG, "EQ3: %02X:%02X:%02X:%02X:%02X:%02X", eq3_device->bda[0], eq3_device->bda[1], eq3_device->bda[2], eq3_device->bda[3], eq3_device->bda[4], eq3_device->bda[5]);
-                char* payload;
-                char topic[155];
-
-                //Home Assistant autodiscovery message for climate device
-
-                cJSON* ha_therm_payload = generate_ha_therm_payload (eq3_device->bda, mqtt_id);
-                payload = cJSON_Print (ha_therm_payload);
-                ESP_LOGI (MQTT_TAG, "Therm Payload: %s", payload);
-                snprintf (topic, sizeof (topic), "homeassistant/climate/%s%02X%02X%02X_thermostat/config", mqtt_id, eq3_device->bda[3], eq3_device->bda[4], eq3_device->bda[5]);
-                ESP_LOGI (MQTT_TAG, "Therm topic: %s", topic);
-                esp_mqtt_client_publish (repclient, topic, payload, strlen (payload), 0, 1); // retain on
-                cJSON_free (ha_therm_payload);
-                free (payload);
-
-                //Home Assistant autodiscovery message for valve position sensor
-                cJSON* ha_valve_payload = generate_ha_valve_payload (eq3_device->bda, mqtt_id);
-                payload = cJSON_Print (ha_valve_payload);
-                ESP_LOGI (MQTT_TAG, "Valve Payload: %s", payload);
-                snprintf (topic, sizeof (topic), "homeassistant/sensor/%s%02X%02X%02X_valve/config", mqtt_id, eq3_device->bda[3], eq3_device->bda[4], eq3_device->bda[5]);
-                ESP_LOGI (MQTT_TAG, "Valve topic: %s", topic);
-                esp_mqtt_client_publish (repclient, topic, payload, strlen (payload), 0, 1); // retain on
-                cJSON_free (ha_valve_payload);
-                free (payload);
-
-                //Home Assistant autodiscovery message for valve position sensor
-                cJSON* ha_battery_payload = generate_ha_battery_payload (eq3_device->bda, mqtt_id);
-                payload = cJSON_Print (ha_battery_payload);
-                ESP_LOGI (MQTT_TAG, "Battery Payload: %s", payload);
-                snprintf (topic, sizeof (topic), "homeassistant/binary_sensor/%s%02X%02X%02X_battery/config", mqtt_id, eq3_device->bda[3], eq3_device->bda[4], eq3_device->bda[5]);
-                ESP_LOGI (MQTT_TAG, "Battery topic: %s", topic);
-                esp_mqtt_client_publish (repclient, topic, payload, strlen (payload), 0, 1); // retain on
-                cJSON_free (ha_battery_payload);
-                free (payload);
-
-                eq3_device = eq3_device->next;
-            }
-        }
-        vTaskDelay (pdMS_TO_TICKS(100));
+    /* Home Assistant discovery is published by its own task so this handler is not held up */
+    connect_time = esp_timer_get_time();
+    first_command = true;
+    if(ready_time == 0){
+        ready_time = connect_time;
+        ESP_LOGI(MQTT_TAG, "Ready %d mS after boot", (int)(ready_time / 1000));
     }
-    
+    ha_discovery_republish(false);
+}
+
+/* Commands for valves owned by another hub are refused so only one hub ever talks to a valve */
+static bool trv_owned(char *command){
+    uint8_t bda[6];
+    char mac_addr[18];
+    char owner[HUB_ID_LEN];
+    char statrep[100], topic[64];
+
+    snprintf(mac_addr, sizeof(mac_addr), "%.17s", command);
+    if(sscanf(mac_addr, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", &bda[0], &bda[1], &bda[2], &bda[3], &bda[4], &bda[5]) != 6 ||
+       hub_owns(bda) == true || hub_owner_id(bda, owner, sizeof(owner)) == false)
+        return true;
+    ESP_LOGW(MQTT_TAG, "Ignoring command for %s - owned by %s", mac_addr, owner);
+    /* Queued rather than sent through the status buffer - this runs in the MQTT event handler */
+    snprintf(topic, sizeof(topic), "%s/status/%s", outtopicbase, mac_addr);
+    snprintf(statrep, sizeof(statrep), "{\"trv\":\"%s\",\"error\":\"Owned by %s\"}", mac_addr, owner);
+    mqtt_publish(topic, statrep, strlen(statrep), 0);
+    return false;
 }
 
 /* MQTT data received (subscribed topic receives data) */
 static void data_cb(esp_mqtt_event_handle_t event){
     esp_mqtt_client_handle_t client = event->client;
     char* topic = malloc (event->topic_len + 1);
-    bool trvcmd = false, trvscan = false;
+    bool trvcmd = false, trvscan = false, trvsnapshot = false, trvcapture = false;
     if(event->current_data_offset == 0) {
         memcpy(topic, event->topic, event->topic_len);
         topic[event->topic_len] = 0;
+        if(eq3_dedup_repeat(&deliveries, event->msg_id, event->dup, event->topic, event->topic_len,
+                            event->data, event->data_len) == true){
+            free(topic);
+            return;
+        }
+        if(hub_message(topic, event->data, event->data_len) == true){
+            free(topic);
+            return;
+        }
         /* /trv is a command to an EQ3 valve */
         if (strstr (topic, "/trv") != NULL) {
             trvcmd = true;
             ESP_LOGI (MQTT_TAG, "TRV command: %s", topic);
+            if (first_command == true) {
+                first_command = false;
+                ESP_LOGI (MQTT_TAG, "First command %d mS after broker connect", (int)((esp_timer_get_time() - connect_time) / 1000));
+            }
         }
         /* /scan is a request to run a BLE scan for EQ3 valves */
         if(strstr(topic, "/scan") != NULL)
             trvscan = true;
+        /* /snapshot is a request to publish the cached state of all known valves */
+        if(strstr(topic, "/snapshot") != NULL)
+            trvsnapshot = true;
+        /* /capture exports the BLE capture ring - "clear" empties it */
+        if(strstr(topic, "/capture") != NULL){
+            if(event->data_len == 5 && strncmp(event->data, "clear", 5) == 0)
+                eq3_capture_clear();
+            else
+                trvcapture = true;
+        }
+#ifdef CONFIG_EQ3_MQTT_BINARY
+        /* /binary turns the cbor topic tree on or off */
+        if(strstr(topic, "/binary") != NULL){
+            binary_enabled = !(event->data_len >= 3 && strncmp(event->data, "off", 3) == 0);
+            ESP_LOGI(MQTT_TAG, "Binary topics %s", binary_enabled ? "enabled" : "disabled");
+        }
+#endif
+        /* Home Assistant has (re)started - publish all discovery messages again */
+        if(strcmp(topic, HA_STATUS_TOPIC) == 0){
+            if(event->data_len == 6 && strncmp(event->data, "online", 6) == 0)
+                ha_discovery_republish(true);
+            free(topic);
+            return;
+        }
         /* /check is a simple 'ping' check that the ESP is connected */
         if(strstr(topic, "/check") != NULL){
             char rsptopic[45];
@@ -221,115 +480,410 @@ static void data_cb(esp_mqtt_event_handle_t event){
     }
 
     if(trvcmd == true){
-        //char *data = malloc(event->data_len + 1);
-        //ESP_LOGI (MQTT_TAG, "Topic: %s, data: %s", topic, event->data);
-        const int MAX_DATA_LEN = 80;
-        char data[MAX_DATA_LEN];
-        memset (data, 0, sizeof (data));
-        char* topicptr = topic;
-        //ESP_LOGI (MQTT_TAG, "topicptr = %c", *topicptr);
-        // while (*topicptr != 0 && !isxdigit ((int)*topicptr)) {
-        //     ESP_LOGI (MQTT_TAG, "topicptr = %c", *topicptr);
-        //     topicptr++;
-        // }
-        int dataidx = 0;
-        bool dataerror = false;
-        topicptr = strstr (topicptr, "/trv/");
-        if (topicptr) {
-            topicptr += 5;
-            //ESP_LOGI (MQTT_TAG, "Found string \"/trv/\" %s", topicptr);
-        } else {
-            dataerror = true;
-        }
-
-        while (*topicptr != '/' && *topicptr != 0 && !dataerror) {
-            //ESP_LOGI (MQTT_TAG, "topicptr = %c", *topicptr);
-            if ((isxdigit ((unsigned char)*topicptr) || *topicptr == ':') && dataidx < MAX_DATA_LEN - 1) {
-                data[dataidx] = *topicptr;
-                dataidx++;
-                topicptr++;
-            } else {
-                dataerror = true;
-            }
+        char data[EQ3_TOPIC_CMD_MAX];
+        if (eq3_topic_command (topic, event->data, event->data_len, data, sizeof (data)) == 0) {
+            ESP_LOGI (MQTT_TAG, "Handle trv mqtt msg \"%s\"", data);
+            if (trv_owned (data) == true)
+                handle_request (data);
         }
+    }
+    
+    free (topic);
 
-        if (dataidx != 17) {
-            dataerror = true;
-            ESP_LOGI (MQTT_TAG, "Wrong address length: %d", dataidx);
-        }
-        
-        // ESP_LOGI (MQTT_TAG, "Added address %s idx %d", data, dataidx);
+    if(trvscan == true){
+        eq3gap_request_scan();
+    }
 
-        if (*topicptr == '/') {
-            topicptr++;
-        } else {
-            dataerror = true;
-        }
-        
-        if (!dataerror && dataidx < MAX_DATA_LEN - 1) {
-            data[dataidx] = ' ';
-            dataidx++;
-        } else {
-            dataerror = true;
-        }
+    if(trvsnapshot == true){
+        send_trv_snapshot();
+    }
 
-        // ESP_LOGI (MQTT_TAG, "Added space %s idx %d", data, dataidx);
+    if(trvcapture == true){
+        send_capture();
+    }
+    
+}
 
-        while (*topicptr != '\0' && !dataerror && dataidx < MAX_DATA_LEN - 1) {
-            data[dataidx] = *topicptr;
-            dataidx++;
-            topicptr++;
-        }
+/* Publish for other modules - dropped while the broker isn't connected */
+int mqtt_publish(const char *topic, const char *data, int len, int retain){
+    if(repclient == NULL)
+        return -1;
+    return esp_mqtt_client_enqueue(repclient, topic, data, len, retain ? 1 : 0, retain, true);
+}
 
-        if (event->data_len > 0) {
-            if (!dataerror && dataidx < MAX_DATA_LEN - 1) {
-                data[dataidx] = ' ';
-                dataidx++;
-            } else {
-                dataerror = true;
-            }
-        }
+int mqtt_subscribe(const char *topic){
+    if(repclient == NULL)
+        return -1;
+    return esp_mqtt_client_subscribe(repclient, topic, 0);
+}
 
-        ESP_LOGI (MQTT_TAG, "Added command \"%s\" idx %d", data, dataidx);
+/* =========================================
+ * Status reports held while the broker is unreachable
+ */
 
-        if (!dataerror && dataidx < MAX_DATA_LEN - 1 - event->data_len) {
-            //memcpy ((void*)&(data[dataidx]), (void*)event->data, event->data_len);
-            int i = 0;
-            for (i = 0; i < event->data_len; i++) {
-                data[dataidx] = event->data[i];
-                dataidx++;
-            }
-            data[dataidx] = 0;
-            ESP_LOGI (MQTT_TAG, "Handle trv mqtt msg \"%s\"", data);
-            handle_request (data);
+/* Time between the held reports published after a reconnect */
+#define STATUS_FLUSH_INTERVAL_MS 100
+
+static struct {
+    int pending;
+    int replaced;       /* Superseded by a newer report from the same TRV before being published */
+    int dropped;        /* Pushed out by reports from other TRVs while every slot was in use */
+    int flushed;
+} status_buffer;
+
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+/* Latest unpublished report of a TRV - a fixed table so a long outage can't use up the heap.
+ * Publishing happens outside pending_lock (esp-mqtt takes its own lock and the MQTT handler may
+ * report too), so each report is stamped with a sequence number and checked again afterwards */
+struct pending_status {
+    uint32_t seq;       /* Stamp of the held report, oldest is published first - 0 if none is held */
+    uint32_t latest;    /* Stamp of the newest report from this TRV */
+    int sending;        /* Publishes of this TRV in progress - the slot is free when 0 and nothing is held */
+    char mac_addr[18];
+    char status[EQ3_STATUS_JSON_MAX];
+};
+
+static struct pending_status pending_statuses[CONFIG_EQ3_STATUS_BUFFER];
+static uint32_t pending_seq = 0;
+static SemaphoreHandle_t pending_lock = NULL;
+
+/* Slot tracking a TRV, taking a free one or pushing out the oldest held report that isn't being
+ * published. NULL if every slot is being published - called with pending_lock */
+static struct pending_status *claim_trv_status(const char *mac_addr){
+    struct pending_status *slot = NULL, *oldest = NULL;
+    int idx;
+
+    for(idx = 0; idx < CONFIG_EQ3_STATUS_BUFFER; idx++){
+        struct pending_status *walk = &pending_statuses[idx];
+        if(walk->seq == 0 && walk->sending == 0){
+            if(slot == NULL)
+                slot = walk;
+        }else if(strcmp(walk->mac_addr, mac_addr) == 0){
+            return walk;
+        }else if(walk->sending == 0 && (oldest == NULL || walk->seq < oldest->seq)){
+            oldest = walk;
         }
-        //free(data);
     }
-    
-    free (topic);
+    if(slot == NULL && oldest != NULL){
+        slot = oldest;
+        slot->seq = 0;
+        status_buffer.pending--;
+        status_buffer.dropped++;
+        ESP_LOGW(MQTT_TAG, "Status buffer full - dropping report from %s", slot->mac_addr);
+    }
+    if(slot != NULL)
+        snprintf(slot->mac_addr, sizeof(slot->mac_addr), "%s", mac_addr);
+    return slot;
+}
 
-    if(trvscan == true){
-        start_scan();
+/* Hold a report until it can be published, replacing any older one from the same TRV - called
+ * with pending_lock */
+static bool hold_trv_status(struct pending_status *slot, const char *status, uint32_t seq){
+    if(strlen(status) >= EQ3_STATUS_JSON_MAX){
+        status_buffer.dropped++;
+        return false;
     }
-    
+    if(slot->seq == 0)
+        status_buffer.pending++;
+    else
+        status_buffer.replaced++;
+    slot->seq = seq;
+    snprintf(slot->status, sizeof(slot->status), "%s", status);
+    return true;
+}
+
+/* Oldest held report - NULL if there are none. Called with pending_lock */
+static struct pending_status *oldest_trv_status(void){
+    struct pending_status *oldest = NULL;
+    int idx;
+    for(idx = 0; idx < CONFIG_EQ3_STATUS_BUFFER; idx++){
+        if(pending_statuses[idx].seq != 0 && (oldest == NULL || pending_statuses[idx].seq < oldest->seq))
+            oldest = &pending_statuses[idx];
+    }
+    return oldest;
+}
+#endif
+
+static int publish_trv_status(const char *status, const char *mac_addr){
+    esp_mqtt_client_handle_t client = repclient;
+    char topic[64];
+    if(client == NULL)
+        return -1;
+    snprintf(topic, sizeof(topic), "%s/status/%s", outtopicbase, mac_addr);
+    return esp_mqtt_client_publish(client, topic, status, strlen(status), 0, 0);
 }
 
 /* Publish a status message */
 int send_trv_status(char *status, char* mac_addr){
 	ESP_LOGI(MQTT_TAG, "send_trv_status");
+    if(mac_addr == NULL){
+        ESP_LOGW(MQTT_TAG, "NULL mac address");
+        return 0;
+    }
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+    if(pending_lock != NULL){
+        struct pending_status *slot;
+        uint32_t seq = 0;
+        bool reflush = false;
+        int rc;
+
+        xSemaphoreTake(pending_lock, portMAX_DELAY);
+        if((slot = claim_trv_status(mac_addr)) != NULL){
+            seq = slot->latest = ++pending_seq;
+            slot->sending++;
+        }
+        xSemaphoreGive(pending_lock);
+
+        rc = publish_trv_status(status, mac_addr);
+
+        xSemaphoreTake(pending_lock, portMAX_DELAY);
+        if(slot == NULL){
+            if(rc < 0)
+                status_buffer.dropped++;
+        }else{
+            slot->sending--;
+            if(slot->latest != seq){
+                /* A newer report from this TRV follows and sorts out what is left */
+                if(rc < 0)
+                    status_buffer.replaced++;
+            }else if(rc < 0){
+                hold_trv_status(slot, status, seq);
+            }else if(slot->sending > 0){
+                /* An older report may still land after this one - publish this again once it has */
+                reflush = hold_trv_status(slot, status, seq);
+            }else if(slot->seq != 0){
+                slot->seq = 0;
+                status_buffer.pending--;
+                status_buffer.replaced++;
+            }
+        }
+        xSemaphoreGive(pending_lock);
+        if(reflush == true && status_flush_handle != NULL)
+            xTaskNotifyGive(status_flush_handle);
+        return 0;
+    }
+#endif
+    if(publish_trv_status(status, mac_addr) < 0)
+        status_buffer.dropped++;
+    return 0;
+}
+
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+/* Publish the held reports oldest first after a reconnect, paced so the burst doesn't fill the
+ * outbox. Whatever can't be published stays held for the next reconnect */
+static void status_flush_task(void *parm){
+    struct pending_status *held;
+    char topic[48], stats[100];
+    char mac_addr[18], status[EQ3_STATUS_JSON_MAX];
+    uint32_t seq;
+    int flushed, rc;
+
+    while(1){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        flushed = 0;
+        while(repclient != NULL){
+            xSemaphoreTake(pending_lock, portMAX_DELAY);
+            if((held = oldest_trv_status()) != NULL){
+                seq = held->seq;
+                held->sending++;
+                snprintf(mac_addr, sizeof(mac_addr), "%s", held->mac_addr);
+                snprintf(status, sizeof(status), "%s", held->status);
+            }
+            xSemaphoreGive(pending_lock);
+            if(held == NULL)
+                break;
+
+            rc = publish_trv_status(status, mac_addr);
+
+            /* A report sent meanwhile has either held itself again or made this one obsolete */
+            xSemaphoreTake(pending_lock, portMAX_DELAY);
+            held->sending--;
+            if(rc >= 0){
+                if(held->seq == seq){
+                    held->seq = 0;
+                    status_buffer.pending--;
+                }
+                status_buffer.flushed++;
+                flushed++;
+            }
+            xSemaphoreGive(pending_lock);
+            if(rc < 0)
+                break;
+            vTaskDelay(pdMS_TO_TICKS(STATUS_FLUSH_INTERVAL_MS));
+        }
+        if(flushed == 0)
+            continue;
+        ESP_LOGI(MQTT_TAG, "Published %d held status reports", flushed);
+        snprintf(topic, sizeof(topic), "%s/statusbuffer", outtopicbase);
+        snprintf(stats, sizeof(stats), "{\"flushed\":%d,\"pending\":%d,\"replaced\":%d,\"dropped\":%d}",
+                 flushed, status_buffer.pending, status_buffer.replaced, status_buffer.dropped);
+        mqtt_publish(topic, stats, strlen(stats), 0);
+    }
+}
+#endif
+
+/* Occupancy of the status buffer for the status page */
+void status_buffer_describe(char *buf, int len){
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+    snprintf(buf, len, "%d of %d held, %d replaced, %d dropped, %d sent late", status_buffer.pending, CONFIG_EQ3_STATUS_BUFFER,
+             status_buffer.replaced, status_buffer.dropped, status_buffer.flushed);
+#else
+    snprintf(buf, len, "off, %d dropped", status_buffer.dropped);
+#endif
+}
+
+/* Link statistics of a valve after each session */
+int send_trv_link(char *link, char *mac_addr){
     if(repclient != NULL){
-        char topic[38];
-        if (mac_addr != NULL) {
-            sprintf (topic, "%s/status/%s", outtopicbase, mac_addr);
-            esp_mqtt_client_publish (repclient, topic, status, strlen (status), 0, 0);
-        } else {
-            ESP_LOGW (MQTT_TAG, "NULL mac address");
+        char topic[64];
+        snprintf(topic, sizeof(topic), "%s/link/%s", outtopicbase, mac_addr);
+        esp_mqtt_client_publish(repclient, topic, link, strlen(link), 0, 0);
+    }
+    return 0;
+}
+
+/* =========================================
+ * Cached TRV state for the all-valves snapshot
+ */
+
+/* Last status report received from each TRV */
+struct trv_state {
+    char mac_addr[18];
+    char *status;
+    int64_t updated;    /* uS since boot */
+    struct trv_state *next;
+};
+
+static struct trv_state *trv_states = NULL;
+static int trv_states_len = 0;              /* Sum of cached status lengths */
+static int num_trv_states = 0;
+static SemaphoreHandle_t trv_state_lock = NULL;
+
+/* Called from app_main before the BLE task or the registry can store a status */
+void trv_state_init(void){
+    trv_state_lock = xSemaphoreCreateMutex();
+}
+
+/* Store the latest status report for a TRV. The report is kept already serialised so
+ * a snapshot only has to concatenate the cached entries */
+int store_trv_status(char *status, char *mac_addr){
+    struct trv_state *state;
+    char *newstatus;
+
+    if(status == NULL || mac_addr == NULL || status[0] != '{' || trv_state_lock == NULL)
+        return -1;
+    if((newstatus = strdup(status)) == NULL)
+        return -1;
+
+    xSemaphoreTake(trv_state_lock, portMAX_DELAY);
+    for(state = trv_states; state != NULL; state = state->next){
+        if(strcmp(state->mac_addr, mac_addr) == 0)
+            break;
+    }
+    if(state == NULL){
+        state = malloc(sizeof(struct trv_state));
+        if(state == NULL){
+            xSemaphoreGive(trv_state_lock);
+            free(newstatus);
+            return -1;
         }
-        
+        snprintf(state->mac_addr, sizeof(state->mac_addr), "%s", mac_addr);
+        state->status = NULL;
+        state->next = trv_states;
+        trv_states = state;
+        num_trv_states++;
+    }else{
+        trv_states_len -= strlen(state->status);
+        free(state->status);
     }
+    state->status = newstatus;
+    state->updated = esp_timer_get_time();
+    trv_states_len += strlen(newstatus);
+    xSemaphoreGive(trv_state_lock);
     return 0;
 }
 
+/* Publish the cached state of every known TRV as a single document */
+/* {"uptime":1234,"trvs":[{"age":12,"trv":"00:1A:22:00:00:00","temp":"20.0",...},...]} */
+int send_trv_snapshot(void){
+    struct trv_state *state;
+    char *snapshot;
+    int wridx = 0;
+    int64_t now = esp_timer_get_time();
+
+    if(repclient == NULL || trv_state_lock == NULL)
+        return -1;
+
+    xSemaphoreTake(trv_state_lock, portMAX_DELAY);
+    /* Each entry gains at most "{\"age\":<10 digits>," less its own opening brace plus a separating comma */
+    int snaplen = 40 + trv_states_len + (num_trv_states * 20);
+    snapshot = malloc(snaplen);
+    if(snapshot == NULL){
+        xSemaphoreGive(trv_state_lock);
+        ESP_LOGE(MQTT_TAG, "No memory for snapshot");
+        return -1;
+    }
+    wridx += snprintf(&snapshot[wridx], snaplen - wridx, "{\"uptime\":%d,\"trvs\":[", (int)(now / 1000000));
+    for(state = trv_states; state != NULL; state = state->next){
+        wridx += snprintf(&snapshot[wridx], snaplen - wridx, "%s{\"age\":%d,%s", state == trv_states ? "" : ",",
+                          (int)((now - state->updated) / 1000000), &state->status[1]);
+    }
+    xSemaphoreGive(trv_state_lock);
+    wridx += snprintf(&snapshot[wridx], snaplen - wridx, "]}");
+
+    char topic[40];
+    snprintf(topic, sizeof(topic), "%s/snapshot", outtopicbase);
+    esp_mqtt_client_publish(repclient, topic, snapshot, wridx, 0, 0);
+    ESP_LOGI(MQTT_TAG, "Published snapshot of %d TRVs (%d bytes)", num_trv_states, wridx);
+    free(snapshot);
+    return 0;
+}
+
+#if CONFIG_EQ3_SNAPSHOT_INTERVAL > 0
+/* Periodically publish the all-valves snapshot */
+static void snapshot_task(void *parm){
+    while(1){
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_EQ3_SNAPSHOT_INTERVAL * 1000));
+        send_trv_snapshot();
+    }
+}
+#endif
+
+/* Publish the BLE capture ring to <mqttid>radout/capture */
+int send_capture(void){
+    uint8_t *capture;
+    int len;
+    if(repclient == NULL || (len = eq3_capture_export(&capture)) < 0)
+        return -1;
+    char topic[40];
+    snprintf(topic, sizeof(topic), "%s/capture", outtopicbase);
+    esp_mqtt_client_publish(repclient, topic, (char *)capture, len, 0, 0);
+    free(capture);
+    return 0;
+}
+
+#ifdef CONFIG_EQ3_MQTT_BINARY
+/* Publish a cbor encoded status message */
+int send_trv_status_bin(uint8_t *status, int len, char *mac_addr){
+    if(repclient != NULL && binary_enabled == true){
+        char topic[64];
+        snprintf(topic, sizeof(topic), "%s/bin/status/%s", outtopicbase, mac_addr);
+        esp_mqtt_client_publish(repclient, topic, (char *)status, len, 0, 0);
+    }
+    return 0;
+}
+
+/* Publish a cbor encoded device list */
+int send_device_list_bin(uint8_t *list, int len){
+    if(repclient != NULL && binary_enabled == true){
+        char topic[40];
+        snprintf(topic, sizeof(topic), "%s/bin/devlist", outtopicbase);
+        esp_mqtt_client_publish(repclient, topic, (char *)list, len, 0, 0);
+    }
+    return 0;
+}
+#endif
+
 /* Publish a discovered device list */
 int send_device_list(char *list){
     if(repclient != NULL){
@@ -348,8 +902,20 @@ int send_device_list(char *list){
     return 0;
 }
 
+/* Publish a single newly found device to <mqttid>radout/device/<address> - called from the GAP callback so only queue it */
+int send_device_found(char *entry, char *mac_addr){
+    if(repclient != NULL){
+        char topic[80];
+        snprintf(topic, sizeof(topic), "%s/device/%s", outtopicbase, mac_addr);
+        esp_mqtt_client_enqueue(repclient, topic, entry, strlen(entry), 0, 0, true);
+    }
+    return 0;
+}
+
 int connect_server(char *url, char *user, char *password, char *id){
     int rc = 0;
+    int outbox_limit = CONFIG_EQ3_MQTT_OUTBOX_LIMIT * 1024;
+    uint32_t free_heap = esp_get_free_heap_size();
     mqtt_config_error = false;
     
     if(id == NULL || url == NULL){
@@ -362,6 +928,11 @@ int connect_server(char *url, char *user, char *password, char *id){
     snprintf(outtopicbase, OUT_TOPIC_LEN,  "%sradout", id);
     snprintf(mqtt_id, MQTT_ID_LEN, "%s", id);
 
+    if(outbox_limit > free_heap / OUTBOX_HEAP_SHARE){
+        outbox_limit = free_heap / OUTBOX_HEAP_SHARE > OUTBOX_MIN_LIMIT ? free_heap / OUTBOX_HEAP_SHARE : OUTBOX_MIN_LIMIT;
+        ESP_LOGW(MQTT_TAG, "Outbox limited to %d bytes with %u bytes of heap free", outbox_limit, (unsigned)free_heap);
+    }
+
     esp_mqtt_client_config_t settings = {
 #if defined(CONFIG_MQTT_SECURITY_ON)
         .port = 8883, // encrypted
@@ -376,7 +947,11 @@ int connect_server(char *url, char *user, char *password, char *id){
         .broker.address.uri = url,
         .credentials.username = user,
         .credentials.authentication.password = password,
-        .credentials.client_id = id
+        .credentials.client_id = id,
+#ifdef CONFIG_EQ3_MQTT_PERSISTENT_SESSION
+        .session.disable_clean_session = true,
+#endif
+        .outbox.limit = outbox_limit
     };
 
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&settings);
@@ -384,7 +959,17 @@ int connect_server(char *url, char *user, char *password, char *id){
 	esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
 	
     if(client){
+        ha_discovery_init();
+        hub_init(id);
+        xTaskCreate(ha_discovery_task, "ha_discovery_task", 4096, NULL, 5, &ha_discovery_handle);
+#if CONFIG_EQ3_STATUS_BUFFER > 0
+        pending_lock = xSemaphoreCreateMutex();
+        xTaskCreate(status_flush_task, "status_flush_task", 3072, NULL, 5, &status_flush_handle);
+#endif
         esp_mqtt_client_start(client);
+#if CONFIG_EQ3_SNAPSHOT_INTERVAL > 0
+        xTaskCreate(snapshot_task, "snapshot_task", 3072, NULL, 5, NULL);
+#endif
         ESP_LOGI(MQTT_TAG, "[APP] Settings.lwt_topic: %s", settings.session.last_will.topic);
         ESP_LOGI(MQTT_TAG, "[APP] Settings.client_id: %s", settings.credentials.client_id);
     }else{
@@ -2,13 +2,34 @@
 #ifndef EQ3_WIFI_H
 #define EQ3_WIFI_H
 
+#include <stdint.h>
+#include "sdkconfig.h"
+
 void initialise_wifi(void);
 
 typedef enum {MQTT_NOT_CONNECTED = 0, MQTT_CONNECTED, MQTT_CONFIG_ERROR}mqttconnstate;
 mqttconnstate ismqttconnected(void);
+int64_t mqtt_ready_time(void);
+
+int mqtt_publish(const char *topic, const char *data, int len, int retain);
+int mqtt_subscribe(const char *topic);
 
 int send_device_list(char *list);
+int send_device_found(char *entry, char *mac_addr);
 int send_trv_status(char *status, char* mac_addr);
+int send_trv_link(char *link, char *mac_addr);
+void trv_state_init(void);
+int store_trv_status(char *status, char *mac_addr);
+int send_trv_snapshot(void);
+int send_capture(void);
+void status_buffer_describe(char *buf, int len);
+#ifdef CONFIG_EQ3_MQTT_BINARY
+int send_trv_status_bin(uint8_t *status, int len, char *mac_addr);
+int send_device_list_bin(uint8_t *list, int len);
+#endif
+
+void ha_discovery_add_device(char *bda);
+void ha_discovery_force_device(char *bda);
 
 int connect_server(char *url, char *user, char *password, char *id);
 